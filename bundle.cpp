@@ -0,0 +1,96 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: bundle.cpp                                          */
+/* purpose: this source file implements the bundle format        */
+/*          declared in bundle.h.                                */
+/*****************************************************************/
+#include "bundle.h"
+#include <cerrno>
+#include <endian.h>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+// Size of the per-record header
+constexpr size_t RECORD_HEADER_SIZE = 6;
+
+static void addheader(std::string &bundle, const std::string &path, uint32_t size) {
+    if (path.size() > UINT16_MAX) {
+        throw std::runtime_error("Path too long for a bundle: " + path);
+    }
+    char header[RECORD_HEADER_SIZE];
+    uint16_t path_length = htobe16(static_cast<uint16_t>(path.size()));
+    uint32_t data_length = htobe32(size);
+    std::memcpy(header, &path_length, sizeof(path_length));
+    std::memcpy(header + 2, &data_length, sizeof(data_length));
+    bundle.append(header, sizeof(header));
+    bundle.append(path);
+}
+
+void addrecord(std::string &bundle, const std::string &path, const char *data, uint32_t size) {
+    addheader(bundle, path, size);
+    bundle.append(data, size);
+}
+
+bool addfile(std::string &bundle, const std::string &path, int fd, uint64_t size) {
+    if (size > BUNDLE_FILE_MAX) {
+        return false;
+    }
+    size_t start = bundle.size();
+    addheader(bundle, path, static_cast<uint32_t>(size));
+    size_t data_start = bundle.size();
+    bundle.resize(data_start + size);
+
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t got = pread(fd, &bundle[data_start + done], size - done, done);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            bundle.resize(start); // the file shrank or failed; drop the record
+            return false;
+        }
+        done += got;
+    }
+    return true;
+}
+
+std::vector<bundlerecord> parsebundle(const std::string &payload) {
+    std::vector<bundlerecord> records;
+    size_t pos = 0;
+    while (pos < payload.size()) {
+        if (payload.size() - pos < RECORD_HEADER_SIZE) {
+            throw std::runtime_error("Truncated bundle record");
+        }
+        uint16_t path_length;
+        uint32_t data_length;
+        std::memcpy(&path_length, payload.data() + pos, sizeof(path_length));
+        std::memcpy(&data_length, payload.data() + pos + 2, sizeof(data_length));
+        path_length = be16toh(path_length);
+        data_length = be32toh(data_length);
+        pos += RECORD_HEADER_SIZE;
+        if (payload.size() - pos < static_cast<uint64_t>(path_length) + data_length) {
+            throw std::runtime_error("Truncated bundle record");
+        }
+
+        bundlerecord record;
+        record.path = payload.substr(pos, path_length);
+        record.data = payload.data() + pos + path_length;
+        record.size = data_length;
+        records.push_back(record);
+        pos += path_length + data_length;
+    }
+    return records;
+}
+
+std::string recvbundle(mysock &s, const frameheader &h) {
+    if (h.length > MAX_BUNDLE_FRAME) {
+        throw std::runtime_error("Bundle frame exceeds the maximum size");
+    }
+    std::string payload(h.length, '\0');
+    if (h.length > 0 && s.recvall(&payload[0], h.length) != h.length) {
+        throw std::runtime_error("Connection closed in the middle of a frame");
+    }
+    return payload;
+}
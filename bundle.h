@@ -0,0 +1,88 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: bundle.h                                        */
+/* purpose: this header file declares the bundle format used */
+/*          to move many small files in one frame. a BUNDLE  */
+/*          frame's payload is a run of records, each a      */
+/*          6 byte header (path length u16, data length u32, */
+/*          both big-endian) followed by the path, relative  */
+/*          to the directory being transferred, and the file */
+/*          contents. small files then cost a few bytes of   */
+/*          framing instead of a command, a reply and their  */
+/*          own DATA/END frames.                             */
+/*************************************************************/
+
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "protocol.h"
+#include "socket.h"
+
+// Files up to this size travel inside bundles
+constexpr uint64_t BUNDLE_FILE_MAX = 64 << 10;
+
+// A bundle is sent once its payload reaches this size
+constexpr uint64_t BUNDLE_TARGET = 1 << 20;
+
+// Largest BUNDLE payload a receiver accepts
+constexpr uint64_t MAX_BUNDLE_FRAME = 2 << 20;
+
+/*************************************************************/
+/* struct: bundlerecord                                      */
+/* purpose: one file inside a received bundle. data points   */
+/*          into the payload it was parsed from.             */
+/*************************************************************/
+struct bundlerecord {
+    std::string path;
+    const char *data;
+    uint32_t size;
+};
+
+/*************************************************************/
+/* function: addrecord                                      */
+/* purpose: appends one file held in memory to a bundle.    */
+/* parameters:                                              */
+/*    - bundle: the payload being built.                    */
+/*    - path: the file's relative path.                     */
+/*    - data: the file contents.                            */
+/*    - size: the number of bytes.                          */
+/*************************************************************/
+void addrecord(std::string &bundle, const std::string &path, const char *data, uint32_t size);
+
+/*************************************************************/
+/* function: addfile                                        */
+/* purpose: reads a small file straight into a bundle.      */
+/* parameters:                                              */
+/*    - bundle: the payload being built.                    */
+/*    - path: the file's relative path.                     */
+/*    - fd: the open file.                                  */
+/*    - size: the file size (at most BUNDLE_FILE_MAX).      */
+/* return: false if the file could not be read in full; the */
+/*         bundle is left as it was.                        */
+/*************************************************************/
+bool addfile(std::string &bundle, const std::string &path, int fd, uint64_t size);
+
+/*************************************************************/
+/* function: parsebundle                                    */
+/* purpose: splits a bundle payload into its records.       */
+/*          throws if the payload is malformed.             */
+/* parameters:                                              */
+/*    - payload: the BUNDLE frame payload.                  */
+/*************************************************************/
+std::vector<bundlerecord> parsebundle(const std::string &payload);
+
+/*************************************************************/
+/* function: recvbundle                                     */
+/* purpose: reads the payload of a BUNDLE frame whose       */
+/*          header was already received. throws if it is    */
+/*          larger than MAX_BUNDLE_FRAME.                   */
+/* parameters:                                              */
+/*    - s: the connection to read from.                     */
+/*    - h: the frame header.                                */
+/*************************************************************/
+std::string recvbundle(mysock &s, const frameheader &h);
+
+#endif
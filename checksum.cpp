@@ -0,0 +1,522 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: checksum.cpp                                        */
+/* purpose: this source file implements the checksums declared   */
+/*          in checksum.h. the XXH64 code follows the reference  */
+/*          algorithm by Yann Collet (BSD licensed) and SHA-256  */
+/*          follows FIPS 180-4.                                  */
+/*****************************************************************/
+#include "checksum.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <vector>
+
+static const uint64_t PRIME1 = 11400714785074694791ULL;
+static const uint64_t PRIME2 = 14029467366897019727ULL;
+static const uint64_t PRIME3 = 1609587929392839161ULL;
+static const uint64_t PRIME4 = 9650029242287828579ULL;
+static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+// Read size used when hashing files
+constexpr size_t HASH_CHUNK = 1 << 20;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v; // XXH64 is defined on little-endian input, which is what x86/ARM give us
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+xxh64::xxh64(uint64_t seed) : seed(seed) {
+    v[0] = seed + PRIME1 + PRIME2;
+    v[1] = seed + PRIME2;
+    v[2] = seed;
+    v[3] = seed - PRIME1;
+}
+
+void xxh64::update(const void *data, size_t size) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    total += size;
+
+    // Top up a partial stripe first
+    if (buffered > 0) {
+        size_t take = 32 - buffered < size ? 32 - buffered : size;
+        std::memcpy(buffer + buffered, p, take);
+        buffered += take;
+        p += take;
+        size -= take;
+        if (buffered < 32) {
+            return;
+        }
+        for (int i = 0; i < 4; ++i) {
+            v[i] = round64(v[i], read64(buffer + 8 * i));
+        }
+        buffered = 0;
+    }
+
+    while (size >= 32) {
+        v[0] = round64(v[0], read64(p));
+        v[1] = round64(v[1], read64(p + 8));
+        v[2] = round64(v[2], read64(p + 16));
+        v[3] = round64(v[3], read64(p + 24));
+        p += 32;
+        size -= 32;
+    }
+
+    std::memcpy(buffer, p, size);
+    buffered = size;
+}
+
+uint64_t xxh64::digest() const {
+    uint64_t h;
+    if (total >= 32) {
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (int i = 0; i < 4; ++i) {
+            h = merge64(h, v[i]);
+        }
+    } else {
+        h = seed + PRIME5;
+    }
+    h += total;
+
+    const unsigned char *p = buffer;
+    size_t left = buffered;
+    while (left >= 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+        left -= 8;
+    }
+    if (left >= 4) {
+        h ^= static_cast<uint64_t>(read32(p)) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+        left -= 4;
+    }
+    while (left > 0) {
+        h ^= (*p) * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+        p++;
+        left--;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*************************************************************/
+/* function: hashrange                                      */
+/* purpose: feeds a byte range of a file into a hash.       */
+/*************************************************************/
+template <class hash> static bool hashrange(int fd, uint64_t offset, uint64_t length, hash &h) {
+    // Small files are common; a full chunk would be faulted in for each
+    std::vector<char> buffer(length < HASH_CHUNK ? length : HASH_CHUNK);
+    while (length > 0) {
+        size_t want = length < buffer.size() ? length : buffer.size();
+        ssize_t got = pread(fd, buffer.data(), want, offset);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        h.update(buffer.data(), got);
+        offset += got;
+        length -= got;
+    }
+    return true;
+}
+
+bool hashfile(int fd, uint64_t offset, uint64_t length, uint64_t &digest) {
+    xxh64 hash;
+    if (!hashrange(fd, offset, length, hash)) {
+        return false;
+    }
+    digest = hash.digest();
+    return true;
+}
+
+std::string tohex(uint64_t digest) {
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(digest));
+    return text;
+}
+
+// Reflected CRC32C (Castagnoli) polynomial
+constexpr uint32_t CRC32C_POLY = 0x82f63b78;
+
+// The hardware CRC runs three independent streams of these lengths
+// side by side to hide the latency of the crc32 instruction, then
+// merges them with precomputed "append zeros" tables
+constexpr size_t CRC_LONG = 8192;
+constexpr size_t CRC_SHORT = 256;
+
+/*************************************************************/
+/* struct: crctables                                        */
+/* purpose: lookup tables for the software CRC and for      */
+/*          shifting a CRC past CRC_LONG or CRC_SHORT zero  */
+/*          bytes, built once on first use.                 */
+/*************************************************************/
+struct crctables {
+    uint32_t bytes[256];
+    uint32_t shift_long[4][256];
+    uint32_t shift_short[4][256];
+
+    crctables() {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t crc = n;
+            for (int k = 0; k < 8; k++) {
+                crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            }
+            bytes[n] = crc;
+        }
+        zeros(shift_long, CRC_LONG);
+        zeros(shift_short, CRC_SHORT);
+    }
+
+  private:
+    // GF(2) matrix times vector
+    static uint32_t times(const uint32_t *mat, uint32_t vec) {
+        uint32_t sum = 0;
+        for (; vec; vec >>= 1, mat++) {
+            if (vec & 1) {
+                sum ^= *mat;
+            }
+        }
+        return sum;
+    }
+
+    static void square(uint32_t *result, const uint32_t *mat) {
+        for (int n = 0; n < 32; n++) {
+            result[n] = times(mat, mat[n]);
+        }
+    }
+
+    // Builds the tables that append len zero bytes (len a power of two)
+    static void zeros(uint32_t table[4][256], size_t len) {
+        uint32_t even[32], odd[32];
+        odd[0] = CRC32C_POLY; // one zero bit
+        for (int n = 1; n < 32; n++) {
+            odd[n] = 1u << (n - 1);
+        }
+        square(even, odd); // two zero bits
+        square(odd, even); // four zero bits
+        uint32_t *op = odd;
+        while (true) {
+            square(even, odd); // one zero byte on the first pass
+            op = even;
+            len >>= 1;
+            if (len == 0) {
+                break;
+            }
+            square(odd, even);
+            op = odd;
+            len >>= 1;
+            if (len == 0) {
+                break;
+            }
+        }
+        for (uint32_t n = 0; n < 256; n++) {
+            table[0][n] = times(op, n);
+            table[1][n] = times(op, n << 8);
+            table[2][n] = times(op, n << 16);
+            table[3][n] = times(op, n << 24);
+        }
+    }
+};
+
+static const crctables &tables() {
+    static const crctables t;
+    return t;
+}
+
+static inline uint32_t crcshift(const uint32_t table[4][256], uint32_t crc) {
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^ table[2][(crc >> 16) & 0xff] ^
+           table[3][crc >> 24];
+}
+
+/*************************************************************/
+/* function: crc32csoft                                     */
+/* purpose: table driven CRC32C for CPUs without SSE4.2.    */
+/*************************************************************/
+static uint32_t crc32csoft(uint32_t crc, const unsigned char *p, size_t size) {
+    const crctables &t = tables();
+    crc = ~crc;
+    while (size--) {
+        crc = t.bytes[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+/*************************************************************/
+/* function: crcstreams                                     */
+/* purpose: runs three interleaved hardware CRC streams of  */
+/*          len bytes each and folds them into one.         */
+/*************************************************************/
+__attribute__((target("sse4.2"))) static inline uint64_t crcstreams(uint64_t crc0, const unsigned char *&p,
+                                                                    size_t len, const uint32_t table[4][256]) {
+    uint64_t crc1 = 0, crc2 = 0;
+    const unsigned char *end = p + len;
+    for (; p < end; p += 8) {
+        uint64_t a, b, c;
+        std::memcpy(&a, p, 8);
+        std::memcpy(&b, p + len, 8);
+        std::memcpy(&c, p + 2 * len, 8);
+        crc0 = _mm_crc32_u64(crc0, a);
+        crc1 = _mm_crc32_u64(crc1, b);
+        crc2 = _mm_crc32_u64(crc2, c);
+    }
+    crc0 = crcshift(table, static_cast<uint32_t>(crc0)) ^ crc1;
+    crc0 = crcshift(table, static_cast<uint32_t>(crc0)) ^ crc2;
+    p += 2 * len;
+    return crc0;
+}
+
+/*************************************************************/
+/* function: crc32chard                                     */
+/* purpose: CRC32C with the SSE4.2 crc32 instruction.       */
+/*************************************************************/
+__attribute__((target("sse4.2"))) static uint32_t crc32chard(uint32_t crc, const unsigned char *p,
+                                                             size_t size) {
+    const crctables &t = tables();
+    uint64_t crc0 = ~crc;
+    while (size >= 3 * CRC_LONG) {
+        crc0 = crcstreams(crc0, p, CRC_LONG, t.shift_long);
+        size -= 3 * CRC_LONG;
+    }
+    while (size >= 3 * CRC_SHORT) {
+        crc0 = crcstreams(crc0, p, CRC_SHORT, t.shift_short);
+        size -= 3 * CRC_SHORT;
+    }
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        crc0 = _mm_crc32_u64(crc0, word);
+    }
+    for (; size > 0; p++, size--) {
+        crc0 = _mm_crc32_u8(static_cast<uint32_t>(crc0), *p);
+    }
+    return ~static_cast<uint32_t>(crc0);
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return crc32chard(crc, p, size);
+    }
+#endif
+    return crc32csoft(crc, p, size);
+}
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotr(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+/*************************************************************/
+/* function: sha256soft                                     */
+/* purpose: runs the SHA-256 compression function over      */
+/*          whole 64 byte blocks in plain C++.              */
+/*************************************************************/
+static void sha256soft(uint32_t state[8], const unsigned char *p, size_t blocks) {
+    for (; blocks > 0; blocks--, p += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = uint32_t(p[4 * i]) << 24 | uint32_t(p[4 * i + 1]) << 16 | uint32_t(p[4 * i + 2]) << 8 |
+                   p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/*************************************************************/
+/* function: sha256hard                                     */
+/* purpose: the compression function with the SHA           */
+/*          extensions, four rounds per pair of sha256rnds2 */
+/*          and the message schedule in sha256msg1/msg2.    */
+/*************************************************************/
+__attribute__((target("sha,ssse3,sse4.1"))) static void sha256hard(uint32_t state[8], const unsigned char *p,
+                                                                   size_t blocks) {
+    const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // The instructions keep the state as ABEF and CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0])), 0xb1);
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4])), 0x1b);
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+    for (; blocks > 0; blocks--, p += 64) {
+        __m128i abef_saved = abef;
+        __m128i cdgh_saved = cdgh;
+        __m128i w[4];
+#pragma GCC unroll 4
+        for (int i = 0; i < 4; i++) {
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i)), swap);
+        }
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++) {
+            __m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&SHA256_K[4 * i]));
+            __m128i msg = _mm_add_epi32(w[i & 3], k);
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e));
+            if (i < 12) {
+                // Words 4(i+4) .. 4(i+4)+3 replace the ones just used
+                __m128i next = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(next, w[(i + 3) & 3]);
+            }
+        }
+        abef = _mm_add_epi32(abef, abef_saved);
+        cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1b);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), _mm_blend_epi16(tmp, cdgh, 0xf0));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), _mm_alignr_epi8(cdgh, tmp, 8));
+}
+#endif
+
+/*************************************************************/
+/* function: sha256blocks                                   */
+/* purpose: runs the compression function over whole        */
+/*          blocks, in hardware when the CPU can.           */
+/*************************************************************/
+static void sha256blocks(uint32_t state[8], const unsigned char *p, size_t blocks) {
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+    if (hardware) {
+        sha256hard(state, p, blocks);
+        return;
+    }
+#endif
+    sha256soft(state, p, blocks);
+}
+
+sha256::sha256() {
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    std::memcpy(state, initial, sizeof(state));
+}
+
+void sha256::update(const void *data, size_t size) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    total += size;
+    if (buffered > 0) {
+        size_t n = size < 64 - buffered ? size : 64 - buffered;
+        std::memcpy(buffer + buffered, p, n);
+        buffered += n;
+        p += n;
+        size -= n;
+        if (buffered < 64) {
+            return;
+        }
+        sha256blocks(state, buffer, 1);
+        buffered = 0;
+    }
+    sha256blocks(state, p, size / 64);
+    p += size / 64 * 64;
+    size %= 64;
+    std::memcpy(buffer, p, size);
+    buffered = size;
+}
+
+std::string sha256::digest() const {
+    // Pad a copy, so more data can still be fed afterwards
+    uint32_t out[8];
+    std::memcpy(out, state, sizeof(out));
+    unsigned char tail[128] = {0};
+    std::memcpy(tail, buffer, buffered);
+    tail[buffered] = 0x80;
+    size_t length = buffered < 56 ? 64 : 128;
+    uint64_t bits = total * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[length - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+    }
+    sha256blocks(out, tail, length / 64);
+
+    char text[65];
+    for (int i = 0; i < 8; i++) {
+        std::snprintf(text + 8 * i, 9, "%08x", out[i]);
+    }
+    return std::string(text, 64);
+}
+
+bool sha256file(int fd, uint64_t offset, uint64_t length, std::string &digest) {
+    sha256 hash;
+    if (!hashrange(fd, offset, length, hash)) {
+        return false;
+    }
+    digest = hash.digest();
+    return true;
+}
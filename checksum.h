@@ -0,0 +1,133 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: checksum.h                                      */
+/* purpose: this header file declares the checksums used to  */
+/*          verify transfers end to end. xxh64 is a fast     */
+/*          non-cryptographic 64 bit hash (XXH64) that can   */
+/*          be fed incrementally while data streams by.      */
+/*          crc32c is the Castagnoli CRC, computed with the  */
+/*          SSE4.2 crc32 instruction where the CPU has it.   */
+/*          sha256 names file contents in the content store; */
+/*          it uses the SHA extensions where available.      */
+/*************************************************************/
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*************************************************************/
+/* class: xxh64                                              */
+/* purpose: streaming XXH64 hash state.                      */
+/*************************************************************/
+class xxh64 {
+  public:
+    /*************************************************************/
+    /* function: xxh64                                          */
+    /* purpose: starts a new hash.                              */
+    /* parameters:                                              */
+    /*    - seed: the hash seed.                                */
+    /*************************************************************/
+    xxh64(uint64_t seed = 0);
+
+    /*************************************************************/
+    /* function: update                                         */
+    /* purpose: feeds more bytes into the hash.                 */
+    /* parameters:                                              */
+    /*    - data: the bytes.                                    */
+    /*    - size: how many bytes.                               */
+    /*************************************************************/
+    void update(const void *data, size_t size);
+
+    /*************************************************************/
+    /* function: digest                                         */
+    /* purpose: returns the hash of everything fed so far.      */
+    /*************************************************************/
+    uint64_t digest() const;
+
+  private:
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total = 0;
+    unsigned char buffer[32];
+    size_t buffered = 0;
+};
+
+/*************************************************************/
+/* function: hashfile                                       */
+/* purpose: computes the XXH64 of a byte range of a file.   */
+/* parameters:                                              */
+/*    - fd: an open, readable file descriptor.              */
+/*    - offset: where the range starts.                     */
+/*    - length: how many bytes to hash.                     */
+/*    - digest: receives the hash.                          */
+/* return: false if the file could not be read.             */
+/*************************************************************/
+bool hashfile(int fd, uint64_t offset, uint64_t length, uint64_t &digest);
+
+/*************************************************************/
+/* class: sha256                                             */
+/* purpose: streaming SHA-256 hash state.                    */
+/*************************************************************/
+class sha256 {
+  public:
+    sha256();
+
+    /*************************************************************/
+    /* function: update                                         */
+    /* purpose: feeds more bytes into the hash.                 */
+    /* parameters:                                              */
+    /*    - data: the bytes.                                    */
+    /*    - size: how many bytes.                               */
+    /*************************************************************/
+    void update(const void *data, size_t size);
+
+    /*************************************************************/
+    /* function: digest                                         */
+    /* purpose: returns the hash of everything fed so far as 64 */
+    /*          lowercase hex digits.                           */
+    /*************************************************************/
+    std::string digest() const;
+
+  private:
+    uint32_t state[8];
+    uint64_t total = 0;
+    unsigned char buffer[64];
+    size_t buffered = 0;
+};
+
+/*************************************************************/
+/* function: sha256file                                     */
+/* purpose: computes the SHA-256 of a byte range of a file. */
+/* parameters:                                              */
+/*    - fd: an open, readable file descriptor.              */
+/*    - offset: where the range starts.                     */
+/*    - length: how many bytes to hash.                     */
+/*    - digest: receives the hash as hex digits.            */
+/* return: false if the file could not be read.             */
+/*************************************************************/
+bool sha256file(int fd, uint64_t offset, uint64_t length, std::string &digest);
+
+/*************************************************************/
+/* function: crc32c                                         */
+/* purpose: computes or continues a CRC32C. start with 0    */
+/*          and pass the previous result to continue over   */
+/*          the next bytes.                                 */
+/* parameters:                                              */
+/*    - crc: the CRC of the bytes before data.              */
+/*    - data: the bytes.                                    */
+/*    - size: how many bytes.                               */
+/*************************************************************/
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+/*************************************************************/
+/* function: tohex                                          */
+/* purpose: formats a 64 bit digest as 16 hex digits.       */
+/* parameters:                                              */
+/*    - digest: the value to format.                        */
+/*************************************************************/
+std::string tohex(uint64_t digest);
+
+#endif
@@ -3,9 +3,9 @@
 /* filename: parsing.cpp                                      */
 /* purpose: this source file implements the parsemenu function */
 /*          that processes command-line arguments for a client.*/
-/*          It parses the `-h` (hostname) and `-p` (port)      */
-/*          options and stores them in a structure for further */
-/*          use.                                               */
+/*          It parses the `-h` (hostname), `-p` (port) and     */
+/*          `-c` (download cache) options and stores them in a */
+/*          structure for further use.                         */
 /*************************************************************/
 #include <iostream>
 #include <unistd.h>
@@ -18,8 +18,9 @@ struct options parsemenu(int argc, char* argv[]){
 	struct options o;
 	o.hostname = "";
 	o.port = "";
+	o.cache = "";
 	int opt;
-	while((opt = getopt(argc, argv, "h:p:")) != -1){
+	while((opt = getopt(argc, argv, "h:p:c:")) != -1){
 		switch (opt){
 			case 'h':
 				o.hostname = optarg;
@@ -30,6 +31,10 @@ struct options parsemenu(int argc, char* argv[]){
 				o.port = optarg;
 				// cout << "port: " << o.port << endl;
 				break;
+
+			case 'c':
+				o.cache = optarg;
+				break;
 			
 		}
 	}
@@ -15,6 +15,7 @@ using namespace std;
 struct options {
     string hostname;
     string port;
+    string cache;     // directory of download records for conditional gets (-c), or empty
 };
 
 /*************************************************************************/
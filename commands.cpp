@@ -0,0 +1,1192 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: commands.cpp                                        */
+/* purpose: this source file implements the server's command     */
+/*          core declared in commands.h. every path a client     */
+/*          names is opened through the session's directory      */
+/*          descriptors, so the kernel keeps it inside the base  */
+/*          directory while resolving it.                        */
+/*****************************************************************/
+#include "commands.h"
+#include "protocol.h"
+#include "checksum.h"
+#include "bundle.h"
+#include "compress.h"
+#include "store.h"
+#include "treeindex.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+const vector<string> ALLOWED_EXTENSIONS = {".txt", ".csv", ".log"};
+
+string base_directory;
+
+void startSession(session &sess) {
+    int fd = open(base_directory.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        throw runtime_error("Cannot open base directory " + base_directory + ": " + strerror(errno));
+    }
+    sess.base_fd.reset(fd);
+    sess.cwd_fd.reset(fcntl(fd, F_DUPFD_CLOEXEC, 0));
+    if (sess.cwd_fd.get() == -1) {
+        throw runtime_error("Cannot open base directory " + base_directory + ": " + strerror(errno));
+    }
+    sess.current_directory = base_directory;
+}
+
+/*************************************************************/
+/* function: isStorePath                                    */
+/* purpose: Tells whether a path relative to the base       */
+/*          directory names the content store or something  */
+/*          in it. The store is the server's own; clients   */
+/*          never name it.                                  */
+/*************************************************************/
+static bool isStorePath(const fs::path &relative) {
+    return storeenabled() && !relative.empty() && *relative.begin() == STORE_DIRECTORY;
+}
+
+/*************************************************************/
+/* function: splitArgument                                  */
+/* purpose: Picks the directory descriptor a path argument  */
+/*          is opened from and the path relative to it. "." */
+/*          and ".." are folded lexically first, as cd and  */
+/*          pwd always have, so a path that climbs out of   */
+/*          the base fails here; the kernel then refuses    */
+/*          symlinks that lead out.                         */
+/* return: false with errno set if the path leaves the base */
+/*         or names the content store.                      */
+/*************************************************************/
+static bool splitArgument(const session &sess, const string &arg, int &dirfd, string &relative) {
+    static const fs::path base = resolvePath(session(), "/");
+    fs::path lexical = resolvePath(sess, arg).lexically_relative(base);
+    if (lexical.empty() || *lexical.begin() == "..") {
+        errno = EXDEV;
+        return false;
+    }
+    if (isStorePath(lexical)) {
+        errno = EACCES;
+        return false;
+    }
+
+    bool climbs = false;
+    for (const auto &component : fs::path(arg)) {
+        climbs = climbs || component == "..";
+    }
+    if (!arg.empty() && arg[0] != '/' && !climbs) {
+        dirfd = sess.cwd_fd.get(); // one component for a name in the current directory
+        relative = arg;
+    } else {
+        dirfd = sess.base_fd.get();
+        relative = lexical.string();
+    }
+    return true;
+}
+
+int openBeneath(const session &sess, const string &arg, int flags, mode_t mode) {
+    int dirfd;
+    string relative;
+    if (!splitArgument(sess, arg, dirfd, relative)) {
+        return -1;
+    }
+    return openbeneath(dirfd, relative, flags, mode);
+}
+
+bool locateFile(const session &sess, const string &arg, location &target) {
+    int dirfd;
+    string relative;
+    if (!splitArgument(sess, arg, dirfd, relative)) {
+        return false;
+    }
+    target.dir.reset(openparent(dirfd, relative, target.name));
+    return target.dir.get() != -1;
+}
+
+/*************************************************************/
+/* function: indexPath                                      */
+/* purpose: Names a directory argument the way the tree     */
+/*          index does: below the base, "" for the base.    */
+/*          The index checks the directory it finds there   */
+/*          is the one that was opened.                     */
+/*************************************************************/
+static string indexPath(const session &sess, const string &arg) {
+    static const fs::path base = resolvePath(session(), "/");
+    string relative = resolvePath(sess, arg).lexically_relative(base).string();
+    return relative == "." ? "" : relative;
+}
+
+/*************************************************************/
+/* function: isDenied                                       */
+/* purpose: Tells whether an openBeneath failure means the  */
+/*          path was refused rather than missing.           */
+/*************************************************************/
+static bool isDenied(int error) {
+    return error == EXDEV || error == EACCES || error == ELOOP || error == EPERM;
+}
+
+fs::path resolvePath(const session &sess, const string &arg) {
+    fs::path path;
+    if (!arg.empty() && arg[0] == '/') {
+        path = fs::path(base_directory) / arg.substr(1);
+    } else {
+        path = fs::path(sess.current_directory) / arg;
+    }
+    path = fs::absolute(path).lexically_normal();
+    if (!path.has_filename() && path.has_relative_path()) {
+        path = path.parent_path(); // drop the trailing separator of "dir/"
+    }
+    return path;
+}
+
+string virtualPath(const fs::path &path) {
+    static const fs::path base = resolvePath(session(), "/");
+    fs::path relative = path.lexically_relative(base);
+    if (relative.empty() || relative == "." || *relative.begin() == "..") {
+        return "/";
+    }
+    return "/" + relative.string();
+}
+
+bool parseNumber(const string &text, uint64_t &value) {
+    if (text.empty() || text.find_first_not_of("0123456789") != string::npos) {
+        return false;
+    }
+    errno = 0;
+    value = strtoull(text.c_str(), nullptr, 10);
+    return errno == 0;
+}
+
+bool hasAllowedExtension(const fs::path &file_path) {
+    string ext = file_path.extension().string();
+    return find(ALLOWED_EXTENSIONS.begin(), ALLOWED_EXTENSIONS.end(), ext) != ALLOWED_EXTENSIONS.end();
+}
+
+command parseCommand(const string &line) {
+    command c;
+    stringstream ss(line);
+    ss >> c.cmd;
+    string word;
+    while (ss >> word) {
+        c.args.push_back(word);
+    }
+    return c;
+}
+
+bool takeOption(command &c, const string &option) {
+    for (size_t i = 0; i < c.args.size() && c.args[i].size() > 1 && c.args[i][0] == '-'; ++i) {
+        if (c.args[i] == option) {
+            c.args.erase(c.args.begin() + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool takeValue(command &c, const string &option, string &value) {
+    for (size_t i = 0; i + 1 < c.args.size() && c.args[i].size() > 1 && c.args[i][0] == '-'; ++i) {
+        if (c.args[i] == option) {
+            value = c.args[i + 1];
+            c.args.erase(c.args.begin() + i, c.args.begin() + i + 2);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*************************************************************/
+/* function: wholeSum                                       */
+/* purpose: The XXH64 of a whole file. The tree index keeps */
+/*          it until the file changes.                      */
+/* parameters:                                              */
+/*    - fd: the file.                                       */
+/*    - st: its status.                                     */
+/*    - digest: receives the hash.                          */
+/* return: false if the file could not be read.             */
+/*************************************************************/
+static bool wholeSum(int fd, const struct stat &st, uint64_t &digest) {
+    if (indexsum(st, digest)) {
+        return true;
+    }
+    if (!hashfile(fd, 0, st.st_size, digest)) {
+        return false;
+    }
+    indexremember(st, digest);
+    return true;
+}
+
+/*************************************************************/
+/* function: makeDirectories                                */
+/* purpose: Creates a directory and any missing parents,    */
+/*          entering each one with openbeneath so a symlink */
+/*          met on the way cannot lead out of the base.     */
+/* return: false with errno set on failure.                 */
+/*************************************************************/
+static bool makeDirectories(int dirfd, const string &relative) {
+    fdhandle current(openbeneath(dirfd, "", O_PATH | O_DIRECTORY));
+    for (const auto &component : fs::path(relative)) {
+        if (current.get() == -1) {
+            return false;
+        }
+        if (component.empty() || component == ".") {
+            continue;
+        }
+        if (mkdirat(current.get(), component.c_str(), 0755) == -1 && errno != EEXIST) {
+            return false;
+        }
+        current.reset(openbeneath(current.get(), component.string(), O_PATH | O_DIRECTORY));
+    }
+    return current.get() != -1;
+}
+
+reply runCommand(session &sess, const command &c) {
+    const string &cmd = c.cmd;
+    const string &arg1 = c.arg(0);
+
+    if (cmd == "cd") {
+        int fd = openBeneath(sess, arg1, O_PATH | O_DIRECTORY);
+        if (fd == -1 && errno == ENOTDIR) {
+            return {FRAME_ERROR, "Error: Target is not a directory."};
+        } else if (fd == -1 && isDenied(errno)) {
+            return {FRAME_ERROR, "Error: Access denied to restricted directory."};
+        } else if (fd == -1) {
+            return {FRAME_ERROR, "Error: Directory does not exist."};
+        }
+        sess.cwd_fd.reset(fd);
+        sess.current_directory = resolvePath(sess, arg1).string();
+        return {FRAME_RESP, "Directory changed to: " + sess.current_directory};
+    } else if (cmd == "pwd") {
+        return {FRAME_RESP, sess.current_directory};
+    } else if (cmd == "mkdir" && arg1 == "-p") {
+        // Batch form: every argument is created with its parents, and
+        // directories that already exist are fine
+        size_t created = 0;
+        for (size_t i = 1; i < c.args.size(); ++i) {
+            int dirfd;
+            string relative;
+            if (!splitArgument(sess, c.args[i], dirfd, relative)) {
+                return {FRAME_ERROR, "Error: Access denied: " + c.args[i]};
+            }
+            if (!makeDirectories(dirfd, relative)) {
+                if (isDenied(errno)) {
+                    return {FRAME_ERROR, "Error: Access denied: " + c.args[i]};
+                }
+                return {FRAME_ERROR, "Error: Cannot create " + c.args[i] + ": " + strerror(errno)};
+            }
+            created++;
+        }
+        return {FRAME_RESP, to_string(created) + " directories ready."};
+    } else if (cmd == "mkdir") {
+        location target;
+        if (!locateFile(sess, arg1, target) && isDenied(errno)) {
+            return {FRAME_ERROR, "Error: Access denied."};
+        } else if (target.dir.get() == -1 || mkdirat(target.dir.get(), target.name.c_str(), 0755) == -1) {
+            return {FRAME_ERROR, "Error: Directory already exists or cannot be created."};
+        }
+        return {FRAME_RESP, "Directory created."};
+    } else if (cmd == "lmkdir") {
+        if (arg1.empty()) {
+            return {FRAME_ERROR, "Error: Directory name not specified."};
+        } else if (mkdir(arg1.c_str(), 0755) == 0) {
+            return {FRAME_RESP, "Local directory created: " + arg1};
+        }
+        return {FRAME_ERROR, "Error: Unable to create local directory."};
+    } else if (cmd == "lls") {
+        DIR *dir = opendir(arg1.empty() ? "." : arg1.c_str());
+        if (!dir) {
+            return {FRAME_ERROR, "Error: Unable to list local directory."};
+        }
+        stringstream response;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            response << entry->d_name << (entry->d_type == DT_DIR ? "/" : "") << "\n";
+        }
+        closedir(dir);
+        return {FRAME_RESP, response.str()};
+    } else if (cmd == "stat") {
+        // "FILE|DIR size mtime path", with path relative to the base
+        fs::path target_path = resolvePath(sess, arg1);
+        int fd = openBeneath(sess, arg1, O_PATH);
+        struct stat st;
+        bool found = fd != -1 && fstat(fd, &st) == 0;
+        if (fd != -1) {
+            close(fd);
+        }
+        if (!found) {
+            return {FRAME_ERROR, "Error: File or directory does not exist or access denied."};
+        }
+        stringstream response;
+        response << (S_ISDIR(st.st_mode) ? "DIR " : S_ISREG(st.st_mode) ? "FILE " : "OTHER ")
+                 << (S_ISREG(st.st_mode) ? st.st_size : 0) << " " << st.st_mtime << " "
+                 << virtualPath(target_path);
+        return {FRAME_RESP, response.str()};
+    } else if (cmd == "sum") {
+        // XXH64 of a file range, used to verify parallel transfers
+        string path;
+        uint64_t offset, length, digest;
+        reply err;
+        int fd = openForGet(sess, c, path, offset, length, err);
+        if (fd == -1) {
+            return err;
+        }
+        struct stat st;
+        bool whole = offset == 0 && fstat(fd, &st) == 0 && length == static_cast<uint64_t>(st.st_size);
+        bool ok = whole ? wholeSum(fd, st, digest) : hashfile(fd, offset, length, digest);
+        close(fd);
+        if (!ok) {
+            return {FRAME_ERROR, "Error: Reading file failed."};
+        }
+        return {FRAME_RESP, tohex(digest)};
+    } else if (cmd == "compress") {
+        // Negotiates compressed downloads for the rest of the session
+        if (arg1 == COMPRESSION_METHOD || arg1 == "none") {
+            sess.compress = arg1 != "none";
+            return {FRAME_RESP, "Compression: " + arg1};
+        }
+        return {FRAME_ERROR, "Error: Unsupported compression: " + arg1};
+    } else if (cmd == "dedup") {
+        // Tells a client whether announcing content with "link" can work
+        if (!storeenabled()) {
+            return {FRAME_ERROR, "Error: Content store is disabled."};
+        }
+        return {FRAME_RESP, "Content store: on"};
+    } else if (cmd == "link") {
+        // "link <sha256> <size> <path>": creates path from stored content
+        // so the client can skip the upload
+        fs::path target_path = resolvePath(sess, c.arg(2));
+        location target;
+        uint64_t size;
+        if (!storeenabled()) {
+            return {FRAME_ERROR, "Error: Content store is disabled."};
+        } else if (!iscontenthash(arg1) || !parseNumber(c.arg(1), size)) {
+            return {FRAME_ERROR, "Error: Invalid content hash."};
+        } else if (c.arg(2).empty() || !locateFile(sess, c.arg(2), target)) {
+            return {FRAME_ERROR, "Error: Access denied."};
+        } else if (!hasAllowedExtension(target_path)) {
+            return {FRAME_ERROR, "Error: Unsupported file type."};
+        } else if (!linkcontent(arg1, size, target.dir.get(), target.name)) {
+            return {FRAME_ERROR, "Error: Content not stored."};
+        }
+        cout << "File linked from the content store: " << target_path.string() << endl;
+        return {FRAME_RESP, "File linked: " + target_path.string()};
+    }
+    return {FRAME_ERROR, "Error: Unknown command."};
+}
+
+reply tuneLink(linktuner &tuner, const command &c) {
+    if (!c.args.empty()) {
+        linksettings settings = tuner.forced();
+        string error;
+        if (!parselinksettings(c.args, settings, error)) {
+            return {FRAME_ERROR, "Error: " + error};
+        }
+        tuner.force(settings);
+    }
+    return {FRAME_RESP, tuner.describe()};
+}
+
+bool openListing(session &sess, const command &c, dirlisting &listing, reply &err) {
+    listoptions options;
+    size_t i = 0;
+    for (; i < c.args.size() && c.args[i].size() > 1 && c.args[i][0] == '-'; ++i) {
+        const string &option = c.args[i];
+        const string &value = c.arg(i + 1);
+        if (option == "-l") {
+            options.details = true;
+        } else if (option == "-r") {
+            options.reverse = true;
+        } else if (option == "-s" && (value == "name" || value == "size" || value == "mtime")) {
+            options.order = value == "name" ? listorder::NAME : value == "size" ? listorder::SIZE : listorder::MTIME;
+            ++i;
+        } else if (option == "-n" && parseNumber(value, options.limit) && options.limit > 0) {
+            ++i;
+        } else if (option == "-c" && !value.empty()) {
+            options.cursor = value;
+            ++i;
+        } else {
+            err = {FRAME_ERROR,
+                   "Error: Usage: ls [-l] [-s name|size|mtime] [-r] [-n count] [-c cursor] [path [pattern]]"};
+            return false;
+        }
+    }
+    options.pattern = c.arg(i + 1);
+
+    int fd = openBeneath(sess, c.arg(i), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        err = {FRAME_ERROR, errno == ENOTDIR ? "Error: Specified path is not a directory."
+                                             : "Error: Path does not exist or access denied."};
+        return false;
+    }
+    string error;
+    if (!listing.start(fd, indexPath(sess, c.arg(i)), options, error)) {
+        err = {FRAME_ERROR, error};
+        return false;
+    }
+    return true;
+}
+
+int openForGet(session &sess, const command &c, string &path, uint64_t &offset, uint64_t &length,
+               reply &err) {
+    fs::path target_path = resolvePath(sess, c.arg(0));
+    path = target_path.string();
+
+    offset = 0;
+    length = 0;
+    if ((!c.arg(1).empty() && !parseNumber(c.arg(1), offset)) ||
+        (!c.arg(2).empty() && !parseNumber(c.arg(2), length))) {
+        err = {FRAME_ERROR, "Error: Invalid range."};
+        return -1;
+    }
+
+    // O_NONBLOCK keeps a FIFO from blocking the open; it is cleared
+    // once the file is known to be regular
+    int fd = openBeneath(sess, c.arg(0), O_RDONLY | O_NONBLOCK | O_NOCTTY);
+    if (fd == -1) {
+        err = {FRAME_ERROR, "Error: File or directory does not exist or access denied."};
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        err = {FRAME_ERROR, "Error: Specified path is not a file."};
+        return -1;
+    }
+    if (!hasAllowedExtension(target_path)) {
+        close(fd);
+        err = {FRAME_ERROR, "Error: Unsupported file type."};
+        return -1;
+    }
+    fcntl(fd, F_SETFL, 0);
+    uint64_t size = st.st_size;
+    if (offset > size) {
+        close(fd);
+        err = {FRAME_ERROR, "Error: Invalid range."};
+        return -1;
+    }
+    if (length == 0 || length > size - offset) {
+        length = size - offset;
+    }
+    return fd;
+}
+
+bool checkUnchanged(int fd, const string &known, string &version) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        version = "-";
+        return false;
+    }
+    auto nanoseconds = [](const struct timespec &t) {
+        return to_string(static_cast<int64_t>(t.tv_sec) * 1000000000 + t.tv_nsec);
+    };
+    string size = to_string(st.st_size);
+    version = size + ":" + nanoseconds(st.st_mtim) + ":" + nanoseconds(st.st_ctim);
+
+    size_t hash_at = known.rfind(':');
+    if (hash_at == string::npos) {
+        return false;
+    }
+    if (known.compare(0, hash_at, version) == 0) {
+        return true;
+    }
+    // Touched or rewritten: only a file of the same size can still match
+    uint64_t digest;
+    return known.compare(0, size.size() + 1, size + ":") == 0 && wholeSum(fd, st, digest) &&
+           known.compare(hash_at + 1, string::npos, tohex(digest)) == 0;
+}
+
+int openForPut(session &sess, const command &c, string &path, location &target, uint64_t &offset, bool &ranged,
+               reply &err) {
+    fs::path target_path = resolvePath(sess, c.arg(0));
+    path = target_path.string();
+
+    offset = 0;
+    uint64_t total = 0;
+    ranged = !c.arg(1).empty();
+    if ((ranged && !parseNumber(c.arg(1), offset)) || (!c.arg(2).empty() && !parseNumber(c.arg(2), total))) {
+        ranged = false;
+        err = {FRAME_ERROR, "Error: Invalid range."};
+        return -1;
+    }
+
+    if (c.arg(0).empty() || (!locateFile(sess, c.arg(0), target) && isDenied(errno))) {
+        err = {FRAME_ERROR, "Error: Access denied."};
+        return -1;
+    }
+    if (!hasAllowedExtension(target_path)) {
+        err = {FRAME_ERROR, "Error: Unsupported file type."};
+        return -1;
+    }
+    if (target.dir.get() == -1) {
+        err = {FRAME_ERROR, "Error: Cannot create file."};
+        return -1;
+    }
+
+    struct stat st;
+    if (!ranged && fstatat(target.dir.get(), target.name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        cout << "Overwriting existing file: " << path << endl;
+    }
+
+    // A file shared with the content store must not be written in place.
+    // Only a range write or a resume needs the old contents
+    bool keep = ranged && (offset > 0 || !c.arg(2).empty());
+    int fd = openunshared(target.dir.get(), target.name, O_RDWR | O_CREAT | (ranged ? 0 : O_TRUNC) | O_CLOEXEC,
+                          keep);
+    if (fd == -1) {
+        err = {FRAME_ERROR, "Error: Cannot create file."};
+        return -1;
+    }
+
+    // Every range of a parallel upload sets the same final size, so
+    // whichever arrives first sizes the file and the rest are no-ops.
+    // Without a total the upload resumes (appends) at offset, so the
+    // file is cut back to exactly the bytes before it.
+    if (ranged && fstat(fd, &st) == -1) {
+        close(fd);
+        err = {FRAME_ERROR, "Error: Cannot create file."};
+        return -1;
+    }
+    uint64_t current = ranged ? st.st_size : 0;
+    if (ranged && c.arg(2).empty() && offset > current) {
+        close(fd);
+        err = {FRAME_ERROR, "Error: Invalid range."};
+        return -1;
+    }
+    uint64_t wanted = c.arg(2).empty() ? offset : total;
+    if (ranged && current != wanted && ftruncate(fd, wanted) == -1) {
+        close(fd);
+        err = {FRAME_ERROR, "Error: Cannot create file."};
+        return -1;
+    }
+    return fd;
+}
+
+bool hashesUpload(const command &c, uint64_t offset) {
+    return storeenabled() && offset == 0 && c.arg(2).empty();
+}
+
+reply finishPut(const string &path, const location &target, const sha256 *content) {
+    cout << "File uploaded: " << path << endl;
+    if (content && storecontent(target.dir.get(), target.name, content->digest())) {
+        cout << "Identical content already stored; " << path << " shares it." << endl;
+        return {FRAME_RESP, "File received: " + path + " (deduplicated)"};
+    }
+    return {FRAME_RESP, "File received: " + path};
+}
+
+void discardPut(const location &target) {
+    if (target.dir.get() != -1) {
+        unlinkat(target.dir.get(), target.name.c_str(), 0);
+    }
+}
+
+/*************************************************************/
+/* function: visitTree                                      */
+/* purpose: Calls visit for every entry below an opened     */
+/*          directory, each directory before what is in it, */
+/*          until visit returns false. Directories come     */
+/*          from the tree index while it is current and     */
+/*          from the disk otherwise; the index is only held */
+/*          while one directory is copied, so a slow visit  */
+/*          does not hold up its updates. Symlinks are      */
+/*          reported but not followed; unreadable           */
+/*          directories and the content store are left out. */
+/*************************************************************/
+static void visitTree(const string &indexed, int root_fd,
+                      const function<bool(const string &, const indexentry &)> &visit) {
+    struct stat st;
+    bool use_index = fstat(root_fd, &st) == 0;
+    vector<pair<string, indexentry>> entries;
+    vector<string> pending = {""};
+    while (!pending.empty()) {
+        string relative = pending.back();
+        pending.pop_back();
+        string directory = relative.empty() ? indexed : indexed.empty() ? relative : indexed + "/" + relative;
+        use_index = use_index && indexentries(directory, relative.empty() ? &st : nullptr, entries);
+        if (use_index) {
+            for (const auto &entry : entries) {
+                string path = relative.empty() ? entry.first : relative + "/" + entry.first;
+                if (!visit(path, entry.second)) {
+                    return;
+                }
+                if (entry.second.kind == 'D') {
+                    pending.push_back(path);
+                }
+            }
+            continue;
+        }
+
+        int fd = openbeneath(root_fd, relative, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        DIR *dir = fd == -1 ? nullptr : fdopendir(fd);
+        if (!dir) {
+            if (fd != -1) {
+                close(fd);
+            }
+            continue;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            string name = entry->d_name;
+            if (name == "." || name == "..") {
+                continue;
+            }
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || isstore(st)) {
+                continue;
+            }
+            string path = relative.empty() ? name : relative + "/" + name;
+            if (!visit(path, makeentry(st))) {
+                closedir(dir);
+                return;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                pending.push_back(path);
+            }
+        }
+        closedir(dir);
+    }
+}
+
+bool listTree(session &sess, const string &arg, string &root, fdhandle &root_fd, vector<treeentry> &entries,
+              reply &err) {
+    root = resolvePath(sess, arg).string();
+    root_fd.reset(openBeneath(sess, arg, O_PATH | O_DIRECTORY));
+    if (root_fd.get() == -1 && errno == ENOTDIR) {
+        err = {FRAME_ERROR, "Error: Specified path is not a directory."};
+        return false;
+    }
+    if (root_fd.get() == -1) {
+        err = {FRAME_ERROR, "Error: File or directory does not exist or access denied."};
+        return false;
+    }
+
+    vector<treeentry> files;
+    visitTree(indexPath(sess, arg), root_fd.get(), [&](const string &path, const indexentry &e) {
+        treeentry t;
+        t.path = path;
+        t.mtime = e.mtime;
+        t.inode = e.inode;
+        if (e.kind == 'D') {
+            t.directory = true;
+            entries.push_back(t);
+        } else if (e.kind == 'F' && hasAllowedExtension(path)) {
+            t.size = e.size;
+            files.push_back(t);
+        }
+        return true;
+    });
+
+    sort(files.begin(), files.end(), [](const treeentry &a, const treeentry &b) { return a.inode < b.inode; });
+    entries.insert(entries.end(), files.begin(), files.end());
+    return true;
+}
+
+/*************************************************************/
+/* struct: findbound                                        */
+/* purpose: A "-size" or "-mtime" test of find, written as  */
+/*          find(1) writes it: "+N" for more than N, "-N"   */
+/*          for less and "N" for exactly N.                 */
+/*************************************************************/
+struct findbound {
+    char relation = 0; // '+', '-' or '='; 0 when not given
+    uint64_t value = 0;
+    uint64_t unit = 1; // the value is counted in these, rounded up
+
+    bool holds(uint64_t amount) const {
+        uint64_t units = amount / unit + (amount % unit != 0);
+        return relation == 0 || (relation == '+' ? units > value : relation == '-' ? units < value : units == value);
+    }
+};
+
+/*************************************************************/
+/* function: parseBound                                     */
+/* purpose: Parses the argument of "-size" (bytes, or with  */
+/*          a k, M or G suffix) or "-mtime" (days).         */
+/* return: false if text is not such an argument.           */
+/*************************************************************/
+static bool parseBound(const string &text, bool sized, findbound &bound) {
+    string digits = text;
+    bound.relation = '=';
+    if (!digits.empty() && (digits[0] == '+' || digits[0] == '-')) {
+        bound.relation = digits[0];
+        digits.erase(0, 1);
+    }
+    size_t suffix = sized && !digits.empty() ? string("kMG").find(digits.back()) : string::npos;
+    if (suffix != string::npos) {
+        bound.unit = uint64_t(1) << (10 * (suffix + 1));
+        digits.pop_back();
+    }
+    return parseNumber(digits, bound.value);
+}
+
+bool openFind(session &sess, const command &c, findwalk &walk, reply &err) {
+    string pattern;
+    char type = 0;
+    findbound size, age;
+    size_t i = 0;
+    for (; i < c.args.size() && c.args[i].size() > 1 && c.args[i][0] == '-'; ++i) {
+        const string &option = c.args[i];
+        const string &value = c.arg(i + 1);
+        if (option == "-name" && !value.empty()) {
+            pattern = value;
+            ++i;
+        } else if (option == "-type" && (value == "f" || value == "d")) {
+            type = value == "f" ? 'F' : 'D';
+            ++i;
+        } else if (option == "-size" && parseBound(value, true, size)) {
+            ++i;
+        } else if (option == "-mtime" && parseBound(value, false, age)) {
+            ++i;
+        } else {
+            err = {FRAME_ERROR,
+                   "Error: Usage: find [-name pattern] [-type f|d] [-size [+|-]N[k|M|G]] [-mtime [+|-]days] [path]"};
+            return false;
+        }
+    }
+    const string &arg = c.arg(i);
+    fdhandle root_fd(openBeneath(sess, arg, O_PATH | O_DIRECTORY));
+    if (root_fd.get() == -1) {
+        err = {FRAME_ERROR, errno == ENOTDIR ? "Error: Specified path is not a directory."
+                                             : "Error: Path does not exist or access denied."};
+        return false;
+    }
+
+    // Paths are printed the way they were asked for, like find(1)
+    string prefix = arg.empty() ? "" : arg.back() == '/' ? arg : arg + "/";
+    string indexed = indexPath(sess, arg);
+    int64_t now = time(nullptr);
+    walk.start(move(root_fd), [=](int root, const atomic<bool> &stopping, const function<bool(string &)> &emit) {
+        string chunk;
+        bool sending = true;
+        visitTree(indexed, root, [&](const string &path, const indexentry &e) {
+            if (stopping) {
+                return false;
+            }
+            size_t slash = path.rfind('/');
+            const char *name = path.c_str() + (slash == string::npos ? 0 : slash + 1);
+            if ((type != 0 && e.kind != type) || (!pattern.empty() && fnmatch(pattern.c_str(), name, 0) != 0) ||
+                !size.holds(e.size) || !age.holds(now > e.mtime ? (now - e.mtime) / 86400 : 0)) {
+                return true;
+            }
+            string line = string(e.kind == 'D' ? "DIR " : e.kind == 'F' ? "FILE " : "OTHER ") +
+                          to_string(e.size) + " " + to_string(e.mtime) + " " + prefix + path + "\n";
+            if (chunk.size() + line.size() > MAX_TEXT_FRAME) {
+                sending = emit(chunk);
+                chunk.clear();
+            }
+            chunk += line;
+            return sending;
+        });
+        if (sending && !chunk.empty()) {
+            emit(chunk);
+        }
+    });
+    return true;
+}
+
+void findwalk::start(fdhandle dir, walker walk) {
+    finish();
+    root = move(dir);
+    stopping = false;
+    results.reset(new workqueue<string>(FIND_QUEUE_FRAMES));
+    results->notify(notify_fd);
+    worker = thread([this, walk]() {
+        walk(root.get(), stopping, [this](string &text) { return results->push(move(text)); });
+        results->close();
+    });
+}
+
+bool findwalk::next(string &text) {
+    text.clear();
+    if (!results) {
+        return false;
+    }
+    if (!results->pop(text)) {
+        finish();
+        return false;
+    }
+    return true;
+}
+
+bool findwalk::trynext(string &text, bool &more) {
+    text.clear();
+    more = false;
+    if (!results) {
+        return true;
+    }
+    if (!results->trypop(text)) {
+        if (!results->finished()) {
+            return false;
+        }
+        finish();
+        return true;
+    }
+    more = true;
+    return true;
+}
+
+void findwalk::finish() {
+    stopping = true;
+    if (results) {
+        results->close();
+    }
+    if (worker.joinable()) {
+        worker.join();
+    }
+    results.reset();
+    root.reset();
+}
+
+bool openSearch(session &sess, const command &c, textsearch &search, reply &err) {
+    const reply usage = {FRAME_ERROR, "Error: Usage: grep [-F] [-i] [-n] [-c|-l] pattern [path]"};
+    searchoptions options;
+    size_t i = 0;
+    for (; i < c.args.size() && c.args[i].size() > 1 && c.args[i][0] == '-'; ++i) {
+        const string &option = c.args[i];
+        if (option == "--") {
+            ++i;
+            break;
+        } else if (option == "-F") {
+            options.fixed = true;
+        } else if (option == "-i") {
+            options.ignore_case = true;
+        } else if (option == "-n") {
+            options.numbers = true;
+        } else if (option == "-c") {
+            options.count = true;
+        } else if (option == "-l") {
+            options.names = true;
+        } else {
+            err = usage;
+            return false;
+        }
+    }
+    options.pattern = c.arg(i);
+    if (options.pattern.empty() || (options.count && options.names)) {
+        err = usage;
+        return false;
+    }
+
+    // Paths are shown the way they were asked for, like find
+    const string &arg = c.arg(i + 1);
+    string prefix;
+    vector<pair<uint64_t, string>> found;
+    fdhandle root(openBeneath(sess, arg, O_PATH | O_DIRECTORY));
+    if (root.get() != -1) {
+        prefix = arg.empty() ? "" : arg.back() == '/' ? arg : arg + "/";
+        visitTree(indexPath(sess, arg), root.get(), [&](const string &path, const indexentry &e) {
+            if (e.kind == 'F' && hasAllowedExtension(path)) {
+                found.emplace_back(e.inode, path);
+            }
+            return true;
+        });
+    } else if (errno == ENOTDIR) {
+        location target;
+        if (!hasAllowedExtension(arg)) {
+            err = {FRAME_ERROR, "Error: Unsupported file type."};
+            return false;
+        }
+        if (!locateFile(sess, arg, target)) {
+            err = {FRAME_ERROR, "Error: Path does not exist or access denied."};
+            return false;
+        }
+        root = move(target.dir);
+        prefix = arg.substr(0, arg.rfind('/') + 1);
+        found.emplace_back(0, target.name);
+    } else {
+        err = {FRAME_ERROR, "Error: Path does not exist or access denied."};
+        return false;
+    }
+
+    // Files are handed out in roughly on-disk order, as a recursive get sends them
+    sort(found.begin(), found.end());
+    vector<string> files;
+    files.reserve(found.size());
+    for (auto &f : found) {
+        files.push_back(move(f.second));
+    }
+    string error;
+    if (!search.start(move(root), move(files), prefix, options, error)) {
+        err = {FRAME_ERROR, "Error: Invalid pattern: " + error};
+        return false;
+    }
+    return true;
+}
+
+vector<string> formatManifest(const vector<treeentry> &entries) {
+    vector<string> chunks;
+    string chunk;
+    for (const auto &e : entries) {
+        string line = string(e.directory ? "DIR " : "FILE ") + to_string(e.size) + " " + to_string(e.mtime) +
+                      " " + e.path + "\n";
+        if (chunk.size() + line.size() > MAX_TEXT_FRAME) {
+            chunks.push_back(chunk);
+            chunk.clear();
+        }
+        chunk += line;
+    }
+    if (!chunk.empty()) {
+        chunks.push_back(chunk);
+    }
+    return chunks;
+}
+
+int openTreeFile(const string &root, int root_fd, const treeentry &e, string &path, uint64_t &size, reply &err) {
+    path = root + "/" + e.path;
+    int fd = openbeneath(root_fd, e.path, O_RDONLY | O_NOFOLLOW);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        err = {FRAME_ERROR, "Error: Cannot read " + e.path};
+        return -1;
+    }
+    size = st.st_size;
+    return fd;
+}
+
+treeitem nextTreeItem(const string &root, int root_fd, const vector<treeentry> &entries, size_t &next,
+                      bool bundling) {
+    treeitem item;
+    string bundle;
+    while (next < entries.size()) {
+        const treeentry &e = entries[next];
+        if (e.directory) {
+            next++;
+            continue;
+        }
+
+        reply err;
+        int fd = openTreeFile(root, root_fd, e, item.path, item.size, err);
+        bool small = bundling && fd != -1 && item.size <= BUNDLE_FILE_MAX;
+        if (small && addfile(bundle, e.path, fd, item.size)) {
+            close(fd);
+            next++;
+            if (bundle.size() >= BUNDLE_TARGET) {
+                break;
+            }
+            continue;
+        }
+
+        // Anything that is not bundled goes after the bundle so far; the
+        // entry is opened again on the next call
+        if (!bundle.empty()) {
+            if (fd != -1) {
+                close(fd);
+            }
+            break;
+        }
+        next++;
+        if (fd == -1 || small) {
+            if (fd != -1) {
+                close(fd); // a small file that could not be read in full
+            }
+            item.kind = treeitemkind::FAILED;
+            item.text = fd == -1 ? err.text : "Error: Cannot read " + e.path;
+            return item;
+        }
+        item.kind = treeitemkind::SENDFILE;
+        item.fd = fd;
+        return item;
+    }
+
+    if (!bundle.empty()) {
+        item.kind = treeitemkind::BUNDLE;
+        item.text = move(bundle);
+    }
+    return item;
+}
+
+bool openBundle(session &sess, const string &arg, bundlewriter &w, reply &err) {
+    fs::path root_path = resolvePath(sess, arg);
+    w.root = root_path.string();
+    w.relative = root_path.lexically_relative(resolvePath(sess, "/")).string();
+    if (!arg.empty()) {
+        w.root_fd.reset(openBeneath(sess, arg, O_PATH | O_DIRECTORY));
+    }
+    if (w.root_fd.get() == -1) {
+        err = {FRAME_ERROR, "Error: Directory does not exist or access denied."};
+        return false;
+    }
+    w.open = true;
+    return true;
+}
+
+void storeBundle(bundlewriter &w, const string &payload) {
+    for (const auto &record : parsebundle(payload)) {
+        fs::path relative(record.path);
+        string error;
+        if (relative.empty() || relative.is_absolute() ||
+            find(relative.begin(), relative.end(), fs::path("..")) != relative.end()) {
+            error = "invalid path";
+        } else if (!hasAllowedExtension(relative)) {
+            error = "unsupported file type";
+        } else if (isStorePath((fs::path(w.relative) / relative).lexically_normal())) {
+            error = "access denied";
+        }
+
+        string parent = relative.parent_path().string();
+        string name = relative.filename().string();
+        auto found = w.parents.find(parent);
+        if (error.empty() && found == w.parents.end()) {
+            fdhandle dir(openbeneath(w.root_fd.get(), parent, O_PATH | O_DIRECTORY));
+            if (dir.get() != -1) {
+                found = w.parents.emplace(parent, move(dir)).first;
+            } else {
+                error = isDenied(errno) ? "access denied" : "cannot create file";
+            }
+        }
+
+        if (error.empty()) {
+            int fd = openunshared(found->second.get(), name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, false);
+            size_t done = 0;
+            while (fd != -1 && done < record.size) {
+                ssize_t written = write(fd, record.data + done, record.size - done);
+                if (written == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (written <= 0) {
+                    break;
+                }
+                done += written;
+            }
+            if (fd == -1 || done < record.size) {
+                error = fd == -1 ? "cannot create file" : "writing to file failed";
+            }
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+
+        if (error.empty() && storeenabled()) {
+            sha256 content;
+            content.update(record.data, record.size);
+            storecontent(found->second.get(), name, content.digest());
+        }
+        if (error.empty()) {
+            w.stored++;
+        } else {
+            if (w.failed++ == 0) {
+                w.first_error = record.path + ": " + error;
+            }
+        }
+    }
+}
+
+reply finishBundle(const bundlewriter &w) {
+    if (w.failed == 0) {
+        return {FRAME_RESP, "Bundle stored: " + to_string(w.stored) + " files."};
+    }
+    return {FRAME_ERROR, "Error: " + to_string(w.failed) + " of " + to_string(w.stored + w.failed) +
+                             " bundled files failed; first: " + w.first_error};
+}
+
+bool openSync(session &sess, const command &c, syncwriter &w, string &header, string &signatures, reply &err) {
+    fs::path target_path = resolvePath(sess, c.arg(0));
+    w.path = target_path.string();
+
+    if (c.arg(0).empty() || (!locateFile(sess, c.arg(0), w.target) && isDenied(errno))) {
+        err = {FRAME_ERROR, "Error: Access denied."};
+        return false;
+    }
+    if (!hasAllowedExtension(target_path)) {
+        err = {FRAME_ERROR, "Error: Unsupported file type."};
+        return false;
+    }
+    if (w.target.dir.get() == -1) {
+        err = {FRAME_ERROR, "Error: Cannot create file."};
+        return false;
+    }
+
+    // A target that does not exist yet is synced from an empty basis
+    uint64_t size = 0;
+    mode_t mode = 0644;
+    w.basis_fd = openat(w.target.dir.get(), w.target.name.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (w.basis_fd == -1 && errno != ENOENT) {
+        err = {FRAME_ERROR, "Error: File not found."};
+        return false;
+    }
+    if (w.basis_fd != -1) {
+        struct stat st;
+        if (fstat(w.basis_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            abortSync(w);
+            err = {FRAME_ERROR, "Error: Specified path is not a file."};
+            return false;
+        }
+        fcntl(w.basis_fd, F_SETFL, 0);
+        size = st.st_size;
+        mode = st.st_mode & 07777;
+    }
+
+    w.block = syncblocksize(size);
+    w.blocks = size / w.block;
+    if (w.basis_fd != -1 && !signfile(w.basis_fd, size, w.block, signatures)) {
+        abortSync(w);
+        err = {FRAME_ERROR, "Error: Reading file failed."};
+        return false;
+    }
+
+    // The new copy is built next to the old one so the rename that
+    // replaces it stays on one filesystem and is atomic
+    w.temp_fd = createtemp(w.target.dir.get(), w.target.name, "sync", w.temp_name);
+    if (w.temp_fd == -1) {
+        w.temp_name.clear();
+        abortSync(w);
+        err = {FRAME_ERROR, "Error: Cannot create file."};
+        return false;
+    }
+    fchmod(w.temp_fd, mode);
+
+    header = "SIGNATURE " + to_string(w.block) + " " + to_string(size) + " " + to_string(w.blocks);
+    return true;
+}
+
+void applySync(syncwriter &w, const char *data, size_t size) {
+    if (w.failed) {
+        return;
+    }
+    if (!applydelta(data, size, w.basis_fd, w.temp_fd, w.block, w.blocks, w.offset, w.stats)) {
+        w.failed = true;
+    }
+}
+
+reply finishSync(syncwriter &w) {
+    uint64_t digest = 0;
+    if (w.failed || !hashfile(w.temp_fd, 0, w.offset, digest) ||
+        renameat(w.target.dir.get(), w.temp_name.c_str(), w.target.dir.get(), w.target.name.c_str()) == -1) {
+        abortSync(w);
+        return {FRAME_ERROR, "Error: Writing to file failed."};
+    }
+    w.temp_name.clear();
+    abortSync(w);
+    cout << "File synced: " << w.path << endl;
+    return {FRAME_RESP, "Synced: " + to_string(w.stats.copied) + " bytes reused, " + to_string(w.stats.literal) +
+                            " bytes received, checksum " + tohex(digest)};
+}
+
+void abortSync(syncwriter &w) {
+    if (w.basis_fd != -1) {
+        close(w.basis_fd);
+        w.basis_fd = -1;
+    }
+    if (w.temp_fd != -1) {
+        close(w.temp_fd);
+        w.temp_fd = -1;
+    }
+    if (!w.temp_name.empty()) {
+        unlinkat(w.target.dir.get(), w.temp_name.c_str(), 0);
+        w.temp_name.clear();
+    }
+}
@@ -0,0 +1,658 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: commands.h                                      */
+/* purpose: this header file declares the server's command   */
+/*          core: path resolution inside the base directory  */
+/*          and execution of client commands for one session.*/
+/*          it does no socket I/O of its own, so the fork    */
+/*          mode handler and the epoll reactor can both      */
+/*          drive it and only differ in how bytes move.      */
+/*************************************************************/
+
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "delta.h"
+#include "listing.h"
+#include "sandbox.h"
+#include "search.h"
+#include "tuning.h"
+#include "workqueue.h"
+
+class sha256;
+
+// Directory the server is allowed to serve
+extern std::string base_directory;
+
+// File extensions that may be uploaded or downloaded
+extern const std::vector<std::string> ALLOWED_EXTENSIONS;
+
+/*************************************************************/
+/* struct: session                                           */
+/* purpose: per-client state kept between commands. every    */
+/*          file the client names is opened relative to one  */
+/*          of the two directory descriptors.                */
+/*************************************************************/
+struct session {
+    std::string current_directory; // as pwd shows it
+    fdhandle base_fd;              // the base directory (O_PATH)
+    fdhandle cwd_fd;               // the current directory (O_PATH)
+    bool compress = false;         // downloads are compressed (negotiated with "compress")
+};
+
+/*************************************************************/
+/* struct: location                                          */
+/* purpose: a file a command creates or replaces, as the     */
+/*          directory it is in and its name there, so the    */
+/*          file, its temporaries and renames all stay in    */
+/*          the directory that was resolved.                 */
+/*************************************************************/
+struct location {
+    fdhandle dir;     // the directory (O_PATH)
+    std::string name; // the file's name in it
+};
+
+/*************************************************************/
+/* struct: command                                           */
+/* purpose: a command line split into its words.             */
+/*************************************************************/
+struct command {
+    std::string cmd;
+    std::vector<std::string> args;
+
+    // Returns argument i, or an empty string if it was not given
+    const std::string &arg(size_t i) const {
+        static const std::string none;
+        return i < args.size() ? args[i] : none;
+    }
+};
+
+/*************************************************************/
+/* struct: reply                                             */
+/* purpose: a text answer to a command. type is FRAME_RESP   */
+/*          or FRAME_ERROR.                                  */
+/*************************************************************/
+struct reply {
+    uint8_t type;
+    std::string text;
+};
+
+/*************************************************************/
+/* struct: treeentry                                         */
+/* purpose: one directory or file found by a recursive get.  */
+/*************************************************************/
+struct treeentry {
+    bool directory = false;
+    std::string path;   // relative to the root of the tree
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    uint64_t inode = 0;
+};
+
+/*************************************************************/
+/* enum: treeitemkind                                        */
+/* purpose: what nextTreeItem produced.                      */
+/*************************************************************/
+enum class treeitemkind {
+    DONE,     // every file has been sent
+    BUNDLE,   // text holds a BUNDLE payload of small files
+    SENDFILE, // fd/path/size describe a file to send as DATA+END
+    FAILED    // text holds the error for a file that cannot be read
+};
+
+/*************************************************************/
+/* struct: treeitem                                          */
+/* purpose: the next thing to send for a recursive get.      */
+/*************************************************************/
+struct treeitem {
+    treeitemkind kind = treeitemkind::DONE;
+    std::string text;
+    int fd = -1;
+    std::string path;
+    uint64_t size = 0;
+};
+
+/*************************************************************/
+/* struct: bundlewriter                                      */
+/* purpose: state of a "put -B" upload, which unpacks BUNDLE */
+/*          frames into files below one directory.           */
+/*************************************************************/
+struct bundlewriter {
+    std::string root;      // directory the records are relative to
+    std::string relative;  // the same, relative to the base directory
+    fdhandle root_fd;      // the same, opened (O_PATH)
+    bool open = false;     // root was accepted
+    size_t stored = 0;
+    size_t failed = 0;
+    std::string first_error;
+    std::unordered_map<std::string, fdhandle> parents; // parent directories already opened
+};
+
+/*************************************************************/
+/* struct: syncwriter                                        */
+/* purpose: state of a "sync" upload, which rebuilds a file  */
+/*          from the old copy and a delta into a temporary   */
+/*          file that replaces it when complete.             */
+/*************************************************************/
+struct syncwriter {
+    std::string path;      // the file being synced
+    location target;       // the same, as opened
+    std::string temp_name; // where it is rebuilt, next to it
+    int basis_fd = -1;     // the old copy (-1 if there was none)
+    int temp_fd = -1;
+    uint32_t block = 0;
+    uint64_t blocks = 0;   // signed blocks of the old copy
+    uint64_t offset = 0;   // bytes rebuilt so far
+    deltastats stats;
+    bool failed = false;   // a write failed; the rest is only drained
+};
+
+/*************************************************************/
+/* function: startSession                                   */
+/* purpose: Opens the base directory for a new session and  */
+/*          makes it the current directory. throws if the   */
+/*          base directory cannot be opened.                */
+/* parameters:                                              */
+/*    - sess: the session to set up.                        */
+/*************************************************************/
+void startSession(session &sess);
+
+/*************************************************************/
+/* function: openBeneath                                    */
+/* purpose: Opens a path argument without leaving the base  */
+/*          directory; the kernel resolves it (see          */
+/*          sandbox.h), so nothing can swap a component for */
+/*          a symlink between a check and the open. a path  */
+/*          without ".." is opened from the current         */
+/*          directory's descriptor, anything else from the  */
+/*          base's. the content store cannot be named.      */
+/* parameters:                                              */
+/*    - sess: the client's session.                         */
+/*    - arg: the path argument from the client.             */
+/*    - flags: open(2) flags.                               */
+/*    - mode: the mode of a file created with O_CREAT.      */
+/* return: the descriptor, or -1 with errno set.            */
+/*************************************************************/
+int openBeneath(const session &sess, const std::string &arg, int flags, mode_t mode = 0);
+
+/*************************************************************/
+/* function: locateFile                                     */
+/* purpose: Opens the directory a path argument names an    */
+/*          entry in, the way openBeneath opens the path.   */
+/* parameters:                                              */
+/*    - sess: the client's session.                         */
+/*    - arg: the path argument from the client.             */
+/*    - target: receives the directory and the name.        */
+/* return: false with errno set if the directory cannot be  */
+/*         opened or the path names no entry.               */
+/*************************************************************/
+bool locateFile(const session &sess, const std::string &arg, location &target);
+
+/*************************************************************/
+/* function: resolvePath                                    */
+/* purpose: Turns a path argument into a server path. A     */
+/*          leading "/" is relative to the base directory,  */
+/*          anything else to the session's current one.     */
+/* parameters:                                              */
+/*    - sess: the client's session.                         */
+/*    - arg: the path argument from the client.             */
+/*************************************************************/
+std::filesystem::path resolvePath(const session &sess, const std::string &arg);
+
+/*************************************************************/
+/* function: virtualPath                                    */
+/* purpose: Returns a path as the client sees it, relative  */
+/*          to the base directory and starting with "/".    */
+/*          The path is taken as written, as resolvePath    */
+/*          builds it; openBeneath already decided that it  */
+/*          stays inside the base.                          */
+/* parameters:                                              */
+/*    - path: a path from resolvePath.                      */
+/*************************************************************/
+std::string virtualPath(const std::filesystem::path &path);
+
+/*************************************************************/
+/* function: parseNumber                                    */
+/* purpose: Parses an unsigned decimal argument.            */
+/* parameters:                                              */
+/*    - text: the argument.                                 */
+/*    - value: receives the number.                         */
+/* return: false if text is not a number.                   */
+/*************************************************************/
+bool parseNumber(const std::string &text, uint64_t &value);
+
+/*************************************************************/
+/* function: hasAllowedExtension                            */
+/* purpose: Checks if a file path has an allowed extension  */
+/* parameters:                                              */
+/*    - file_path: the file path to check.                  */
+/*************************************************************/
+bool hasAllowedExtension(const std::filesystem::path &file_path);
+
+/*************************************************************/
+/* function: parseCommand                                   */
+/* purpose: Splits a command line into command and args.   */
+/* parameters:                                              */
+/*    - line: the command line received from the client.    */
+/*************************************************************/
+command parseCommand(const std::string &line);
+
+/*************************************************************/
+/* function: takeOption                                     */
+/* purpose: Removes an option such as "-R" from the options */
+/*          in front of a command's other arguments.        */
+/* parameters:                                              */
+/*    - c: the command.                                     */
+/*    - option: the option to look for.                     */
+/* return: true if the option was given.                    */
+/*************************************************************/
+bool takeOption(command &c, const std::string &option);
+
+/*************************************************************/
+/* function: takeValue                                      */
+/* purpose: Removes an option that takes a value, such as   */
+/*          "-m version", from the options in front of a    */
+/*          command's other arguments.                      */
+/* parameters:                                              */
+/*    - c: the command.                                     */
+/*    - option: the option to look for.                     */
+/*    - value: receives the word after it.                  */
+/* return: true if the option was given with a value.       */
+/*************************************************************/
+bool takeValue(command &c, const std::string &option, std::string &value);
+
+/*************************************************************/
+/* function: runCommand                                     */
+/* purpose: Executes a command that is answered with a      */
+/*          single text reply (cd, pwd, mkdir, lmkdir, lls, */
+/*          stat, sum, compress, dedup, link, and unknown   */
+/*          commands).                                      */
+/* parameters:                                              */
+/*    - sess: the client's session.                         */
+/*    - c: the parsed command.                              */
+/* return: the reply to send.                               */
+/*************************************************************/
+reply runCommand(session &sess, const command &c);
+
+/*************************************************************/
+/* function: tuneLink                                       */
+/* purpose: Answers "tune [auto | <setting> <size> ...]".   */
+/*          With arguments, fixes sizes of the connection,  */
+/*          or returns them to its tuner (see tuning.h).    */
+/* parameters:                                              */
+/*    - tuner: the connection's tuner.                      */
+/*    - c: the parsed command.                              */
+/* return: the sizes in use, or the reason they were not    */
+/*         changed.                                         */
+/*************************************************************/
+reply tuneLink(linktuner &tuner, const command &c);
+
+/*************************************************************/
+/* function: openListing                                    */
+/* purpose: Parses "ls [-l] [-s name|size|mtime] [-r]       */
+/*          [-n count] [-c cursor] [path [pattern]]" and    */
+/*          starts listing the directory. The listing is    */
+/*          sent as RESP frames from listing.next, ended by */
+/*          an empty RESP.                                  */
+/* parameters:                                              */
+/*    - sess: the client's session.                         */
+/*    - c: the parsed ls command.                           */
+/*    - listing: the listing to start.                      */
+/*    - err: receives the error reply on failure.           */
+/* return: false if the directory cannot be listed.         */
+/*************************************************************/
+bool openListing(session &sess, const command &c, dirlisting &listing, reply &err);
+
+/*************************************************************/
+/* function: openForGet                                     */
+/* purpose: Validates a get request and opens the file. The */
+/*          command is "get path [offset [length]]"; a      */
+/*          missing or zero length means "to end of file".  */
+/* parameters:                                              */
+/*    - sess: the client's session.                         */
+/*    - c: the parsed get command.                          */
+/*    - path: receives the resolved path.                   */
+/*    - offset: receives the first byte to send.            */
+/*    - length: receives the number of bytes to send.       */
+/*    - err: receives the error reply on failure.           */
+/* return: an open read-only descriptor, or -1.             */
+/*************************************************************/
+int openForGet(session &sess, const command &c, std::string &path, uint64_t &offset, uint64_t &length,
+               reply &err);
+
+/*************************************************************/
+/* function: checkUnchanged                                 */
+/* purpose: Answers the -m of a conditional get. A file's   */
+/*          version is "size:mtime:ctime", the times in     */
+/*          nanoseconds. The client sends the version it    */
+/*          last received followed by ":" and the XXH64 of  */
+/*          its copy, or "none" when it has none. The copy  */
+/*          is current if the version still matches or,     */
+/*          after a touch or an identical rewrite, if the   */
+/*          file still has the same size and hash.          */
+/* parameters:                                              */
+/*    - fd: the file, opened by openForGet.                 */
+/*    - known: what the client sent.                        */
+/*    - version: receives the file's version now.           */
+/* return: true if the client's copy is current.            */
+/*************************************************************/
+bool checkUnchanged(int fd, const std::string &known, std::string &version);
+
+/*************************************************************/
+/* function: openForPut                                     */
+/* purpose: Validates a put request and creates the file.   */
+/*          "put path" replaces the file. "put path offset" */
+/*          resumes it: the file is cut to offset bytes and */
+/*          the upload is appended. "put path offset total" */
+/*          writes one range in place and sizes the file to */
+/*          total, so several connections can fill a file   */
+/*          together. a file shared with the content store  */
+/*          is detached before it is written. on failure    */
+/*          the caller still has to consume the upload      */
+/*          stream before sending err.                      */
+/* parameters:                                              */
+/*    - sess: the client's session.                         */
+/*    - c: the parsed put command.                          */
+/*    - path: receives the resolved path.                   */
+/*    - target: receives where the file was created.        */
+/*    - offset: receives where the upload starts.           */
+/*    - ranged: set for a range write. a failed range must  */
+/*              not delete the file the other ranges share. */
+/*    - err: receives the error reply on failure.           */
+/* return: an open write-only descriptor, or -1.            */
+/*************************************************************/
+int openForPut(session &sess, const command &c, std::string &path, location &target, uint64_t &offset,
+               bool &ranged, reply &err);
+
+/*************************************************************/
+/* function: hashesUpload                                   */
+/* purpose: Tells whether a put's bytes should be hashed as */
+/*          they land: the content store is on and the put  */
+/*          writes the whole file from the start.           */
+/* parameters:                                              */
+/*    - c: the parsed put command.                          */
+/*    - offset: where the upload starts (from openForPut).  */
+/*************************************************************/
+bool hashesUpload(const command &c, uint64_t offset);
+
+/*************************************************************/
+/* function: finishPut                                      */
+/* purpose: Builds the reply for a put that arrived intact  */
+/*          and hands a whole-file upload to the content    */
+/*          store.                                          */
+/* parameters:                                              */
+/*    - path: the uploaded file.                            */
+/*    - target: where it was created (from openForPut).     */
+/*    - content: the SHA-256 of its bytes, or null when the */
+/*               upload was not hashed.                     */
+/*************************************************************/
+reply finishPut(const std::string &path, const location &target, const sha256 *content);
+
+/*************************************************************/
+/* function: discardPut                                     */
+/* purpose: Removes the file of a put that failed.          */
+/* parameters:                                              */
+/*    - target: where it was created (from openForPut).     */
+/*************************************************************/
+void discardPut(const location &target);
+
+/*************************************************************/
+/* function: listTree                                       */
+/* purpose: Walks a directory for "get -R". Directories are */
+/*          listed first, parents before children, and then */
+/*          the files sorted by inode number so they can be */
+/*          read back in roughly on-disk order. Symlinks and */
+/*          files with other extensions are skipped. The    */
+/*          tree index answers instead of the disk when it  */
+/*          is current.                                     */
+/* parameters:                                              */
+/*    - sess: the client's session.                         */
+/*    - arg: the directory argument.                        */
+/*    - root: receives the resolved directory.              */
+/*    - root_fd: receives the directory, opened; the files  */
+/*               are opened relative to it.                 */
+/*    - entries: receives the directories and files.        */
+/*    - err: receives the error reply on failure.           */
+/* return: false if the directory cannot be listed.         */
+/*************************************************************/
+bool listTree(session &sess, const std::string &arg, std::string &root, fdhandle &root_fd,
+              std::vector<treeentry> &entries, reply &err);
+
+// Frames of find results that may wait for the client
+constexpr size_t FIND_QUEUE_FRAMES = 4;
+
+/*************************************************************/
+/* class: findwalk                                           */
+/* purpose: a find in progress. the tree is walked on a      */
+/*          thread of its own, which hands the results over  */
+/*          a frame at a time through a short queue and      */
+/*          waits while it is full, so neither a large tree  */
+/*          nor a slow client holds up the caller, and only  */
+/*          a few frames are ever kept.                      */
+/*************************************************************/
+class findwalk {
+  public:
+    // Walks the tree below root_fd, handing each frame to emit, until emit returns false or stopping is set
+    using walker = std::function<void(int root_fd, const std::atomic<bool> &stopping,
+                                      const std::function<bool(std::string &)> &emit)>;
+
+    findwalk() = default;
+    findwalk(const findwalk &) = delete;
+    findwalk &operator=(const findwalk &) = delete;
+    ~findwalk() { finish(); }
+
+    /*************************************************************/
+    /* function: start                                          */
+    /* purpose: starts the thread that walks the tree.          */
+    /* parameters:                                              */
+    /*    - root: the directory to walk (O_PATH). owned from    */
+    /*            now.                                          */
+    /*    - walk: produces the results.                         */
+    /*************************************************************/
+    void start(fdhandle root, walker walk);
+
+    /*************************************************************/
+    /* function: next                                           */
+    /* purpose: waits for the next frame of results.            */
+    /* parameters:                                              */
+    /*    - text: receives the frame; empty for the last call.  */
+    /* return: false once the walk is over.                     */
+    /*************************************************************/
+    bool next(std::string &text);
+
+    /*************************************************************/
+    /* function: trynext                                        */
+    /* purpose: next without waiting, for an event loop that    */
+    /*          gave notify an eventfd.                         */
+    /* parameters:                                              */
+    /*    - text: receives the frame; empty for the last one.   */
+    /*    - more: set to false with the last frame.             */
+    /* return: false if no frame is ready yet.                  */
+    /*************************************************************/
+    bool trynext(std::string &text, bool &more);
+
+    // Has later walks signal an eventfd when results are ready
+    void notify(int fd) { notify_fd = fd; }
+
+    // Whether a walk was started and next has not returned false yet
+    bool active() const { return results != nullptr; }
+
+    // Stops the walk, waiting for its thread
+    void finish();
+
+  private:
+    fdhandle root;
+    std::atomic<bool> stopping{false};
+    std::unique_ptr<workqueue<std::string>> results;
+    std::thread worker;
+    int notify_fd = -1;
+};
+
+/*************************************************************/
+/* function: openFind                                       */
+/* purpose: Parses "find [-name pattern] [-type f|d]        */
+/*          [-size [+|-]N[k|M|G]] [-mtime [+|-]days]        */
+/*          [path]" and starts walking the directory for    */
+/*          the entries that pass the tests. They are sent  */
+/*          as "DIR|FILE|OTHER size mtime path" lines, with */
+/*          the path as the client gave it, in RESP frames  */
+/*          from walk.next, ended by an empty RESP. The     */
+/*          walk reads the tree index when it is current.   */
+/* parameters:                                              */
+/*    - sess: the client's session.                         */
+/*    - c: the parsed find command.                         */
+/*    - walk: the walk to start.                            */
+/*    - err: receives the error reply on failure.           */
+/* return: false if the directory cannot be searched.       */
+/*************************************************************/
+bool openFind(session &sess, const command &c, findwalk &walk, reply &err);
+
+/*************************************************************/
+/* function: openSearch                                     */
+/* purpose: Parses "grep [-F] [-i] [-n] [-c|-l] pattern     */
+/*          [path]" and starts searching the .txt, .csv and */
+/*          .log files below the directory (or the one file */
+/*          named) for lines matching the extended regex.   */
+/*          The results are sent as RESP frames from        */
+/*          search.next, ended by an empty RESP.            */
+/* parameters:                                              */
+/*    - sess: the client's session.                         */
+/*    - c: the parsed grep command.                         */
+/*    - search: the search to start.                        */
+/*    - err: receives the error reply on failure.           */
+/* return: false if the path or the pattern is not valid.   */
+/*************************************************************/
+bool openSearch(session &sess, const command &c, textsearch &search, reply &err);
+
+/*************************************************************/
+/* function: formatManifest                                 */
+/* purpose: Renders tree entries as manifest text, one      */
+/*          "DIR|FILE size mtime path" line per entry, cut  */
+/*          into chunks that each fit in one text frame.    */
+/* parameters:                                              */
+/*    - entries: the entries from listTree.                 */
+/*************************************************************/
+std::vector<std::string> formatManifest(const std::vector<treeentry> &entries);
+
+/*************************************************************/
+/* function: openTreeFile                                   */
+/* purpose: Opens one file of a recursive get for sending.  */
+/* parameters:                                              */
+/*    - root: the tree root from listTree.                  */
+/*    - root_fd: its descriptor from listTree.              */
+/*    - e: the file entry.                                  */
+/*    - path: receives the full path.                       */
+/*    - size: receives the current file size.               */
+/*    - err: receives the error reply on failure.           */
+/* return: an open read-only descriptor, or -1.             */
+/*************************************************************/
+int openTreeFile(const std::string &root, int root_fd, const treeentry &e, std::string &path, uint64_t &size,
+                 reply &err);
+
+/*************************************************************/
+/* function: nextTreeItem                                   */
+/* purpose: Produces the next piece of a recursive get's    */
+/*          payload, in manifest order. With bundling on,   */
+/*          runs of small files are packed into one bundle. */
+/* parameters:                                              */
+/*    - root: the tree root from listTree.                  */
+/*    - root_fd: its descriptor from listTree.              */
+/*    - entries: the entries from listTree.                 */
+/*    - next: index of the next entry. advanced.            */
+/*    - bundling: whether small files may be bundled.       */
+/*************************************************************/
+treeitem nextTreeItem(const std::string &root, int root_fd, const std::vector<treeentry> &entries, size_t &next,
+                      bool bundling);
+
+/*************************************************************/
+/* function: openBundle                                     */
+/* purpose: Validates the directory of a "put -B" upload.   */
+/* parameters:                                              */
+/*    - sess: the client's session.                         */
+/*    - arg: the directory argument.                        */
+/*    - w: the writer to set up.                            */
+/*    - err: receives the error reply on failure.           */
+/* return: false if the upload must be rejected (the caller */
+/*         still consumes the stream).                      */
+/*************************************************************/
+bool openBundle(session &sess, const std::string &arg, bundlewriter &w, reply &err);
+
+/*************************************************************/
+/* function: storeBundle                                    */
+/* purpose: Writes every file of a BUNDLE payload. Each     */
+/*          parent directory is opened below the upload's   */
+/*          directory once per upload, not once per file.   */
+/*          throws if the payload is malformed.             */
+/* parameters:                                              */
+/*    - w: the writer from openBundle.                      */
+/*    - payload: the BUNDLE frame payload.                  */
+/*************************************************************/
+void storeBundle(bundlewriter &w, const std::string &payload);
+
+/*************************************************************/
+/* function: finishBundle                                   */
+/* purpose: Builds the reply for a finished "put -B".       */
+/* parameters:                                              */
+/*    - w: the writer.                                      */
+/*************************************************************/
+reply finishBundle(const bundlewriter &w);
+
+/*************************************************************/
+/* function: openSync                                       */
+/* purpose: Validates the target of a "sync", signs the     */
+/*          current copy and creates the temporary file the */
+/*          new one is rebuilt in. A missing target syncs   */
+/*          from nothing.                                   */
+/* parameters:                                              */
+/*    - sess: the client's session.                         */
+/*    - c: the parsed command (path).                       */
+/*    - w: the writer to set up.                            */
+/*    - header: receives the SIGNATURE response text.       */
+/*    - signatures: receives the packed block signatures.   */
+/*    - err: receives the error reply on failure.           */
+/* return: false if the sync must be rejected.              */
+/*************************************************************/
+bool openSync(session &sess, const command &c, syncwriter &w, std::string &header, std::string &signatures,
+              reply &err);
+
+/*************************************************************/
+/* function: applySync                                      */
+/* purpose: Applies one delta DATA frame. After a write     */
+/*          failure the rest of the delta is ignored.       */
+/*          throws if the delta is malformed.               */
+/* parameters:                                              */
+/*    - w: the writer from openSync.                        */
+/*    - data: the frame payload.                            */
+/*    - size: its length.                                   */
+/*************************************************************/
+void applySync(syncwriter &w, const char *data, size_t size);
+
+/*************************************************************/
+/* function: finishSync                                     */
+/* purpose: Moves the rebuilt file into place and builds    */
+/*          the reply, which carries its checksum so the    */
+/*          client can verify the result.                   */
+/* parameters:                                              */
+/*    - w: the writer.                                      */
+/*************************************************************/
+reply finishSync(syncwriter &w);
+
+/*************************************************************/
+/* function: abortSync                                      */
+/* purpose: Discards an unfinished sync, leaving the old    */
+/*          copy untouched. Safe to call more than once.    */
+/* parameters:                                              */
+/*    - w: the writer.                                      */
+/*************************************************************/
+void abortSync(syncwriter &w);
+
+#endif
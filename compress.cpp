@@ -0,0 +1,198 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: compress.cpp                                        */
+/* purpose: this source file implements the payload compression  */
+/*          declared in compress.h on top of zlib.               */
+/*****************************************************************/
+#include "compress.h"
+#include "protocol.h"
+#include "transfer.h"
+#include "workqueue.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <endian.h>
+#include <exception>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+#include <zlib.h>
+
+// Fastest zlib level: the point is to beat the link, not to win on size
+constexpr int DEFLATE_LEVEL = 1;
+
+// Chunks compressed ahead of the sender
+constexpr size_t COMPRESS_QUEUE_DEPTH = 4;
+
+// One chunk in this many goes the slower way, to keep measuring it
+constexpr unsigned PROBE_INTERVAL = 16;
+
+// Share of the old totals kept with each new sample
+constexpr double DECAY = 7.0 / 8;
+
+bool compressgate::wanted() {
+    // Measure both ways first
+    if (compressed_seconds == 0) {
+        return true;
+    }
+    if (raw_seconds == 0) {
+        return false;
+    }
+    bool faster = compressed_bytes / compressed_seconds > raw_bytes / raw_seconds;
+    return ++chunks % PROBE_INTERVAL == 0 ? !faster : faster;
+}
+
+void compressgate::record(bool compressed, uint64_t bytes, double seconds) {
+    if (compressed) {
+        compressed_bytes = compressed_bytes * DECAY + bytes;
+        compressed_seconds = compressed_seconds * DECAY + seconds;
+    } else {
+        raw_bytes = raw_bytes * DECAY + bytes;
+        raw_seconds = raw_seconds * DECAY + seconds;
+    }
+}
+
+bool deflatechunk(const char *data, size_t size, std::string &out) {
+    uLongf packed = compressBound(size);
+    out.resize(4 + packed);
+    uint32_t length = htobe32(static_cast<uint32_t>(size));
+    std::memcpy(&out[0], &length, sizeof(length));
+    if (compress2(reinterpret_cast<Bytef *>(&out[4]), &packed, reinterpret_cast<const Bytef *>(data), size,
+                  DEFLATE_LEVEL) != Z_OK) {
+        return false;
+    }
+    out.resize(4 + packed);
+    return out.size() < size;
+}
+
+void inflatechunk(const char *data, size_t size, std::string &out) {
+    uint32_t length;
+    if (size < sizeof(length)) {
+        throw std::runtime_error("Truncated compressed frame");
+    }
+    std::memcpy(&length, data, sizeof(length));
+    length = be32toh(length);
+    if (length > MAX_COMPRESSED_FRAME) {
+        throw std::runtime_error("Compressed frame inflates beyond the maximum size");
+    }
+
+    out.resize(length);
+    uLongf restored = length;
+    if (uncompress(reinterpret_cast<Bytef *>(&out[0]), &restored, reinterpret_cast<const Bytef *>(data + 4),
+                   size - 4) != Z_OK ||
+        restored != length) {
+        throw std::runtime_error("Corrupt compressed frame");
+    }
+}
+
+// One DATA frame prepared by the compression worker
+struct outchunk {
+    uint64_t offset = 0;
+    uint64_t size = 0;       // uncompressed size
+    bool attempted = false;  // compression was tried
+    bool compressed = false;
+    std::string payload;     // empty if the range goes out zero-copy
+};
+
+/*************************************************************/
+/* function: seconds                                        */
+/* purpose: time elapsed since start.                       */
+/*************************************************************/
+static double seconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void sendcompressed(mysock &s, uint32_t reqid, int fd, uint64_t offset, uint64_t length) {
+    posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+
+    compressgate gate;
+    std::mutex gate_lock;
+    integritysums sums(offset); // only touched by the worker until it is joined
+    workqueue<outchunk> chunks(COMPRESS_QUEUE_DEPTH);
+    std::exception_ptr failure;
+
+    // Read and compress ahead on a worker while this thread sends. Chunks
+    // that are not to be compressed are not read: they are sent zero-copy
+    std::thread worker([&]() {
+        try {
+            std::string raw;
+            while (length > 0) {
+                outchunk chunk;
+                chunk.offset = offset;
+                chunk.size = length < COMPRESS_CHUNK ? length : COMPRESS_CHUNK;
+                {
+                    std::lock_guard<std::mutex> guard(gate_lock);
+                    chunk.attempted = gate.wanted();
+                }
+                offset += chunk.size;
+                length -= chunk.size;
+                if (!chunk.attempted) {
+                    // Summed here, off the sending thread, though not sent from here
+                    if (!sums.readfile(fd, offset)) {
+                        throw std::runtime_error("File ended before the announced length");
+                    }
+                    if (!chunks.push(std::move(chunk))) {
+                        break; // the sender gave up
+                    }
+                    continue;
+                }
+
+                size_t want = chunk.size;
+                raw.resize(want);
+                size_t got = 0;
+                while (got < want) {
+                    ssize_t n = pread(fd, &raw[got], want - got, chunk.offset + got);
+                    if (n == -1 && errno == EINTR) {
+                        continue;
+                    }
+                    if (n <= 0) {
+                        throw std::runtime_error("File ended before the announced length");
+                    }
+                    got += n;
+                }
+
+                sums.update(raw.data(), raw.size());
+                chunk.compressed = deflatechunk(raw.data(), raw.size(), chunk.payload);
+                if (!chunk.compressed) {
+                    chunk.payload.swap(raw);
+                }
+                if (!chunks.push(std::move(chunk))) {
+                    break;
+                }
+            }
+        } catch (...) {
+            failure = std::current_exception();
+        }
+        chunks.close();
+    });
+
+    try {
+        // The time between two sends covers every stage the chunk went
+        // through: reading, compressing, sending and the receiver's pace
+        outchunk chunk;
+        auto last = std::chrono::steady_clock::now();
+        while (chunks.pop(chunk)) {
+            if (chunk.payload.empty()) {
+                sendfileframe(s, reqid, fd, chunk.offset, chunk.size);
+            } else {
+                sendframe(s, FRAME_DATA, reqid, chunk.payload.data(), chunk.payload.size(),
+                          chunk.compressed ? FLAG_COMPRESSED : 0);
+            }
+            std::lock_guard<std::mutex> guard(gate_lock);
+            gate.record(chunk.attempted, chunk.size, seconds(last));
+            last = std::chrono::steady_clock::now();
+        }
+    } catch (...) {
+        chunks.close();
+        worker.join();
+        throw;
+    }
+    worker.join();
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    std::string digest = sums.digest();
+    sendframe(s, FRAME_END, reqid, digest.data(), digest.size());
+}
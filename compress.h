@@ -0,0 +1,121 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: compress.h                                      */
+/* purpose: this header file declares on-the-fly compression */
+/*          of file payloads. a compressed transfer is sent  */
+/*          as a series of DATA frames flagged               */
+/*          FLAG_COMPRESSED, each holding one independently  */
+/*          deflated chunk, so the receiver can inflate and  */
+/*          write every frame as it arrives. the sender      */
+/*          compresses on a worker thread while the previous */
+/*          chunk is on the wire, and a compressgate keeps   */
+/*          measuring both sides so chunks go out raw when   */
+/*          sending them raw gets the data across faster.    */
+/*************************************************************/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "socket.h"
+
+// Uncompressed bytes per compressed DATA frame
+constexpr size_t COMPRESS_CHUNK = 256 << 10;
+
+// Upper bound for a compressed frame and for what it may inflate to,
+// so a corrupt header cannot make the receiver allocate unbounded memory
+constexpr uint64_t MAX_COMPRESSED_FRAME = 2 << 20;
+
+// Name of the only method offered in the "compress" negotiation
+const std::string COMPRESSION_METHOD = "deflate";
+
+/*************************************************************/
+/* class: compressgate                                       */
+/* purpose: decides chunk by chunk whether compressing pays  */
+/*          off. it measures the file bytes per second that  */
+/*          get across either way, over the whole path: the  */
+/*          compressor, the link and the receiver. sends are */
+/*          bursty, so the rates come from decaying totals   */
+/*          over many chunks rather than per chunk averages. */
+/*          the faster way is used, and every few chunks the */
+/*          other one is tried again so a change in the link */
+/*          or the data is noticed. not thread safe.         */
+/*************************************************************/
+class compressgate {
+  public:
+    /*************************************************************/
+    /* function: wanted                                         */
+    /* purpose: tells whether the next chunk should be          */
+    /*          compressed.                                     */
+    /*************************************************************/
+    bool wanted();
+
+    /*************************************************************/
+    /* function: record                                         */
+    /* purpose: records how long one chunk took from being read */
+    /*          to being handed to the socket after the         */
+    /*          previous one.                                   */
+    /* parameters:                                              */
+    /*    - compressed: whether compressing it was tried.       */
+    /*    - bytes: the uncompressed size.                       */
+    /*    - seconds: the time it took.                          */
+    /*************************************************************/
+    void record(bool compressed, uint64_t bytes, double seconds);
+
+  private:
+    double compressed_bytes = 0;   // file bytes sent with compression
+    double compressed_seconds = 0; // time they took
+    double raw_bytes = 0;          // file bytes sent raw
+    double raw_seconds = 0;        // time they took
+    unsigned chunks = 0;           // decisions made
+};
+
+/*************************************************************/
+/* function: deflatechunk                                   */
+/* purpose: compresses one chunk into the payload of a      */
+/*          FLAG_COMPRESSED DATA frame: the uncompressed    */
+/*          size (4 bytes, network byte order) followed by  */
+/*          a zlib stream.                                  */
+/* parameters:                                              */
+/*    - data: the chunk.                                    */
+/*    - size: its length (at most MAX_COMPRESSED_FRAME).    */
+/*    - out: receives the payload.                          */
+/* return: false if the chunk did not shrink; out is then   */
+/*         unspecified and the chunk should be sent raw.    */
+/*************************************************************/
+bool deflatechunk(const char *data, size_t size, std::string &out);
+
+/*************************************************************/
+/* function: inflatechunk                                   */
+/* purpose: restores a chunk from the payload of a          */
+/*          FLAG_COMPRESSED DATA frame. throws if the       */
+/*          payload is corrupt.                             */
+/* parameters:                                              */
+/*    - data: the frame payload.                            */
+/*    - size: its length.                                   */
+/*    - out: receives the uncompressed chunk.               */
+/*************************************************************/
+void inflatechunk(const char *data, size_t size, std::string &out);
+
+/*************************************************************/
+/* function: sendcompressed                                 */
+/* purpose: sends a byte range of a file like sendfiledata, */
+/*          but as COMPRESS_CHUNK sized DATA frames that    */
+/*          are compressed where the compressgate says so,  */
+/*          followed by END. a worker thread reads and      */
+/*          compresses the next chunks while the calling    */
+/*          thread sends; chunks the gate sends raw are not */
+/*          read at all but go out zero-copy. throws if the */
+/*          file cannot supply the range.                   */
+/* parameters:                                              */
+/*    - s: the connection to send on.                       */
+/*    - reqid: the request id the data belongs to.          */
+/*    - fd: an open, readable file descriptor.              */
+/*    - offset: where in the file to start.                 */
+/*    - length: how many bytes to send.                     */
+/*************************************************************/
+void sendcompressed(mysock &s, uint32_t reqid, int fd, uint64_t offset, uint64_t length);
+
+#endif
@@ -0,0 +1,313 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: delta.cpp                                           */
+/* purpose: this source file implements the delta encoding       */
+/*          declared in delta.h.                                 */
+/*****************************************************************/
+#include "delta.h"
+#include "checksum.h"
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <endian.h>
+#include <stdexcept>
+#include <unistd.h>
+#include <unordered_map>
+
+// Largest literal run carried by one 'L' operation
+constexpr uint32_t MAX_LITERAL = 256 << 10;
+
+// Bytes moved per pread/pwrite when copy_file_range is unavailable
+constexpr size_t COPY_BUFFER = 128 << 10;
+
+void rollingsum::init(const unsigned char *data, size_t size) {
+    a = b = 0;
+    length = static_cast<uint32_t>(size);
+    for (size_t i = 0; i < size; i++) {
+        a += data[i];
+        b += static_cast<uint32_t>(size - i) * data[i];
+    }
+}
+
+uint32_t syncblocksize(uint64_t size) {
+    uint64_t block = static_cast<uint64_t>(std::sqrt(static_cast<double>(size)));
+    block = (block + 1023) & ~static_cast<uint64_t>(1023);
+    if (block < MIN_SYNC_BLOCK) {
+        return MIN_SYNC_BLOCK;
+    }
+    if (block > MAX_SYNC_BLOCK) {
+        return MAX_SYNC_BLOCK;
+    }
+    return static_cast<uint32_t>(block);
+}
+
+/*************************************************************/
+/* function: strongsum                                      */
+/* purpose: the XXH64 of one block.                         */
+/*************************************************************/
+static uint64_t strongsum(const void *data, size_t size) {
+    xxh64 hash;
+    hash.update(data, size);
+    return hash.digest();
+}
+
+/*************************************************************/
+/* function: put32 / put64                                  */
+/* purpose: append a number in network byte order.          */
+/*************************************************************/
+static void put32(std::string &out, uint32_t value) {
+    value = htobe32(value);
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void put64(std::string &out, uint64_t value) {
+    value = htobe64(value);
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+/*************************************************************/
+/* function: get32                                          */
+/* purpose: reads a number in network byte order.           */
+/*************************************************************/
+static uint32_t get32(const char *data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return be32toh(value);
+}
+
+bool signfile(int fd, uint64_t size, uint32_t block, std::string &out) {
+    out.clear();
+    out.reserve(size / block * SIGNATURE_SIZE);
+    std::string buffer(block, '\0');
+    for (uint64_t offset = 0; offset + block <= size; offset += block) {
+        size_t got = 0;
+        while (got < block) {
+            ssize_t n = pread(fd, &buffer[got], block - got, offset + got);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            got += n;
+        }
+        rollingsum weak;
+        weak.init(reinterpret_cast<const unsigned char *>(buffer.data()), block);
+        put32(out, weak.digest());
+        put64(out, strongsum(buffer.data(), block));
+    }
+    return true;
+}
+
+std::vector<blocksignature> parsesignatures(const std::string &data) {
+    if (data.size() % SIGNATURE_SIZE != 0) {
+        throw std::runtime_error("Truncated block signatures");
+    }
+    std::vector<blocksignature> signatures(data.size() / SIGNATURE_SIZE);
+    for (size_t i = 0; i < signatures.size(); i++) {
+        const char *p = data.data() + i * SIGNATURE_SIZE;
+        uint64_t strong;
+        std::memcpy(&strong, p + 4, sizeof(strong));
+        signatures[i].weak = get32(p);
+        signatures[i].strong = be64toh(strong);
+    }
+    return signatures;
+}
+
+void builddelta(const char *data, uint64_t size, uint32_t block, const std::vector<blocksignature> &signatures,
+                const std::function<void(const std::string &)> &emit, deltastats &stats) {
+    std::unordered_map<uint32_t, std::vector<uint32_t>> index;
+    for (uint32_t i = 0; i < signatures.size(); i++) {
+        index[signatures[i].weak].push_back(i);
+    }
+
+    std::string ops;
+    uint32_t copy_first = 0;
+    uint32_t copy_count = 0;
+
+    auto flushOps = [&](bool final) {
+        if (!ops.empty() && (final || ops.size() >= DELTA_FRAME_TARGET)) {
+            emit(ops);
+            ops.clear();
+        }
+    };
+    auto flushCopy = [&]() {
+        if (copy_count > 0) {
+            ops += 'C';
+            put32(ops, copy_first);
+            put32(ops, copy_count);
+            stats.copied += static_cast<uint64_t>(copy_count) * block;
+            copy_count = 0;
+            flushOps(false);
+        }
+    };
+    auto addLiteral = [&](uint64_t from, uint64_t to) {
+        if (from == to) {
+            return;
+        }
+        flushCopy();
+        while (from < to) {
+            uint32_t length = to - from < MAX_LITERAL ? static_cast<uint32_t>(to - from) : MAX_LITERAL;
+            ops += 'L';
+            put32(ops, length);
+            ops.append(data + from, length);
+            stats.literal += length;
+            from += length;
+            flushOps(false);
+        }
+    };
+
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    uint64_t pos = 0;
+    uint64_t literal_start = 0;
+    rollingsum weak;
+    if (!index.empty() && size >= block) {
+        weak.init(bytes, block);
+    }
+    while (!index.empty() && pos + block <= size) {
+        auto found = index.find(weak.digest());
+        long match = -1;
+        if (found != index.end()) {
+            uint64_t strong = strongsum(data + pos, block);
+            for (uint32_t candidate : found->second) {
+                if (signatures[candidate].strong != strong) {
+                    continue;
+                }
+                match = candidate;
+                // Continuing the current run keeps the copy a single op
+                if (copy_count > 0 && candidate == copy_first + copy_count) {
+                    break;
+                }
+            }
+        }
+
+        if (match == -1) {
+            if (pos + block < size) {
+                weak.roll(bytes[pos], bytes[pos + block]);
+            }
+            pos++;
+            continue;
+        }
+
+        addLiteral(literal_start, pos);
+        if (copy_count > 0 && static_cast<uint32_t>(match) == copy_first + copy_count) {
+            copy_count++;
+        } else {
+            flushCopy();
+            copy_first = static_cast<uint32_t>(match);
+            copy_count = 1;
+        }
+        pos += block;
+        literal_start = pos;
+        if (pos + block <= size) {
+            weak.init(bytes + pos, block);
+        }
+    }
+    addLiteral(literal_start, size);
+    flushCopy();
+    flushOps(true);
+}
+
+/*************************************************************/
+/* function: writeall                                       */
+/* purpose: writes a buffer at an offset, retrying short    */
+/*          writes.                                         */
+/*************************************************************/
+static bool writeall(int fd, const char *data, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/*************************************************************/
+/* function: copyrange                                      */
+/* purpose: copies a range between files, in the kernel if  */
+/*          the filesystem allows it.                       */
+/*************************************************************/
+static bool copyrange(int in_fd, uint64_t in_offset, int out_fd, uint64_t out_offset, uint64_t length) {
+    while (length > 0) {
+        loff_t in = in_offset;
+        loff_t out = out_offset;
+        ssize_t n = copy_file_range(in_fd, &in, out_fd, &out, length, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        in_offset += n;
+        out_offset += n;
+        length -= n;
+    }
+
+    // Not supported here (or across filesystems): copy through userspace
+    std::string buffer;
+    while (length > 0) {
+        size_t want = length < COPY_BUFFER ? length : COPY_BUFFER;
+        buffer.resize(want);
+        ssize_t n = pread(in_fd, &buffer[0], want, in_offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || !writeall(out_fd, buffer.data(), n, out_offset)) {
+            return false;
+        }
+        in_offset += n;
+        out_offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool applydelta(const char *ops, size_t size, int basis_fd, int out_fd, uint32_t block, uint64_t blocks,
+                uint64_t &offset, deltastats &stats) {
+    size_t pos = 0;
+    while (pos < size) {
+        char op = ops[pos++];
+        if (op == 'C') {
+            if (size - pos < 8) {
+                throw std::runtime_error("Truncated copy instruction");
+            }
+            uint64_t first = get32(ops + pos);
+            uint64_t count = get32(ops + pos + 4);
+            pos += 8;
+            if (basis_fd == -1 || count == 0 || first + count > blocks) {
+                throw std::runtime_error("Copy instruction names a missing block");
+            }
+            uint64_t length = count * block;
+            if (!copyrange(basis_fd, first * block, out_fd, offset, length)) {
+                return false;
+            }
+            offset += length;
+            stats.copied += length;
+        } else if (op == 'L') {
+            if (size - pos < 4) {
+                throw std::runtime_error("Truncated literal instruction");
+            }
+            uint32_t length = get32(ops + pos);
+            pos += 4;
+            if (length > size - pos) {
+                throw std::runtime_error("Truncated literal data");
+            }
+            if (!writeall(out_fd, ops + pos, length, offset)) {
+                return false;
+            }
+            pos += length;
+            offset += length;
+            stats.literal += length;
+        } else {
+            throw std::runtime_error("Unknown delta instruction");
+        }
+    }
+    return true;
+}
@@ -0,0 +1,172 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: delta.h                                         */
+/* purpose: this header file declares the rsync style delta  */
+/*          encoding behind "sync". the receiver cuts its    */
+/*          copy of a file into fixed blocks and signs each  */
+/*          with a rolling checksum and an XXH64. the sender */
+/*          slides a window over its own file, looks every   */
+/*          position up by rolling checksum and confirms a   */
+/*          hit with the XXH64, and sends copy instructions  */
+/*          for matched blocks and the literal bytes of      */
+/*          everything else. a delta payload is a run of     */
+/*          operations:                                      */
+/*            'C' first u32, count u32: copy count blocks    */
+/*            'L' length u32, bytes:    literal bytes        */
+/*          with every number big-endian.                    */
+/*************************************************************/
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Block size bounds; in between it grows with the square root of the
+// file size, as in rsync
+constexpr uint32_t MIN_SYNC_BLOCK = 2 << 10;
+constexpr uint32_t MAX_SYNC_BLOCK = 128 << 10;
+
+// Bytes per signature: rolling checksum u32 and XXH64, big-endian
+constexpr size_t SIGNATURE_SIZE = 12;
+
+// A delta or signature DATA frame is sent once it reaches this size
+constexpr size_t DELTA_FRAME_TARGET = 256 << 10;
+
+// Largest delta DATA frame a receiver accepts
+constexpr uint64_t MAX_DELTA_FRAME = 1 << 20;
+
+/*************************************************************/
+/* class: rollingsum                                         */
+/* purpose: rsync's weak checksum over a window of bytes. it */
+/*          can be moved forward by one byte in constant     */
+/*          time.                                            */
+/*************************************************************/
+class rollingsum {
+  public:
+    /*************************************************************/
+    /* function: init                                           */
+    /* purpose: computes the checksum of a window.              */
+    /* parameters:                                              */
+    /*    - data: the window.                                   */
+    /*    - size: its length.                                   */
+    /*************************************************************/
+    void init(const unsigned char *data, size_t size);
+
+    /*************************************************************/
+    /* function: roll                                           */
+    /* purpose: moves the window one byte forward.              */
+    /* parameters:                                              */
+    /*    - out: the byte leaving the window.                   */
+    /*    - in: the byte entering it.                           */
+    /*************************************************************/
+    void roll(unsigned char out, unsigned char in) {
+        a += in - out;
+        b += a - length * out;
+    }
+
+    /*************************************************************/
+    /* function: digest                                         */
+    /* purpose: returns the checksum of the current window.     */
+    /*************************************************************/
+    uint32_t digest() const {
+        return (a & 0xffff) | (b << 16);
+    }
+
+  private:
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t length = 0;
+};
+
+/*************************************************************/
+/* struct: blocksignature                                    */
+/* purpose: the checksums of one block of the receiver's     */
+/*          file.                                            */
+/*************************************************************/
+struct blocksignature {
+    uint32_t weak;
+    uint64_t strong;
+};
+
+/*************************************************************/
+/* struct: deltastats                                        */
+/* purpose: how much of a file was reused and how much sent. */
+/*************************************************************/
+struct deltastats {
+    uint64_t copied = 0;
+    uint64_t literal = 0;
+};
+
+/*************************************************************/
+/* function: syncblocksize                                  */
+/* purpose: picks the block size for a file.                */
+/* parameters:                                              */
+/*    - size: the size of the receiver's file.              */
+/*************************************************************/
+uint32_t syncblocksize(uint64_t size);
+
+/*************************************************************/
+/* function: signfile                                       */
+/* purpose: signs every whole block of a file. a partial    */
+/*          last block is left unsigned; it is resent as    */
+/*          literal bytes.                                  */
+/* parameters:                                              */
+/*    - fd: the file.                                       */
+/*    - size: its size.                                     */
+/*    - block: the block size.                              */
+/*    - out: receives the packed signatures.                */
+/* return: false if the file could not be read.             */
+/*************************************************************/
+bool signfile(int fd, uint64_t size, uint32_t block, std::string &out);
+
+/*************************************************************/
+/* function: parsesignatures                                */
+/* purpose: unpacks signatures. throws if the data is not a */
+/*          whole number of them.                           */
+/* parameters:                                              */
+/*    - data: the packed signatures.                        */
+/*************************************************************/
+std::vector<blocksignature> parsesignatures(const std::string &data);
+
+/*************************************************************/
+/* function: builddelta                                     */
+/* purpose: encodes a file as operations against the        */
+/*          receiver's blocks. runs of consecutive blocks   */
+/*          become one copy.                                */
+/* parameters:                                              */
+/*    - data: the sender's file contents.                   */
+/*    - size: their length.                                 */
+/*    - block: the receiver's block size.                   */
+/*    - signatures: the receiver's signatures.              */
+/*    - emit: called with each delta payload of about       */
+/*            DELTA_FRAME_TARGET bytes, in order.           */
+/*    - stats: receives the copied and literal byte counts. */
+/*************************************************************/
+void builddelta(const char *data, uint64_t size, uint32_t block, const std::vector<blocksignature> &signatures,
+                const std::function<void(const std::string &)> &emit, deltastats &stats);
+
+/*************************************************************/
+/* function: applydelta                                     */
+/* purpose: appends what one delta payload describes to the */
+/*          output file. copies are done in the kernel with */
+/*          copy_file_range where possible. throws if the   */
+/*          payload is malformed or names a missing block.  */
+/* parameters:                                              */
+/*    - ops: the delta payload.                             */
+/*    - size: its length.                                   */
+/*    - basis_fd: the receiver's old file (-1 if none).     */
+/*    - out_fd: the file being rebuilt.                     */
+/*    - block: the block size.                              */
+/*    - blocks: the number of signed blocks.                */
+/*    - offset: where the output continues. advanced.       */
+/*    - stats: the copied and literal byte counts. advanced.*/
+/* return: false if reading or writing a file failed.       */
+/*************************************************************/
+bool applydelta(const char *ops, size_t size, int basis_fd, int out_fd, uint32_t block, uint64_t blocks,
+                uint64_t &offset, deltastats &stats);
+
+#endif
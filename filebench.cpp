@@ -0,0 +1,206 @@
+/*************************************************************/
+/* Author: Arek Gebka                                        */
+/* Editor: Lizmary Delarosa                                  */
+/* filename: filebench.cpp                                   */
+/* purpose: Benchmarks the transfer engines against each     */
+/*          other over a loopback TCP connection. For each   */
+/*          engine a test file is downloaded (file ->        */
+/*          socket) and uploaded (socket -> file) through    */
+/*          sendfiledata/recvfiledata, and the throughput    */
+/*          and CPU time of the side doing the file I/O are  */
+/*          reported. Downloads run twice: cold, with the    */
+/*          file dropped from the page cache first, and warm.*/
+/*                                                           */
+/*          usage: filebench [-s size_mb] [-n runs]          */
+/*                           [-d scratch_dir]                */
+/*************************************************************/
+
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "socket.h"
+#include "protocol.h"
+#include "transfer.h"
+
+using namespace std;
+
+/*************************************************************/
+/* struct: sample                                            */
+/* purpose: wall and CPU time of one transfer.               */
+/*************************************************************/
+struct sample {
+    double seconds = 0;
+    double cpu_seconds = 0;
+};
+
+/*************************************************************/
+/* function: threadcpu                                      */
+/* purpose: returns the CPU time used by the calling thread.*/
+/*************************************************************/
+double threadcpu() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/*************************************************************/
+/* function: connectpair                                    */
+/* purpose: opens a loopback TCP connection.                */
+/* parameters:                                              */
+/*    - listener: a socket bound to an ephemeral port.      */
+/*    - client: receives the connecting end.                */
+/*    - server: receives the accepted end.                  */
+/*************************************************************/
+void connectpair(mysock &listener, mysock &client, mysock &server) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(listener.getfd(), reinterpret_cast<struct sockaddr *>(&addr), &len);
+    client.connect("127.0.0.1", to_string(ntohs(addr.sin_port)));
+    server = listener.accept();
+}
+
+/*************************************************************/
+/* function: runtransfer                                    */
+/* purpose: sends `size` bytes of src_fd over a fresh       */
+/*          connection into dst_fd (-1 discards) and times  */
+/*          the side selected by measure_sender.            */
+/*************************************************************/
+sample runtransfer(mysock &listener, int src_fd, int dst_fd, uint64_t size, bool measure_sender) {
+    mysock client, server;
+    connectpair(listener, client, server);
+
+    sample result;
+    double sender_cpu = 0;
+    auto start = chrono::steady_clock::now();
+
+    thread sender([&]() {
+        double before = threadcpu();
+        sendfiledata(server, 1, src_fd, 0, size);
+        sender_cpu = threadcpu() - before;
+    });
+
+    double before = threadcpu();
+    string error;
+    if (!recvfiledata(client, dst_fd, 0, error)) {
+        cerr << "transfer failed: " << error << endl;
+    }
+    double receiver_cpu = threadcpu() - before;
+    sender.join();
+
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result.cpu_seconds = measure_sender ? sender_cpu : receiver_cpu;
+    client.close();
+    server.close();
+    return result;
+}
+
+/*************************************************************/
+/* function: report                                         */
+/* purpose: prints the best of several runs.                */
+/*************************************************************/
+void report(const string &engine, const string &direction, const vector<sample> &runs, uint64_t size) {
+    sample best = runs[0];
+    for (const auto &run : runs) {
+        if (run.seconds < best.seconds) {
+            best = run;
+        }
+    }
+    double gb = size / 1e9;
+    cout << left << setw(10) << engine << setw(10) << direction << right << fixed << setprecision(0)
+         << setw(10) << (size / 1e6) / best.seconds << " MB/s" << setw(12) << setprecision(1)
+         << best.cpu_seconds * 1000 / gb << " ms CPU/GB" << endl;
+}
+
+int main(int argc, char **argv) {
+    uint64_t size_mb = 256;
+    int runs = 3;
+    string scratch = "/tmp";
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:d:")) != -1) {
+        switch (opt) {
+            case 's':
+                size_mb = strtoull(optarg, nullptr, 10);
+                break;
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            case 'd':
+                scratch = optarg;
+                break;
+            default:
+                cerr << "Usage: " << argv[0] << " [-s size_mb] [-n runs] [-d scratch_dir]\n";
+                return 1;
+        }
+    }
+    uint64_t size = size_mb << 20;
+
+    // Build the source file once; it stays in the page cache (warm
+    // runs) until a cold run drops it
+    string src_path = scratch + "/filebench.src";
+    string dst_path = scratch + "/filebench.dst";
+    int src_fd = open(src_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (src_fd == -1) {
+        perror("open");
+        return 1;
+    }
+    vector<char> block(1 << 20);
+    for (size_t i = 0; i < block.size(); ++i) {
+        block[i] = static_cast<char>(i * 131 + 7);
+    }
+    for (uint64_t written = 0; written < size; written += block.size()) {
+        if (write(src_fd, block.data(), block.size()) != static_cast<ssize_t>(block.size())) {
+            perror("write");
+            return 1;
+        }
+    }
+    // Clean pages are the only ones POSIX_FADV_DONTNEED drops
+    fdatasync(src_fd);
+
+    mysock listener;
+    listener.bind("0");
+    listener.listen(4);
+
+    cout << "filebench: " << size_mb << " MB, best of " << runs << " runs" << endl;
+    const vector<pair<string, transferengine>> engines = {
+        {"buffered", transferengine::BUFFERED},
+        {"zerocopy", transferengine::ZEROCOPY},
+        {"uring", transferengine::URING},
+        {"mmap", transferengine::MAPPED},
+    };
+    for (const auto &engine : engines) {
+        if (settransferengine(engine.second) != engine.second) {
+            cout << left << setw(10) << engine.first << "not available on this kernel" << endl;
+            continue;
+        }
+
+        vector<sample> cold, warm, uploads;
+        for (int i = 0; i < runs; ++i) {
+            posix_fadvise(src_fd, 0, 0, POSIX_FADV_DONTNEED);
+            cold.push_back(runtransfer(listener, src_fd, -1, size, true));
+            warm.push_back(runtransfer(listener, src_fd, -1, size, true));
+
+            int dst_fd = open(dst_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            uploads.push_back(runtransfer(listener, src_fd, dst_fd, size, false));
+            close(dst_fd);
+        }
+        report(engine.first, "get cold", cold, size);
+        report(engine.first, "get warm", warm, size);
+        report(engine.first, "put", uploads, size);
+    }
+
+    close(src_fd);
+    unlink(src_path.c_str());
+    unlink(dst_path.c_str());
+    return 0;
+}
@@ -45,66 +45,1147 @@
 #include <string>
 #include <cstdlib>
 #include <set>
+#include <unordered_map>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <stack>
 #include <filesystem>
+#include <sstream>
+#include <vector>
+#include <atomic>
+#include <csignal>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <deque>
+#include <poll.h>
 
 #include "clientparse.h"
 #include "socket.h"
-
-// Define default buffer size for file transfer
-constexpr size_t DEFAULT_BUFFER_SIZE = 4096;
+#include "protocol.h"
+#include "transfer.h"
+#include "checksum.h"
+#include "workqueue.h"
+#include "bundle.h"
+#include "compress.h"
+#include "delta.h"
+#include "tuning.h"
 
 using namespace std;
 namespace fs = std::filesystem;
 
+// Request id of the most recently sent command
+atomic<uint32_t> last_reqid{0};
+
+// Server address, kept for opening extra transfer streams
+string server_host;
+string server_port;
+
+// Remote working directory relative to the base, restored on reconnect
+string remote_cwd = "/";
+
+// Compression negotiated with "compress on", and whether the transfer
+// being run right now is compressed (the session setting or -z)
+bool compress_session = false;
+bool compress_transfer = false;
+
+// Uploads are first offered to the server's content store by hash
+// ("dedup on")
+bool dedup_session = false;
+
+// Sizes fixed with "tune" at both ends of the session's connection;
+// restored on reconnect
+linksettings link_overrides;
+
+// Where gets are remembered for conditional gets (-c); empty when off
+string cache_directory;
+
+// Replaced lines the download log may hold before it is compacted
+constexpr size_t MIN_LOG_COMPACTION = 1000;
+
+// Smallest range worth giving its own stream in a parallel transfer
+constexpr uint64_t MIN_STREAM_RANGE = 4 << 20;
+
+// How often a dropped transfer is resumed before giving up
+constexpr int MAX_RECONNECTS = 5;
+
+// put -R: connections used when -P is not given, threads opening files,
+// files waiting between stages, puts sent ahead of their replies, and
+// how much of each file the readers pull into the page cache
+constexpr int DEFAULT_UPLOAD_CONNECTIONS = 4;
+constexpr int UPLOAD_READERS = 2;
+constexpr size_t UPLOAD_QUEUE_DEPTH = 256;
+constexpr size_t MAX_PIPELINED_PUTS = 64;
+constexpr uint64_t READAHEAD_LIMIT = 8 << 20;
+
+// Commands typed or piped in that are sent without waiting for the
+// replies to the ones before them, and how many may wait at once
+const set<string> PIPELINED_COMMANDS = {"ls", "find", "grep", "mkdir", "pwd"};
+constexpr size_t MAX_PIPELINED_COMMANDS = 64;
+
+/*************************************************************/
+/* Function: sendCommand                                      */
+/* Purpose: Sends a command line to the server as a CMD      */
+/*          frame with a fresh request id.                   */
+/* Input: s - The socket object used for communication.      */
+/*        command - The command line to send.                */
+/* Output: The request id assigned to the command.           */
+/*************************************************************/
+uint32_t sendCommand(mysock &s, const string &command) {
+    uint32_t reqid = ++last_reqid;
+    sendtext(s, FRAME_CMD, reqid, command);
+    return reqid;
+}
+
+/*************************************************************/
+/* Function: getCommand                                       */
+/* Purpose: Builds a get command line, asking for a          */
+/*          compressed transfer when one is selected.        */
+/* Input: arguments - Everything after "get".                */
+/* Output: The command line.                                 */
+/*************************************************************/
+string getCommand(const string &arguments) {
+    return (compress_transfer ? "get -z " : "get ") + arguments;
+}
+
+/*************************************************************/
+/* Function: sendData                                         */
+/* Purpose: Sends a file range after a put command, as one   */
+/*          zero-copy DATA frame or, when compression is     */
+/*          selected, as compressed chunks.                  */
+/* Input: s - The socket object used for communication.      */
+/*        reqid - The request id of the put.                 */
+/*        fd - The file to send.                             */
+/*        offset - Where the range starts.                   */
+/*        length - How many bytes to send.                   */
+/*************************************************************/
+void sendData(mysock &s, uint32_t reqid, int fd, uint64_t offset, uint64_t length) {
+    if (compress_transfer) {
+        sendcompressed(s, reqid, fd, offset, length);
+    } else {
+        sendfiledata(s, reqid, fd, offset, length);
+    }
+}
+
+/*************************************************************/
+/* Function: recvReply                                        */
+/* Purpose: Receives the text reply to a command.            */
+/* Input: s - The socket object used for communication.      */
+/*        reply - Receives the reply text.                   */
+/* Output: true for a successful reply, false for an error.  */
+/*************************************************************/
+bool recvReply(mysock &s, string &reply) {
+    frameheader h;
+    if (!recvmessage(s, h, reply)) {
+        throw runtime_error("Server closed the connection");
+    }
+    return h.type == FRAME_RESP;
+}
+
+/*************************************************************/
+/* Function: statRemote                                       */
+/* Purpose: Asks the server for the type, size and base      */
+/*          relative path of a remote file or directory.     */
+/* Input: s - The socket object used for communication.      */
+/*        remote_path - The path to look up.                 */
+/*        type - Receives "FILE" or "DIR".                   */
+/*        size - Receives the file size.                     */
+/*        path - Receives the path relative to the base      */
+/*        directory, usable from any connection.             */
+/*        report - Whether to print the server's error.      */
+/* Output: true if the path exists.                          */
+/*************************************************************/
+bool statRemote(mysock &s, const string &remote_path, string &type, uint64_t &size, string &path,
+                bool report = true) {
+    string response;
+    sendCommand(s, "stat " + remote_path);
+    if (!recvReply(s, response)) {
+        if (report) {
+            cerr << response << endl;
+        }
+        return false;
+    }
+    uint64_t mtime;
+    stringstream ss(response);
+    ss >> type >> size >> mtime >> path;
+    return !ss.fail();
+}
+
+/*************************************************************/
+/* Function: samePrefix                                       */
+/* Purpose: Checks that the first length bytes of a local    */
+/*          file match the remote file, by comparing the     */
+/*          server's checksum of that prefix with our own.   */
+/* Input: s - The socket object used for communication.      */
+/*        remote_path - The remote file.                     */
+/*        fd - The local file, open for reading.             */
+/*        length - The size of the prefix to compare.        */
+/* Output: true if both prefixes have the same checksum.     */
+/*************************************************************/
+bool samePrefix(mysock &s, const string &remote_path, int fd, uint64_t length) {
+    string response;
+    sendCommand(s, "sum " + remote_path + " 0 " + to_string(length));
+    uint64_t digest;
+    return recvReply(s, response) && hashfile(fd, 0, length, digest) && tohex(digest) == response;
+}
+
+/*************************************************************/
+/* Function: refetchRanges                                    */
+/* Purpose: Downloads damaged ranges of a file again, into   */
+/*          their place in the local file, until they match  */
+/*          the server's checksums or MAX_INTEGRITY_RETRIES  */
+/*          rounds have failed.                              */
+/* Input: s - The socket object used for communication.      */
+/*        remote_path - The remote file.                     */
+/*        fd - The local file, open for reading and writing. */
+/*        damaged - The ranges that failed the check.        */
+/* Output: true once every range arrived intact.             */
+/*************************************************************/
+bool refetchRanges(mysock &s, const string &remote_path, int fd, vector<byterange> damaged) {
+    for (int attempt = 0; !damaged.empty(); ++attempt) {
+        if (attempt == MAX_INTEGRITY_RETRIES) {
+            cerr << "Error: Data still corrupted after " << attempt << " retries." << endl;
+            return false;
+        }
+        cerr << "Checksum mismatch in " << damaged.size() << " range(s); fetching them again." << endl;
+        vector<byterange> again;
+        for (const auto &r : damaged) {
+            sendCommand(s, getCommand(remote_path + " " + to_string(r.offset) + " " + to_string(r.length)));
+            string error;
+            vector<byterange> bad;
+            if (!recvfiledata(s, fd, r.offset, error, nullptr, &bad)) {
+                if (bad.empty()) {
+                    cerr << error << endl;
+                    return false;
+                }
+                again.insert(again.end(), bad.begin(), bad.end());
+            }
+        }
+        damaged.swap(again);
+    }
+    return true;
+}
+
+/*************************************************************/
+/* Function: resendRanges                                     */
+/* Purpose: Uploads the ranges the server reported damaged   */
+/*          again, each as a ranged put written in place,    */
+/*          until they arrive intact or MAX_INTEGRITY_RETRIES*/
+/*          rounds have failed.                              */
+/* Input: s - The socket object used for communication.      */
+/*        remote_path - The destination on the server.       */
+/*        fd - The local file.                               */
+/*        size - The size of the local file.                 */
+/*        reply - The server's error; receives the last      */
+/*        reply.                                             */
+/* Output: true once every range arrived intact.             */
+/*************************************************************/
+bool resendRanges(mysock &s, const string &remote_path, int fd, uint64_t size, string &reply) {
+    vector<byterange> damaged;
+    for (int attempt = 0; parsedamaged(reply, damaged); ++attempt) {
+        if (attempt == MAX_INTEGRITY_RETRIES) {
+            return false;
+        }
+        cerr << "Checksum mismatch in " << damaged.size() << " range(s); sending them again." << endl;
+        vector<byterange> again;
+        for (const auto &r : damaged) {
+            string range = to_string(r.offset) + " " + to_string(size);
+            uint32_t reqid = sendCommand(s, "put " + remote_path + " " + range);
+            sendData(s, reqid, fd, r.offset, r.length);
+            vector<byterange> bad;
+            if (!recvReply(s, reply)) {
+                if (!parsedamaged(reply, bad)) {
+                    return false;
+                }
+                again.insert(again.end(), bad.begin(), bad.end());
+            }
+        }
+        if (again.empty()) {
+            return true;
+        }
+        reply = formatdamaged(again);
+    }
+    return false;
+}
+
 /*************************************************************/
 /* Function: recvallFile                                      */
 /* Purpose: Receives the entire contents of a file from the  */
-/*          server and writes it to a local file.            */
+/*          server and writes it to a local file. The data   */
+/*          is spliced to "<local>.part" first and is renamed into */
+/*          place once the END frame arrives. If the         */
+/*          connection drops the ".part" file is kept so the */
+/*          next get can resume it; an error reported by the */
+/*          server discards it. Ranges that fail the         */
+/*          checksum check are fetched again when the remote */
+/*          path is given.                                   */
 /* Input: s - The socket object used for communication.      */
 /*        local_file_path - The path to the local file where*/
 /*        the received file will be saved.                   */
+/*        offset - Where the data starts; bytes before it    */
+/*        are already in the ".part" file.                   */
+/*        first - The first frame header if it was already   */
+/*        read, or null.                                     */
+/*        remote_file_path - The file being received, or     */
+/*        empty if it cannot be requested again.             */
+/* Output: true if the file was received completely.         */
 /*************************************************************/
-void recvallFile(mysock &s, const string &local_file_path) {
-    ofstream outFile(local_file_path, ios::binary);
-    if (!outFile) {
+bool recvallFile(mysock &s, const string &local_file_path, uint64_t offset = 0,
+                 const frameheader *first = nullptr, const string &remote_file_path = "") {
+    string part_path = local_file_path + ".part";
+    int fd = open(part_path.c_str(), O_RDWR | O_CREAT | (offset == 0 ? O_TRUNC : 0) | O_CLOEXEC, 0644);
+    if (fd == -1) {
         cerr << "Error: Cannot create local file " << local_file_path << endl;
-        s.clientsend("Error: Cannot create file.");
+    }
+
+    string error;
+    vector<byterange> damaged;
+    bool complete;
+    try {
+        complete = recvfiledata(s, fd, offset, error, first, &damaged);
+        if (!complete && !damaged.empty() && !remote_file_path.empty()) {
+            error.clear();
+            complete = refetchRanges(s, remote_file_path, fd, damaged);
+        }
+    } catch (...) {
+        if (fd != -1) {
+            close(fd);
+        }
+        throw;
+    }
+    if (fd == -1) {
+        return false;
+    }
+    close(fd);
+
+    if (!complete) {
+        if (!error.empty()) {
+            cerr << error << endl;
+        }
+        fs::remove(part_path);
+        return false;
+    }
+    fs::rename(part_path, local_file_path);
+    cout << "File transfer completed: " << local_file_path << endl;
+    return true;
+}
+
+/*************************************************************/
+/* Struct: downloadrecord                                     */
+/* Purpose: What the download cache keeps about one remote   */
+/*          file: the server's version of it when it was      */
+/*          fetched, the XXH64 of the contents, and where the */
+/*          copy was saved with the size and mtime it had, so */
+/*          a copy changed locally is fetched again.          */
+/*************************************************************/
+struct downloadrecord {
+    string remote;           // "host:port path", the path relative to the base
+    string version;          // "size:mtime:ctime" as the server reported it
+    string hash;             // XXH64 of the contents in hex
+    string local;            // absolute path of the copy
+    uint64_t local_size = 0;
+    int64_t local_mtime = 0; // nanoseconds
+};
+
+// The records, loaded from the log in the cache directory, and the log
+// they are appended to as gets finish
+unordered_map<string, downloadrecord> download_records;
+int download_log = -1;
+const string DOWNLOAD_LOG = "downloads.log";
+
+/*************************************************************/
+/* Function: recordKey                                        */
+/* Purpose: Names a remote file the same way from any remote */
+/*          directory and any session with the same server.  */
+/* Input: remote_path - The path as the user gave it.        */
+/* Output: The key of its download record.                   */
+/*************************************************************/
+string recordKey(const string &remote_path) {
+    string path = (fs::path(remote_cwd) / remote_path).lexically_normal().string();
+    return server_host + ":" + server_port + " " + path;
+}
+
+/*************************************************************/
+/* Function: splitRecord                                      */
+/* Purpose: Parses one line of the download log: the key,    */
+/*          version, hash, local size, local mtime and local */
+/*          path, separated by tabs. The path comes last as  */
+/*          it is the only field that may hold spaces.       */
+/* Input: line - The line.                                   */
+/*        r - Receives the record.                           */
+/* Output: false for a line cut short by a crash.            */
+/*************************************************************/
+bool splitRecord(const string &line, downloadrecord &r) {
+    vector<string> fields;
+    size_t start = 0;
+    while (fields.size() < 5) {
+        size_t tab = line.find('\t', start);
+        if (tab == string::npos) {
+            return false;
+        }
+        fields.push_back(line.substr(start, tab - start));
+        start = tab + 1;
+    }
+    r.remote = fields[0];
+    r.version = fields[1];
+    r.hash = fields[2];
+    r.local = line.substr(start);
+    char *end;
+    r.local_size = strtoull(fields[3].c_str(), &end, 10);
+    r.local_mtime = strtoll(fields[4].c_str(), &end, 10);
+    return !r.local.empty() && *end == '\0';
+}
+
+/*************************************************************/
+/* Function: formatRecord                                     */
+/* Purpose: Formats a record as a line of the download log.  */
+/* Input: r - The record.                                    */
+/* Output: The line, with its newline.                       */
+/*************************************************************/
+string formatRecord(const downloadrecord &r) {
+    return r.remote + "\t" + r.version + "\t" + r.hash + "\t" + to_string(r.local_size) + "\t" +
+           to_string(r.local_mtime) + "\t" + r.local + "\n";
+}
+
+/*************************************************************/
+/* Function: openDownloadCache                                */
+/* Purpose: Loads the download log of a cache directory and  */
+/*          opens it for appending. A later line for a key   */
+/*          replaces an earlier one. Once most lines are     */
+/*          replaced ones, the log is rewritten first with   */
+/*          one line per key.                                */
+/* Input: directory - The cache directory.                   */
+/* Output: false if the directory or log cannot be used.     */
+/*************************************************************/
+bool openDownloadCache(const string &directory) {
+    error_code ec;
+    fs::create_directories(directory, ec);
+    if (ec) {
+        return false;
+    }
+    string log_path = directory + "/" + DOWNLOAD_LOG;
+    size_t lines = 0;
+    {
+        ifstream in(log_path);
+        string line;
+        downloadrecord r;
+        while (getline(in, line)) {
+            ++lines;
+            if (splitRecord(line, r)) {
+                download_records[r.remote] = r;
+            }
+        }
+    }
+    if (lines > 2 * download_records.size() + MIN_LOG_COMPACTION) {
+        string temporary = log_path + ".tmp";
+        ofstream out(temporary, ios::trunc);
+        for (const auto &entry : download_records) {
+            out << formatRecord(entry.second);
+        }
+        if (out.flush()) {
+            out.close();
+            fs::rename(temporary, log_path, ec);
+        }
+    }
+    download_log = open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return download_log != -1;
+}
+
+/*************************************************************/
+/* Function: loadRecord                                       */
+/* Purpose: Looks up the download record of a remote file.   */
+/* Input: key - The key from recordKey.                      */
+/*        r - Receives the record.                           */
+/* Output: false if there is none.                           */
+/*************************************************************/
+bool loadRecord(const string &key, downloadrecord &r) {
+    auto found = download_records.find(key);
+    if (found == download_records.end()) {
+        return false;
+    }
+    r = found->second;
+    return true;
+}
+
+/*************************************************************/
+/* Function: saveRecord                                       */
+/* Purpose: Stores a download record, appending it to the    */
+/*          log in one write so sessions sharing the cache   */
+/*          directory do not interleave their lines.         */
+/* Input: r - The record.                                    */
+/*************************************************************/
+void saveRecord(const downloadrecord &r) {
+    download_records[r.remote] = r;
+    string line = formatRecord(r);
+    if (write(download_log, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+        cerr << "Warning: Cannot write the download cache in " << cache_directory << "." << endl;
+    }
+}
+
+/*************************************************************/
+/* Function: localCopy                                        */
+/* Purpose: Checks that the copy a record describes is still */
+/*          at a local path, with its size and mtime as the  */
+/*          get left them.                                   */
+/* Input: r - The record.                                    */
+/*        local_file_path - Where the file is being saved.   */
+/*        st - Receives the status of the local file.        */
+/* Output: true if the copy is there and untouched.          */
+/*************************************************************/
+bool localCopy(const downloadrecord &r, const string &local_file_path, struct stat &st) {
+    return stat(local_file_path.c_str(), &st) == 0 && fs::absolute(local_file_path).string() == r.local &&
+           static_cast<uint64_t>(st.st_size) == r.local_size &&
+           static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec == r.local_mtime;
+}
+
+/*************************************************************/
+/* Function: recordDownload                                   */
+/* Purpose: Records a file a conditional get just saved, so  */
+/*          the next get of it can be answered "Unchanged".  */
+/* Input: r - The record to fill in.                         */
+/*        key - The remote file's record key.                */
+/*        version - The version the server sent it at.       */
+/*        local_file_path - Where it was saved.              */
+/*************************************************************/
+void recordDownload(downloadrecord &r, const string &key, const string &version, const string &local_file_path) {
+    // The copy was just written, so hashing it reads the page cache
+    uint64_t digest;
+    struct stat st;
+    int fd = open(local_file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1 && fstat(fd, &st) == 0 && hashfile(fd, 0, st.st_size, digest)) {
+        r.remote = key;
+        r.version = version;
+        r.hash = tohex(digest);
+        r.local = fs::absolute(local_file_path).string();
+        r.local_size = st.st_size;
+        r.local_mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        saveRecord(r);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/*************************************************************/
+/* Function: conditionalGet                                   */
+/* Purpose: Downloads a file unless the local copy from the  */
+/*          last get is still current. The server is sent    */
+/*          the version and hash of that copy and answers    */
+/*          "Unchanged" without sending the file, or with    */
+/*          its version followed by the file, which is then  */
+/*          recorded for next time.                          */
+/* Input: s - The socket object used for communication.      */
+/*        remote_file_path - The file to download.           */
+/*        local_file_path - Where to save it.                */
+/* Output: true if the local copy is current.                */
+/*************************************************************/
+bool conditionalGet(mysock &s, const string &remote_file_path, const string &local_file_path) {
+    downloadrecord r;
+    struct stat st;
+    string key = recordKey(remote_file_path);
+    bool have = loadRecord(key, r) && localCopy(r, local_file_path, st);
+    string known = have ? r.version + ":" + r.hash : "none";
+    sendCommand(s, getCommand("-m " + known + " " + remote_file_path));
+
+    string response, word, version;
+    if (!recvReply(s, response)) {
+        cerr << response << endl;
+        return false;
+    }
+    stringstream ss(response);
+    ss >> word >> version;
+    if (word == "Unchanged") {
+        if (version != r.version) {
+            r.version = version; // touched, or rewritten with the same contents
+            saveRecord(r);
+        }
+        cout << "Not modified: " << local_file_path << endl;
+        return true;
+    }
+    if (!recvallFile(s, local_file_path, 0, nullptr, remote_file_path)) {
+        return false;
+    }
+    recordDownload(r, key, version, local_file_path);
+    return true;
+}
+
+/*************************************************************/
+/* Function: getFile                                          */
+/* Purpose: Downloads one file. If "<local>.part" is left    */
+/*          from an interrupted download and still matches   */
+/*          the start of the remote file, only the rest of   */
+/*          the file is requested. Otherwise, with a download */
+/*          cache, the get is conditional.                   */
+/* Input: s - The socket object used for communication.      */
+/*        remote_file_path - The file to download.           */
+/*        local_file_path - Where to save it.                */
+/* Output: true if the file was received completely.         */
+/*************************************************************/
+bool getFile(mysock &s, const string &remote_file_path, const string &local_file_path) {
+    string part_path = local_file_path + ".part";
+    uint64_t offset = 0;
+    struct stat st;
+    if (stat(part_path.c_str(), &st) == 0 && st.st_size > 0) {
+        string type, path;
+        uint64_t size;
+        int fd = open(part_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd != -1 && statRemote(s, remote_file_path, type, size, path, false) && type == "FILE" &&
+            static_cast<uint64_t>(st.st_size) <= size && samePrefix(s, remote_file_path, fd, st.st_size)) {
+            offset = st.st_size;
+            cout << "Resuming download at byte " << offset << " of " << size << "." << endl;
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    if (offset == 0 && !cache_directory.empty()) {
+        return conditionalGet(s, remote_file_path, local_file_path);
+    }
+    sendCommand(s, getCommand(remote_file_path + (offset > 0 ? " " + to_string(offset) : "")));
+    return recvallFile(s, local_file_path, offset, nullptr, remote_file_path);
+}
+
+/*************************************************************/
+/* Function: linkStored                                       */
+/* Purpose: Offers a file to the server's content store by   */
+/*          its SHA-256 before uploading it. If the server   */
+/*          already has the content it creates the remote    */
+/*          file from it and nothing is uploaded.            */
+/* Input: s - The socket object used for communication.      */
+/*        fd - The local file.                               */
+/*        size - The size of the local file.                 */
+/*        remote_file_path - The destination on the server.  */
+/* Output: true if the server created the file.              */
+/*************************************************************/
+bool linkStored(mysock &s, int fd, uint64_t size, const string &remote_file_path) {
+    string digest, reply;
+    if (!dedup_session || !sha256file(fd, 0, size, digest)) {
+        return false;
+    }
+    sendCommand(s, "link " + digest + " " + to_string(size) + " " + remote_file_path);
+    if (!recvReply(s, reply)) {
+        return false; // not stored: upload it
+    }
+    cout << reply << " (content already on the server; nothing uploaded)" << endl;
+    return true;
+}
+
+/*************************************************************/
+/* Function: sendallFile                                      */
+/* Purpose: Uploads a local file as DATA frames after a put  */
+/*          command and waits for the server's reply. The    */
+/*          contents are sent with sendfile. The put is a    */
+/*          ranged one that the server keeps if the          */
+/*          connection drops, so when the remote file is a   */
+/*          shorter copy of the local one (checked with a    */
+/*          prefix checksum) only the missing tail is sent.  */
+/* Input: s - The socket object used for communication.      */
+/*        local_file_path - The local file to upload.        */
+/*        remote_file_path - The destination on the server.  */
+/* Output: true if the server stored the file.               */
+/*************************************************************/
+bool sendallFile(mysock &s, const string &local_file_path, const string &remote_file_path) {
+    int fd = open(local_file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        cout << "Error opening local file: " << local_file_path << endl;
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    uint64_t size = st.st_size;
+
+    uint64_t offset = 0;
+    string type, path, reply;
+    uint64_t remote_size;
+    bool ok;
+    try {
+        if (statRemote(s, remote_file_path, type, remote_size, path, false) && type == "FILE" &&
+            remote_size > 0 && remote_size <= size && samePrefix(s, remote_file_path, fd, remote_size)) {
+            if (remote_size == size) {
+                close(fd);
+                cout << "Remote file is already up to date: " << path << endl;
+                return true;
+            }
+            offset = remote_size;
+            cout << "Resuming upload at byte " << offset << " of " << size << "." << endl;
+        } else if (linkStored(s, fd, size, remote_file_path)) {
+            close(fd);
+            return true;
+        }
+
+        uint32_t reqid = sendCommand(s, "put " + remote_file_path + " " + to_string(offset));
+        sendData(s, reqid, fd, offset, size - offset);
+        ok = recvReply(s, reply) || resendRanges(s, remote_file_path, fd, size, reply);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    cout << reply << endl;
+    return ok;
+}
+
+/*************************************************************/
+/* Function: syncFile                                         */
+/* Purpose: Updates a remote file to match a local one by    */
+/*          sending only what changed. The server answers    */
+/*          "sync" with the block signatures of its copy;    */
+/*          the local file is scanned for those blocks and   */
+/*          sent as copy instructions plus the bytes that    */
+/*          match no block. The server's checksum of the     */
+/*          rebuilt file is compared with the local one, and */
+/*          the whole file is sent if they differ.           */
+/* Input: s - The socket object used for communication.      */
+/*        local_file_path - The local file to upload.        */
+/*        remote_file_path - The destination on the server.  */
+/* Output: true if the server has an identical copy.         */
+/*************************************************************/
+bool syncFile(mysock &s, const string &local_file_path, const string &remote_file_path) {
+    int fd = open(local_file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        cout << "Error opening local file: " << local_file_path << endl;
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    uint64_t size = st.st_size;
+    void *mapped = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    if (mapped == MAP_FAILED) {
+        close(fd);
+        cout << "Error reading local file: " << local_file_path << endl;
+        return false;
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    uint64_t digest = 0;
+    deltastats stats;
+    string reply;
+    bool ok;
+    try {
+        // A refused sync is answered with ERROR and nothing else
+        uint32_t reqid = sendCommand(s, "sync " + remote_file_path);
+        ok = recvReply(s, reply);
+        if (ok) {
+            string word;
+            uint32_t block = 0;
+            uint64_t remote_size = 0, count = 0;
+            stringstream ss(reply);
+            ss >> word >> block >> remote_size >> count;
+            if (ss.fail() || word != "SIGNATURE" || block == 0) {
+                throw runtime_error("Malformed sync response");
+            }
+
+            string packed;
+            frameheader h;
+            while (true) {
+                if (!recvheader(s, h)) {
+                    throw runtime_error("Server closed the connection");
+                }
+                if (h.type == FRAME_END) {
+                    skippayload(s, h);
+                    break;
+                }
+                if (h.type != FRAME_DATA) {
+                    throw runtime_error("Unexpected frame in signature stream");
+                }
+                packed += recvtext(s, h);
+            }
+            vector<blocksignature> signatures = parsesignatures(packed);
+            if (signatures.size() != count) {
+                throw runtime_error("Signature count does not match the sync response");
+            }
+
+            auto emit = [&](const string &ops) { sendframe(s, FRAME_DATA, reqid, ops.data(), ops.size()); };
+            builddelta(static_cast<const char *>(mapped), size, block, signatures, emit, stats);
+            sendframe(s, FRAME_END, reqid, nullptr, 0);
+            ok = recvReply(s, reply) && hashfile(fd, 0, size, digest);
+        }
+    } catch (...) {
+        if (mapped != nullptr) {
+            munmap(mapped, size);
+        }
+        close(fd);
+        throw;
+    }
+    if (mapped != nullptr) {
+        munmap(mapped, size);
+    }
+    close(fd);
+
+    cout << reply << endl;
+    if (!ok) {
+        return false;
+    }
+    size_t at = reply.rfind(' ');
+    if (at == string::npos || reply.substr(at + 1) != tohex(digest)) {
+        cout << "Checksum mismatch after sync; sending the whole file." << endl;
+        return sendallFile(s, local_file_path, remote_file_path);
+    }
+    cout << "Sent " << stats.literal << " of " << size << " bytes (" << stats.copied << " reused)." << endl;
+    return true;
+}
+
+/*************************************************************/
+/* Function: reconnect                                        */
+/* Purpose: Replaces a dropped connection with a new one and */
+/*          returns to the remote working directory. Waits a */
+/*          little longer before each attempt.               */
+/* Input: s - The socket object to replace.                  */
+/*************************************************************/
+void reconnect(mysock &s) {
+    try {
+        s.close();
+    } catch (const exception &) {
+        // The old connection is already gone
+    }
+    for (int attempt = 1; attempt <= MAX_RECONNECTS; ++attempt) {
+        sleep(attempt);
+        mysock fresh;
+        try {
+            fresh.connect(server_host, server_port);
+        } catch (const exception &e) {
+            cerr << "Reconnect attempt " << attempt << " failed: " << e.what() << endl;
+            fresh.close();
+            continue;
+        }
+        s = fresh;
+        string response;
+        if (remote_cwd != "/") {
+            sendCommand(s, "cd " + remote_cwd);
+            recvReply(s, response);
+        }
+        if (compress_session) {
+            sendCommand(s, "compress " + COMPRESSION_METHOD);
+            recvReply(s, response);
+        }
+        if (link_overrides.any()) {
+            sendCommand(s, "tune " + formatlinksettings(link_overrides));
+            recvReply(s, response);
+            s.tuning().force(link_overrides);
+        }
+        cout << "Reconnected to server." << endl;
         return;
     }
+    throw runtime_error("Could not reconnect to the server");
+}
 
-    char buffer[DEFAULT_BUFFER_SIZE];
-    while (true) {
-        int receivedBytes = s.clientrecv(buffer, sizeof(buffer));
-        if (receivedBytes <= 0) {
-            cerr << "Error: Connection lost or server error during file transfer." << endl;
-            break;
+/*************************************************************/
+/* Function: withResume                                       */
+/* Purpose: Runs a transfer and, if the connection drops,    */
+/*          reconnects and runs it again. The transfers      */
+/*          resume from what already arrived, so a retry     */
+/*          only moves the missing bytes.                    */
+/* Input: s - The socket object used for communication.      */
+/*        transfer - The transfer to run.                    */
+/* Output: The result of the transfer.                       */
+/*************************************************************/
+bool withResume(mysock &s, const function<bool()> &transfer) {
+    for (int attempt = 0;; ++attempt) {
+        try {
+            return transfer();
+        } catch (const fs::filesystem_error &) {
+            throw; // a local problem, reconnecting will not help
+        } catch (const exception &e) {
+            if (attempt == MAX_RECONNECTS) {
+                throw;
+            }
+            cerr << "Connection lost (" << e.what() << "); reconnecting to resume." << endl;
+            reconnect(s);
         }
+    }
+}
 
-        string data(buffer, receivedBytes);
+/*************************************************************/
+/* Function: basePath                                         */
+/* Purpose: Turns a remote path relative to the current      */
+/*          remote directory into one relative to the base   */
+/*          directory, which new connections start in.       */
+/* Input: s - The socket object used for communication.      */
+/*        remote_path - The remote path.                     */
+/*        path - Receives the base relative path.            */
+/* Output: false if the remote directory cannot be found.    */
+/*************************************************************/
+bool basePath(mysock &s, const string &remote_path, string &path) {
+    if (!remote_path.empty() && remote_path[0] == '/') {
+        path = remote_path;
+        return true;
+    }
+    string type, cwd;
+    uint64_t ignored;
+    if (!statRemote(s, ".", type, ignored, cwd)) {
+        return false;
+    }
+    path = (cwd == "/" ? "" : cwd) + "/" + remote_path;
+    return true;
+}
 
-        // Detect EOF explicitly
-        if (data == "EOF") {
-            cout << "File transfer completed: " << local_file_path << endl;
-            break;
+/*************************************************************/
+/* Function: streamCount                                      */
+/* Purpose: Limits the number of streams so that every range */
+/*          is at least MIN_STREAM_RANGE bytes.              */
+/* Input: size - The file size.                              */
+/*        streams - The number of streams requested.         */
+/* Output: The number of streams to use.                     */
+/*************************************************************/
+int streamCount(uint64_t size, int streams) {
+    uint64_t most = size / MIN_STREAM_RANGE;
+    if (most < 1) {
+        most = 1;
+    }
+    return static_cast<uint64_t>(streams) < most ? streams : static_cast<int>(most);
+}
+
+/*************************************************************/
+/* Function: runStreams                                       */
+/* Purpose: Splits [0, size) into one range per stream and   */
+/*          runs transfer on each range over its own new     */
+/*          connection, all in parallel.                     */
+/* Input: size - The file size.                              */
+/*        streams - The number of connections to open.       */
+/*        transfer - Moves one range over a connection and   */
+/*        returns true on success.                           */
+/* Output: true if every range succeeded.                    */
+/*************************************************************/
+bool runStreams(uint64_t size, int streams,
+                const function<bool(mysock &, uint64_t, uint64_t)> &transfer) {
+    uint64_t range = size / streams;
+    vector<thread> workers;
+    vector<char> succeeded(streams, 0);
+
+    for (int i = 0; i < streams; ++i) {
+        uint64_t offset = range * i;
+        uint64_t length = i == streams - 1 ? size - offset : range;
+        workers.emplace_back([&, i, offset, length]() {
+            mysock conn;
+            try {
+                conn.connect(server_host, server_port);
+                succeeded[i] = transfer(conn, offset, length);
+                sendCommand(conn, "exit");
+            } catch (const exception &e) {
+                cerr << "Error: stream " << i << ": " << e.what() << endl;
+            }
+            conn.close();
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    for (char ok : succeeded) {
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*************************************************************/
+/* Function: parallelGet                                      */
+/* Purpose: Downloads a large file over several connections */
+/*          at once, each fetching one byte range into its   */
+/*          place in "<local>.part". The assembled file is   */
+/*          checked against the server's checksum before it  */
+/*          is renamed into place.                           */
+/* Input: s - The socket object used for communication.      */
+/*        remote_path - The file to download.                */
+/*        local_file_path - Where to save it.                */
+/*        streams - The number of connections to use.        */
+/* Output: true if the file was received and verified.       */
+/*************************************************************/
+bool parallelGet(mysock &s, const string &remote_path, const string &local_file_path, int streams) {
+    string type, path;
+    uint64_t size;
+    if (!statRemote(s, remote_path, type, size, path)) {
+        return false;
+    }
+    if (type != "FILE") {
+        cerr << "Error: Specified path is not a file." << endl;
+        return false;
+    }
+    streams = streamCount(size, streams);
+    if (streams <= 1) {
+        return getFile(s, path, local_file_path);
+    }
+
+    string part_path = local_file_path + ".part";
+    int fd = open(part_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        cerr << "Error: Cannot create local file " << local_file_path << endl;
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+
+    cout << "Fetching " << size << " bytes over " << streams << " streams." << endl;
+    bool complete = runStreams(size, streams, [&](mysock &conn, uint64_t offset, uint64_t length) {
+        sendCommand(conn, getCommand(path + " " + to_string(offset) + " " + to_string(length)));
+        string error;
+        vector<byterange> damaged;
+        if (!recvfiledata(conn, fd, offset, error, nullptr, &damaged)) {
+            if (!damaged.empty()) {
+                return refetchRanges(conn, path, fd, damaged);
+            }
+            cerr << error << endl;
+            return false;
+        }
+        return true;
+    });
+
+    string response;
+    if (complete) {
+        uint64_t digest;
+        sendCommand(s, "sum " + path);
+        complete = recvReply(s, response) && hashfile(fd, 0, size, digest) && tohex(digest) == response;
+        if (!complete) {
+            cerr << "Error: Checksum mismatch; the file changed during the transfer." << endl;
         }
+    }
+    close(fd);
+
+    if (!complete) {
+        fs::remove(part_path);
+        return false;
+    }
+    fs::rename(part_path, local_file_path);
+    cout << "File transfer completed: " << local_file_path << " (checksum " << response << ")" << endl;
+    return true;
+}
+
+/*************************************************************/
+/* Function: parallelPut                                      */
+/* Purpose: Uploads a large file over several connections at */
+/*          once. Each connection sends one byte range with  */
+/*          a ranged put that the server writes in place.    */
+/*          The local checksum is computed while the ranges  */
+/*          are in flight and compared with the server's.    */
+/* Input: s - The socket object used for communication.      */
+/*        local_file_path - The local file to upload.        */
+/*        remote_file_path - The destination on the server.  */
+/*        streams - The number of connections to use.        */
+/* Output: true if the server stored the file intact.        */
+/*************************************************************/
+bool parallelPut(mysock &s, const string &local_file_path, const string &remote_file_path, int streams) {
+    int fd = open(local_file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        cout << "Error opening local file: " << local_file_path << endl;
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    uint64_t size = st.st_size;
+    streams = streamCount(size, streams);
+    if (streams <= 1) {
+        close(fd);
+        return sendallFile(s, local_file_path, remote_file_path);
+    }
 
-        // Write received data to file
-        outFile.write(data.c_str(), data.size());
+    // The extra connections start in the base directory, so name the
+    // destination relative to it
+    string path;
+    if (!basePath(s, remote_file_path, path)) {
+        close(fd);
+        return false;
+    }
+    if (linkStored(s, fd, size, path)) {
+        close(fd);
+        return true;
     }
 
-    outFile.close();
-    if (!outFile) {
-        cerr << "Error: Writing to file failed." << endl;
+    uint64_t digest = 0;
+    bool hashed = false;
+    thread hasher([&]() { hashed = hashfile(fd, 0, size, digest); });
+
+    cout << "Sending " << size << " bytes over " << streams << " streams." << endl;
+    bool complete = runStreams(size, streams, [&](mysock &conn, uint64_t offset, uint64_t length) {
+        uint32_t reqid = sendCommand(conn, "put " + path + " " + to_string(offset) + " " + to_string(size));
+        sendData(conn, reqid, fd, offset, length);
+        string reply;
+        if (!recvReply(conn, reply) && !resendRanges(conn, path, fd, size, reply)) {
+            cerr << reply << endl;
+            return false;
+        }
+        return true;
+    });
+    hasher.join();
+    close(fd);
+
+    if (complete) {
+        string response;
+        sendCommand(s, "sum " + path);
+        complete = recvReply(s, response) && hashed && tohex(digest) == response;
+        if (!complete) {
+            cerr << "Error: Checksum mismatch on the server copy of " << path << endl;
+            return false;
+        }
+        cout << "File received: " << path << " (checksum " << response << ")" << endl;
     }
+    return complete;
+}
+
+/*************************************************************/
+/* Function: setModifiedTime                                  */
+/* Purpose: Sets the modification time of a local path.      */
+/* Input: path - The local file or directory.                */
+/*        mtime - The time in seconds since the epoch.       */
+/*************************************************************/
+void setModifiedTime(const string &path, int64_t mtime) {
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT; // leave the access time alone
+    times[1].tv_sec = mtime;
+    times[1].tv_nsec = 0;
+    utimensat(AT_FDCWD, path.c_str(), times, 0);
+}
+
+/*************************************************************/
+/* Function: writeLocalFile                                   */
+/* Purpose: Writes a whole small file from memory.           */
+/* Input: path - The local file to create or replace.        */
+/*        data - The contents.                               */
+/*        size - The number of bytes.                        */
+/* Output: true if every byte was written.                   */
+/*************************************************************/
+bool writeLocalFile(const string &path, const char *data, size_t size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t written = write(fd, data + done, size - done);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            break;
+        }
+        done += written;
+    }
+    close(fd);
+    return done == size;
 }
 
 /*************************************************************/
 /* Function: getRecursive                                     */
 /* Purpose: Recursively retrieves a directory and its files */
-/*          from the server and saves them locally.          */
+/*          from the server and saves them locally. The     */
+/*          server walks the tree and answers with a        */
+/*          manifest of every directory and file, followed  */
+/*          by the file contents in manifest order on the   */
+/*          same request, so the whole tree costs one round */
+/*          trip instead of one per file. Small files come  */
+/*          packed into bundles and are written directly.   */
 /* Input: s - The socket object used for communication.      */
 /*        remote_path - The path to the remote directory to  */
 /*        be retrieved.                                      */
@@ -112,109 +1193,386 @@ void recvallFile(mysock &s, const string &local_file_path) {
 /*        and files will be saved.                           */
 /*************************************************************/
 void getRecursive(mysock &s, const string &remote_path, const string &local_path) {
-    // Send the recursive get request to the server
-    s.clientsend("get -R " + remote_path);
-
-    char response_buffer[DEFAULT_BUFFER_SIZE];
-    int receivedBytes;
+    // Send the recursive get request to the server, allowing bundles
+    sendCommand(s, getCommand("-R -B " + remote_path));
 
-    // Process server responses
-    while ((receivedBytes = s.clientrecv(response_buffer, sizeof(response_buffer))) > 0) {
-        string response(response_buffer, receivedBytes);
-
-        // End of directory listing
-        if (response == "EOF") {
-            cout << "Server signaled end of directory listing." << endl;
+    // The manifest arrives as text frames ended by an empty one, with
+    // one "DIR|FILE size mtime path" line per entry
+    string manifest, response;
+    while (true) {
+        if (!recvReply(s, response)) {
+            cerr << response << endl;
+            return;
+        }
+        if (response.empty()) {
             break;
         }
+        manifest += response;
+    }
 
-        stringstream ss(response);
-        string type, relative_path;
-        ss >> type >> relative_path;
+    struct entry {
+        string type;
+        uint64_t size;
+        int64_t mtime;
+        string path;
+        bool valid;
+    };
+    vector<entry> entries;
+    stringstream lines(manifest);
+    string line;
+    while (getline(lines, line)) {
+        entry e;
+        stringstream ss(line);
+        ss >> e.type >> e.size >> e.mtime;
+        ss.get(); // the space before the path, which may itself contain spaces
+        getline(ss, e.path);
+        fs::path relative(e.path);
+        bool escapes = relative.is_absolute() ||
+                       find(relative.begin(), relative.end(), fs::path("..")) != relative.end();
+        if (ss.fail() || e.path.empty() || escapes) {
+            cerr << "Skipping invalid manifest entry: " << line << endl;
+        }
+        e.valid = !ss.fail() && !e.path.empty() && !escapes; // invalid entries keep their place
+        entries.push_back(e);
+    }
 
-        string local_file_path = local_path + "/" + relative_path;
+    try {
+        fs::create_directories(local_path);
+        for (const auto &e : entries) {
+            if (e.type == "DIR" && e.valid) {
+                fs::create_directories(local_path + "/" + e.path);
+            }
+        }
+    } catch (const fs::filesystem_error &e) {
+        cerr << "Error creating local directory: " << e.what() << endl;
+    }
 
-        if (type == "DIR") {
-            // Create the corresponding local directory
-            try {
-                fs::create_directories(local_file_path);
-                cout << "Directory created: " << local_file_path << endl;
-            } catch (const fs::filesystem_error &e) {
-                cerr << "Error creating local directory: " << e.what() << endl;
-                continue; // Skip to the next item
+    // The file payloads follow back to back in manifest order, each one
+    // either as its own DATA/END (or ERROR) or as a record of a BUNDLE
+    vector<const entry *> files;
+    for (const auto &e : entries) {
+        if (e.type != "DIR") {
+            files.push_back(&e);
+        }
+    }
+    size_t received = 0, next = 0;
+    while (next < files.size()) {
+        frameheader h;
+        if (!recvheader(s, h)) {
+            throw runtime_error("Server closed the connection");
+        }
+        if (h.type == FRAME_BUNDLE) {
+            string payload = recvbundle(s, h);
+            for (const auto &record : parsebundle(payload)) {
+                if (next == files.size()) {
+                    throw runtime_error("Unexpected file in bundle");
+                }
+                const entry &e = *files[next++];
+                if (!e.valid || record.path != e.path) {
+                    cerr << "Skipping unexpected bundled file: " << record.path << endl;
+                    continue;
+                }
+                string local_file_path = local_path + "/" + e.path;
+                if (writeLocalFile(local_file_path, record.data, record.size)) {
+                    setModifiedTime(local_file_path, e.mtime);
+                    received++;
+                } else {
+                    cerr << "Error: Cannot create local file " << local_file_path << endl;
+                }
             }
-        } else if (type == "FILE") {
-            // Fetch the file from the server
-            cout << "Fetching file: " << relative_path << " -> " << local_file_path << endl;
-            s.clientsend("get " + relative_path);
-            recvallFile(s, local_file_path); // Corrected call
-        } else {
-            cerr << "Unknown type received: " << type << endl;
-            continue; // Skip invalid responses
+            continue;
+        }
+
+        const entry &e = *files[next++];
+        if (!e.valid) {
+            string error;
+            recvfiledata(s, -1, 0, error, &h); // consume it to stay in step
+            continue;
+        }
+        string local_file_path = local_path + "/" + e.path;
+        if (recvallFile(s, local_file_path, 0, &h)) {
+            setModifiedTime(local_file_path, e.mtime);
+            received++;
         }
     }
 
-    // Detect socket closure or end of response
-    if (receivedBytes <= 0) {
-        cerr << "Error: Connection lost or server closed unexpectedly." << endl;
+    // Directory times last, children first, since creating files bumps them
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        if (it->type == "DIR" && it->valid) {
+            setModifiedTime(local_path + "/" + it->path, it->mtime);
+        }
     }
 
-    cout << "Directory download complete: " << local_path << endl;
+    cout << "Directory download complete: " << local_path << " (" << received << " of " << files.size()
+         << " files)" << endl;
 }
 
+/*************************************************************/
+/* Function: makeDirectories                                  */
+/* Purpose: Creates remote directories with as few requests  */
+/*          as possible: the paths are packed into "mkdir -p"*/
+/*          commands that are all sent before any reply is   */
+/*          read.                                            */
+/* Input: s - The socket object used for communication.      */
+/*        dirs - The directories, relative to the base.      */
+/* Output: true if every directory exists afterwards.        */
+/*************************************************************/
+bool makeDirectories(mysock &s, const vector<string> &dirs) {
+    vector<string> batches;
+    string batch;
+    for (const auto &dir : dirs) {
+        if (!batch.empty() && batch.size() + dir.size() + 1 > MAX_TEXT_FRAME) {
+            batches.push_back(batch);
+            batch.clear();
+        }
+        batch += (batch.empty() ? "mkdir -p " : " ") + dir;
+    }
+    if (!batch.empty()) {
+        batches.push_back(batch);
+    }
+
+    for (const auto &command : batches) {
+        sendCommand(s, command);
+    }
+    bool ok = true;
+    for (size_t i = 0; i < batches.size(); ++i) {
+        string response;
+        if (!recvReply(s, response)) {
+            cerr << response << endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// A file on its way through the put -R pipeline
+struct uploadfile {
+    string local_path;
+    string relative_path;
+    int fd = -1;
+    uint64_t size = 0;
+    string record; // small files: the file already packed as a bundle record
+};
+
+// A put -R request waiting for its reply
+struct pendingput {
+    string label;
+    size_t files;
+};
+
 /*************************************************************/
 /* Function: putRecursive                                    */
 /* Purpose: Recursively uploads a directory and its files   */
-/*          to the server.                                   */
+/*          to the server. The work runs as a pipeline:     */
+/*          every directory is created first with batched   */
+/*          "mkdir -p" requests, then a walker thread lists */
+/*          the files, reader threads open them and pull    */
+/*          them into the page cache, and one sender thread */
+/*          per pooled connection streams them out. The     */
+/*          stages are joined by bounded queues. Small      */
+/*          files are read whole by the readers and sent    */
+/*          packed into bundles ("put -B"). A sender does   */
+/*          not wait for each reply: a companion thread     */
+/*          collects the replies while the next files are   */
+/*          already being sent.                             */
 /* Input: s - The socket object used for communication.      */
 /*        local_path - The path to the local directory to    */
 /*        be uploaded.                                       */
 /*        remote_path - The path to the remote directory.    */
+/*        connections - The number of connections to use.   */
 /*************************************************************/
-void putRecursive(mysock &s, const string &local_path, const string &remote_path) {
-    // Ensure the remote directory exists
-    s.clientsend("mkdir " + remote_path);
-    char buffer[DEFAULT_BUFFER_SIZE];
-    int receivedBytes = s.clientrecv(buffer, sizeof(buffer));
+void putRecursive(mysock &s, const string &local_path, const string &remote_path, int connections) {
+    if (!fs::is_directory(local_path)) {
+        cerr << "Error: " << local_path << " is not a directory." << endl;
+        return;
+    }
+    string root;
+    if (!basePath(s, remote_path, root)) {
+        return;
+    }
 
-    string response(buffer, receivedBytes);
-    if (response == "Error") {
-        cout << "Error creating remote directory: " << remote_path << endl;
+    // Stage 0: the whole directory skeleton, so files can land anywhere
+    const auto walk_options = fs::directory_options::skip_permission_denied;
+    vector<string> dirs = {root};
+    for (const auto &entry : fs::recursive_directory_iterator(local_path, walk_options)) {
+        if (entry.is_directory() && !entry.is_symlink()) {
+            dirs.push_back(root + "/" + fs::relative(entry.path(), local_path).string());
+        }
+    }
+    if (!makeDirectories(s, dirs)) {
         return;
     }
+    cout << "Remote directories ready: " << dirs.size() << endl;
 
-    // Iterate through the local directory structure
-    for (const auto &entry : fs::recursive_directory_iterator(local_path)) {
-        string local_file_path = entry.path().string();
-        string relative_path = fs::relative(entry.path(), local_path).string();
-        string remote_file_path = remote_path + "/" + relative_path;
-
-        if (entry.is_directory()) {
-            // Create the corresponding remote directory
-            s.clientsend("mkdir " + remote_file_path);
-            s.clientrecv(buffer, sizeof(buffer)); // Ignore mkdir response
-            cout << "Remote directory created: " << remote_file_path << endl;
-        } else if (entry.is_regular_file()) {
-            // Upload the file
-            ifstream infile(local_file_path, ios::binary);
-            if (!infile.is_open()) {
-                cout << "Error opening local file: " << local_file_path << endl;
-                continue;
-            }
+    workqueue<uploadfile> walked(UPLOAD_QUEUE_DEPTH);
+    workqueue<uploadfile> opened(UPLOAD_QUEUE_DEPTH);
+    atomic<size_t> found{0}, uploaded{0};
+    atomic<int> readers_left{UPLOAD_READERS};
+    atomic<int> senders_left{connections};
 
-            s.clientsend("put " + remote_file_path);
-            while (infile.read(buffer, sizeof(buffer))) {
-                s.clientsend(string(buffer, infile.gcount()));
+    // Stage 1: walk the tree
+    thread walker([&]() {
+        for (const auto &entry : fs::recursive_directory_iterator(local_path, walk_options)) {
+            if (entry.is_regular_file()) {
+                uploadfile f;
+                f.local_path = entry.path().string();
+                f.relative_path = fs::relative(entry.path(), local_path).string();
+                found++;
+                if (!walked.push(f)) {
+                    break;
+                }
+            } else if (!entry.is_directory()) {
+                cout << "Skipping unsupported file type: " << entry.path().string() << endl;
             }
-            infile.close();
-            s.clientsend("EOF");
-            cout << "File uploaded: " << local_file_path << " -> " << remote_file_path << endl;
-        } else {
-            cout << "Skipping unsupported file type: " << local_file_path << endl;
         }
+        walked.close();
+    });
+
+    // Stage 2: open the files and start reading them in
+    vector<thread> readers;
+    for (int i = 0; i < UPLOAD_READERS; ++i) {
+        readers.emplace_back([&]() {
+            uploadfile f;
+            while (walked.pop(f)) {
+                f.fd = open(f.local_path.c_str(), O_RDONLY | O_CLOEXEC);
+                struct stat st;
+                if (f.fd == -1 || fstat(f.fd, &st) == -1) {
+                    cerr << "Error opening local file: " << f.local_path << endl;
+                    if (f.fd != -1) {
+                        close(f.fd);
+                    }
+                    continue;
+                }
+                f.size = st.st_size;
+                if (f.size <= BUNDLE_FILE_MAX) {
+                    bool read = addfile(f.record, f.relative_path, f.fd, f.size);
+                    close(f.fd);
+                    f.fd = -1;
+                    if (!read) {
+                        cerr << "Error reading local file: " << f.local_path << endl;
+                        continue;
+                    }
+                } else {
+                    readahead(f.fd, 0, f.size < READAHEAD_LIMIT ? f.size : READAHEAD_LIMIT);
+                }
+                if (!opened.push(f)) {
+                    if (f.fd != -1) {
+                        close(f.fd);
+                    }
+                    break;
+                }
+            }
+            if (--readers_left == 0) {
+                opened.close();
+            }
+        });
     }
 
-    cout << "Directory upload complete: " << local_path << endl;
+    // Stage 3: send over a pool of connections
+    vector<thread> senders;
+    for (int i = 0; i < connections; ++i) {
+        senders.emplace_back([&, i]() {
+            mysock conn;
+            workqueue<pendingput> inflight(MAX_PIPELINED_PUTS);
+            thread replies([&]() {
+                pendingput p;
+                string reply;
+                try {
+                    while (inflight.pop(p)) {
+                        if (recvReply(conn, reply)) {
+                            uploaded += p.files;
+                            continue;
+                        }
+                        cerr << p.label << ": " << reply << endl;
+
+                        // A bundle reply starts "Error: <failed> of <files>"
+                        stringstream ss(reply);
+                        string word;
+                        size_t failed;
+                        if (p.files > 1 && ss >> word >> failed && failed < p.files) {
+                            uploaded += p.files - failed;
+                        }
+                    }
+                } catch (const exception &e) {
+                    cerr << "Error: connection " << i << ": " << e.what() << endl;
+                }
+                inflight.close();
+            });
+
+            uploadfile f;
+            string bundle;
+            size_t bundle_files = 0;
+            auto sendbundle = [&]() {
+                if (bundle.empty()) {
+                    return;
+                }
+                if (!inflight.push({"bundle of " + to_string(bundle_files) + " files", bundle_files})) {
+                    throw runtime_error("lost the connection");
+                }
+                uint32_t reqid = sendCommand(conn, "put -B " + root);
+                sendframe(conn, FRAME_BUNDLE, reqid, bundle.data(), bundle.size());
+                sendframe(conn, FRAME_END, reqid, nullptr, 0);
+                bundle.clear();
+                bundle_files = 0;
+            };
+
+            try {
+                conn.connect(server_host, server_port);
+                while (opened.pop(f)) {
+                    if (f.fd == -1) {
+                        bundle += f.record;
+                        bundle_files++;
+                        if (bundle.size() >= BUNDLE_TARGET) {
+                            sendbundle();
+                        }
+                        continue;
+                    }
+                    if (!inflight.push({f.local_path, 1})) {
+                        throw runtime_error("lost the connection");
+                    }
+                    uint32_t reqid = sendCommand(conn, "put " + root + "/" + f.relative_path);
+                    sendData(conn, reqid, f.fd, 0, f.size);
+                    close(f.fd);
+                    f.fd = -1;
+                }
+                sendbundle();
+                inflight.close();
+                replies.join();
+                sendCommand(conn, "exit");
+            } catch (const exception &e) {
+                cerr << "Error: connection " << i << ": " << e.what() << endl;
+                if (f.fd != -1) {
+                    close(f.fd);
+                }
+                inflight.close();
+                if (replies.joinable()) {
+                    replies.join();
+                }
+            }
+            conn.close();
+
+            // With no sender left the earlier stages must not wait forever
+            if (--senders_left == 0) {
+                walked.close();
+                opened.close();
+            }
+        });
+    }
+
+    walker.join();
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    for (auto &sender : senders) {
+        sender.join();
+    }
+    uploadfile leftover;
+    while (opened.pop(leftover)) {
+        close(leftover.fd);
+    }
+
+    cout << "Directory upload complete: " << local_path << " (" << uploaded << " of " << found << " files)"
+         << endl;
 }
 
 /*************************************************************/
@@ -231,6 +1589,395 @@ void printLocalWorkingDirectory() {
 	}
 }
 
+// The arguments of a put or get: [-R] [-P streams] [-z] source [destination]
+struct transferargs {
+    bool recursive = false;
+    int streams = 0; // 0 = not given
+    bool compress = false;
+    string source;
+    string destination;
+};
+
+/*************************************************************/
+/* Function: parseTransfer                                    */
+/* Purpose: Reads the arguments of a put or get. The         */
+/*          destination defaults to the source's file name.  */
+/* Input: argument - The arguments as typed.                 */
+/*        t - Receives them.                                 */
+/* Output: false if they are not valid.                      */
+/*************************************************************/
+bool parseTransfer(const string &argument, transferargs &t) {
+    stringstream ss(argument);
+    vector<string> args;
+    t.compress = compress_session;
+    string token;
+    while (ss >> token) {
+        if (token == "-R") {
+            t.recursive = true;
+        } else if (token == "-z") {
+            t.compress = true;
+        } else if (token == "-P" && ss >> token) {
+            t.streams = atoi(token.c_str());
+            if (t.streams < 1) {
+                return false;
+            }
+        } else {
+            args.push_back(token);
+        }
+    }
+    if (args.empty()) {
+        return false;
+    }
+    t.source = args[0];
+    t.destination = args.size() > 1 ? args[1] : fs::path(t.source).filename().string();
+    return true;
+}
+
+// A command sent ahead of the replies to earlier ones
+struct pendingcommand {
+    uint32_t reqid;
+    string command; // decides how the reply is printed
+    string line;    // the command as sent, to send again after a drop
+    string output;  // printed once the commands before it are done
+    string failure; // printed to cerr after the output
+    string prompt;  // the prompt shown after it, once it is done
+    bool done = false;
+
+    // A get: the stream is received into "<local>.part" from its first
+    // DATA frame on, while the replies to other commands arrive
+    string remote_path;
+    string local_path;
+    bool conditional = false; // asked with a download record (-c)
+    downloadrecord record;
+    string key;
+    string version;
+    int fd = -1;
+    unique_ptr<datareceiver> stream;
+    bool repair = false; // damaged ranges wait to be fetched again
+};
+
+// The commands waiting for replies, in the order they were sent
+deque<pendingcommand> pipelined;
+
+/*************************************************************/
+/* Function: inputWaiting                                     */
+/* Purpose: Tells whether the next command line can be read  */
+/*          without blocking, as when commands are piped in  */
+/*          from a script rather than typed.                 */
+/* Output: true if a line (or the end of input) is ready.    */
+/*************************************************************/
+bool inputWaiting() {
+    if (cin.rdbuf()->in_avail() > 0) {
+        return true;
+    }
+    struct pollfd p = {STDIN_FILENO, POLLIN, 0};
+    return poll(&p, 1, 0) > 0;
+}
+
+/*************************************************************/
+/* Function: formatListing                                    */
+/* Purpose: Turns one frame of an ls, find or grep answer    */
+/*          into the text printed for it. An ls page cut     */
+/*          short by -n ends with a cursor, shown as the     */
+/*          option that continues it.                        */
+/* Input: command - "ls", "find" or "grep".                  */
+/*        response - The frame's text.                       */
+/* Output: The text to print.                                */
+/*************************************************************/
+string formatListing(const string &command, const string &response) {
+    size_t at = command == "ls" ? response.rfind("CURSOR ") : string::npos;
+    if (at != string::npos && (at == 0 || response[at - 1] == '\n')) {
+        return response.substr(0, at) + "More entries: add -c " +
+               response.substr(at + 7, response.find('\n', at) - at - 7) + " to continue.\n";
+    }
+    return response;
+}
+
+/*************************************************************/
+/* Function: finishGet                                        */
+/* Purpose: Ends a pipelined get: the ".part" file is      */
+/*          renamed into place and recorded for conditional  */
+/*          gets, or removed if the file did not arrive.     */
+/* Input: p - The get.                                       */
+/*        complete - Whether every byte arrived intact.      */
+/*************************************************************/
+void finishGet(pendingcommand &p, bool complete) {
+    p.stream.reset();
+    p.repair = false;
+    p.done = true;
+    if (p.fd == -1) {
+        return;
+    }
+    close(p.fd);
+    p.fd = -1;
+
+    string part_path = p.local_path + ".part";
+    if (!complete) {
+        fs::remove(part_path);
+        return;
+    }
+    fs::rename(part_path, p.local_path);
+    p.output += "File transfer completed: " + p.local_path + "\n";
+    if (p.conditional) {
+        recordDownload(p.record, p.key, p.version, p.local_path);
+    }
+}
+
+/*************************************************************/
+/* Function: recvGetFrame                                     */
+/* Purpose: Takes one frame of the answer to a pipelined get.*/
+/*          A conditional get is answered "Unchanged" or     */
+/*          with the version its data follows. The ".part"   */
+/*          file is created when the data starts. Ranges     */
+/*          that fail the checksum check are left for        */
+/*          awaitReplies to fetch again.                     */
+/* Input: s - The socket object used for communication.      */
+/*        p - The get.                                       */
+/*        h - The frame's header.                            */
+/*************************************************************/
+void recvGetFrame(mysock &s, pendingcommand &p, const frameheader &h) {
+    if (!p.stream) {
+        if (h.type == FRAME_ERROR) {
+            p.failure = recvtext(s, h) + "\n";
+            p.done = true;
+            return;
+        }
+        if (h.type == FRAME_RESP && p.conditional) {
+            string word;
+            stringstream ss(recvtext(s, h));
+            ss >> word >> p.version;
+            if (word == "Unchanged") {
+                if (p.version != p.record.version) {
+                    p.record.version = p.version; // touched, or rewritten with the same contents
+                    saveRecord(p.record);
+                }
+                p.output = "Not modified: " + p.local_path + "\n";
+                p.done = true;
+                return;
+            }
+        }
+        p.fd = open((p.local_path + ".part").c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (p.fd == -1) {
+            p.failure = "Error: Cannot create local file " + p.local_path + "\n";
+        }
+        p.stream.reset(new datareceiver(p.fd, 0));
+        if (h.type == FRAME_RESP && p.conditional) {
+            return;
+        }
+    }
+
+    if (!p.stream->frame(s, h)) {
+        return;
+    }
+    if (p.stream->complete() || p.stream->damaged().empty() || p.fd == -1) {
+        if (!p.stream->error().empty()) {
+            p.failure += p.stream->error() + "\n";
+        }
+        finishGet(p, p.stream->complete());
+    } else {
+        p.repair = true;
+    }
+}
+
+/*************************************************************/
+/* Function: collectReplies                                   */
+/* Purpose: Receives replies to pipelined commands until no  */
+/*          more than keep are waiting. Frames are matched   */
+/*          to their command by request id, as the server    */
+/*          may answer several at once, and the DATA frames  */
+/*          of several gets may be interleaved. A command's  */
+/*          output is printed as soon as every command sent  */
+/*          before it is done, so it reads as if they ran    */
+/*          one at a time, and the oldest command's streams  */
+/*          in. A get whose data failed the checksum check   */
+/*          has the damaged ranges fetched again once no     */
+/*          other reply is on its way, so those frames come  */
+/*          alone.                                           */
+/* Input: s - The socket object used for communication.      */
+/*        keep - How many commands may still be waiting.     */
+/*************************************************************/
+void collectReplies(mysock &s, size_t keep) {
+    while (pipelined.size() > keep) {
+        bool arriving = any_of(pipelined.begin(), pipelined.end(),
+                               [](const pendingcommand &c) { return !c.done && !c.repair; });
+        if (!arriving) {
+            // Only the oldest can be left, waiting for its repair
+            pendingcommand &p = pipelined.front();
+            cout << flush;
+            finishGet(p, refetchRanges(s, p.remote_path, p.fd, p.stream->damaged()));
+        } else {
+            frameheader h;
+            if (!recvheader(s, h)) {
+                throw runtime_error("Server closed the connection");
+            }
+            auto p = find_if(pipelined.begin(), pipelined.end(),
+                             [&h](const pendingcommand &c) { return c.reqid == h.reqid && !c.done; });
+            if (p == pipelined.end()) {
+                throw runtime_error("Reply to an unknown request");
+            }
+            if (p->command == "get") {
+                recvGetFrame(s, *p, h);
+            } else {
+                string text = recvtext(s, h);
+                bool listing = p->command == "ls" || p->command == "find" || p->command == "grep";
+                if (p->command == "pwd") {
+                    p->output += "Remote directory: " + text + "\n";
+                    p->done = true;
+                } else if (!listing || h.type != FRAME_RESP) {
+                    p->output += text + "\n";
+                    p->done = true;
+                } else if (text.empty()) {
+                    p->output += "\n";
+                    p->done = true;
+                } else {
+                    p->output += formatListing(p->command, text);
+                }
+            }
+        }
+
+        while (!pipelined.empty()) {
+            cout << pipelined.front().output;
+            pipelined.front().output.clear();
+            if (!pipelined.front().done) {
+                break;
+            }
+            if (!pipelined.front().failure.empty()) {
+                cout << flush;
+                cerr << pipelined.front().failure;
+            }
+            cout << pipelined.front().prompt;
+            pipelined.pop_front();
+        }
+    }
+}
+
+/*************************************************************/
+/* Function: awaitReplies                                     */
+/* Purpose: Collects replies until no more than keep are     */
+/*          waiting. If the connection drops while gets are  */
+/*          among them, it is made again and the commands    */
+/*          that had not finished are run again in turn, the */
+/*          gets resuming from their ".part" files as a get  */
+/*          typed on its own would.                          */
+/* Input: s - The socket object used for communication.      */
+/*        keep - How many commands may still be waiting.     */
+/*************************************************************/
+void awaitReplies(mysock &s, size_t keep) {
+    try {
+        collectReplies(s, keep);
+    } catch (const fs::filesystem_error &) {
+        throw; // a local problem, reconnecting will not help
+    } catch (const exception &e) {
+        if (none_of(pipelined.begin(), pipelined.end(), [](const pendingcommand &c) { return c.command == "get"; })) {
+            throw;
+        }
+        cerr << "Connection lost (" << e.what() << "); reconnecting to resume." << endl;
+        reconnect(s);
+
+        deque<pendingcommand> unfinished;
+        unfinished.swap(pipelined);
+        for (pendingcommand &p : unfinished) {
+            if (p.command == "get" && !p.done) {
+                p.stream.reset();
+                if (p.fd != -1) {
+                    close(p.fd);
+                }
+                cout << flush;
+                withResume(s, [&]() { return getFile(s, p.remote_path, p.local_path); });
+                cout << p.prompt;
+                continue;
+            }
+            if (!p.done) {
+                p.output.clear();
+                p.reqid = sendCommand(s, p.line);
+            }
+            pipelined.push_back(move(p));
+            collectReplies(s, 0);
+        }
+    }
+}
+
+/*************************************************************/
+/* Function: showPrompt                                       */
+/* Purpose: Shows the REPL prompt, or queues it behind the   */
+/*          output of the commands still waiting for replies */
+/*          so a transcript reads as if they ran in turn.    */
+/*************************************************************/
+void showPrompt() {
+    if (pipelined.empty()) {
+        cout << "client> ";
+    } else {
+        pipelined.back().prompt += "client> ";
+    }
+}
+
+/*************************************************************/
+/* Function: sendPipelined                                    */
+/* Purpose: Sends an ls, find, grep, mkdir or pwd command    */
+/*          and returns before its reply arrives. While more */
+/*          commands are ready to be read they are sent too, */
+/*          so a script pays one round trip for a whole run  */
+/*          of them instead of one each. Once nothing more   */
+/*          is waiting to be read, or the window is full,    */
+/*          the replies are collected.                       */
+/* Input: s - The socket object used for communication.      */
+/*        command - The command.                             */
+/*        argument - Its arguments.                          */
+/*************************************************************/
+void sendPipelined(mysock &s, const string &command, const string &argument) {
+    pendingcommand p;
+    p.command = command;
+    p.line = argument.empty() ? command : command + " " + argument;
+    p.reqid = sendCommand(s, p.line);
+    pipelined.push_back(move(p));
+    awaitReplies(s, inputWaiting() ? MAX_PIPELINED_COMMANDS - 1 : 0);
+}
+
+/*************************************************************/
+/* Function: sendPipelinedGet                                 */
+/* Purpose: Sends a get of one file the way sendPipelined    */
+/*          sends a listing, so a script's gets are all on   */
+/*          their way at once and the server can answer them */
+/*          side by side. Gets that need replies before they */
+/*          can be asked are left to the caller: -R and -P,  */
+/*          a ".part" file to resume, and a destination an   */
+/*          earlier get is still writing.                    */
+/* Input: s - The socket object used for communication.      */
+/*        argument - The get's arguments.                    */
+/* Output: false if the get was not sent.                    */
+/*************************************************************/
+bool sendPipelinedGet(mysock &s, const string &argument) {
+    transferargs t;
+    struct stat st;
+    if (!parseTransfer(argument, t) || t.recursive || t.streams > 1 ||
+        (stat((t.destination + ".part").c_str(), &st) == 0 && st.st_size > 0)) {
+        return false;
+    }
+    for (const pendingcommand &c : pipelined) {
+        if (c.command == "get" && c.local_path == t.destination) {
+            return false;
+        }
+    }
+
+    pendingcommand p;
+    p.command = "get";
+    p.remote_path = t.source;
+    p.local_path = t.destination;
+    compress_transfer = t.compress;
+    if (cache_directory.empty()) {
+        p.reqid = sendCommand(s, getCommand(t.source));
+    } else {
+        p.conditional = true;
+        p.key = recordKey(t.source);
+        bool have = loadRecord(p.key, p.record) && localCopy(p.record, t.destination, st);
+        string known = have ? p.record.version + ":" + p.record.hash : "none";
+        p.reqid = sendCommand(s, getCommand("-m " + known + " " + t.source));
+    }
+    pipelined.push_back(move(p));
+    awaitReplies(s, inputWaiting() ? MAX_PIPELINED_COMMANDS - 1 : 0);
+    return true;
+}
+
 /*************************************************************/
 /* Function: displayHelp                                      */
 /* Purpose: Displays a list of available commands and their   */
@@ -239,17 +1986,23 @@ void printLocalWorkingDirectory() {
 void displayHelp() {
 	cout << "Available commands:\n"
 	 << "exit - Quit the application.\n"
+	 << "find [-name pattern] [-type f|d] [-size [+|-]N[k|M|G]] [-mtime [+|-]days] [path] - Find remote files and directories.\n"
+	 << "grep [-F] [-i] [-n] [-c|-l] pattern [path] - Search remote .txt, .csv and .log files for matching lines.\n"
 	 << "cd [path] - Change remote directory.\n"
-	 << "get [-R] remote-path [local-path] - Retrieve remote file/directory.\n"
+	 << "compress on|off - Compress transfers for the rest of the session.\n"
+	 << "dedup on|off - Skip uploads whose content the server already stores.\n"
+	 << "get [-R] [-P streams] [-z] remote-path [local-path] - Retrieve remote file/directory.\n"
 	 << "help - Display this help text.\n"
 	 << "lcd [path] - Change local directory.\n"
 	 << "lls [path] - List local directory contents.\n"
 	 << "lmkdir path - Create local directory.\n"
 	 << "lpwd - Display local working directory.\n"
-	 << "ls [path] - List remote directory contents.\n"
+	 << "ls [-l] [-s name|size|mtime] [-r] [-n count] [-c cursor] [path [pattern]] - List remote directory contents.\n"
 	 << "mkdir path - Create remote directory.\n"
-	 << "put [-R] local-path [remote-path] - Upload file/directory.\n"
-	 << "pwd - Display remote working directory.\n";
+	 << "put [-R] [-P streams] [-z] local-path [remote-path] - Upload file/directory.\n"
+	 << "pwd - Display remote working directory.\n"
+	 << "sync local-path [remote-path] - Upload only the changed parts of a file.\n"
+	 << "tune [auto | chunk|sndbuf|rcvbuf|lowat size|auto ...] - Show or fix the transfer sizes of this session.\n";
 }
 
 /*************************************************************/
@@ -262,108 +2015,194 @@ void displayHelp() {
 int main(int argc, char **argv) {
     struct options o = parsemenu(argc, argv);
 
+    server_host = o.hostname;
+    server_port = o.port;
+
+    if (!o.cache.empty() && !openDownloadCache(o.cache)) {
+        cerr << "Warning: Cannot use the download cache " << o.cache << "; gets are not conditional." << endl;
+    } else if (!o.cache.empty()) {
+        cache_directory = fs::absolute(o.cache).string();
+    }
+
+    // A dropped connection must surface as an error we can resume from
+    signal(SIGPIPE, SIG_IGN);
+
     mysock s;
     s.connect(o.hostname, o.port);
     cout << "Connected to server." << endl;
 
-    string command, argument, remote_path, local_path;
+    string command, argument;
 
     // REPL loop
-    while (true) {
-        cout << "client> ";
-        string input;
-        getline(cin, input);
+    try {
+        while (true) {
+            showPrompt();
+            string input;
+            if (!getline(cin, input)) {
+                awaitReplies(s, 0);
+                sendCommand(s, "exit");
+                break;
+            }
 
-        if (input.empty()) {
-            continue;
-        }
+            if (input.empty()) {
+                continue;
+            }
 
-        size_t len = input.find(' ');
-        command = input.substr(0, len); // Extract the command
-        argument = (len != string::npos) ? input.substr(len + 1) : "";
+            size_t len = input.find(' ');
+            command = input.substr(0, len); // Extract the command
+            argument = (len != string::npos) ? input.substr(len + 1) : "";
 
-        if (command == "exit") {
-            s.clientsend("exit");
-            cout << "Exiting...\n";
-            break;
-        } else if (command == "lcd") {
-            if (argument.empty()) {
-                argument = getenv("HOME"); // Default to home directory
-            }
-            if (chdir(argument.c_str()) == 0) {
-                cout << "Local directory changed to: " << argument << endl;
-            } else {
-                perror("Error changing local directory");
-            }
-        } else if (command == "lpwd") {
-            printLocalWorkingDirectory();
-        } else if (command == "help") {
-            displayHelp();
-        } else if (command == "cd") {
-            s.clientsend("cd " + argument);
-            char response[DEFAULT_BUFFER_SIZE];
-            int receivedBytes = s.clientrecv(response, sizeof(response));
-            cout << string(response, receivedBytes) << endl;
-        } else if (command == "pwd") {
-            s.clientsend("pwd");
-            char response[DEFAULT_BUFFER_SIZE];
-            int receivedBytes = s.clientrecv(response, sizeof(response));
-            cout << "Remote directory: " << string(response, receivedBytes) << endl;
-        } else if (command == "lls") {
-            // Handle local ls
-            DIR *dir = opendir(argument.empty() ? "." : argument.c_str());
-            if (dir) {
-                struct dirent *entry;
-                while ((entry = readdir(dir)) != nullptr) {
-                    cout << entry->d_name << (entry->d_type == DT_DIR ? "/" : "") << "\n";
-                }
-                closedir(dir);
-            } else {
-                perror("Error listing local directory");
-            }
-        } else if (command == "ls") {
-            s.clientsend("ls " + argument);
-            char response[DEFAULT_BUFFER_SIZE];
-            int receivedBytes = s.clientrecv(response, sizeof(response));
-            cout << string(response, receivedBytes) << endl;
-        } else if (command == "mkdir") {
-            s.clientsend("mkdir " + argument);
-            char response[DEFAULT_BUFFER_SIZE];
-            int receivedBytes = s.clientrecv(response, sizeof(response));
-            cout << string(response, receivedBytes) << endl;
-        } else if (command == "lmkdir") {
-            if (argument.empty()) {
-                cout << "Error: Directory name not specified.\n";
+            if (PIPELINED_COMMANDS.count(command)) {
+                sendPipelined(s, command, argument);
                 continue;
             }
-            // Attempt to create the directory
-            if (mkdir(argument.c_str(), 0755) == 0) {
-                cout << "Directory created: " << argument << endl;
-            } else {
-                perror("Error creating directory");
-            }
-        } else if (command == "put") {
-            size_t position = argument.find(" -R");
-            if (position != string::npos) {
-                local_path = argument.substr(0, position);
-                remote_path = argument.substr(position + 4);
-                putRecursive(s, local_path, remote_path);
-            } else {
-                s.clientsend("put " + argument);
-                // Implement the file sending functionality here
+            if (command == "get" && sendPipelinedGet(s, argument)) {
+                continue;
             }
-        } else if (command == "get") {
-            size_t position = argument.find(" -R");
-            if (position != string::npos) {
-                local_path = argument.substr(position + 4);
-                remote_path = argument.substr(0, position);
-                getRecursive(s, remote_path, local_path);
+            // Anything else waits for the commands sent ahead of it
+            awaitReplies(s, 0);
+
+            if (command == "exit") {
+                sendCommand(s, "exit");
+                cout << "Exiting...\n";
+                break;
+            } else if (command == "lcd") {
+                if (argument.empty()) {
+                    argument = getenv("HOME"); // Default to home directory
+                }
+                if (chdir(argument.c_str()) == 0) {
+                    cout << "Local directory changed to: " << argument << endl;
+                } else {
+                    perror("Error changing local directory");
+                }
+            } else if (command == "lpwd") {
+                printLocalWorkingDirectory();
+            } else if (command == "help") {
+                displayHelp();
+            } else if (command == "cd") {
+                string response;
+                sendCommand(s, "cd " + argument);
+                bool changed = recvReply(s, response);
+                cout << response << endl;
+
+                // Remember where we are, for reconnecting after a drop
+                string type, path;
+                uint64_t size;
+                if (changed && statRemote(s, ".", type, size, path)) {
+                    remote_cwd = path;
+                }
+            } else if (command == "lls") {
+                // Handle local ls
+                DIR *dir = opendir(argument.empty() ? "." : argument.c_str());
+                if (dir) {
+                    struct dirent *entry;
+                    while ((entry = readdir(dir)) != nullptr) {
+                        cout << entry->d_name << (entry->d_type == DT_DIR ? "/" : "") << "\n";
+                    }
+                    closedir(dir);
+                } else {
+                    perror("Error listing local directory");
+                }
+            } else if (command == "lmkdir") {
+                if (argument.empty()) {
+                    cout << "Error: Directory name not specified.\n";
+                    continue;
+                }
+                // Attempt to create the directory
+                if (mkdir(argument.c_str(), 0755) == 0) {
+                    cout << "Directory created: " << argument << endl;
+                } else {
+                    perror("Error creating directory");
+                }
+            } else if (command == "compress") {
+                if (argument != "on" && argument != "off") {
+                    cout << "Usage: compress on|off" << endl;
+                    continue;
+                }
+                string response;
+                sendCommand(s, "compress " + (argument == "on" ? COMPRESSION_METHOD : string("none")));
+                if (recvReply(s, response)) {
+                    compress_session = argument == "on";
+                }
+                cout << response << endl;
+            } else if (command == "tune") {
+                // The same sizes are fixed at both ends of the connection
+                stringstream ss(argument);
+                vector<string> words;
+                string word;
+                while (ss >> word) {
+                    words.push_back(word);
+                }
+                linksettings settings = link_overrides;
+                string error;
+                if (!words.empty() && !parselinksettings(words, settings, error)) {
+                    cout << error << endl;
+                    continue;
+                }
+                string response;
+                sendCommand(s, words.empty() ? "tune" : "tune " + formatlinksettings(settings));
+                if (recvReply(s, response) && !words.empty()) {
+                    link_overrides = settings;
+                    s.tuning().force(settings);
+                }
+                cout << "Server: " << response << endl;
+                cout << "Client: " << s.tuning().describe() << endl;
+            } else if (command == "dedup") {
+                if (argument != "on" && argument != "off") {
+                    cout << "Usage: dedup on|off" << endl;
+                    continue;
+                }
+                string response = "Dedup: off";
+                if (argument == "on") {
+                    sendCommand(s, "dedup");
+                    dedup_session = recvReply(s, response);
+                } else {
+                    dedup_session = false;
+                }
+                cout << response << endl;
+            } else if (command == "sync") {
+                stringstream ss(argument);
+                string source, destination;
+                if (!(ss >> source)) {
+                    cout << "Usage: sync local-path [remote-path]" << endl;
+                    continue;
+                }
+                if (!(ss >> destination)) {
+                    destination = fs::path(source).filename().string();
+                }
+                compress_transfer = compress_session; // for a fallback to a full upload
+                withResume(s, [&]() { return syncFile(s, source, destination); });
+            } else if (command == "put" || command == "get") {
+                transferargs t;
+                if (!parseTransfer(argument, t)) {
+                    cout << "Usage: " << command << " [-R] [-P streams] [-z] source [destination]" << endl;
+                    continue;
+                }
+                compress_transfer = t.compress;
+
+                if (command == "put") {
+                    if (t.recursive) {
+                        putRecursive(s, t.source, t.destination, t.streams > 0 ? t.streams : DEFAULT_UPLOAD_CONNECTIONS);
+                    } else if (t.streams > 1) {
+                        parallelPut(s, t.source, t.destination, t.streams);
+                    } else {
+                        withResume(s, [&]() { return sendallFile(s, t.source, t.destination); });
+                    }
+                } else {
+                    if (t.recursive) {
+                        getRecursive(s, t.source, t.destination);
+                    } else if (t.streams > 1) {
+                        parallelGet(s, t.source, t.destination, t.streams);
+                    } else {
+                        withResume(s, [&]() { return getFile(s, t.source, t.destination); }); // Fetch single file
+                    }
+                }
             } else {
-                recvallFile(s, argument); // Fetch single file
+                cout << "Unknown command: " << command << endl;
             }
-        } else {
-            cout << "Unknown command: " << command << endl;
         }
+    } catch (const exception &e) {
+        cerr << "Error: " << e.what() << ". Disconnecting." << endl;
     }
 
     s.close();
@@ -38,292 +38,627 @@
 /*      servers," https://stackoverflow.com/                 */
 /*************************************************************/
 
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <filesystem>
 #include <csignal>
+#include <thread>
 #include <unistd.h>
 #include <set>
 #include <cstring>
 #include "socket.h"
+#include "protocol.h"
+#include "transfer.h"
+#include "commands.h"
+#include "bundle.h"
+#include "compress.h"
+#include "reactor.h"
+#include "serverparse.h"
+#include "checksum.h"
+#include "store.h"
+#include "treeindex.h"
+#include "hotcache.h"
+#include "taskqueue.h"
+#include <fcntl.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <climits>
 #include <vector>
 #include <algorithm>
 
 using namespace std;
 namespace fs = std::filesystem;
 
-constexpr size_t DEFAULT_BUFFER_SIZE = 4096;
 constexpr int SUCCESS_CODE = 0;
-const vector<string> ALLOWED_EXTENSIONS = {".txt", ".csv", ".log"};
 
-string base_directory;
+// Commands of one session that may run at once, and that may wait
+// for a thread before the session stops reading more
+constexpr size_t SESSION_THREADS = 4;
+constexpr size_t SESSION_BACKLOG = 64;
+
 bool shutdown_flag = false;
 
 /*************************************************************/
-/* function: isWithinBaseDirectory                          */
-/* purpose: Verifies whether a given file path is within    */
-/*          the allowed base directory to ensure security.  */
+/* function: sendReply                                      */
+/* purpose: Sends a text reply for a request.               */
 /* parameters:                                              */
-/*    - path: the file or directory path to check.          */
+/*    - client: the mysock object representing the client.  */
+/*    - reqid: the id of the request being answered.        */
+/*    - r: the reply to send.                               */
 /*************************************************************/
-bool isWithinBaseDirectory(const fs::path &path) {
-    try {
-        fs::path canonical_base = fs::canonical(base_directory);
-        fs::path canonical_path = fs::weakly_canonical(path);
-        return canonical_path.string().find(canonical_base.string()) == 0;
-    } catch (const fs::filesystem_error &e) {
-        return false;
+void sendReply(mysock &client, uint32_t reqid, const reply &r) {
+    sendtext(client, r.type, reqid, r.text);
+}
+
+/*************************************************************/
+/* function: sendListing                                    */
+/* purpose: Handles "ls": streams the listing as RESP       */
+/*          frames while the directory is read, ended by an */
+/*          empty RESP, or sends a single ERROR frame.      */
+/* parameters:                                              */
+/*    - client: the mysock object representing the client.  */
+/*    - sess: the client's session.                         */
+/*    - reqid: the id of the ls request.                    */
+/*    - c: the parsed ls command.                           */
+/*************************************************************/
+void sendListing(mysock &client, session &sess, uint32_t reqid, const command &c) {
+    dirlisting listing;
+    reply err;
+    if (!openListing(sess, c, listing, err)) {
+        sendReply(client, reqid, err);
+        return;
+    }
+    string text;
+    while (listing.next(text)) {
+        sendtext(client, FRAME_RESP, reqid, text);
     }
+    sendtext(client, FRAME_RESP, reqid, "");
 }
 
 /*************************************************************/
-/* function: hasAllowedExtension                            */
-/* purpose: Checks if a file path has an allowed extension  */
+/* function: sendFound                                      */
+/* purpose: Handles "find": streams the matching entries    */
+/*          as RESP frames while the tree is walked, ended  */
+/*          by an empty RESP, or sends a single ERROR frame.*/
 /* parameters:                                              */
-/*    - file_path: the file path to check.                  */
+/*    - client: the mysock object representing the client.  */
+/*    - sess: the client's session.                         */
+/*    - reqid: the id of the find request.                  */
+/*    - c: the parsed find command.                         */
 /*************************************************************/
-bool hasAllowedExtension(const fs::path &file_path) {
-    string ext = file_path.extension().string();
-    return find(ALLOWED_EXTENSIONS.begin(), ALLOWED_EXTENSIONS.end(), ext) != ALLOWED_EXTENSIONS.end();
+void sendFound(mysock &client, session &sess, uint32_t reqid, const command &c) {
+    findwalk walk;
+    reply err;
+    if (!openFind(sess, c, walk, err)) {
+        sendReply(client, reqid, err);
+        return;
+    }
+    string text;
+    while (walk.next(text)) {
+        sendtext(client, FRAME_RESP, reqid, text);
+    }
+    sendtext(client, FRAME_RESP, reqid, "");
+}
+
+/*************************************************************/
+/* function: sendMatches                                    */
+/* purpose: Handles "grep": streams the matching lines as   */
+/*          RESP frames while the files are scanned, ended  */
+/*          by an empty RESP, or sends a single ERROR frame.*/
+/* parameters:                                              */
+/*    - client: the mysock object representing the client.  */
+/*    - sess: the client's session.                         */
+/*    - reqid: the id of the grep request.                  */
+/*    - c: the parsed grep command.                         */
+/*************************************************************/
+void sendMatches(mysock &client, session &sess, uint32_t reqid, const command &c) {
+    textsearch search;
+    reply err;
+    if (!openSearch(sess, c, search, err)) {
+        sendReply(client, reqid, err);
+        return;
+    }
+    string text;
+    while (search.next(text)) {
+        sendtext(client, FRAME_RESP, reqid, text);
+    }
+    sendtext(client, FRAME_RESP, reqid, "");
+}
+
+/*************************************************************/
+/* function: sendCached                                     */
+/* purpose: Sends a whole file held in the hot-file cache   */
+/*          as a DATA frame and its END frame, straight     */
+/*          from the shared memory and with the digest that */
+/*          was worked out when it was copied in. On a      */
+/*          multiplexed connection each INTEGRITY_BLOCK is  */
+/*          a DATA frame of its own, as from sendfileframe. */
+/* parameters:                                              */
+/*    - client: the mysock object representing the client.  */
+/*    - reqid: the id of the get request.                   */
+/*    - hot: the held file.                                 */
+/*************************************************************/
+void sendCached(mysock &client, uint32_t reqid, const hotfile &hot) {
+    vector<iovec> body;
+    hot.visit([&body](const char *data, size_t size) {
+        body.push_back({const_cast<char *>(data), size});
+    });
+    string digest = hot.digest();
+    frameheader h;
+    h.type = FRAME_END;
+    h.reqid = reqid;
+    h.length = digest.size();
+    char end[FRAME_HEADER_SIZE];
+    encodeheader(h, end);
+
+    uint64_t most = client.multiplexed() ? INTEGRITY_BLOCK : hot.size();
+    uint64_t left = hot.size();
+    size_t piece = 0; // next piece of body to frame
+    size_t skip = 0;  // bytes of it already framed
+    h.type = FRAME_DATA;
+    do {
+        h.length = left < most ? left : most;
+        left -= h.length;
+        char header[FRAME_HEADER_SIZE];
+        encodeheader(h, header);
+
+        // Each frame goes out in as few sendmsg calls as the pieces allow
+        vector<iovec> pieces{{header, sizeof(header)}};
+        for (uint64_t want = h.length; want > 0;) {
+            size_t take = min<uint64_t>(body[piece].iov_len - skip, want);
+            pieces.push_back({static_cast<char *>(body[piece].iov_base) + skip, take});
+            want -= take;
+            skip += take;
+            if (skip == body[piece].iov_len) {
+                ++piece;
+                skip = 0;
+            }
+        }
+        if (left == 0) {
+            pieces.push_back({end, sizeof(end)});
+            pieces.push_back({&digest[0], digest.size()});
+        }
+        auto held = client.holdframes();
+        for (size_t sent = 0; sent < pieces.size(); sent += IOV_MAX) {
+            client.sendallv(&pieces[sent], min<size_t>(pieces.size() - sent, IOV_MAX));
+        }
+    } while (left > 0);
 }
 
 /*************************************************************/
 /* function: sendallFile                                    */
-/* purpose: Sends a file to the client in chunks over a     */
-/*          socket connection. Appends an "EOF" marker to   */
-/*          signal the end of the transfer.                 */
+/* purpose: Sends a file to the client as a DATA frame      */
+/*          terminated by an END frame, or a single ERROR   */
+/*          frame if the file cannot be served. The bytes   */
+/*          go from the page cache to the socket through    */
+/*          sendfile without being copied into the server.  */
+/*          A ranged get sends only the requested bytes.    */
+/*          A compressed get is read and deflated in chunks */
+/*          instead. A whole uncompressed file held in the  */
+/*          hot-file cache is sent from there. A conditional */
+/*          get is first answered with a RESP frame: either */
+/*          "Unchanged <version>" and nothing more, or      */
+/*          "Version <version>" followed by the file.       */
 /* parameters:                                              */
 /*    - client: the mysock object representing the client.  */
-/*    - file_path: the path of the file to be sent.         */
+/*    - sess: the client's session.                         */
+/*    - reqid: the id of the get request.                   */
+/*    - c: the parsed get command.                          */
+/*    - compress: whether to compress the file.             */
+/*    - known: the client's copy for a conditional get (-m),*/
+/*             or empty.                                    */
 /*************************************************************/
-void sendallFile(mysock &client, const string &file_path) {
-    if (!hasAllowedExtension(file_path)) {
-        client.clientsend("Error: Unsupported file type.");
+void sendallFile(mysock &client, session &sess, uint32_t reqid, const command &c, bool compress,
+                 const string &known) {
+    cout << "Processing 'get' command for: " << c.arg(0) << endl;
+
+    string file_path;
+    uint64_t offset, length;
+    reply err;
+    int fd = openForGet(sess, c, file_path, offset, length, err);
+    if (fd == -1) {
+        sendReply(client, reqid, err);
         return;
     }
 
-    ifstream infile(file_path, ios::binary);
-    if (!infile) {
-        client.clientsend("Error: File not found.");
+    if (!known.empty()) {
+        string version;
+        if (checkUnchanged(fd, known, version)) {
+            ::close(fd);
+            sendtext(client, FRAME_RESP, reqid, "Unchanged " + version);
+            cout << "File unchanged: " << file_path << endl;
+            return;
+        }
+        // MSG_MORE lets the reply share a segment with the file; alone it
+        // would hold back the next small segment until it is acked
+        string text = "Version " + version;
+        frameheader h;
+        h.type = FRAME_RESP;
+        h.reqid = reqid;
+        h.length = text.size();
+        char header[FRAME_HEADER_SIZE];
+        encodeheader(h, header);
+        auto held = client.holdframes();
+        client.sendall(header, sizeof(header), MSG_MORE);
+        client.sendall(text.data(), text.size(), MSG_MORE);
+    }
+
+    hotfile hot;
+    if (!compress && offset == 0 && hot.open(fd) && hot.size() == length) {
+        ::close(fd);
+        sendCached(client, reqid, hot);
+        cout << "File sent from cache: " << file_path << endl;
         return;
     }
+    hot.release();
+
+    try {
+        if (compress) {
+            sendcompressed(client, reqid, fd, offset, length);
+        } else {
+            sendfiledata(client, reqid, fd, offset, length);
+        }
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    cout << "File sent: " << file_path << endl;
+}
+
+/*************************************************************/
+/* function: sendTree                                       */
+/* purpose: Answers "get -R". The manifest of the tree goes */
+/*          out first as RESP frames ended by an empty one, */
+/*          then every FILE entry follows in manifest order */
+/*          as DATA and END (or ERROR if it can no longer be */
+/*          read), without waiting for the client between   */
+/*          files. With bundling, runs of small files are   */
+/*          packed into BUNDLE frames instead.              */
+/* parameters:                                              */
+/*    - client: the mysock object representing the client.  */
+/*    - sess: the client's session.                         */
+/*    - reqid: the id of the get request.                   */
+/*    - arg: the directory to send.                         */
+/*    - bundling: whether small files may be bundled.       */
+/*    - compress: whether to compress the other files.      */
+/*************************************************************/
+void sendTree(mysock &client, session &sess, uint32_t reqid, const string &arg, bool bundling, bool compress) {
+    cout << "Processing 'get -R' command for: " << arg << endl;
+
+    string root;
+    fdhandle root_fd;
+    vector<treeentry> entries;
+    reply err;
+    if (!listTree(sess, arg, root, root_fd, entries, err)) {
+        sendReply(client, reqid, err);
+        return;
+    }
+    for (const auto &chunk : formatManifest(entries)) {
+        sendtext(client, FRAME_RESP, reqid, chunk);
+    }
+    sendtext(client, FRAME_RESP, reqid, "");
+
+    size_t next = 0;
+    while (true) {
+        treeitem item = nextTreeItem(root, root_fd.get(), entries, next, bundling);
+        if (item.kind == treeitemkind::DONE) {
+            break;
+        } else if (item.kind == treeitemkind::BUNDLE) {
+            sendframe(client, FRAME_BUNDLE, reqid, item.text.data(), item.text.size());
+        } else if (item.kind == treeitemkind::FAILED) {
+            sendReply(client, reqid, {FRAME_ERROR, item.text});
+        } else {
+            try {
+                if (compress) {
+                    sendcompressed(client, reqid, item.fd, 0, item.size);
+                } else {
+                    sendfiledata(client, reqid, item.fd, 0, item.size);
+                }
+            } catch (...) {
+                ::close(item.fd);
+                throw;
+            }
+            ::close(item.fd);
+        }
+    }
+    cout << "Directory sent: " << root << endl;
+}
 
-    vector<char> buffer(DEFAULT_BUFFER_SIZE);
-    while (infile.read(buffer.data(), buffer.size()) || infile.gcount() > 0) {
-        client.clientsend(string(buffer.data(), infile.gcount()));
+/*************************************************************/
+/* function: recvBundle                                     */
+/* purpose: Handles "put -B": unpacks the BUNDLE frames     */
+/*          that follow the command into files below the    */
+/*          given directory until END (or ERROR if the      */
+/*          client aborted), then sends one reply.          */
+/* parameters:                                              */
+/*    - client: the mysock object representing the client.  */
+/*    - sess: the client's session.                         */
+/*    - reqid: the id of the put request.                   */
+/*    - arg: the directory the files are relative to.       */
+/*************************************************************/
+void recvBundle(mysock &client, session &sess, uint32_t reqid, const string &arg) {
+    bundlewriter w;
+    reply err;
+    bool accepted = openBundle(sess, arg, w, err);
+
+    frameheader h;
+    while (recvheader(client, h)) {
+        if (h.type == FRAME_BUNDLE) {
+            string payload = recvbundle(client, h);
+            if (accepted) {
+                storeBundle(w, payload);
+            }
+        } else if (h.type == FRAME_END) {
+            skippayload(client, h);
+            sendReply(client, reqid, accepted ? finishBundle(w) : err);
+            cout << "Bundle received into " << w.root << ": " << w.stored << " files" << endl;
+            return;
+        } else if (h.type == FRAME_ERROR) {
+            sendReply(client, reqid, {FRAME_ERROR, recvtext(client, h)});
+            return;
+        } else {
+            skippayload(client, h);
+        }
     }
-    infile.close();
-    client.clientsend("EOF");
+    throw runtime_error("Connection closed in the middle of a transfer");
 }
 
 /*************************************************************/
 /* function: recvFile                                       */
 /* purpose: Receives a file from the client and writes it   */
-/*          to the server's file system. The operation ends */
-/*          when an "EOF" marker is received. Ensures all   */
-/*          bytes are written to the file.                  */
+/*          to the server's file system. The upload is the  */
+/*          DATA frames that follow the put command, ended  */
+/*          by END (or ERROR if the client aborted). The    */
+/*          payload is spliced from the socket into the     */
+/*          file. Exactly one reply is sent once the stream */
+/*          is consumed. A ranged put is written in place   */
+/*          and is not removed if it fails.                 */
 /* parameters:                                              */
 /*    - client: the mysock object representing the client.  */
-/*    - file_path: the destination path for the file.       */
+/*    - sess: the client's session.                         */
+/*    - reqid: the id of the put request.                   */
+/*    - c: the parsed put command.                          */
 /*************************************************************/
-void recvFile(mysock &client, const string &file_path) {
-    if (!hasAllowedExtension(file_path)) {
-        client.clientsend("Error: Unsupported file type.");
+void recvFile(mysock &client, session &sess, uint32_t reqid, const command &c) {
+    string file_path, error;
+    location target;
+    uint64_t offset;
+    bool ranged;
+    reply err;
+    int fd = openForPut(sess, c, file_path, target, offset, ranged, err);
+    if (fd == -1) {
+        recvfiledata(client, -1, 0, error);
+        sendReply(client, reqid, err);
         return;
     }
 
-    ofstream outfile(file_path, ios::binary);
-    if (!outfile) {
-        client.clientsend("Error: Cannot create file.");
+    sha256 content;
+    bool hashing = hashesUpload(c, offset);
+    bool complete;
+    try {
+        complete = recvfiledata(client, fd, offset, error, nullptr, nullptr, hashing ? &content : nullptr);
+    } catch (...) {
+        ::close(fd);
+        if (!ranged) {
+            discardPut(target);
+        }
+        throw;
+    }
+    ::close(fd);
+    if (!complete) {
+        if (!ranged) {
+            discardPut(target);
+        }
+        sendReply(client, reqid, {FRAME_ERROR, error});
         return;
     }
 
-    vector<char> buffer(DEFAULT_BUFFER_SIZE);
-    while (true) {
-        int receivedBytes = client.clientrecv(buffer.data(), buffer.size());
-        if (receivedBytes <= 0) {
-            break;
+    sendReply(client, reqid, finishPut(file_path, target, hashing ? &content : nullptr));
+}
+
+/*************************************************************/
+/* function: syncFile                                       */
+/* purpose: Handles "sync": sends the block signatures of   */
+/*          the current copy of a file as DATA frames after */
+/*          a SIGNATURE response, then rebuilds the file    */
+/*          from the delta the client answers with, until   */
+/*          END (or ERROR if the client aborted). The old   */
+/*          copy stays in place until the new one is        */
+/*          complete.                                       */
+/* parameters:                                              */
+/*    - client: the mysock object representing the client.  */
+/*    - sess: the client's session.                         */
+/*    - reqid: the id of the sync request.                  */
+/*    - c: the parsed sync command.                         */
+/*************************************************************/
+void syncFile(mysock &client, session &sess, uint32_t reqid, const command &c) {
+    syncwriter w;
+    string header, signatures;
+    reply err;
+    if (!openSync(sess, c, w, header, signatures, err)) {
+        sendReply(client, reqid, err);
+        return;
+    }
+
+    try {
+        sendtext(client, FRAME_RESP, reqid, header);
+        for (size_t sent = 0; sent < signatures.size(); sent += DELTA_FRAME_TARGET) {
+            size_t n = min(signatures.size() - sent, DELTA_FRAME_TARGET);
+            sendframe(client, FRAME_DATA, reqid, signatures.data() + sent, n);
         }
-        string data(buffer.data(), receivedBytes);
-        if (data == "EOF") {
-            break;
+        sendframe(client, FRAME_END, reqid, nullptr, 0);
+
+        frameheader h;
+        while (recvheader(client, h)) {
+            if (h.type == FRAME_DATA) {
+                string ops = recvtext(client, h);
+                applySync(w, ops.data(), ops.size());
+            } else if (h.type == FRAME_END) {
+                skippayload(client, h);
+                sendReply(client, reqid, finishSync(w));
+                return;
+            } else if (h.type == FRAME_ERROR) {
+                abortSync(w);
+                sendReply(client, reqid, {FRAME_ERROR, recvtext(client, h)});
+                return;
+            } else {
+                skippayload(client, h);
+            }
         }
-        outfile.write(data.c_str(), receivedBytes);
+    } catch (...) {
+        abortSync(w);
+        throw;
     }
+    abortSync(w);
+    throw runtime_error("Connection closed in the middle of a transfer");
+}
 
-    outfile.close();
-    client.clientsend("File received successfully.");
+/*************************************************************/
+/* function: isQuery                                        */
+/* purpose: Tells whether a command only reads: it neither  */
+/*          changes the session nor the files, so it may    */
+/*          run alongside the session's other queries.      */
+/* parameters:                                              */
+/*    - c: the parsed command.                              */
+/*************************************************************/
+bool isQuery(const command &c) {
+    static const set<string> queries = {"ls", "find", "grep", "get", "pwd", "stat", "sum"};
+    return queries.count(c.cmd) > 0;
 }
 
 /*************************************************************/
-/* function: parseCommands                                  */
-/* purpose: Parses and executes multiple commands received  */
-/*          in a single buffer.                             */
+/* function: runQuery                                       */
+/* purpose: Answers a query command, on a thread of the     */
+/*          session's task queue.                           */
 /* parameters:                                              */
-/*    - commands: the raw commands string.                  */
+/*    - client: the mysock object representing the client.  */
+/*    - sess: the client's session.                         */
+/*    - reqid: the id of the request.                       */
+/*    - c: the parsed command.                              */
 /*************************************************************/
-vector<string> parseCommands(const string &commands) {
-    vector<string> command_list;
-    stringstream ss(commands);
-    string command;
-    while (getline(ss, command, '\n')) {
-        command_list.push_back(command);
+void runQuery(mysock &client, session &sess, uint32_t reqid, command c) {
+    if (c.cmd == "ls") {
+        sendListing(client, sess, reqid, c);
+    } else if (c.cmd == "find") {
+        sendFound(client, sess, reqid, c);
+    } else if (c.cmd == "grep") {
+        sendMatches(client, sess, reqid, c);
+    } else if (c.cmd == "get") {
+        // get [-R] [-B] [-z] [-m known] path ...
+        bool recursive = takeOption(c, "-R");
+        bool bundling = takeOption(c, "-B");
+        bool compress = takeOption(c, "-z") || sess.compress;
+        string known;
+        takeValue(c, "-m", known);
+        if (recursive) {
+            sendTree(client, sess, reqid, c.arg(0), bundling, compress);
+        } else {
+            sendallFile(client, sess, reqid, c, compress, known);
+        }
+    } else {
+        sendReply(client, reqid, runCommand(sess, c));
     }
-    return command_list;
 }
 
 /*************************************************************/
 /* function: handleClient                                   */
 /* purpose: Processes commands from the client, such as     */
 /*          file uploads/downloads, directory navigation,   */
-/*          and listing contents. Each command is executed  */
-/*          securely within the base directory.             */
+/*          and listing contents. Each command arrives as a */
+/*          CMD frame and is answered with frames carrying  */
+/*          the same request id. A client may send commands */
+/*          without waiting for the answers: queries run    */
+/*          concurrently on the session's task queue and    */
+/*          their frames interleave, while any other        */
+/*          command waits for the queries before it and     */
+/*          runs alone, so each sees the effects of the     */
+/*          commands sent ahead of it. Each command is      */
+/*          executed securely within the base directory.    */
 /* parameters:                                              */
 /*    - client: the mysock object representing the client.  */
 /*************************************************************/
 void handleClient(mysock &client) {
-    string current_directory = base_directory;
+    session sess;
+    client.sharesends();
+    taskqueue tasks(SESSION_THREADS, SESSION_BACKLOG);
 
     try {
+        startSession(sess);
         while (true) {
-            char buffer[DEFAULT_BUFFER_SIZE];
-            int receivedBytes = client.clientrecv(buffer, sizeof(buffer) - 1);
-            if (receivedBytes <= 0) {
-                cout << "Error or client disconnected." << endl;
+            frameheader header;
+            if (!recvheader(client, header)) {
+                cout << "Client disconnected." << endl;
                 break;
             }
-            buffer[receivedBytes] = '\0';
-            vector<string> commands = parseCommands(buffer);
-
-            for (const auto &command : commands) {
-                cout << "Command received: " << command << endl;
-
-                stringstream ss(command);
-                string cmd, arg1, arg2;
-                ss >> cmd >> arg1 >> arg2;
-                
-                //comand handling logic
-                if (cmd == "exit") {
-                    cout << "Client disconnected." << endl;
-                    break;
-                } else if (cmd == "cd") {
-                    fs::path target_path = fs::absolute(current_directory + "/" + arg1);
-                    if (!fs::exists(target_path)) {
-                        client.clientsend("Error: Directory does not exist.");
-                    } else if (!isWithinBaseDirectory(target_path)) {
-                        client.clientsend("Error: Access denied to restricted directory.");
-                    } else if (fs::is_directory(target_path)) {
-                        current_directory = target_path.string();
-                        client.clientsend("Directory changed to: " + current_directory);
-                    } else {
-                        client.clientsend("Error: Target is not a directory.");
-                    }
-                    continue;
-                } else if (cmd == "pwd") {
-                    client.clientsend(current_directory);
-                    continue;
-                } else if (cmd == "ls") {
-                    fs::path list_path = arg1.empty() ? current_directory : current_directory + "/" + arg1;
-                    if (!fs::exists(list_path) || !isWithinBaseDirectory(list_path)) {
-                        client.clientsend("Error: Path does not exist or access denied.");
-                        continue;
-                    } else if (fs::is_directory(list_path)) {
-                        stringstream response;
-                        for (const auto &entry : fs::directory_iterator(list_path)) {
-                            response << entry.path().filename() << (fs::is_directory(entry) ? "/" : "") << "\n";
-                        }
-                        client.clientsend(response.str());
-                    } else {
-                        client.clientsend("Error: Specified path is not a directory.");
-                        continue;
-                    }
-                } else if (cmd == "mkdir") {
-                    fs::path dir_path = fs::absolute(current_directory + "/" + arg1);
-                    if (isWithinBaseDirectory(dir_path)) {
-                        try {
-                            if (fs::create_directory(dir_path)) {
-                                client.clientsend("Directory created.");
-                            } else {
-                                client.clientsend("Error: Directory already exists or cannot be created.");
-                            }
-                        } catch (const fs::filesystem_error &e) {
-                            client.clientsend("Error: " + string(e.what()));
-                        }
-                    } else {
-                        client.clientsend("Error: Access denied.");
-                    }
-                    continue;
-                } else if (cmd == "lmkdir") {
-                    if (arg1.empty()) {
-                        client.clientsend("Error: Directory name not specified.");
-                        continue;
-                    }
-                    if (mkdir(arg1.c_str(), 0755) == 0) {
-                        client.clientsend("Local directory created: " + arg1);
-                    } else {
-                        client.clientsend("Error: Unable to create local directory.");
-                    }
-                    continue;
-                } else if (cmd == "lls") {
-                    DIR *dir = opendir(arg1.empty() ? "." : arg1.c_str());
-                    if (dir) {
-                        stringstream response;
-                        struct dirent *entry;
-                        while ((entry = readdir(dir)) != nullptr) {
-                            response << entry->d_name << (entry->d_type == DT_DIR ? "/" : "") << "\n";
-                        }
-                        closedir(dir);
-                        client.clientsend(response.str());
-                    } else {
-                        client.clientsend("Error: Unable to list local directory.");
-                    }
-                    continue;
-                } else if (cmd == "get") {
-                    cout << "Processing 'get' command for: " << arg1 << endl;
-                    fs::path target_path = fs::absolute(current_directory + "/" + arg1);
-
-                    if (!fs::exists(target_path) || !isWithinBaseDirectory(target_path)) {
-                        client.clientsend("Error: File or directory does not exist or access denied.");
-                        continue;
-                    }
-
-                    if (fs::is_regular_file(target_path)) {
-                        sendallFile(client, target_path.string());
-                        cout << "File sent: " << target_path.string() << endl;
-                        client.clientsend("EOF");
-                    } else {
-                        client.clientsend("Error: Specified path is not a file.");
-                        continue;
-                    }
-                } else if (cmd == "put") {
-                    fs::path target_path = fs::absolute(current_directory + "/" + arg1);
-
-                    if (!isWithinBaseDirectory(target_path)) {
-                        client.clientsend("Error: Access denied.");
-                        continue;
-                    }
-
-                    if (fs::exists(target_path)) {
-                        client.clientsend("Warning: File already exists. Overwriting.");
-                        cout << "Overwriting existing file: " << target_path.string() << endl;
+            if (header.type != FRAME_CMD) {
+                // Stray data (e.g. from an aborted transfer); drop it
+                skippayload(client, header);
+                continue;
+            }
+            string line = recvtext(client, header);
+            cout << "Command received: " << line << endl;
+
+            //comand handling logic
+            command c = parseCommand(line);
+            if (isQuery(c)) {
+                uint32_t reqid = header.reqid;
+                tasks.submit([&client, &sess, reqid, c]() {
+                    try {
+                        runQuery(client, sess, reqid, c);
+                    } catch (const exception &e) {
+                        // A frame may be half sent; end the session
+                        cerr << "Error handling client: " << e.what() << endl;
+                        ::shutdown(client.getfd(), SHUT_RDWR);
                     }
-
-                    recvFile(client, target_path.string());
-                    client.clientsend("File received: " + target_path.string());
-                    cout << "File uploaded: " << target_path.string() << endl;
-                } else {
-                    client.clientsend("Error: Unknown command.");
-                    continue;
-                }
+                });
+                continue;
+            }
+            tasks.drain();
+            if (c.cmd == "exit") {
+                cout << "Client disconnected." << endl;
+                break;
+            } else if (c.cmd == "put" && takeOption(c, "-B")) {
+                recvBundle(client, sess, header.reqid, c.arg(0));
+            } else if (c.cmd == "put") {
+                recvFile(client, sess, header.reqid, c);
+            } else if (c.cmd == "sync") {
+                syncFile(client, sess, header.reqid, c);
+            } else if (c.cmd == "tune") {
+                sendReply(client, header.reqid, tuneLink(client.tuning(), c));
+            } else {
+                sendReply(client, header.reqid, runCommand(sess, c));
             }
         }
     } catch (const exception &e) {
         cerr << "Error handling client: " << e.what() << endl;
     }
+    tasks.drain();
 }
+
+/*************************************************************/
+/* function: reportCache                                    */
+/* purpose: Prints the hot-file cache counters each time    */
+/*          the server receives SIGUSR1. In fork mode this  */
+/*          runs on a thread of its own in the parent; the  */
+/*          signal stays blocked everywhere else, and the   */
+/*          children inherit that.                          */
+/* parameters:                                              */
+/*    - signals: the blocked set holding SIGUSR1.           */
+/*************************************************************/
+void reportCache(sigset_t signals) {
+    while (true) {
+        int signal;
+        if (sigwait(&signals, &signal) == 0) {
+            cout << "Hot-file cache: " << formathotstats(hotcachestats()) << endl;
+        }
+    }
+}
+
 /*************************************************************/
 /* function: signalHandler                                  */
 /* purpose: Handles SIGINT signals to gracefully shut down  */
@@ -345,44 +680,85 @@ void signalHandler(int signal) {
 /* purpose: The entry point for the server application.     */
 /*          Initializes the server, binds to a specified    */
 /*          port, and sets the base directory for file      */
-/*          operations. Handles incoming client connections */
-/*          and spawns child processes for each client.     */
+/*          operations. In fork mode a child process is     */
+/*          spawned for each client; in epoll mode sessions */
+/*          are multiplexed on one event loop per worker.   */
 /* parameters:                                              */
 /*    - argc: the number of command-line arguments.         */
 /*    - argv: the array of command-line arguments.          */
 /*************************************************************/
 int main(int argc, char **argv) {
-    if (argc != 5) {
-        cerr << "Usage: " << argv[0] << " -p <port> -d <directory>\n";
+    struct serveroptions o = parseservermenu(argc, argv);
+    transferengine engine;
+    if (o.port.empty() || o.directory.empty() || (o.mode != "fork" && o.mode != "epoll") ||
+        o.threads < 1 || o.backlog < 1 || o.cache < 0 || !parsetransferengine(o.engine, engine)) {
+        cerr << "Usage: " << argv[0] << " -p <port> -d <directory> [-m fork|epoll] [-t threads] [-b backlog]"
+             << " [-e zerocopy|uring|mmap|buffered] [-s] [-i] [-c cache-MB]\n"
+             << "  -m fork runs each session's queries side by side; an epoll session handles its\n"
+             << "  commands one after another, in the order they arrive.\n";
         return 1;
     }
 
-    string port, directory;
-    for (int i = 1; i < argc; i += 2) {
-        string arg = argv[i];
-        if (arg == "-p") {
-            port = argv[i + 1];
-        } else if (arg == "-d") {
-            directory = argv[i + 1];
-        } else {
-            cerr << "Unknown argument: " << arg << "\n";
-            return 1;
-        }
-    }
-
-    base_directory = fs::absolute(directory).string();
+    base_directory = fs::absolute(o.directory).string();
     if (!fs::exists(base_directory) || !fs::is_directory(base_directory)) {
         cerr << "Error: Specified directory does not exist or is not a directory.\n";
         return 1;
     }
 
+    if (o.store && !openstore(base_directory)) {
+        cerr << "Error: Cannot create the content store in " << base_directory << ".\n";
+        return 1;
+    }
+
+    // The index is only a shortcut: without it everything reads the disk
+    size_t indexed = 0;
+    auto index_start = chrono::steady_clock::now();
+    if (o.index && !openindex(base_directory, indexed)) {
+        cerr << "Warning: Cannot watch " << base_directory << " for the tree index; it is off.\n";
+    } else if (o.index) {
+        chrono::duration<double> took = chrono::steady_clock::now() - index_start;
+        cout << "Indexed " << indexed << " entries in " << took.count() << " s." << endl;
+    }
+
+    // Made before any fork or worker so they all share it
+    bool pinned = false;
+    if (o.cache > 0 && !openhotcache(static_cast<uint64_t>(o.cache) << 20, pinned)) {
+        cerr << "Warning: Cannot map " << o.cache << " MB for the hot-file cache; it is off.\n";
+    } else if (o.cache > 0 && !pinned) {
+        cerr << "Warning: Cannot lock the hot-file cache in memory; it may be swapped out.\n";
+    }
+
+    if (settransferengine(engine) != engine) {
+        cerr << "Warning: io_uring is not available on this kernel; using the zerocopy engine.\n";
+    }
+
     signal(SIGINT, signalHandler);
+    signal(SIGPIPE, SIG_IGN);
+
+    cout << "Server listening on port " << o.port << " and serving directory " << base_directory
+         << " (" << o.mode << " mode" << (o.store ? ", content store on" : "")
+         << (indexenabled() ? ", tree index on" : "")
+         << (hotcacheenabled() ? ", " + to_string(o.cache) + " MB hot-file cache" : "") << ")" << endl;
+
+    if (o.mode == "epoll") {
+        cout << "Starting " << o.threads << " reactor worker(s); send SIGUSR1 for session"
+             << (hotcacheenabled() ? " and cache counts." : " counts.") << endl;
+        runReactors(o.port, o.threads, o.backlog);
+        return 0;
+    }
 
-    mysock server;
-    server.bind(port);
-    server.listen(10);
+    if (hotcacheenabled()) {
+        sigset_t report_signals;
+        sigemptyset(&report_signals);
+        sigaddset(&report_signals, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &report_signals, nullptr);
+        thread(reportCache, report_signals).detach();
+        cout << "Send SIGUSR1 for cache counts." << endl;
+    }
 
-    cout << "Server listening on port " << port << " and serving directory " << base_directory << endl;
+    mysock server;
+    server.bind(o.port);
+    server.listen(o.backlog);
 
     while (!shutdown_flag) {
         mysock client = server.accept();
@@ -0,0 +1,443 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: hotcache.cpp                                    */
+/* purpose: this source file implements the hot-file cache.  */
+/*          one shared mapping holds a header with a robust, */
+/*          process-shared mutex and the counters, a hash of */
+/*          slot chains keyed by device and inode, the slots */
+/*          and the chain of HOT_CHUNK pieces behind each    */
+/*          cached file. slots of cached files are kept in   */
+/*          LRU order and the least recently used one that   */
+/*          no one holds is evicted for room; slots that     */
+/*          only remember a miss are kept in their own list  */
+/*          and reused oldest first. the mutex is never held */
+/*          while a file is read.                            */
+/*************************************************************/
+
+#include "hotcache.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+enum : uint8_t { SLOT_FREE, SLOT_GHOST, SLOT_FILLING, SLOT_READY };
+
+// The lists slots are kept in
+enum { LIST_GHOST, LIST_READY, LISTS };
+
+// Slots beyond one per chunk, for files that only missed once
+constexpr uint32_t EXTRA_SLOTS = 1024;
+
+// A file changed this recently may change again within the same
+// timestamp, so it is not copied in yet
+constexpr int64_t SETTLE_NS = 1000000000;
+
+struct hotslot {
+    uint8_t state;
+    uint32_t pins;          // hotfiles holding it
+    int32_t next;           // next slot in its bucket, or in the free list
+    int32_t newer, older;   // neighbours in its list
+    int32_t first;          // first chunk of the contents
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime;          // nanoseconds
+    int64_t ctime;
+    uint32_t digest_size;
+    char digest[HOT_DIGEST];
+};
+
+struct hotheader {
+    pthread_mutex_t lock;
+    hotstats stats;
+    int32_t newest[LISTS];
+    int32_t oldest[LISTS];
+    int32_t free_slots;
+    int32_t free_chunks;
+    uint64_t free_chunk_count;
+};
+
+// Where each part of the shared mapping is; set before any fork
+hotheader *header = nullptr;
+int32_t *buckets = nullptr;
+hotslot *slots = nullptr;
+int32_t *chunk_next = nullptr;
+char *chunk_data = nullptr;
+uint32_t bucket_mask = 0;
+uint64_t largest = 0;
+
+/*************************************************************/
+/* class: cachelock                                          */
+/* purpose: holds the cache mutex for a scope. if a process  */
+/*          died holding it, the mutex is made usable again; */
+/*          every change under it is a few stores, so the    */
+/*          tables are left as whole as they can be.         */
+/*************************************************************/
+class cachelock {
+  public:
+    cachelock() {
+        if (pthread_mutex_lock(&header->lock) == EOWNERDEAD) {
+            pthread_mutex_consistent(&header->lock);
+        }
+    }
+    ~cachelock() { pthread_mutex_unlock(&header->lock); }
+    cachelock(const cachelock &) = delete;
+    cachelock &operator=(const cachelock &) = delete;
+};
+
+int64_t nanoseconds(const struct timespec &t) {
+    return static_cast<int64_t>(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+uint32_t bucketof(uint64_t device, uint64_t inode) {
+    uint64_t h = (device * 0x9e3779b97f4a7c15ULL) ^ inode;
+    h *= 0xff51afd7ed558ccdULL;
+    return static_cast<uint32_t>(h >> 32) & bucket_mask;
+}
+
+bool sameversion(const hotslot &s, const struct stat &st) {
+    return s.size == static_cast<uint64_t>(st.st_size) && s.mtime == nanoseconds(st.st_mtim) &&
+           s.ctime == nanoseconds(st.st_ctim);
+}
+
+void setversion(hotslot &s, const struct stat &st) {
+    s.size = st.st_size;
+    s.mtime = nanoseconds(st.st_mtim);
+    s.ctime = nanoseconds(st.st_ctim);
+}
+
+uint64_t chunksfor(uint64_t size) {
+    return (size + HOT_CHUNK - 1) / HOT_CHUNK;
+}
+
+void linkfront(int list, int32_t i) {
+    slots[i].older = header->newest[list];
+    slots[i].newer = -1;
+    if (header->newest[list] != -1) {
+        slots[header->newest[list]].newer = i;
+    } else {
+        header->oldest[list] = i;
+    }
+    header->newest[list] = i;
+}
+
+void unlink(int list, int32_t i) {
+    hotslot &s = slots[i];
+    if (s.newer != -1) {
+        slots[s.newer].older = s.older;
+    } else {
+        header->newest[list] = s.older;
+    }
+    if (s.older != -1) {
+        slots[s.older].newer = s.newer;
+    } else {
+        header->oldest[list] = s.newer;
+    }
+}
+
+int32_t lookup(const struct stat &st) {
+    for (int32_t i = buckets[bucketof(st.st_dev, st.st_ino)]; i != -1; i = slots[i].next) {
+        if (slots[i].device == st.st_dev && slots[i].inode == st.st_ino) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void unhash(int32_t i) {
+    int32_t *link = &buckets[bucketof(slots[i].device, slots[i].inode)];
+    while (*link != i) {
+        link = &slots[*link].next;
+    }
+    *link = slots[i].next;
+}
+
+void takechunks(hotslot &s) {
+    uint64_t count = chunksfor(s.size);
+    s.first = header->free_chunks;
+    int32_t last = s.first;
+    for (uint64_t k = 1; k < count; ++k) {
+        last = chunk_next[last];
+    }
+    header->free_chunks = chunk_next[last];
+    chunk_next[last] = -1;
+    header->free_chunk_count -= count;
+}
+
+void givechunks(hotslot &s) {
+    uint64_t count = chunksfor(s.size);
+    int32_t last = s.first;
+    for (uint64_t k = 1; k < count; ++k) {
+        last = chunk_next[last];
+    }
+    chunk_next[last] = header->free_chunks;
+    header->free_chunks = s.first;
+    header->free_chunk_count += count;
+    s.first = -1;
+}
+
+// Turns a cached file back into a slot that only remembers it
+void retire(int32_t i) {
+    unlink(LIST_READY, i);
+    givechunks(slots[i]);
+    header->stats.entries--;
+    header->stats.bytes -= slots[i].size;
+    slots[i].state = SLOT_GHOST;
+    linkfront(LIST_GHOST, i);
+}
+
+// Frees the least recently used files no one holds until count chunks are free
+bool makeroom(uint64_t count) {
+    int32_t i = header->oldest[LIST_READY];
+    while (header->free_chunk_count < count && i != -1) {
+        int32_t newer = slots[i].newer;
+        if (slots[i].pins == 0) {
+            retire(i);
+            header->stats.evictions++;
+        }
+        i = newer;
+    }
+    return header->free_chunk_count >= count;
+}
+
+// A slot to remember a miss in: a free one, else the oldest such slot
+int32_t ghostslot() {
+    int32_t i = header->free_slots;
+    if (i != -1) {
+        header->free_slots = slots[i].next;
+        return i;
+    }
+    i = header->oldest[LIST_GHOST];
+    if (i != -1) {
+        unlink(LIST_GHOST, i);
+        unhash(i);
+    }
+    return i;
+}
+
+} // namespace
+
+bool openhotcache(uint64_t bytes, bool &pinned) {
+    uint64_t chunk_count = std::max<uint64_t>(bytes / HOT_CHUNK, 1);
+    if (chunk_count > INT32_MAX - EXTRA_SLOTS) {
+        return false;
+    }
+    uint32_t slot_count = chunk_count + EXTRA_SLOTS;
+    uint32_t bucket_count = 1;
+    while (bucket_count < slot_count) {
+        bucket_count <<= 1;
+    }
+
+    auto align = [](size_t n, size_t to) { return (n + to - 1) / to * to; };
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t buckets_at = align(sizeof(hotheader), 64);
+    size_t slots_at = align(buckets_at + bucket_count * sizeof(int32_t), 64);
+    size_t next_at = align(slots_at + slot_count * sizeof(hotslot), 64);
+    size_t data_at = align(next_at + chunk_count * sizeof(int32_t), page);
+    size_t total = data_at + chunk_count * HOT_CHUNK;
+
+    void *mapped = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    pinned = mlock(mapped, total) == 0;
+
+    char *base = static_cast<char *>(mapped);
+    header = reinterpret_cast<hotheader *>(base);
+    buckets = reinterpret_cast<int32_t *>(base + buckets_at);
+    slots = reinterpret_cast<hotslot *>(base + slots_at);
+    chunk_next = reinterpret_cast<int32_t *>(base + next_at);
+    chunk_data = base + data_at;
+    bucket_mask = bucket_count - 1;
+    largest = std::min<uint64_t>(MAX_HOT_FILE, chunk_count * HOT_CHUNK / 8);
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    header->stats.capacity = chunk_count * HOT_CHUNK;
+    for (int list = 0; list < LISTS; ++list) {
+        header->newest[list] = header->oldest[list] = -1;
+    }
+    std::fill(buckets, buckets + bucket_count, -1);
+    for (uint32_t i = 0; i < slot_count; ++i) {
+        slots[i].state = SLOT_FREE;
+        slots[i].next = i + 1 < slot_count ? i + 1 : -1;
+    }
+    for (uint64_t i = 0; i < chunk_count; ++i) {
+        chunk_next[i] = i + 1 < chunk_count ? i + 1 : -1;
+    }
+    header->free_slots = 0;
+    header->free_chunks = 0;
+    header->free_chunk_count = chunk_count;
+    return true;
+}
+
+bool hotcacheenabled() {
+    return header != nullptr;
+}
+
+hotstats hotcachestats() {
+    if (!header) {
+        return hotstats();
+    }
+    cachelock guard;
+    return header->stats;
+}
+
+std::string formathotstats(const hotstats &stats) {
+    std::ostringstream text;
+    text << stats.hits << " hits, " << stats.misses << " misses, " << stats.admissions << " admitted, "
+         << stats.evictions << " evicted; " << stats.entries << " files in " << stats.bytes << " of "
+         << stats.capacity << " bytes";
+    return text.str();
+}
+
+bool hotfile::open(int fd) {
+    release();
+    struct stat st;
+    if (!header || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        static_cast<uint64_t>(st.st_size) > largest) {
+        return false;
+    }
+
+    int32_t i;
+    {
+        cachelock guard;
+        i = lookup(st);
+        if (i != -1 && slots[i].state == SLOT_READY && sameversion(slots[i], st)) {
+            slots[i].pins++;
+            unlink(LIST_READY, i);
+            linkfront(LIST_READY, i);
+            header->stats.hits++;
+            slot = i;
+            length = st.st_size;
+            return true;
+        }
+        header->stats.misses++;
+
+        if (i == -1) {
+            // First miss: only remember it
+            i = ghostslot();
+            if (i == -1) {
+                return false;
+            }
+            hotslot &s = slots[i];
+            s.state = SLOT_GHOST;
+            s.device = st.st_dev;
+            s.inode = st.st_ino;
+            setversion(s, st);
+            s.first = -1;
+            s.pins = 0;
+            s.next = buckets[bucketof(s.device, s.inode)];
+            buckets[bucketof(s.device, s.inode)] = i;
+            linkfront(LIST_GHOST, i);
+            return false;
+        }
+        hotslot &s = slots[i];
+        if (s.state == SLOT_FILLING) {
+            return false;
+        }
+        if (s.state == SLOT_READY) {
+            // Changed on disk since it was cached: it was wanted, so the
+            // new contents are copied in at once if no one holds the old
+            if (s.pins > 0) {
+                return false;
+            }
+            retire(i);
+            setversion(s, st);
+        } else if (!sameversion(s, st)) {
+            setversion(s, st);
+            unlink(LIST_GHOST, i);
+            linkfront(LIST_GHOST, i);
+            return false;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (nanoseconds(now) - s.ctime < SETTLE_NS || !makeroom(chunksfor(s.size))) {
+            return false;
+        }
+        unlink(LIST_GHOST, i);
+        takechunks(s);
+        s.state = SLOT_FILLING;
+        s.pins = 1;
+    }
+
+    // Copy the file in without the lock; no one else touches a filling slot
+    hotslot &s = slots[i];
+    integritysums sums;
+    bool filled = true;
+    uint64_t done = 0;
+    for (int32_t c = s.first; filled && done < s.size; c = chunk_next[c]) {
+        char *to = chunk_data + static_cast<size_t>(c) * HOT_CHUNK;
+        size_t want = std::min<uint64_t>(HOT_CHUNK, s.size - done);
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = pread(fd, to + got, want - got, done + got);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                filled = false;
+                break;
+            }
+            got += n;
+        }
+        sums.update(to, got);
+        done += got;
+    }
+    struct stat after;
+    filled = filled && fstat(fd, &after) == 0 && sameversion(s, after);
+    std::string digest = sums.digest();
+
+    cachelock guard;
+    s.pins = 0;
+    if (!filled) {
+        givechunks(s);
+        s.state = SLOT_GHOST;
+        linkfront(LIST_GHOST, i);
+        return false;
+    }
+    memcpy(s.digest, digest.data(), digest.size());
+    s.digest_size = digest.size();
+    s.state = SLOT_READY;
+    s.pins = 1;
+    linkfront(LIST_READY, i);
+    header->stats.admissions++;
+    header->stats.entries++;
+    header->stats.bytes += s.size;
+    slot = i;
+    length = s.size;
+    return true;
+}
+
+void hotfile::visit(const std::function<void(const char *, size_t)> &piece) const {
+    uint64_t left = length;
+    for (int32_t c = slots[slot].first; left > 0; c = chunk_next[c]) {
+        size_t n = std::min<uint64_t>(left, HOT_CHUNK);
+        piece(chunk_data + static_cast<size_t>(c) * HOT_CHUNK, n);
+        left -= n;
+    }
+}
+
+std::string hotfile::digest() const {
+    return std::string(slots[slot].digest, slots[slot].digest_size);
+}
+
+void hotfile::release() {
+    if (slot != -1) {
+        cachelock guard;
+        slots[slot].pins--;
+        slot = -1;
+    }
+}
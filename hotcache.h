@@ -0,0 +1,122 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: hotcache.h                                      */
+/* purpose: this header file declares the hot-file cache, an */
+/*          optional size-bounded LRU of whole file contents */
+/*          with their END digests. it lives in one shared   */
+/*          anonymous mapping made before the server forks   */
+/*          or starts workers, so every child and reactor    */
+/*          thread serves from the same copy. entries are    */
+/*          keyed by device and inode and only answer while  */
+/*          the size, mtime and ctime of the descriptor just */
+/*          opened still match. a file is admitted the       */
+/*          second time it misses, so one-off downloads do   */
+/*          not push out the files that are asked for often. */
+/*************************************************************/
+
+#ifndef HOTCACHE_H
+#define HOTCACHE_H
+
+#include <cstdint>
+#include <functional>
+#include <sys/stat.h>
+#include "transfer.h"
+
+// Bytes each piece of a cached file is stored in
+constexpr size_t HOT_CHUNK = 16 << 10;
+
+// Largest file the cache takes, whatever its size
+constexpr uint64_t MAX_HOT_FILE = 64 << 20;
+
+// Room for the END digest of the largest file
+constexpr size_t HOT_DIGEST = 4 * (MAX_HOT_FILE / INTEGRITY_BLOCK);
+
+/*************************************************************/
+/* struct: hotstats                                          */
+/* purpose: the cache counters, since the server started.    */
+/*************************************************************/
+struct hotstats {
+    uint64_t hits = 0;       // gets served from the cache
+    uint64_t misses = 0;     // gets of files it could take that it did not hold
+    uint64_t admissions = 0; // files copied in
+    uint64_t evictions = 0;  // files dropped to make room
+    uint64_t entries = 0;    // files held now
+    uint64_t bytes = 0;      // their size
+    uint64_t capacity = 0;   // the most it holds
+};
+
+/*************************************************************/
+/* function: openhotcache                                   */
+/* purpose: creates the cache. call once at startup, before */
+/*          any fork or worker thread.                      */
+/* parameters:                                              */
+/*    - bytes: the room for file contents.                  */
+/*    - pinned: receives whether the room could be locked   */
+/*              in memory; if not, it may be swapped out.   */
+/* return: false if the memory could not be mapped.         */
+/*************************************************************/
+bool openhotcache(uint64_t bytes, bool &pinned);
+
+/*************************************************************/
+/* function: hotcacheenabled                                */
+/* purpose: tells whether openhotcache made a cache.        */
+/*************************************************************/
+bool hotcacheenabled();
+
+/*************************************************************/
+/* function: hotcachestats                                  */
+/* purpose: a consistent copy of the counters.              */
+/*************************************************************/
+hotstats hotcachestats();
+
+/*************************************************************/
+/* function: formathotstats                                 */
+/* purpose: the counters as one line for the server log.    */
+/*************************************************************/
+std::string formathotstats(const hotstats &stats);
+
+/*************************************************************/
+/* class: hotfile                                            */
+/* purpose: one cached file held for reading. while it is    */
+/*          held its bytes are neither evicted nor replaced. */
+/*************************************************************/
+class hotfile {
+  public:
+    hotfile() = default;
+    hotfile(const hotfile &) = delete;
+    hotfile &operator=(const hotfile &) = delete;
+    ~hotfile() { release(); }
+
+    /*************************************************************/
+    /* function: open                                           */
+    /* purpose: looks the file up, copying it in when it is     */
+    /*          admitted. a file that changes while it is being */
+    /*          copied is not kept.                             */
+    /* parameters:                                              */
+    /*    - fd: the file, opened for reading.                   */
+    /* return: true if it is held and may be served from here.  */
+    /*************************************************************/
+    bool open(int fd);
+
+    // Size of the held file
+    uint64_t size() const { return length; }
+
+    /*************************************************************/
+    /* function: visit                                          */
+    /* purpose: passes the held bytes in order, a piece at a    */
+    /*          time. the pieces stay valid while it is held.   */
+    /*************************************************************/
+    void visit(const std::function<void(const char *, size_t)> &piece) const;
+
+    // The END payload for the whole file
+    std::string digest() const;
+
+    // Lets go of the file
+    void release();
+
+  private:
+    int32_t slot = -1;
+    uint64_t length = 0;
+};
+
+#endif
@@ -0,0 +1,414 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: listing.cpp                                         */
+/* purpose: this source file implements the streaming listing    */
+/*          declared in listing.h. a cursor is the hex of the    */
+/*          sort key of the last entry sent ("<order><+|->       */
+/*          <value>:<name>"); in directory order the value is    */
+/*          the d_off the kernel gave that entry, which lseek(2) */
+/*          on the directory returns to. pages the index answers */
+/*          are in name order and carry name-order cursors, so   */
+/*          the disk can take over from any of them.             */
+/*****************************************************************/
+#include "listing.h"
+#include "store.h"
+#include "treeindex.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*************************************************************/
+/* function: encodehex                                      */
+/* purpose: turns bytes into hex digits, so a cursor is one */
+/*          word whatever the names hold.                   */
+/*************************************************************/
+static std::string encodehex(const std::string &raw) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(raw.size() * 2);
+    for (unsigned char ch : raw) {
+        hex += digits[ch >> 4];
+        hex += digits[ch & 15];
+    }
+    return hex;
+}
+
+/*************************************************************/
+/* function: decodehex                                      */
+/* purpose: reverses encodehex.                             */
+/* return: false if hex is not an even run of hex digits.   */
+/*************************************************************/
+static bool decodehex(const std::string &hex, std::string &raw) {
+    if (hex.size() % 2 != 0) {
+        return false;
+    }
+    auto digit = [](unsigned char ch) {
+        return isdigit(ch) ? ch - '0' : isxdigit(ch) ? tolower(ch) - 'a' + 10 : -1;
+    };
+    raw.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int high = digit(hex[i]), low = digit(hex[i + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        raw += static_cast<char>(high << 4 | low);
+    }
+    return true;
+}
+
+/*************************************************************/
+/* function: orderletter                                    */
+/* purpose: names a sort order inside a cursor.             */
+/*************************************************************/
+static char orderletter(listorder order) {
+    switch (order) {
+    case listorder::NAME:
+        return 'n';
+    case listorder::SIZE:
+        return 's';
+    case listorder::MTIME:
+        return 'm';
+    default:
+        return 'o';
+    }
+}
+
+bool dirlisting::start(int fd, const std::string &path, const listoptions &o, std::string &error) {
+    *this = dirlisting(); // a connection reuses one listing for every ls
+    dir.reset(fd);
+    directory = path;
+    options = o;
+    buffer.resize(LISTING_READ);
+    indexed = fstat(fd, &dir_st) == 0 &&
+              indexlist(directory, dir_st, "", [](const std::string &, const indexentry &) { return false; });
+
+    // The index's order is name order, so an unsorted listing it answers
+    // is sorted by name, and so is every page that continues one
+    std::string raw;
+    bool decoded = decodehex(options.cursor, raw) && raw.size() >= 3;
+    if (options.order == listorder::NONE &&
+        (options.cursor.empty() ? indexed : decoded && raw[0] == orderletter(listorder::NAME))) {
+        options.order = listorder::NAME;
+    }
+    if (options.cursor.empty()) {
+        return true;
+    }
+
+    // The cursor has to come from a listing sorted the same way
+    size_t colon = decoded ? raw.find(':', 2) : std::string::npos;
+    char direction = options.reverse ? '-' : '+';
+    if (colon == std::string::npos || raw[0] != orderletter(options.order) || raw[1] != direction) {
+        error = "Error: Cursor does not match the listing options.";
+        finish();
+        return false;
+    }
+    std::string value = raw.substr(2, colon - 2);
+    char *end = nullptr;
+    errno = 0;
+    long long number = value.empty() ? 0 : strtoll(value.c_str(), &end, 10);
+    if (errno != 0 || (end && *end != '\0')) {
+        error = "Error: Invalid cursor.";
+        finish();
+        return false;
+    }
+
+    if (options.order == listorder::NONE) {
+        if (lseek(dir.get(), number, SEEK_SET) == -1) {
+            error = "Error: Invalid cursor.";
+            finish();
+            return false;
+        }
+        return true;
+    }
+    cursor.name = raw.substr(colon + 1);
+    cursor.size = static_cast<uint64_t>(number);
+    cursor.mtime = number;
+    has_cursor = true;
+    return true;
+}
+
+void dirlisting::finish() {
+    dir.reset();
+    buffer.clear();
+    buffer.shrink_to_fit();
+    sorted.clear();
+    sorted.shrink_to_fit();
+}
+
+/*************************************************************/
+/* function: readentry                                      */
+/* purpose: takes the next entry that matches the pattern   */
+/*          from the getdents64 batch, reading another batch */
+/*          when it runs out.                               */
+/* return: false at the end of the directory.               */
+/*************************************************************/
+bool dirlisting::readentry(item &e) {
+    while (true) {
+        if (buffer_pos >= buffer_len) {
+            ssize_t n = getdents64(dir.get(), buffer.data(), buffer.size());
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            buffer_pos = 0;
+            buffer_len = n;
+        }
+        const struct dirent64 *d = reinterpret_cast<const struct dirent64 *>(buffer.data() + buffer_pos);
+        buffer_pos += d->d_reclen;
+        const char *name = d->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        if (!options.pattern.empty() && fnmatch(options.pattern.c_str(), name, 0) != 0) {
+            continue;
+        }
+
+        e.name = name;
+        e.offset = d->d_off;
+        e.directory = d->d_type == DT_DIR;
+        e.kind = d->d_type == DT_DIR ? 'D' : d->d_type == DT_REG ? 'F' : 'O';
+        e.size = 0;
+        e.mtime = 0;
+
+        // A symlink is listed as what it points to (or as itself when it
+        // dangles)
+        bool wanted = options.details || options.order == listorder::SIZE || options.order == listorder::MTIME;
+        struct stat st;
+        if ((wanted || d->d_type == DT_LNK || d->d_type == DT_UNKNOWN) &&
+            (fstatat(dir.get(), name, &st, 0) == 0 || fstatat(dir.get(), name, &st, AT_SYMLINK_NOFOLLOW) == 0)) {
+            e.directory = S_ISDIR(st.st_mode);
+            e.kind = S_ISDIR(st.st_mode) ? 'D' : S_ISREG(st.st_mode) ? 'F' : 'O';
+            e.size = S_ISREG(st.st_mode) ? st.st_size : 0;
+            e.mtime = st.st_mtime;
+        }
+        if (e.directory && e.name == STORE_DIRECTORY && fstatat(dir.get(), name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            isstore(st)) {
+            continue;
+        }
+        return true;
+    }
+}
+
+/*************************************************************/
+/* function: fromindex                                      */
+/* purpose: turns an index entry into a listed entry. a     */
+/*          symlink is listed as what it points to, as      */
+/*          readentry does.                                 */
+/*************************************************************/
+void dirlisting::fromindex(const std::string &name, const indexentry &entry, item &e) const {
+    e.name = name;
+    e.directory = entry.kind == 'D';
+    e.kind = entry.kind == 'L' ? 'O' : entry.kind;
+    e.size = entry.size;
+    e.mtime = entry.mtime;
+    struct stat st;
+    if (entry.kind == 'L' && fstatat(dir.get(), name.c_str(), &st, 0) == 0) {
+        e.directory = S_ISDIR(st.st_mode);
+        e.kind = S_ISDIR(st.st_mode) ? 'D' : S_ISREG(st.st_mode) ? 'F' : 'O';
+        e.size = S_ISREG(st.st_mode) ? st.st_size : 0;
+        e.mtime = st.st_mtime;
+    }
+}
+
+/*************************************************************/
+/* function: before                                         */
+/* purpose: the sort order: by the chosen key, then name.   */
+/*************************************************************/
+bool dirlisting::before(const item &a, const item &b) const {
+    const item &x = options.reverse ? b : a;
+    const item &y = options.reverse ? a : b;
+    if (options.order == listorder::SIZE && x.size != y.size) {
+        return x.size < y.size;
+    }
+    if (options.order == listorder::MTIME && x.mtime != y.mtime) {
+        return x.mtime < y.mtime;
+    }
+    return x.name < y.name;
+}
+
+/*************************************************************/
+/* function: aftercursor                                    */
+/* purpose: tells whether a sorted entry belongs after the  */
+/*          page the cursor came from.                      */
+/*************************************************************/
+bool dirlisting::aftercursor(const item &e) const {
+    return !has_cursor || before(cursor, e);
+}
+
+void dirlisting::format(const item &e, std::string &text) const {
+    if (options.details) {
+        text += e.kind == 'D' ? "DIR " : e.kind == 'F' ? "FILE " : "OTHER ";
+        text += std::to_string(e.size);
+        text += ' ';
+        text += std::to_string(e.mtime);
+        text += ' ';
+        text += e.name;
+        text += '\n';
+        return;
+    }
+    // Quoted the way std::quoted writes it, as ls always has
+    text += '"';
+    for (char ch : e.name) {
+        if (ch == '"' || ch == '\\') {
+            text += '\\';
+        }
+        text += ch;
+    }
+    text += e.directory ? "\"/\n" : "\"\n";
+}
+
+std::string dirlisting::cursorfor(const item &e) const {
+    std::string raw(1, orderletter(options.order));
+    raw += options.reverse ? '-' : '+';
+    if (options.order == listorder::NONE) {
+        raw += std::to_string(e.offset) + ":";
+    } else if (options.order == listorder::SIZE) {
+        raw += std::to_string(e.size) + ":" + e.name;
+    } else if (options.order == listorder::MTIME) {
+        raw += std::to_string(e.mtime) + ":" + e.name;
+    } else {
+        raw += ":" + e.name;
+    }
+    return encodehex(raw);
+}
+
+/*************************************************************/
+/* function: collect                                        */
+/* purpose: reads the whole directory for a sorted listing, */
+/*          keeping only the entries of the page: a heap of */
+/*          the limit smallest past the cursor.             */
+/*************************************************************/
+void dirlisting::collect() {
+    auto order = [this](const item &a, const item &b) { return before(a, b); };
+    uint64_t limit = options.limit == 0 ? 0 : options.limit - emitted; // less what the index already sent
+    auto add = [&](const item &e) {
+        if (!aftercursor(e)) {
+            return;
+        }
+        if (limit != 0 && sorted.size() == limit && !before(e, sorted.front())) {
+            more = true; // sorts after the whole page
+            return;
+        }
+        sorted.push_back(e);
+        std::push_heap(sorted.begin(), sorted.end(), order);
+        if (limit != 0 && sorted.size() > limit) {
+            std::pop_heap(sorted.begin(), sorted.end(), order);
+            sorted.pop_back();
+            more = true;
+        }
+    };
+
+    item e;
+    auto visit = [&](const std::string &name, const indexentry &entry) {
+        if (options.pattern.empty() || fnmatch(options.pattern.c_str(), name.c_str(), 0) == 0) {
+            fromindex(name, entry, e);
+            add(e);
+        }
+        return true;
+    };
+    if (!indexed || !indexlist(directory, dir_st, "", visit)) {
+        while (readentry(e)) {
+            add(e);
+        }
+    }
+    std::sort_heap(sorted.begin(), sorted.end(), order);
+    collected = true;
+}
+
+/*************************************************************/
+/* function: pageindex                                      */
+/* purpose: produces the next frame of a listing in name    */
+/*          order straight from the index, from the name    */
+/*          after the last one sent, so a page costs what   */
+/*          it holds rather than the whole directory.       */
+/* return: false if the index cannot answer; nothing has    */
+/*         been produced then.                              */
+/*************************************************************/
+bool dirlisting::pageindex(std::string &text) {
+    bool stopped = false;
+    auto visit = [&](const std::string &name, const indexentry &entry) {
+        if (!options.pattern.empty() && fnmatch(options.pattern.c_str(), name.c_str(), 0) != 0) {
+            return true;
+        }
+        if ((options.limit != 0 && emitted == options.limit) || text.size() >= LISTING_FRAME) {
+            stopped = true;
+            return false;
+        }
+        item e;
+        fromindex(name, entry, e);
+        format(e, text);
+        cursor = e;
+        has_cursor = true;
+        emitted++;
+        return true;
+    };
+    if (!indexlist(directory, dir_st, has_cursor ? cursor.name : "", visit)) {
+        return false;
+    }
+    if (!stopped) {
+        done = true;
+    } else if (options.limit != 0 && emitted == options.limit) {
+        text += "CURSOR " + cursorfor(cursor) + "\n";
+        done = true;
+    }
+    return true;
+}
+
+bool dirlisting::next(std::string &text) {
+    text.clear();
+    if (!active() || done) {
+        finish();
+        return false;
+    }
+
+    if (indexed && options.order == listorder::NAME && !options.reverse) {
+        if (pageindex(text)) {
+            return !text.empty() || next(text);
+        }
+        indexed = false; // no longer current: the disk carries on after the cursor
+    }
+
+    if (options.order != listorder::NONE) {
+        if (!collected) {
+            collect();
+        }
+        while (sorted_next < sorted.size() && text.size() < LISTING_FRAME) {
+            format(sorted[sorted_next++], text);
+        }
+        if (sorted_next == sorted.size()) {
+            if (more) {
+                text += "CURSOR " + cursorfor(sorted.back()) + "\n";
+            }
+            done = true;
+        }
+        return !text.empty() || next(text);
+    }
+
+    item e;
+    while (text.size() < LISTING_FRAME) {
+        if (options.limit != 0 && emitted == options.limit) {
+            // Only hand out a cursor if something is left to continue with
+            if (readentry(e)) {
+                text += "CURSOR " + cursorfor(last) + "\n";
+            }
+            done = true;
+            break;
+        }
+        if (!readentry(e)) {
+            done = true;
+            break;
+        }
+        format(e, text);
+        last.offset = e.offset;
+        emitted++;
+    }
+    return !text.empty() || next(text);
+}
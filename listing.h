@@ -0,0 +1,138 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: listing.h                                       */
+/* purpose: this header file declares the streaming listing  */
+/*          behind the server's ls. entries are read straight */
+/*          from getdents64(2) in large batches and turned   */
+/*          into text one frame at a time, so the first      */
+/*          frame leaves before the directory is read to the */
+/*          end and a listing of any size needs one frame of */
+/*          memory. the entry type comes from d_type; a file */
+/*          is only stat'ed when its size or time is asked   */
+/*          for, or when d_type does not tell (symlinks,     */
+/*          filesystems that leave it unknown). a listing    */
+/*          can stop after a number of entries and hand out  */
+/*          a cursor that continues it on a later request.   */
+/*          while the tree index is current it answers       */
+/*          instead of the disk; its order is name order, so */
+/*          an unsorted listing from it comes out sorted.    */
+/*************************************************************/
+
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <cstdint>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+#include "sandbox.h"
+
+struct indexentry;
+
+// Text produced per listing frame, and bytes read per getdents64 call
+constexpr size_t LISTING_FRAME = 64 << 10;
+constexpr size_t LISTING_READ = 64 << 10;
+
+/*************************************************************/
+/* enum: listorder                                           */
+/* purpose: how a listing is sorted.                         */
+/*************************************************************/
+enum class listorder {
+    NONE,  // directory order; pages cost no more than one frame
+    NAME,
+    SIZE,  // then by name
+    MTIME  // then by name
+};
+
+/*************************************************************/
+/* struct: listoptions                                       */
+/* purpose: what a listing shows and in which order.         */
+/*************************************************************/
+struct listoptions {
+    bool details = false;            // type, size and mtime per entry
+    listorder order = listorder::NONE;
+    bool reverse = false;
+    uint64_t limit = 0;              // entries per page; 0 for all
+    std::string cursor;              // from an earlier page, to continue it
+    std::string pattern;             // fnmatch(3) glob on the name; empty for all
+};
+
+/*************************************************************/
+/* class: dirlisting                                         */
+/* purpose: one listing in progress. a sorted listing reads  */
+/*          the whole directory before its first frame but   */
+/*          keeps only the entries of the page it sends.     */
+/*************************************************************/
+class dirlisting {
+  public:
+    /*************************************************************/
+    /* function: start                                          */
+    /* purpose: begins listing a directory.                     */
+    /* parameters:                                              */
+    /*    - fd: the directory, opened O_RDONLY. owned from now. */
+    /*    - directory: its path below the base directory ("" */
+    /*                 for the base), to find it in the index.  */
+    /*    - options: what to list.                              */
+    /*    - error: receives the reason on failure.              */
+    /* return: false if the cursor is not valid for the options.*/
+    /*************************************************************/
+    bool start(int fd, const std::string &directory, const listoptions &options, std::string &error);
+
+    /*************************************************************/
+    /* function: next                                           */
+    /* purpose: produces the next frame of the listing: lines   */
+    /*          of '"name"' (with "/" after a directory) or,    */
+    /*          with details, "DIR|FILE|OTHER size mtime name". */
+    /*          a page that stops early ends with a line        */
+    /*          "CURSOR <token>".                               */
+    /* parameters:                                              */
+    /*    - text: receives the frame.                           */
+    /* return: false once the listing is complete.              */
+    /*************************************************************/
+    bool next(std::string &text);
+
+    // Whether start succeeded and next has not returned false yet
+    bool active() const { return dir.get() != -1; }
+
+    // Ends the listing, closing the directory
+    void finish();
+
+  private:
+    struct item {
+        std::string name;
+        bool directory = false;
+        char kind = 'O';  // 'D', 'F' or 'O' (other)
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        int64_t offset = 0; // where the next entry is read from
+    };
+
+    bool readentry(item &e);
+    void fromindex(const std::string &name, const indexentry &entry, item &e) const;
+    bool pageindex(std::string &text);
+    bool before(const item &a, const item &b) const;
+    bool aftercursor(const item &e) const;
+    void format(const item &e, std::string &text) const;
+    std::string cursorfor(const item &e) const;
+    void collect();
+
+    fdhandle dir;
+    std::string directory;         // below the base, for the index
+    struct stat dir_st;            // what the index must know it as
+    bool indexed = false;          // pages may still come from the index
+    listoptions options;
+    std::vector<char> buffer;
+    size_t buffer_pos = 0;
+    size_t buffer_len = 0;
+    uint64_t emitted = 0;
+    bool more = false;             // entries remain after this page
+    item last;                     // last entry sent, for the cursor
+    item cursor;                   // where a sorted listing continues
+    bool has_cursor = false;
+    std::vector<item> sorted;      // the page of a sorted listing
+    size_t sorted_next = 0;
+    bool collected = false;
+    bool done = false;             // the last frame has been produced
+};
+
+#endif
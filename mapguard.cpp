@@ -0,0 +1,34 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: mapguard.cpp                                        */
+/* purpose: this source file implements the guard declared in    */
+/*          mapguard.h.                                          */
+/*****************************************************************/
+#include "mapguard.h"
+#include <csignal>
+#include <mutex>
+
+thread_local sigjmp_buf *mapped_read = nullptr;
+
+/*************************************************************/
+/* function: onbus                                          */
+/* purpose: leaves the read whose file shrank. any other    */
+/*          SIGBUS is a real fault and kills the process as */
+/*          it would have without the handler.              */
+/*************************************************************/
+static void onbus(int signo) {
+    if (mapped_read) {
+        siglongjmp(*mapped_read, 1);
+    }
+    signal(signo, SIG_DFL);
+}
+
+void guardmappings() {
+    static std::once_flag once;
+    std::call_once(once, []() {
+        struct sigaction action = {};
+        action.sa_handler = onbus;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGBUS, &action, nullptr);
+    });
+}
@@ -0,0 +1,27 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: mapguard.h                                      */
+/* purpose: this header file declares the guard around reads */
+/*          of mapped files. a file that is truncated while  */
+/*          it is mapped raises SIGBUS when the missing      */
+/*          pages are read; a thread that has set            */
+/*          mapped_read is sent back to its sigsetjmp        */
+/*          instead of the process being killed.             */
+/*************************************************************/
+
+#ifndef MAPGUARD_H
+#define MAPGUARD_H
+
+#include <csetjmp>
+
+// Where this thread goes if a mapping it reads shrinks, or nullptr
+extern thread_local sigjmp_buf *mapped_read;
+
+/*************************************************************/
+/* function: guardmappings                                  */
+/* purpose: installs the SIGBUS handler, once per process.  */
+/*          call before the first guarded read.             */
+/*************************************************************/
+void guardmappings();
+
+#endif
@@ -0,0 +1,105 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: protocol.cpp                                        */
+/* purpose: this source file implements the framed wire          */
+/*          protocol declared in protocol.h. it handles header   */
+/*          encoding and text messages; file contents are moved  */
+/*          by the transfer engine in transfer.cpp.              */
+/*****************************************************************/
+#include "protocol.h"
+#include <endian.h>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+void encodeheader(const frameheader &h, char *out) {
+    uint32_t reqid = htobe32(h.reqid);
+    uint64_t length = htobe64(h.length);
+    out[0] = static_cast<char>(h.type);
+    out[1] = static_cast<char>(h.flags);
+    out[2] = 0;
+    out[3] = 0;
+    std::memcpy(out + 4, &reqid, sizeof(reqid));
+    std::memcpy(out + 8, &length, sizeof(length));
+}
+
+void decodeheader(const char *in, frameheader &h) {
+    uint32_t reqid;
+    uint64_t length;
+    std::memcpy(&reqid, in + 4, sizeof(reqid));
+    std::memcpy(&length, in + 8, sizeof(length));
+    h.type = static_cast<uint8_t>(in[0]);
+    h.flags = static_cast<uint8_t>(in[1]);
+    h.reqid = be32toh(reqid);
+    h.length = be64toh(length);
+}
+
+void sendframe(mysock &s, uint8_t type, uint32_t reqid, const char *data, uint64_t length, uint8_t flags) {
+    frameheader h;
+    h.type = type;
+    h.flags = flags;
+    h.reqid = reqid;
+    h.length = length;
+
+    char header[FRAME_HEADER_SIZE];
+    encodeheader(h, header);
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = const_cast<char *>(data);
+    iov[1].iov_len = length;
+    auto held = s.holdframes();
+    s.sendallv(iov, length > 0 ? 2 : 1);
+}
+
+void sendtext(mysock &s, uint8_t type, uint32_t reqid, const std::string &text) {
+    sendframe(s, type, reqid, text.data(), text.size());
+}
+
+bool recvheader(mysock &s, frameheader &h) {
+    char header[FRAME_HEADER_SIZE];
+    size_t received = s.recvall(header, sizeof(header));
+    if (received == 0) {
+        return false;
+    }
+    if (received < sizeof(header)) {
+        throw std::runtime_error("Connection closed in the middle of a frame");
+    }
+    decodeheader(header, h);
+    return true;
+}
+
+std::string recvtext(mysock &s, const frameheader &h) {
+    if (h.length > MAX_TEXT_FRAME) {
+        throw std::runtime_error("Text frame exceeds the maximum size");
+    }
+    std::string text(h.length, '\0');
+    if (s.recvall(&text[0], h.length) < h.length) {
+        throw std::runtime_error("Connection closed in the middle of a frame");
+    }
+    return text;
+}
+
+void skippayload(mysock &s, const frameheader &h) {
+    std::vector<char> buffer(h.length < s.tuning().chunk() ? h.length : s.tuning().chunk());
+    uint64_t remaining = h.length;
+    while (remaining > 0) {
+        size_t want = remaining < buffer.size() ? remaining : buffer.size();
+        if (s.recvall(buffer.data(), want) < want) {
+            throw std::runtime_error("Connection closed in the middle of a frame");
+        }
+        remaining -= want;
+    }
+}
+
+bool recvmessage(mysock &s, frameheader &h, std::string &text) {
+    if (!recvheader(s, h)) {
+        return false;
+    }
+    if (h.type == FRAME_DATA || h.type == FRAME_END || h.type == FRAME_BUNDLE) {
+        throw std::runtime_error("Unexpected data frame");
+    }
+    text = recvtext(s, h);
+    return true;
+}
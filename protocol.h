@@ -0,0 +1,142 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: protocol.h                                      */
+/* purpose: this header file declares the framed wire        */
+/*          protocol that the file server and client speak   */
+/*          on top of a mysock connection. every message is  */
+/*          a fixed 16 byte header followed by a payload of  */
+/*          exactly header.length bytes, so the end of a     */
+/*          file never has to be guessed from recv() chunk   */
+/*          boundaries.                                      */
+/*                                                           */
+/*          header layout (network byte order):              */
+/*            byte  0     frame type                         */
+/*            byte  1     flags                              */
+/*            bytes 2-3   reserved (zero)                    */
+/*            bytes 4-7   request id                         */
+/*            bytes 8-15  payload length                     */
+/*************************************************************/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "socket.h"
+
+// Size of the encoded frame header
+constexpr size_t FRAME_HEADER_SIZE = 16;
+
+// Upper bound for text payloads (CMD, RESP, ERROR) so a corrupt
+// length cannot make the receiver allocate unbounded memory
+constexpr uint64_t MAX_TEXT_FRAME = 1 << 20;
+
+// Frame types
+constexpr uint8_t FRAME_CMD = 1;   // client command line
+constexpr uint8_t FRAME_RESP = 2;  // successful text reply
+constexpr uint8_t FRAME_DATA = 3;  // chunk of file contents
+constexpr uint8_t FRAME_END = 4;   // end of a DATA stream
+constexpr uint8_t FRAME_ERROR = 5; // failed reply or aborted stream
+constexpr uint8_t FRAME_BUNDLE = 6; // many small files packed together (bundle.h)
+
+// Frame flags
+constexpr uint8_t FLAG_COMPRESSED = 0x01; // DATA payload is a deflated chunk (compress.h)
+
+/*************************************************************/
+/* struct: frameheader                                       */
+/* purpose: decoded form of the 16 byte frame header.        */
+/*************************************************************/
+struct frameheader {
+    uint8_t type = 0;
+    uint8_t flags = 0;
+    uint32_t reqid = 0;
+    uint64_t length = 0;
+};
+
+/*************************************************************/
+/* function: encodeheader                                   */
+/* purpose: serializes a frame header into its wire form.   */
+/* parameters:                                              */
+/*    - h: the header to encode.                            */
+/*    - out: FRAME_HEADER_SIZE bytes of output space.       */
+/*************************************************************/
+void encodeheader(const frameheader &h, char *out);
+
+/*************************************************************/
+/* function: decodeheader                                   */
+/* purpose: parses a wire header into a frameheader.        */
+/* parameters:                                              */
+/*    - in: FRAME_HEADER_SIZE bytes read from the socket.   */
+/*    - h: receives the decoded header.                     */
+/*************************************************************/
+void decodeheader(const char *in, frameheader &h);
+
+/*************************************************************/
+/* function: sendframe                                      */
+/* purpose: sends one complete frame. the header and the    */
+/*          payload are written with a single gathered send.*/
+/* parameters:                                              */
+/*    - s: the connection to send on.                       */
+/*    - type: the frame type.                               */
+/*    - reqid: the request id the frame belongs to.         */
+/*    - data: the payload bytes (may be null if length 0).  */
+/*    - length: the payload length.                         */
+/*    - flags: the frame flags.                             */
+/*************************************************************/
+void sendframe(mysock &s, uint8_t type, uint32_t reqid, const char *data, uint64_t length, uint8_t flags = 0);
+
+/*************************************************************/
+/* function: sendtext                                       */
+/* purpose: sends a frame whose payload is a text message.  */
+/* parameters:                                              */
+/*    - s: the connection to send on.                       */
+/*    - type: FRAME_CMD, FRAME_RESP or FRAME_ERROR.         */
+/*    - reqid: the request id the frame belongs to.         */
+/*    - text: the message.                                  */
+/*************************************************************/
+void sendtext(mysock &s, uint8_t type, uint32_t reqid, const std::string &text);
+
+/*************************************************************/
+/* function: recvheader                                     */
+/* purpose: receives the next frame header.                 */
+/* parameters:                                              */
+/*    - s: the connection to read from.                     */
+/*    - h: receives the decoded header.                     */
+/* return: false if the peer closed the connection cleanly  */
+/*         between frames. throws if it closes mid-header.  */
+/*************************************************************/
+bool recvheader(mysock &s, frameheader &h);
+
+/*************************************************************/
+/* function: recvtext                                       */
+/* purpose: receives the payload of a text frame.           */
+/* parameters:                                              */
+/*    - s: the connection to read from.                     */
+/*    - h: the header that announced the payload.           */
+/* return: the payload as a string.                         */
+/*************************************************************/
+std::string recvtext(mysock &s, const frameheader &h);
+
+/*************************************************************/
+/* function: skippayload                                    */
+/* purpose: reads and discards the payload of a frame.      */
+/* parameters:                                              */
+/*    - s: the connection to read from.                     */
+/*    - h: the header that announced the payload.           */
+/*************************************************************/
+void skippayload(mysock &s, const frameheader &h);
+
+/*************************************************************/
+/* function: recvmessage                                    */
+/* purpose: receives a whole text frame (header + payload). */
+/*          data frames are rejected as a protocol error.   */
+/* parameters:                                              */
+/*    - s: the connection to read from.                     */
+/*    - h: receives the header.                             */
+/*    - text: receives the payload.                         */
+/* return: false if the peer closed the connection.         */
+/*************************************************************/
+bool recvmessage(mysock &s, frameheader &h, std::string &text);
+
+#endif
@@ -0,0 +1,1022 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: reactor.cpp                                         */
+/* purpose: this source file implements the epoll based server   */
+/*          core declared in reactor.h. sockets are level        */
+/*          triggered and non-blocking; a session only asks for  */
+/*          EPOLLOUT while it has output queued or a download    */
+/*          in flight, and each wakeup moves a bounded amount of */
+/*          data so one large transfer cannot starve the others. */
+/*****************************************************************/
+#include "reactor.h"
+#include "bundle.h"
+#include "compress.h"
+#include "protocol.h"
+#include "socket.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+// Events fetched per epoll_wait call
+constexpr int MAX_EVENTS = 256;
+
+// Bytes read from a socket per wakeup
+constexpr size_t READ_CHUNK = 256 * 1024;
+
+// Bytes handed to sendfile per wakeup
+constexpr size_t SEND_CHUNK = 1 << 20;
+
+// Stop reading from a client whose unconsumed input exceeds this
+constexpr size_t MAX_PENDING_INPUT = 4 << 20;
+
+// DATA frames at least this large get their range preallocated
+constexpr uint64_t PREALLOCATE_THRESHOLD = 1 << 20;
+
+reactor::reactor(int listen_fd) : listen_fd(listen_fd) {
+    // Every session costs a descriptor (two during a transfer)
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    int flags = fcntl(listen_fd, F_GETFL);
+    if (flags == -1 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        throw runtime_error("Failed to make listening socket non-blocking");
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        throw runtime_error("Failed to create epoll instance");
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+        ::close(epoll_fd);
+        throw runtime_error("Failed to register listening socket");
+    }
+}
+
+reactor::~reactor() {
+    while (!connections.empty()) {
+        closeConnection(*connections.begin()->second);
+    }
+    ::close(epoll_fd);
+}
+
+void reactor::run() {
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw runtime_error("epoll_wait failed");
+        }
+
+        for (int i = 0; i < ready; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                acceptClients();
+                continue;
+            }
+            if (wakers.count(fd)) {
+                onResults(fd);
+                continue;
+            }
+
+            auto it = connections.find(fd);
+            if (it == connections.end()) {
+                continue; // closed earlier in this batch
+            }
+            connection &c = *it->second;
+
+            bool alive = true;
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                alive = false;
+            }
+            if (alive && (events[i].events & EPOLLIN)) {
+                alive = onReadable(c);
+            }
+            if (alive && (events[i].events & EPOLLOUT)) {
+                alive = onWritable(c);
+            }
+            if (alive) {
+                updateInterest(c);
+            } else {
+                closeConnection(c);
+            }
+        }
+    }
+}
+
+void reactor::acceptClients() {
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        auto c = make_unique<connection>();
+        c->fd = fd;
+        c->tuner.attach(fd);
+        c->events = EPOLLIN;
+        try {
+            startSession(c->sess);
+        } catch (const exception &e) {
+            cerr << e.what() << endl;
+            ::close(fd);
+            continue;
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = c->events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            ::close(fd);
+            continue;
+        }
+        connections[fd] = move(c);
+        active++;
+        accepted++;
+        cout << "Client connected." << endl;
+    }
+}
+
+bool reactor::onReadable(connection &c) {
+    size_t old_size = c.in.size();
+    size_t want = c.tuner.chunk() > READ_CHUNK ? c.tuner.chunk() : READ_CHUNK;
+    c.in.resize(old_size + want);
+    ssize_t got = recv(c.fd, c.in.data() + old_size, want, 0);
+    if (got <= 0) {
+        c.in.resize(old_size);
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return true;
+        }
+        cout << "Client disconnected." << endl;
+        return false;
+    }
+    c.in.resize(old_size + got);
+
+    if (!process(c)) {
+        return false;
+    }
+    // Try to answer right away instead of waiting for EPOLLOUT
+    return onWritable(c);
+}
+
+bool reactor::onWritable(connection &c) {
+    while (true) {
+        while (c.out_pos < c.out.size()) {
+            ssize_t sent = send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+            if (sent == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return true;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            c.out_pos += sent;
+        }
+        c.out.clear();
+        c.out_pos = 0;
+
+        if (c.state == connstate::CLOSING) {
+            cout << "Client disconnected." << endl;
+            return false;
+        }
+        if (c.state != connstate::DOWNLOAD) {
+            return true;
+        }
+
+        if (c.cache_sending) {
+            if (!sendCached(c)) {
+                return false;
+            }
+            if (c.cache_sending) {
+                return true;
+            }
+            continue;
+        }
+
+        // A queued bundle or error of a recursive get has no file to stream
+        if (c.file_fd != -1) {
+            if (c.file_compress && c.raw_remaining == 0 && c.file_remaining > 0) {
+                if (!queueChunk(c)) {
+                    return false;
+                }
+                continue;
+            }
+            if (c.file_remaining > 0) {
+                // A compressed download sendfiles only the current raw chunk
+                uint64_t frame_left = c.file_compress ? c.raw_remaining : c.file_remaining;
+                off_t position = c.file_offset;
+                size_t want = frame_left < SEND_CHUNK ? frame_left : SEND_CHUNK;
+                ssize_t sent = sendfile(c.fd, c.file_fd, &position, want);
+                if (sent == -1) {
+                    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+                }
+                if (sent == 0) {
+                    cerr << "File shrank during transfer: " << c.file_path << endl;
+                    return false; // the DATA frame can no longer be completed
+                }
+                c.file_offset = position;
+                c.file_remaining -= sent;
+                if (!c.sums.readfile(c.file_fd, c.file_offset)) {
+                    cerr << "File shrank during transfer: " << c.file_path << endl;
+                    return false;
+                }
+                if (c.file_compress) {
+                    c.raw_remaining -= sent;
+                    continue;
+                }
+                if (c.file_remaining > 0) {
+                    return true;
+                }
+            }
+
+            ::close(c.file_fd);
+            c.file_fd = -1;
+            c.tuner.observe(c.transfer_bytes,
+                            chrono::duration<double>(chrono::steady_clock::now() - c.transfer_started).count());
+            cout << "File sent: " << c.file_path << endl;
+            string digest = c.sums.digest();
+            queueFrame(c, FRAME_END, c.reqid, digest.data(), digest.size());
+        }
+
+        if (c.listing.active()) {
+            string text;
+            bool more = c.listing.next(text);
+            queueFrame(c, FRAME_RESP, c.reqid, text.data(), text.size());
+            if (more) {
+                continue;
+            }
+        }
+        if (c.search.active()) {
+            // Never wait for the scan here: the whole worker would stall
+            string text;
+            bool more;
+            c.waiting = !c.search.trynext(text, more);
+            if (c.waiting) {
+                return true;
+            }
+            queueFrame(c, FRAME_RESP, c.reqid, text.data(), text.size());
+            if (more) {
+                continue;
+            }
+        }
+        if (c.finder.active()) {
+            string text;
+            bool more;
+            c.waiting = !c.finder.trynext(text, more);
+            if (c.waiting) {
+                return true;
+            }
+            queueFrame(c, FRAME_RESP, c.reqid, text.data(), text.size());
+            if (more) {
+                continue;
+            }
+        }
+
+        // Loop rather than recurse: a recursive get may have many files left
+        if (!nextTreeFile(c)) {
+            c.state = connstate::COMMAND;
+
+            // Commands that arrived during the download can run now
+            if (!process(c)) {
+                return false;
+            }
+        }
+    }
+}
+
+/*************************************************************/
+/* function: writeUpload                                    */
+/* purpose: writes upload bytes at the connection's file    */
+/*          offset, or drops them after a rejected put or a */
+/*          failed write.                                   */
+/* parameters:                                              */
+/*    - c: the uploading connection.                        */
+/*    - data: the bytes.                                    */
+/*    - n: how many.                                        */
+/*************************************************************/
+static void writeUpload(connection &c, const char *data, size_t n) {
+    if (c.file_fd == -1 || c.write_failed) {
+        return;
+    }
+    size_t done = 0;
+    while (done < n) {
+        ssize_t written = pwrite(c.file_fd, data + done, n - done, c.file_offset);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            c.write_failed = true;
+            return;
+        }
+        done += written;
+        c.file_offset += written;
+    }
+    c.sums.update(data, n);
+}
+
+bool reactor::process(connection &c) {
+    while (c.state == connstate::COMMAND || c.state == connstate::UPLOAD) {
+        size_t avail = c.in.size() - c.in_pos;
+        const char *data = c.in.data() + c.in_pos;
+
+        if (c.skip_remaining > 0) {
+            size_t n = avail < c.skip_remaining ? avail : c.skip_remaining;
+            if (n == 0) {
+                break;
+            }
+            c.in_pos += n;
+            c.skip_remaining -= n;
+            continue;
+        }
+
+        // Inside the payload of an upload's DATA frame
+        if (c.state == connstate::UPLOAD && c.file_remaining > 0) {
+            size_t n = avail < c.file_remaining ? avail : c.file_remaining;
+            if (n == 0) {
+                break;
+            }
+            writeUpload(c, data, n);
+            c.in_pos += n;
+            c.file_remaining -= n;
+            continue;
+        }
+
+        if (avail < FRAME_HEADER_SIZE) {
+            break;
+        }
+        frameheader h;
+        decodeheader(data, h);
+
+        if (c.state == connstate::UPLOAD && c.syncing && h.type == FRAME_DATA) {
+            // A delta frame is applied whole, once it has arrived
+            if (h.length > MAX_DELTA_FRAME) {
+                cerr << "Delta frame exceeds the maximum size" << endl;
+                return false;
+            }
+            if (avail < FRAME_HEADER_SIZE + h.length) {
+                break;
+            }
+            try {
+                applySync(c.sync, data + FRAME_HEADER_SIZE, h.length);
+            } catch (const exception &e) {
+                cerr << "Error handling client: " << e.what() << endl;
+                return false;
+            }
+            c.in_pos += FRAME_HEADER_SIZE + h.length;
+            continue;
+        }
+        if (c.state == connstate::UPLOAD && h.type == FRAME_DATA && (h.flags & FLAG_COMPRESSED)) {
+            // A compressed chunk can only be inflated once it is complete
+            if (h.length > MAX_COMPRESSED_FRAME) {
+                cerr << "Compressed frame exceeds the maximum size" << endl;
+                return false;
+            }
+            if (avail < FRAME_HEADER_SIZE + h.length) {
+                break;
+            }
+            string chunk;
+            try {
+                inflatechunk(data + FRAME_HEADER_SIZE, h.length, chunk);
+            } catch (const exception &e) {
+                cerr << "Error handling client: " << e.what() << endl;
+                return false;
+            }
+            c.in_pos += FRAME_HEADER_SIZE + h.length;
+            writeUpload(c, chunk.data(), chunk.size());
+            continue;
+        }
+        if (c.state == connstate::UPLOAD && h.type == FRAME_DATA) {
+            c.in_pos += FRAME_HEADER_SIZE;
+            c.file_remaining = h.length;
+            c.transfer_bytes += h.length;
+            if (c.file_fd != -1 && !c.write_failed && h.length >= PREALLOCATE_THRESHOLD) {
+                fallocate(c.file_fd, FALLOC_FL_KEEP_SIZE, c.file_offset, h.length); // best effort
+            }
+            continue;
+        }
+        if (c.state == connstate::UPLOAD && h.type == FRAME_BUNDLE) {
+            if (h.length > MAX_BUNDLE_FRAME) {
+                cerr << "Bundle frame exceeds the maximum size" << endl;
+                return false;
+            }
+            if (avail < FRAME_HEADER_SIZE + h.length) {
+                break;
+            }
+            string payload(data + FRAME_HEADER_SIZE, h.length);
+            c.in_pos += FRAME_HEADER_SIZE + h.length;
+            if (c.bundling && c.bundle.open) {
+                try {
+                    storeBundle(c.bundle, payload);
+                } catch (const exception &e) {
+                    cerr << "Error handling client: " << e.what() << endl;
+                    return false;
+                }
+            }
+            continue;
+        }
+        if (c.state == connstate::COMMAND && h.type != FRAME_CMD) {
+            // Stray data (e.g. from an aborted transfer); drop it
+            c.in_pos += FRAME_HEADER_SIZE;
+            c.skip_remaining = h.length;
+            continue;
+        }
+
+        // Text frames (CMD, END, ERROR) are handled once complete
+        if (h.length > MAX_TEXT_FRAME) {
+            cerr << "Text frame exceeds the maximum size" << endl;
+            return false;
+        }
+        if (avail < FRAME_HEADER_SIZE + h.length) {
+            break;
+        }
+        string text(data + FRAME_HEADER_SIZE, h.length);
+        c.in_pos += FRAME_HEADER_SIZE + h.length;
+
+        if (c.state == connstate::COMMAND) {
+            if (!startCommand(c, h.reqid, text)) {
+                return false;
+            }
+        } else if (h.type == FRAME_END) {
+            finishUpload(c, true, text);
+        } else if (h.type == FRAME_ERROR) {
+            finishUpload(c, false, text);
+        } else {
+            cerr << "Unexpected frame in data stream" << endl;
+            return false;
+        }
+    }
+
+    // Drop consumed input so the buffer does not grow without bound
+    if (c.in_pos == c.in.size()) {
+        c.in.clear();
+        c.in_pos = 0;
+    } else if (c.in_pos > READ_CHUNK) {
+        c.in.erase(c.in.begin(), c.in.begin() + c.in_pos);
+        c.in_pos = 0;
+    }
+    return true;
+}
+
+bool reactor::startCommand(connection &c, uint32_t reqid, const string &line) {
+    cout << "Command received: " << line << endl;
+    command cmd = parseCommand(line);
+
+    try {
+        if (cmd.cmd == "exit") {
+            c.state = connstate::CLOSING;
+        } else if (cmd.cmd == "ls") {
+            // The listing is produced a frame at a time as output drains
+            reply err;
+            if (!openListing(c.sess, cmd, c.listing, err)) {
+                queueFrame(c, err.type, reqid, err.text.data(), err.text.size());
+                return true;
+            }
+            c.reqid = reqid;
+            c.state = connstate::DOWNLOAD;
+            c.file_fd = -1;
+            c.file_remaining = 0;
+        } else if (cmd.cmd == "grep") {
+            // Matches are taken from the scanning threads as they are ready
+            reply err;
+            watchResults(c);
+            if (!openSearch(c.sess, cmd, c.search, err)) {
+                queueFrame(c, err.type, reqid, err.text.data(), err.text.size());
+                return true;
+            }
+            c.reqid = reqid;
+            c.state = connstate::DOWNLOAD;
+            c.file_fd = -1;
+            c.file_remaining = 0;
+        } else if (cmd.cmd == "find") {
+            // The tree is walked on a thread of its own, like a grep scan
+            reply err;
+            watchResults(c);
+            if (!openFind(c.sess, cmd, c.finder, err)) {
+                queueFrame(c, err.type, reqid, err.text.data(), err.text.size());
+                return true;
+            }
+            c.reqid = reqid;
+            c.state = connstate::DOWNLOAD;
+            c.file_fd = -1;
+            c.file_remaining = 0;
+        } else if (cmd.cmd == "get" && takeOption(cmd, "-R")) {
+            // get -R [-B] [-z] directory
+            reply err;
+            c.tree.clear();
+            c.tree_bundling = takeOption(cmd, "-B");
+            c.tree_compress = takeOption(cmd, "-z") || c.sess.compress;
+            if (!listTree(c.sess, cmd.arg(0), c.tree_root, c.tree_root_fd, c.tree, err)) {
+                queueFrame(c, err.type, reqid, err.text.data(), err.text.size());
+                return true;
+            }
+            for (const auto &chunk : formatManifest(c.tree)) {
+                queueFrame(c, FRAME_RESP, reqid, chunk.data(), chunk.size());
+            }
+            queueFrame(c, FRAME_RESP, reqid, nullptr, 0);
+            c.reqid = reqid;
+            c.tree_next = 0;
+            nextTreeFile(c);
+        } else if (cmd.cmd == "get") {
+            // get [-z] [-m known] path [offset [length]]
+            bool compress = takeOption(cmd, "-z") || c.sess.compress;
+            string known;
+            takeValue(cmd, "-m", known);
+            reply err;
+            uint64_t offset, length;
+            int fd = openForGet(c.sess, cmd, c.file_path, offset, length, err);
+            if (fd == -1) {
+                queueFrame(c, err.type, reqid, err.text.data(), err.text.size());
+                return true;
+            }
+            if (!known.empty()) {
+                // A conditional get: "Unchanged" alone, or "Version" then the file
+                string version;
+                bool unchanged = checkUnchanged(fd, known, version);
+                string text = (unchanged ? "Unchanged " : "Version ") + version;
+                queueFrame(c, FRAME_RESP, reqid, text.data(), text.size());
+                if (unchanged) {
+                    ::close(fd);
+                    cout << "File unchanged: " << c.file_path << endl;
+                    return true;
+                }
+            }
+            if (!compress && offset == 0 && c.cached.open(fd) && c.cached.size() == length) {
+                // Sent from memory while held, so the disk is never waited on
+                ::close(fd);
+                beginCached(c, reqid);
+                return true;
+            }
+            c.cached.release();
+            c.reqid = reqid;
+            beginDownload(c, fd, offset, length, compress);
+        } else if (cmd.cmd == "put" && takeOption(cmd, "-B")) {
+            c.state = connstate::UPLOAD;
+            c.reqid = reqid;
+            c.bundling = true;
+            c.bundle = bundlewriter();
+            openBundle(c.sess, cmd.arg(0), c.bundle, c.pending_error);
+            c.file_fd = -1;
+            c.file_remaining = 0;
+        } else if (cmd.cmd == "put") {
+            c.state = connstate::UPLOAD;
+            c.reqid = reqid;
+            c.file_fd = openForPut(c.sess, cmd, c.file_path, c.upload, c.file_offset, c.file_ranged,
+                                   c.pending_error);
+            c.hashing = c.file_fd != -1 && hashesUpload(cmd, c.file_offset);
+            c.content = sha256();
+            c.sums = integritysums(c.file_offset, c.hashing ? &c.content : nullptr);
+            c.file_remaining = 0;
+            c.write_failed = false;
+            c.transfer_bytes = 0;
+            c.transfer_started = chrono::steady_clock::now();
+        } else if (cmd.cmd == "sync") {
+            // Signatures go out now; the delta comes back like an upload
+            reply err;
+            string header, signatures;
+            c.sync = syncwriter();
+            if (!openSync(c.sess, cmd, c.sync, header, signatures, err)) {
+                queueFrame(c, err.type, reqid, err.text.data(), err.text.size());
+                return true;
+            }
+            queueFrame(c, FRAME_RESP, reqid, header.data(), header.size());
+            for (size_t sent = 0; sent < signatures.size(); sent += DELTA_FRAME_TARGET) {
+                size_t n = min(signatures.size() - sent, DELTA_FRAME_TARGET);
+                queueFrame(c, FRAME_DATA, reqid, signatures.data() + sent, n);
+            }
+            queueFrame(c, FRAME_END, reqid, nullptr, 0);
+            c.state = connstate::UPLOAD;
+            c.reqid = reqid;
+            c.syncing = true;
+            c.file_fd = -1;
+            c.file_remaining = 0;
+        } else if (cmd.cmd == "tune") {
+            reply r = tuneLink(c.tuner, cmd);
+            queueFrame(c, r.type, reqid, r.text.data(), r.text.size());
+        } else {
+            reply r = runCommand(c.sess, cmd);
+            queueFrame(c, r.type, reqid, r.text.data(), r.text.size());
+        }
+    } catch (const exception &e) {
+        string message = "Error: " + string(e.what());
+        queueFrame(c, FRAME_ERROR, reqid, message.data(), message.size());
+    }
+    return true;
+}
+
+void reactor::beginDownload(connection &c, int fd, uint64_t offset, uint64_t length, bool compress) {
+    if (!compress) {
+        // The DATA header announces the whole range; sendfile fills it in
+        frameheader h;
+        h.type = FRAME_DATA;
+        h.reqid = c.reqid;
+        h.length = length;
+        char header[FRAME_HEADER_SIZE];
+        encodeheader(h, header);
+        c.out.append(header, sizeof(header));
+    }
+    posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+
+    c.state = connstate::DOWNLOAD;
+    c.transfer_bytes = length;
+    c.transfer_started = chrono::steady_clock::now();
+    c.file_fd = fd;
+    c.file_offset = offset;
+    c.file_remaining = length;
+    c.file_compress = compress;
+    c.sums = integritysums(offset);
+    c.gate = compressgate();
+    c.raw_remaining = 0;
+    c.chunk_size = 0;
+}
+
+bool reactor::queueChunk(connection &c) {
+    // The previous chunk has been sent: that took from its start to now
+    auto now = chrono::steady_clock::now();
+    if (c.chunk_size > 0) {
+        c.gate.record(c.chunk_attempted, c.chunk_size, chrono::duration<double>(now - c.chunk_started).count());
+    }
+
+    size_t want = c.file_remaining < COMPRESS_CHUNK ? c.file_remaining : COMPRESS_CHUNK;
+    c.chunk_size = want;
+    c.chunk_started = now;
+    c.chunk_attempted = c.gate.wanted();
+    if (!c.chunk_attempted) {
+        // A raw chunk is its own DATA frame that sendfile fills in
+        frameheader h;
+        h.type = FRAME_DATA;
+        h.reqid = c.reqid;
+        h.length = want;
+        char header[FRAME_HEADER_SIZE];
+        encodeheader(h, header);
+        c.out.append(header, sizeof(header));
+        c.raw_remaining = want;
+        return true;
+    }
+
+    // Compressing inline keeps the loop single threaded; a chunk is small
+    // enough that other sessions barely notice
+    string raw(want, '\0');
+    size_t got = 0;
+    while (got < want) {
+        ssize_t n = pread(c.file_fd, &raw[got], want - got, c.file_offset + got);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            cerr << "File shrank during transfer: " << c.file_path << endl;
+            return false;
+        }
+        got += n;
+    }
+
+    c.sums.update(raw.data(), raw.size());
+    string packed;
+    bool compressed = deflatechunk(raw.data(), raw.size(), packed);
+    const string &payload = compressed ? packed : raw;
+    queueFrame(c, FRAME_DATA, c.reqid, payload.data(), payload.size(), compressed ? FLAG_COMPRESSED : 0);
+    c.file_offset += want;
+    c.file_remaining -= want;
+    return true;
+}
+
+bool reactor::nextTreeFile(connection &c) {
+    treeitem item = nextTreeItem(c.tree_root, c.tree_root_fd.get(), c.tree, c.tree_next, c.tree_bundling);
+    if (item.kind == treeitemkind::DONE) {
+        c.tree.clear();
+        c.tree_next = 0;
+        c.tree_root_fd.reset();
+        return false;
+    }
+    if (item.kind == treeitemkind::SENDFILE) {
+        c.file_path = item.path;
+        beginDownload(c, item.fd, 0, item.size, c.tree_compress);
+        return true;
+    }
+
+    // A bundle or an error: flush it, then come back for the next item
+    uint8_t type = item.kind == treeitemkind::BUNDLE ? FRAME_BUNDLE : FRAME_ERROR;
+    queueFrame(c, type, c.reqid, item.text.data(), item.text.size());
+    c.state = connstate::DOWNLOAD;
+    c.file_fd = -1;
+    c.file_remaining = 0;
+    return true;
+}
+
+void reactor::finishUpload(connection &c, bool complete, const string &text) {
+    reply r;
+    if (c.syncing) {
+        if (complete) {
+            r = finishSync(c.sync);
+        } else {
+            abortSync(c.sync);
+            r = {FRAME_ERROR, text};
+        }
+        c.syncing = false;
+    } else if (c.bundling) {
+        if (!c.bundle.open) {
+            r = c.pending_error;
+        } else if (complete) {
+            r = finishBundle(c.bundle);
+            cout << "Bundle received into " << c.bundle.root << ": " << c.bundle.stored << " files" << endl;
+        } else {
+            r = {FRAME_ERROR, text};
+        }
+        c.bundling = false;
+        c.bundle = bundlewriter();
+    } else if (c.file_fd == -1) {
+        r = c.pending_error;
+    } else {
+        ::close(c.file_fd);
+        c.file_fd = -1;
+        c.tuner.observe(c.transfer_bytes,
+                        chrono::duration<double>(chrono::steady_clock::now() - c.transfer_started).count());
+        // END carries the client's block sums, ERROR its reason
+        vector<byterange> damaged;
+        if (complete && !c.write_failed && c.sums.verify(text, damaged)) {
+            r = finishPut(c.file_path, c.upload, c.hashing ? &c.content : nullptr);
+        } else {
+            if (!c.file_ranged) {
+                discardPut(c.upload);
+            }
+            if (!complete) {
+                r = {FRAME_ERROR, text};
+            } else if (c.write_failed) {
+                r = {FRAME_ERROR, "Error: Writing to file failed."};
+            } else {
+                r = {FRAME_ERROR, formatdamaged(damaged)};
+            }
+        }
+    }
+    queueFrame(c, r.type, c.reqid, r.text.data(), r.text.size());
+    c.state = connstate::COMMAND;
+}
+
+void reactor::queueFrame(connection &c, uint8_t type, uint32_t reqid, const char *data, uint64_t length,
+                         uint8_t flags) {
+    frameheader h;
+    h.type = type;
+    h.flags = flags;
+    h.reqid = reqid;
+    h.length = length;
+    char header[FRAME_HEADER_SIZE];
+    encodeheader(h, header);
+    c.out.append(header, sizeof(header));
+    if (length > 0) {
+        c.out.append(data, length);
+    }
+}
+
+/*************************************************************/
+/* function: beginCached                                    */
+/* purpose: starts a get of the file held in c.cached. the  */
+/*          DATA header is queued and the pieces are sent   */
+/*          from the shared cache by sendCached, so the     */
+/*          connection never holds a copy of the file.      */
+/* parameters:                                              */
+/*    - c: the connection.                                  */
+/*    - reqid: the id of the get request.                   */
+/*************************************************************/
+void reactor::beginCached(connection &c, uint32_t reqid) {
+    frameheader h;
+    h.type = FRAME_DATA;
+    h.reqid = reqid;
+    h.length = c.cached.size();
+    char header[FRAME_HEADER_SIZE];
+    encodeheader(h, header);
+    c.out.append(header, sizeof(header));
+
+    c.cached_pieces.clear();
+    c.cached.visit([&c](const char *data, size_t size) {
+        c.cached_pieces.push_back({const_cast<char *>(data), size});
+    });
+    c.cached_next = 0;
+    c.cache_sending = true;
+    c.reqid = reqid;
+    c.state = connstate::DOWNLOAD;
+}
+
+/*************************************************************/
+/* function: sendCached                                     */
+/* purpose: sends the next pieces of a cached get, as many  */
+/*          as one sendmsg takes. once all are out the file */
+/*          is let go and its END frame queued.             */
+/* parameters:                                              */
+/*    - c: the connection.                                  */
+/* return: false if the connection failed.                  */
+/*************************************************************/
+bool reactor::sendCached(connection &c) {
+    if (c.cached_next < c.cached_pieces.size()) {
+        struct msghdr m;
+        memset(&m, 0, sizeof(m));
+        m.msg_iov = &c.cached_pieces[c.cached_next];
+        m.msg_iovlen = min<size_t>(c.cached_pieces.size() - c.cached_next, IOV_MAX);
+        ssize_t sent = sendmsg(c.fd, &m, MSG_NOSIGNAL);
+        if (sent == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        while (sent > 0) {
+            iovec &piece = c.cached_pieces[c.cached_next];
+            size_t n = static_cast<size_t>(sent) < piece.iov_len ? sent : piece.iov_len;
+            piece.iov_base = static_cast<char *>(piece.iov_base) + n;
+            piece.iov_len -= n;
+            sent -= n;
+            if (piece.iov_len == 0) {
+                ++c.cached_next;
+            }
+        }
+        if (c.cached_next < c.cached_pieces.size()) {
+            return true;
+        }
+    }
+
+    string digest = c.cached.digest();
+    c.cached.release();
+    c.cached_pieces.clear();
+    c.cache_sending = false;
+    cout << "File sent from cache: " << c.file_path << endl;
+    queueFrame(c, FRAME_END, c.reqid, digest.data(), digest.size());
+    return true;
+}
+
+/*************************************************************/
+/* function: watchResults                                   */
+/* purpose: gives a connection the eventfd its grep and     */
+/*          find threads signal, registered with the loop,  */
+/*          the first time it needs one.                    */
+/*************************************************************/
+void reactor::watchResults(connection &c) {
+    if (c.wake_fd != -1) {
+        return;
+    }
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+        throw runtime_error("Failed to create eventfd");
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        ::close(fd);
+        throw runtime_error("Failed to register eventfd");
+    }
+    c.wake_fd = fd;
+    c.search.notify(fd);
+    c.finder.notify(fd);
+    wakers[fd] = c.fd;
+}
+
+/*************************************************************/
+/* function: onResults                                      */
+/* purpose: resets a signalled eventfd and, if its          */
+/*          connection was waiting for results, sends them. */
+/*************************************************************/
+void reactor::onResults(int wake_fd) {
+    uint64_t count;
+    if (read(wake_fd, &count, sizeof(count)) == -1) {
+        return; // already reset
+    }
+    connection &c = *connections.at(wakers.at(wake_fd));
+    if (!c.waiting) {
+        return;
+    }
+    c.waiting = false;
+    if (onWritable(c)) {
+        updateInterest(c);
+    } else {
+        closeConnection(c);
+    }
+}
+
+void reactor::updateInterest(connection &c) {
+    uint32_t wanted = 0;
+    bool accepting_input = c.state == connstate::COMMAND || c.state == connstate::UPLOAD;
+    if (accepting_input && c.in.size() - c.in_pos < MAX_PENDING_INPUT) {
+        wanted |= EPOLLIN;
+    }
+    bool sending = c.state == connstate::DOWNLOAD && !c.waiting;
+    if (c.out_pos < c.out.size() || sending || c.state == connstate::CLOSING) {
+        wanted |= EPOLLOUT;
+    }
+    if (wanted == c.events) {
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = wanted;
+    ev.data.fd = c.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+    c.events = wanted;
+}
+
+void reactor::closeConnection(connection &c) {
+    int fd = c.fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    if (c.file_fd != -1) {
+        ::close(c.file_fd);
+        if (c.state == connstate::UPLOAD && !c.file_ranged) {
+            discardPut(c.upload); // ranged puts are kept so they can be resumed
+        }
+    }
+    if (c.syncing) {
+        abortSync(c.sync); // the old copy stays as it was
+    }
+    if (c.wake_fd != -1) {
+        c.search.finish(); // their threads must not signal a closed eventfd
+        c.finder.finish();
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.wake_fd, nullptr);
+        ::close(c.wake_fd);
+        wakers.erase(c.wake_fd);
+    }
+    connections.erase(fd);
+    active--;
+}
+
+uint64_t reactor::activeSessions() const {
+    return active.load();
+}
+
+uint64_t reactor::acceptedSessions() const {
+    return accepted.load();
+}
+
+void runReactors(const string &port, int threads, int backlog) {
+    // Workers inherit this mask, so SIGUSR1 is only seen by sigwait below
+    sigset_t report_signals;
+    sigemptyset(&report_signals);
+    sigaddset(&report_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &report_signals, nullptr);
+
+    // Bind every listener up front so a port error stops startup
+    vector<unique_ptr<mysock>> listeners;
+    vector<unique_ptr<reactor>> workers;
+    for (int i = 0; i < threads; ++i) {
+        listeners.push_back(make_unique<mysock>());
+        listeners.back()->reuseport();
+        listeners.back()->bind(port);
+        listeners.back()->listen(backlog);
+        workers.push_back(make_unique<reactor>(listeners.back()->getfd()));
+    }
+
+    for (int i = 0; i < threads; ++i) {
+        reactor *worker = workers[i].get();
+        thread([worker, i]() {
+            try {
+                worker->run();
+            } catch (const exception &e) {
+                cerr << "Worker " << i << " failed: " << e.what() << endl;
+                exit(1);
+            }
+        }).detach();
+    }
+
+    while (true) {
+        int signal;
+        if (sigwait(&report_signals, &signal) != 0) {
+            continue;
+        }
+        cout << "Worker sessions (active / accepted):" << endl;
+        for (int i = 0; i < threads; ++i) {
+            cout << "  worker " << i << ": " << workers[i]->activeSessions() << " / "
+                 << workers[i]->acceptedSessions() << endl;
+        }
+        if (hotcacheenabled()) {
+            cout << "Hot-file cache: " << formathotstats(hotcachestats()) << endl;
+        }
+    }
+}
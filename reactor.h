@@ -0,0 +1,212 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: reactor.h                                       */
+/* purpose: this header file declares the event driven       */
+/*          server core. one reactor multiplexes every       */
+/*          client session on a single thread with a         */
+/*          non-blocking epoll loop instead of forking a     */
+/*          process per client. each connection carries a    */
+/*          small state machine that tracks whether it is    */
+/*          waiting for a command, streaming a download (or  */
+/*          the files of a recursive get) or consuming an    */
+/*          upload. a session's commands are read ahead but  */
+/*          handled one after another, in the order they     */
+/*          came; unlike fork mode no session runs queries   */
+/*          side by side. runReactors starts several         */
+/*          reactors on their own threads, each with its own */
+/*          SO_REUSEPORT listening socket, so the kernel     */
+/*          spreads new connections across cores.            */
+/*************************************************************/
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/uio.h>
+#include "checksum.h"
+#include "commands.h"
+#include "compress.h"
+#include "hotcache.h"
+#include "transfer.h"
+
+/*************************************************************/
+/* enum: connstate                                           */
+/* purpose: what a connection is currently doing.            */
+/*************************************************************/
+enum class connstate {
+    COMMAND,  // waiting for the next CMD frame
+    DOWNLOAD, // sending a file for a get
+    UPLOAD,   // receiving DATA frames for a put
+    CLOSING   // flushing output before closing (after exit)
+};
+
+/*************************************************************/
+/* struct: connection                                        */
+/* purpose: per-client state owned by the reactor.           */
+/*************************************************************/
+struct connection {
+    int fd = -1;
+    session sess;
+    linktuner tuner;                // sizes of this connection's transfers
+    connstate state = connstate::COMMAND;
+    uint32_t events = 0;            // epoll events currently registered
+
+    std::vector<char> in;           // received bytes not yet consumed
+    size_t in_pos = 0;              // first unconsumed byte in `in`
+    std::string out;                // encoded frames waiting to be sent
+    size_t out_pos = 0;             // first unsent byte in `out`
+    uint64_t skip_remaining = 0;    // payload bytes of a stray frame to drop
+
+    // Transfer in progress (get or put)
+    uint32_t reqid = 0;
+    int file_fd = -1;
+    std::string file_path;
+    location upload;                // where a put's file was created
+    uint64_t file_offset = 0;       // next file byte to send or write
+    uint64_t file_remaining = 0;    // bytes left in the download or DATA frame
+    bool file_ranged = false;       // put of one range; kept even if it fails
+    bool write_failed = false;
+    reply pending_error;            // reply for a rejected put, sent after draining
+    integritysums sums;             // CRC32C blocks of the range, for the END frame
+    bool hashing = false;           // put is named for the content store as it lands
+    sha256 content;
+    uint64_t transfer_bytes = 0;    // payload of the get or put, for the tuner
+    std::chrono::steady_clock::time_point transfer_started;
+
+    // Compressed download: the file goes out chunk by chunk
+    bool file_compress = false;
+    compressgate gate;
+    uint64_t raw_remaining = 0;     // bytes of a raw chunk still to sendfile
+    uint64_t chunk_size = 0;        // the chunk being sent, timed by the next one
+    bool chunk_attempted = false;
+    std::chrono::steady_clock::time_point chunk_started;
+
+    // Recursive get in progress: files still to send after the current one
+    std::vector<treeentry> tree;
+    size_t tree_next = 0;
+    std::string tree_root;
+    fdhandle tree_root_fd;
+    bool tree_bundling = false;
+    bool tree_compress = false;
+
+    // Get served from the hot-file cache: the held file's pieces are sent
+    // straight from the shared cache as output drains
+    hotfile cached;
+    bool cache_sending = false;
+    std::vector<iovec> cached_pieces;
+    size_t cached_next = 0;         // first piece not wholly sent
+
+    // ls in progress: frames are read from the directory as output drains
+    dirlisting listing;
+
+    // grep in progress: result frames are taken from the scan as output drains
+    textsearch search;
+
+    // find in progress: result frames are taken from the walk the same way
+    findwalk finder;
+
+    // The scanning and walking threads signal this eventfd as results
+    // become ready. While the output is drained and no frame is ready,
+    // the connection waits for it instead of EPOLLOUT
+    int wake_fd = -1;
+    bool waiting = false;
+
+    // "put -B" in progress: BUNDLE frames are unpacked as they arrive
+    bool bundling = false;
+    bundlewriter bundle;
+
+    // "sync" in progress: delta frames rebuild the file beside the old one
+    bool syncing = false;
+    syncwriter sync;
+};
+
+/*************************************************************/
+/* class: reactor                                            */
+/* purpose: accepts clients on a listening socket and runs   */
+/*          their sessions from one epoll event loop.        */
+/*************************************************************/
+class reactor {
+  public:
+    /*************************************************************/
+    /* function: reactor                                        */
+    /* purpose: creates the epoll instance and registers the    */
+    /*          listening socket, switching it to non-blocking. */
+    /* parameters:                                              */
+    /*    - listen_fd: a bound socket that is already listening.*/
+    /*************************************************************/
+    reactor(int listen_fd);
+
+    /*************************************************************/
+    /* function: ~reactor                                       */
+    /* purpose: closes every open session and the epoll fd.     */
+    /*************************************************************/
+    ~reactor();
+
+    /*************************************************************/
+    /* function: run                                            */
+    /* purpose: runs the event loop until the process exits.    */
+    /*************************************************************/
+    void run();
+
+    /*************************************************************/
+    /* function: activeSessions                                 */
+    /* purpose: number of sessions currently open. safe to call */
+    /*          from another thread.                            */
+    /*************************************************************/
+    uint64_t activeSessions() const;
+
+    /*************************************************************/
+    /* function: acceptedSessions                               */
+    /* purpose: number of sessions accepted since startup. safe */
+    /*          to call from another thread.                    */
+    /*************************************************************/
+    uint64_t acceptedSessions() const;
+
+  private:
+    void acceptClients();
+    bool onReadable(connection &c);
+    bool onWritable(connection &c);
+    bool process(connection &c);
+    bool startCommand(connection &c, uint32_t reqid, const std::string &line);
+    void beginDownload(connection &c, int fd, uint64_t offset, uint64_t length, bool compress);
+    bool queueChunk(connection &c);
+    bool nextTreeFile(connection &c);
+    void finishUpload(connection &c, bool complete, const std::string &text);
+    void queueFrame(connection &c, uint8_t type, uint32_t reqid, const char *data, uint64_t length,
+                    uint8_t flags = 0);
+    void beginCached(connection &c, uint32_t reqid);
+    bool sendCached(connection &c);
+    void watchResults(connection &c);
+    void onResults(int wake_fd);
+    void updateInterest(connection &c);
+    void closeConnection(connection &c);
+
+    int listen_fd;
+    int epoll_fd;
+    std::unordered_map<int, std::unique_ptr<connection>> connections;
+    std::unordered_map<int, int> wakers; // a connection's wake_fd -> its socket
+    std::atomic<uint64_t> active{0};
+    std::atomic<uint64_t> accepted{0};
+};
+
+/*************************************************************/
+/* function: runReactors                                    */
+/* purpose: binds one SO_REUSEPORT listening socket per     */
+/*          worker, runs a reactor on each worker thread    */
+/*          and never returns. the calling thread prints    */
+/*          per-worker session counters on SIGUSR1 so an    */
+/*          uneven spread across workers is visible.        */
+/* parameters:                                              */
+/*    - port: the port every worker listens on.             */
+/*    - threads: the number of worker threads.              */
+/*    - backlog: the listen backlog of each worker socket.  */
+/*************************************************************/
+void runReactors(const std::string &port, int threads, int backlog);
+
+#endif
@@ -0,0 +1,222 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: sandbox.cpp                                         */
+/* purpose: this source file implements the directory sandbox    */
+/*          declared in sandbox.h. openat2(2) is tried first;    */
+/*          once it reports ENOSYS every later call takes the    */
+/*          component walk.                                      */
+/*****************************************************************/
+#include "sandbox.h"
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+// Times openat2 is retried when a rename raced with resolving ".."
+constexpr int MAX_RESOLVE_RETRIES = 8;
+
+// Names tried by createtemp before giving up
+constexpr int MAX_TEMP_ATTEMPTS = 100;
+
+// Cleared the first time the kernel lacks openat2
+static std::atomic<bool> have_openat2{true};
+
+fdhandle &fdhandle::operator=(fdhandle &&other) noexcept {
+    if (this != &other) {
+        reset(other.release());
+    }
+    return *this;
+}
+
+fdhandle::~fdhandle() {
+    reset();
+}
+
+int fdhandle::release() {
+    int released = fd;
+    fd = -1;
+    return released;
+}
+
+void fdhandle::reset(int newfd) {
+    if (fd != -1) {
+        close(fd);
+    }
+    fd = newfd;
+}
+
+/*************************************************************/
+/* function: pushcomponents                                 */
+/* purpose: queues the components of a path so that the     */
+/*          first one is taken from the back next.          */
+/*************************************************************/
+static void pushcomponents(std::vector<std::string> &pending, const std::string &path) {
+    size_t end = path.size();
+    while (end > 0) {
+        size_t start = path.rfind('/', end - 1);
+        start = start == std::string::npos ? 0 : start + 1;
+        if (end > start) {
+            pending.push_back(path.substr(start, end - start));
+        }
+        end = start == 0 ? 0 : start - 1;
+    }
+}
+
+/*************************************************************/
+/* function: walkbeneath                                    */
+/* purpose: openbeneath for kernels without openat2. every  */
+/*          directory is entered with O_NOFOLLOW, so a      */
+/*          component swapped for a symlink while walking   */
+/*          fails instead of being followed; symlinks are   */
+/*          read and resolved here, and ".." only climbs    */
+/*          back through directories this walk entered.     */
+/*************************************************************/
+static int walkbeneath(int dirfd, const std::string &path, int flags, mode_t mode) {
+    std::vector<std::string> pending;
+    pushcomponents(pending, path);
+    std::vector<int> entered; // directories below dirfd, innermost last
+    int fd = -1, error = 0, links = 0;
+
+    while (true) {
+        int current = entered.empty() ? dirfd : entered.back();
+        if (pending.empty()) {
+            fd = openat(current, ".", flags, mode); // the path named a directory
+            error = errno;
+            break;
+        }
+        std::string name = pending.back();
+        pending.pop_back();
+        if (name == ".") {
+            continue;
+        }
+        if (name == "..") {
+            if (entered.empty()) {
+                error = EXDEV;
+                break;
+            }
+            close(entered.back());
+            entered.pop_back();
+            continue;
+        }
+
+        if (!pending.empty()) {
+            int next = openat(current, name.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (next != -1) {
+                entered.push_back(next);
+                continue;
+            }
+        } else {
+            fd = openat(current, name.c_str(), flags | O_NOFOLLOW, mode);
+            struct stat st;
+            bool link_itself = fd != -1 && (flags & O_PATH) && fstat(fd, &st) == 0 && S_ISLNK(st.st_mode);
+            if (fd != -1 && (!link_itself || (flags & O_NOFOLLOW))) {
+                break;
+            }
+            if (fd != -1) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        error = errno;
+
+        // Only a symlink is worth another look; the caller's own
+        // O_NOFOLLOW still refuses one at the end
+        char target[PATH_MAX];
+        ssize_t n = readlinkat(current, name.c_str(), target, sizeof(target));
+        if (n == -1 || (pending.empty() && (flags & O_NOFOLLOW))) {
+            break;
+        }
+        if (++links > MAX_SYMLINK_FOLLOWS) {
+            error = ELOOP;
+            break;
+        }
+        if (n == 0 || target[0] == '/') {
+            error = EXDEV;
+            break;
+        }
+        pushcomponents(pending, std::string(target, n));
+        error = 0;
+    }
+
+    for (int dir : entered) {
+        close(dir);
+    }
+    if (fd == -1) {
+        errno = error;
+    }
+    return fd;
+}
+
+int openbeneath(int dirfd, const std::string &path, int flags, mode_t mode) {
+    std::string relative = path.empty() ? "." : path;
+    flags |= O_CLOEXEC;
+    if (relative[0] == '/') {
+        errno = EXDEV;
+        return -1;
+    }
+    if (have_openat2.load(std::memory_order_relaxed)) {
+        struct open_how how = {};
+        how.flags = flags;
+        how.mode = (flags & (O_CREAT | O_TMPFILE)) ? mode : 0;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        for (int attempt = 0; attempt < MAX_RESOLVE_RETRIES; attempt++) {
+            int fd = syscall(SYS_openat2, dirfd, relative.c_str(), &how, sizeof(how));
+            if (fd != -1 || (errno != EAGAIN && errno != EINTR)) {
+                if (fd == -1 && errno == ENOSYS) {
+                    break;
+                }
+                return fd;
+            }
+        }
+        if (errno == ENOSYS) {
+            have_openat2.store(false, std::memory_order_relaxed);
+        } else {
+            return -1;
+        }
+    }
+    return walkbeneath(dirfd, relative, flags, mode);
+}
+
+int openparent(int dirfd, const std::string &path, std::string &name) {
+    size_t end = path.find_last_not_of('/');
+    if (end == std::string::npos) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t slash = path.rfind('/', end);
+    size_t start = slash == std::string::npos ? 0 : slash + 1;
+    name = path.substr(start, end + 1 - start);
+    if (name == "." || name == "..") {
+        errno = EINVAL;
+        return -1;
+    }
+    return openbeneath(dirfd, path.substr(0, start), O_PATH | O_DIRECTORY);
+}
+
+int createtemp(int dirfd, const std::string &name, const std::string &tag, std::string &temp) {
+    size_t slash = name.rfind('/');
+    std::string directory = slash == std::string::npos ? "" : name.substr(0, slash + 1);
+    std::string base = slash == std::string::npos ? name : name.substr(slash + 1);
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    for (int attempt = 0; attempt < MAX_TEMP_ATTEMPTS; attempt++) {
+        unsigned char random[6];
+        if (getrandom(random, sizeof(random), 0) != sizeof(random)) {
+            return -1;
+        }
+        temp = directory + "." + base + "." + tag + "-";
+        for (unsigned char byte : random) {
+            temp += letters[byte % (sizeof(letters) - 1)];
+        }
+        int fd = openat(dirfd, temp.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd != -1 || errno != EEXIST) {
+            return fd;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,97 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: sandbox.h                                       */
+/* purpose: this header file declares how the server opens   */
+/*          files without leaving a directory. a path is     */
+/*          resolved by the kernel relative to an open       */
+/*          directory descriptor with openat2(2) and         */
+/*          RESOLVE_BENEATH, so "..", absolute symlinks and  */
+/*          symlinks pointing outside fail in the same call  */
+/*          that opens the file: there is no gap between     */
+/*          checking a path and using it, and no path walk   */
+/*          of its own. kernels older than 5.6 get the same  */
+/*          rules from a walk one component at a time with   */
+/*          O_PATH descriptors.                              */
+/*************************************************************/
+
+#ifndef SANDBOX_H
+#define SANDBOX_H
+
+#include <string>
+#include <sys/types.h>
+
+// Symlinks followed while resolving one path, as the kernel allows
+constexpr int MAX_SYMLINK_FOLLOWS = 40;
+
+/*************************************************************/
+/* class: fdhandle                                           */
+/* purpose: owns a file descriptor and closes it when it is  */
+/*          replaced or goes away. can be moved, not copied. */
+/*************************************************************/
+class fdhandle {
+  public:
+    explicit fdhandle(int fd = -1) : fd(fd) {}
+    fdhandle(fdhandle &&other) noexcept : fd(other.release()) {}
+    fdhandle &operator=(fdhandle &&other) noexcept;
+    fdhandle(const fdhandle &) = delete;
+    fdhandle &operator=(const fdhandle &) = delete;
+    ~fdhandle();
+
+    int get() const { return fd; }
+
+    // Gives the descriptor up without closing it
+    int release();
+
+    // Closes the current descriptor and takes fd
+    void reset(int fd = -1);
+
+  private:
+    int fd;
+};
+
+/*************************************************************/
+/* function: openbeneath                                    */
+/* purpose: opens a path relative to a directory, failing   */
+/*          if resolving it would leave the directory.      */
+/*          symlinks inside the directory are followed.     */
+/* parameters:                                              */
+/*    - dirfd: the directory (an O_PATH descriptor will do).*/
+/*    - path: a relative path; empty means the directory.   */
+/*    - flags: open(2) flags; O_CLOEXEC is always added.    */
+/*    - mode: the mode of a file created with O_CREAT.      */
+/* return: the descriptor, or -1 with errno set (EXDEV for  */
+/*         a path leaving the directory).                   */
+/*************************************************************/
+int openbeneath(int dirfd, const std::string &path, int flags, mode_t mode = 0);
+
+/*************************************************************/
+/* function: openparent                                     */
+/* purpose: opens the directory a path's last component is  */
+/*          in, for calls that name the entry itself        */
+/*          (mkdirat, renameat, unlinkat, linkat).          */
+/* parameters:                                              */
+/*    - dirfd: the directory the path is relative to.       */
+/*    - path: the relative path.                            */
+/*    - name: receives the last component.                  */
+/* return: an O_PATH directory descriptor, or -1 with errno */
+/*         set (EINVAL if the path names no entry, such as  */
+/*         "" or "..").                                     */
+/*************************************************************/
+int openparent(int dirfd, const std::string &path, std::string &name);
+
+/*************************************************************/
+/* function: createtemp                                     */
+/* purpose: creates an empty file with a unique hidden name */
+/*          next to an entry, so it can be renamed over it  */
+/*          once complete. the mkostemp(3) of a directory   */
+/*          descriptor.                                     */
+/* parameters:                                              */
+/*    - dirfd: the directory holding the entry.             */
+/*    - name: the entry; may have directories in front.     */
+/*    - tag: what the temporary file is for ("sync").       */
+/*    - temp: receives its name, relative to dirfd.         */
+/* return: a read-write descriptor, or -1.                  */
+/*************************************************************/
+int createtemp(int dirfd, const std::string &name, const std::string &tag, std::string &temp);
+
+#endif
@@ -0,0 +1,501 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: search.cpp                                          */
+/* purpose: this source file implements the search declared in   */
+/*          search.h. a file that is truncated while it is       */
+/*          mapped raises SIGBUS when the missing pages are read;*/
+/*          mapguard.h abandons the scan of that file instead of */
+/*          the process being killed.                            */
+/*****************************************************************/
+#include "search.h"
+#include "mapguard.h"
+#include <algorithm>
+#include <cctype>
+#include <csetjmp>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*************************************************************/
+/* function: isliteral                                      */
+/* purpose: tells whether an extended regex has no special  */
+/*          characters, so it can be searched as a literal. */
+/*************************************************************/
+static bool isliteral(const std::string &pattern) {
+    return pattern.find_first_of(".[]()*+?{}|^$\\") == std::string::npos;
+}
+
+/*************************************************************/
+/* function: requiredliteral                                */
+/* purpose: finds the longest run of plain characters that  */
+/*          every match of an extended regex contains. runs */
+/*          inside groups, bracket expressions and before a */
+/*          quantifier that allows zero are not required,   */
+/*          and with "|" outside a group nothing is.        */
+/* return: the run, or "" if there is none.                 */
+/*************************************************************/
+static std::string requiredliteral(const std::string &pattern) {
+    std::string best, run;
+    auto endrun = [&]() {
+        if (run.size() > best.size()) {
+            best = run;
+        }
+        run.clear();
+    };
+
+    int depth = 0;
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        char ch = pattern[i];
+        if (ch == '[') {
+            endrun();
+            size_t j = i + 1;
+            if (j < pattern.size() && pattern[j] == '^') {
+                ++j;
+            }
+            if (j < pattern.size() && pattern[j] == ']') {
+                ++j;
+            }
+            for (; j < pattern.size() && pattern[j] != ']'; ++j) {
+                if (pattern[j] == '[' && j + 1 < pattern.size() && strchr(":=.", pattern[j + 1])) {
+                    size_t close = pattern.find(std::string(1, pattern[j + 1]) + "]", j + 2);
+                    j = close == std::string::npos ? pattern.size() : close + 1;
+                }
+            }
+            i = j;
+        } else if (ch == '(') {
+            endrun();
+            ++depth;
+        } else if (ch == ')') {
+            depth = depth > 0 ? depth - 1 : 0;
+        } else if (ch == '|' && depth == 0) {
+            return "";
+        } else if (depth > 0) {
+            i += ch == '\\' ? 1 : 0;
+        } else if (ch == '*' || ch == '?' || ch == '{') {
+            if (!run.empty()) {
+                run.pop_back();
+            }
+            endrun();
+            if (ch == '{') {
+                size_t close = pattern.find('}', i);
+                i = close == std::string::npos ? pattern.size() : close;
+            }
+        } else if (ch == '+' || ch == '.' || ch == '^' || ch == '$') {
+            endrun();
+        } else if (ch == '\\') {
+            // \w, \b, \<, \1 and the like are not plain characters
+            char escaped = i + 1 < pattern.size() ? pattern[++i] : 0;
+            if (escaped == 0 || isalnum(static_cast<unsigned char>(escaped)) || strchr("<>`'", escaped)) {
+                endrun();
+            } else {
+                run += escaped;
+            }
+        } else {
+            run += ch;
+        }
+    }
+    endrun();
+    return best;
+}
+
+void literalfinder::prepare(const std::string &text, bool folding) {
+    literal = text;
+    fold.assign(text.size(), 0);
+    folded = false;
+    for (size_t i = 0; i < literal.size(); ++i) {
+        unsigned char ch = literal[i];
+        if (folding && isalpha(ch)) {
+            literal[i] = static_cast<char>(tolower(ch));
+            fold[i] = 0x20;
+            folded = true;
+        }
+    }
+
+    size_t k = literal.size();
+    std::fill(std::begin(skip), std::end(skip), k);
+    for (size_t i = 0; i + 1 < k; ++i) {
+        unsigned char ch = literal[i];
+        skip[ch] = k - 1 - i;
+        if (fold[i]) {
+            skip[toupper(ch)] = k - 1 - i;
+        }
+    }
+}
+
+/*************************************************************/
+/* function: matches                                        */
+/* purpose: compares the literal with the bytes at p.       */
+/*************************************************************/
+bool literalfinder::matches(const char *p) const {
+    if (!folded) {
+        return memcmp(p, literal.data(), literal.size()) == 0;
+    }
+    for (size_t i = 0; i < literal.size(); ++i) {
+        if ((p[i] | fold[i]) != literal[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*************************************************************/
+/* function: findskip                                       */
+/* purpose: Boyer-Moore-Horspool: the byte under the end of */
+/*          the literal says how far it can move without    */
+/*          passing an occurrence.                          */
+/*************************************************************/
+const char *literalfinder::findskip(const char *p, const char *end) const {
+    size_t k = literal.size();
+    unsigned char last = literal[k - 1], last_fold = fold[k - 1];
+    while (static_cast<size_t>(end - p) >= k) {
+        unsigned char ch = p[k - 1];
+        if ((ch | last_fold) == last && matches(p)) {
+            return p;
+        }
+        p += skip[ch];
+    }
+    return nullptr;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/*************************************************************/
+/* function: findwide                                       */
+/* purpose: compares the first and last bytes of the        */
+/*          literal with 32 positions at once and checks    */
+/*          the whole literal where both agree.             */
+/*************************************************************/
+__attribute__((target("avx2"))) const char *literalfinder::findwide(const char *p, const char *end) const {
+    size_t k = literal.size();
+    const __m256i first = _mm256_set1_epi8(literal[0]);
+    const __m256i last = _mm256_set1_epi8(literal[k - 1]);
+    const __m256i first_fold = _mm256_set1_epi8(fold[0]);
+    const __m256i last_fold = _mm256_set1_epi8(fold[k - 1]);
+    while (static_cast<size_t>(end - p) >= k - 1 + 32) {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)), first_fold);
+        __m256i b =
+            _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + k - 1)), last_fold);
+        uint32_t candidates = static_cast<uint32_t>(
+            _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last))));
+        while (candidates != 0) {
+            const char *at = p + __builtin_ctz(candidates);
+            if (matches(at)) {
+                return at;
+            }
+            candidates &= candidates - 1;
+        }
+        p += 32;
+    }
+    return findskip(p, end);
+}
+#endif
+
+const char *literalfinder::find(const char *p, const char *end) const {
+    if (literal.size() == 1 && !folded) {
+        return static_cast<const char *>(memchr(p, literal[0], end - p));
+    }
+#if defined(__x86_64__)
+    static const bool wide = __builtin_cpu_supports("avx2");
+    if (wide) {
+        return findwide(p, end);
+    }
+#endif
+    return findskip(p, end);
+}
+
+bool textsearch::start(fdhandle dir, std::vector<std::string> list, const std::string &shown,
+                       const searchoptions &opts, std::string &error) {
+    finish();
+    options = opts;
+    std::string needle = opts.fixed || isliteral(opts.pattern) ? opts.pattern : requiredliteral(opts.pattern);
+    if (!opts.fixed && !isliteral(opts.pattern)) {
+        int flags = REG_EXTENDED | REG_NEWLINE | (opts.ignore_case ? REG_ICASE : 0);
+        int status = regcomp(&compiled, opts.pattern.c_str(), flags);
+        if (status != 0) {
+            char message[256];
+            regerror(status, &compiled, message, sizeof(message));
+            error = message;
+            return false;
+        }
+        regex = true;
+    }
+    prefilter = !needle.empty();
+    if (prefilter) {
+        literal.prepare(needle, opts.ignore_case);
+    }
+
+    root = std::move(dir);
+    files = std::move(list);
+    prefix = shown;
+    next_file = 0;
+    stopping = false;
+    guardmappings();
+
+    // One thread still runs for no files, to end the results
+    unsigned threads = std::max(1u, std::min(std::thread::hardware_concurrency(), MAX_SEARCH_THREADS));
+    threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, files.size())));
+    results.reset(new workqueue<std::string>(4 * threads));
+    results->notify(notify_fd);
+    running = threads;
+    for (unsigned i = 0; i < threads; ++i) {
+        workers.emplace_back(&textsearch::work, this);
+    }
+    return true;
+}
+
+bool textsearch::next(std::string &text) {
+    text.clear();
+    if (!results) {
+        return false;
+    }
+    if (!results->pop(text)) {
+        finish();
+        return false;
+    }
+    gather(text);
+    return true;
+}
+
+bool textsearch::trynext(std::string &text, bool &more) {
+    text.clear();
+    more = false;
+    if (!results) {
+        return true;
+    }
+    if (!results->trypop(text)) {
+        if (!results->finished()) {
+            return false;
+        }
+        finish();
+        return true;
+    }
+    gather(text);
+    more = true;
+    return true;
+}
+
+/*************************************************************/
+/* function: gather                                         */
+/* purpose: adds what else is ready to a frame, so many     */
+/*          small files do not each cost one.               */
+/*************************************************************/
+void textsearch::gather(std::string &text) {
+    std::string more;
+    while (text.size() < SEARCH_FRAME && results->trypop(more)) {
+        text += more;
+    }
+}
+
+void textsearch::finish() {
+    stopping = true;
+    if (results) {
+        results->close();
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    results.reset();
+    if (regex) {
+        regfree(&compiled);
+        regex = false;
+    }
+    files.clear();
+    root.reset();
+}
+
+/*************************************************************/
+/* function: work                                           */
+/* purpose: scans files until none are left; the last       */
+/*          thread to finish ends the results.              */
+/*************************************************************/
+void textsearch::work() {
+    std::string out;
+    scratch copies;
+    size_t i;
+    while (!stopping && (i = next_file++) < files.size()) {
+        scan(files[i], out, copies);
+        if (!out.empty() && !flush(out)) {
+            break;
+        }
+    }
+    if (--running == 0) {
+        results->close();
+    }
+}
+
+/*************************************************************/
+/* function: flush                                          */
+/* purpose: hands a worker's results to next.               */
+/* return: false if the search was stopped.                 */
+/*************************************************************/
+bool textsearch::flush(std::string &out) {
+    if (!results->push(std::move(out))) {
+        stopping = true;
+        return false;
+    }
+    out.clear();
+    return true;
+}
+
+/*************************************************************/
+/* function: scan                                           */
+/* purpose: maps one file and searches it. files that are   */
+/*          gone, are no longer regular files or cannot be  */
+/*          mapped are skipped.                             */
+/*************************************************************/
+void textsearch::scan(const std::string &path, std::string &out, scratch &copies) {
+    fdhandle fd(openbeneath(root.get(), path, O_RDONLY | O_NOFOLLOW));
+    struct stat st;
+    if (fd.get() == -1 || fstat(fd.get(), &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return;
+    }
+    size_t size = st.st_size;
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+    if (mapped == MAP_FAILED) {
+        return;
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    sigjmp_buf shrank;
+    copies.block_start = copies.block_end = nullptr;
+    if (sigsetjmp(shrank, 1) == 0) {
+        mapped_read = &shrank;
+        scanbuffer(path, static_cast<const char *>(mapped), size, out, copies);
+    }
+    mapped_read = nullptr;
+    munmap(mapped, size);
+}
+
+/*************************************************************/
+/* function: scanbuffer                                     */
+/* purpose: finds the matching lines of a mapped file. with */
+/*          a literal, only the lines it is found in are    */
+/*          looked at; without one, only the lines where a  */
+/*          match of a whole block starts. line numbers are */
+/*          counted only up to the lines that are sent.     */
+/*          nothing here may need a destructor, as SIGBUS   */
+/*          can leave it at any read of the mapping.        */
+/*************************************************************/
+void textsearch::scanbuffer(const std::string &path, const char *data, size_t size, std::string &out,
+                            scratch &copies) {
+    const char *pos = data, *end = data + size, *counted = data;
+    uint64_t number = 1, count = 0;
+    while (pos < end && !stopping) {
+        const char *hit = prefilter ? literal.find(pos, end) : matchblock(pos, end, copies);
+        if (!hit) {
+            break;
+        }
+        const char *line = static_cast<const char *>(memrchr(pos, '\n', hit - pos));
+        line = line ? line + 1 : pos;
+        const char *line_end = static_cast<const char *>(memchr(line, '\n', end - line));
+        line_end = line_end ? line_end : end;
+        pos = line_end == end ? end : line_end + 1;
+        if (regex && !matchline(line, line_end - line, copies.line)) {
+            continue;
+        }
+
+        if (options.names) {
+            out += prefix;
+            out += path;
+            out += '\n';
+            return;
+        }
+        ++count;
+        if (options.count) {
+            continue;
+        }
+        if (options.numbers) {
+            const char *newline;
+            while ((newline = static_cast<const char *>(memchr(counted, '\n', line - counted))) != nullptr) {
+                ++number;
+                counted = newline + 1;
+            }
+            counted = line;
+        }
+        report(path, number, line, line_end - line, out);
+        if (out.size() >= SEARCH_FRAME && !flush(out)) {
+            return;
+        }
+    }
+    if (options.count && count > 0) {
+        char digits[24];
+        snprintf(digits, sizeof(digits), ":%llu\n", static_cast<unsigned long long>(count));
+        out += prefix;
+        out += path;
+        out += digits;
+    }
+}
+
+/*************************************************************/
+/* function: matchblock                                     */
+/* purpose: tries the regex on SEARCH_BLOCK bytes of whole  */
+/*          lines at a time, so a text with few matches     */
+/*          costs a regexec per block rather than per line. */
+/*          a bracket expression can match a newline, so    */
+/*          the line a match starts in is still checked on  */
+/*          its own.                                        */
+/* return: where a match starts, or nullptr if there is     */
+/*         none before end.                                 */
+/*************************************************************/
+const char *textsearch::matchblock(const char *pos, const char *end, scratch &copies) const {
+    while (pos < end) {
+        // Lines of the block already copied are searched from where the last match left off
+        if (pos < copies.block_start || pos >= copies.block_end) {
+            const char *stop = pos + std::min<size_t>(end - pos, SEARCH_BLOCK);
+            if (stop < end) {
+                const char *newline = static_cast<const char *>(memrchr(pos, '\n', stop - pos));
+                newline = newline ? newline : static_cast<const char *>(memchr(stop, '\n', end - stop));
+                stop = newline ? newline + 1 : end;
+            }
+            copies.block.assign(pos, stop - pos);
+            copies.block_start = pos;
+            copies.block_end = stop;
+        }
+        size_t offset = pos - copies.block_start;
+        regmatch_t match;
+        // An empty match after the block's last newline belongs to the next block
+        if (regexec(&compiled, copies.block.c_str() + offset, 1, &match, 0) == 0 &&
+            (offset + match.rm_so < copies.block.size() || copies.block.back() != '\n')) {
+            return pos + match.rm_so;
+        }
+        pos = copies.block_end;
+    }
+    return nullptr;
+}
+
+/*************************************************************/
+/* function: matchline                                      */
+/* purpose: tries one line against the regex. the line is   */
+/*          copied out of the mapping first, so regexec     */
+/*          never reads a page that may be gone.            */
+/*************************************************************/
+bool textsearch::matchline(const char *line, size_t length, std::string &copy) const {
+    copy.assign(line, length);
+    return regexec(&compiled, copy.c_str(), 0, nullptr, 0) == 0;
+}
+
+/*************************************************************/
+/* function: report                                         */
+/* purpose: adds one matching line to the results, cut at   */
+/*          MAX_SEARCH_LINE and without a trailing "\r".    */
+/*************************************************************/
+void textsearch::report(const std::string &path, uint64_t number, const char *line, size_t length,
+                        std::string &out) const {
+    if (length > 0 && line[length - 1] == '\r') {
+        --length;
+    }
+    out += prefix;
+    out += path;
+    out += ':';
+    if (options.numbers) {
+        char digits[24];
+        snprintf(digits, sizeof(digits), "%llu:", static_cast<unsigned long long>(number));
+        out += digits;
+    }
+    out.append(line, std::min(length, MAX_SEARCH_LINE));
+    out += '\n';
+}
@@ -0,0 +1,185 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: search.h                                        */
+/* purpose: this header file declares the search behind the  */
+/*          server's grep. the files are scanned by several  */
+/*          threads at once, each mapping a file and looking */
+/*          for a literal the pattern cannot match without   */
+/*          (the whole pattern with -F). only the lines that */
+/*          hold it are tried against the regular expression,*/
+/*          and only matching lines are sent. results leave  */
+/*          a frame at a time while the scan goes on.        */
+/*************************************************************/
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <regex.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "sandbox.h"
+#include "workqueue.h"
+
+// Most threads one search scans with
+constexpr unsigned MAX_SEARCH_THREADS = 8;
+
+// Text produced per result frame
+constexpr size_t SEARCH_FRAME = 64 << 10;
+
+// Text a regex without a literal is tried on at once
+constexpr size_t SEARCH_BLOCK = 64 << 10;
+
+// Longest part of a matching line that is sent
+constexpr size_t MAX_SEARCH_LINE = 4096;
+
+/*************************************************************/
+/* struct: searchoptions                                     */
+/* purpose: what a search looks for and how it reports it.   */
+/*************************************************************/
+struct searchoptions {
+    std::string pattern;
+    bool fixed = false;       // the pattern is a literal, not an extended regex
+    bool ignore_case = false; // ASCII letters match either case
+    bool numbers = false;     // each line is preceded by its number
+    bool count = false;       // "path:count" for each file with matches
+    bool names = false;       // the path of each file with matches
+};
+
+/*************************************************************/
+/* class: literalfinder                                      */
+/* purpose: finds a literal in a buffer. with AVX2 it checks */
+/*          32 positions at a time for the literal's first   */
+/*          and last bytes and compares the rest only where  */
+/*          both are in place; without it, Horspool's skip   */
+/*          table lets it jump ahead by up to its length.    */
+/*************************************************************/
+class literalfinder {
+  public:
+    /*************************************************************/
+    /* function: prepare                                        */
+    /* purpose: sets the literal to look for.                   */
+    /* parameters:                                              */
+    /*    - literal: the bytes to find; not empty.              */
+    /*    - fold: whether ASCII letters match either case.      */
+    /*************************************************************/
+    void prepare(const std::string &literal, bool fold);
+
+    /*************************************************************/
+    /* function: find                                           */
+    /* purpose: finds the first occurrence in [p, end).         */
+    /* return: where it starts, or nullptr if it is not there.  */
+    /*************************************************************/
+    const char *find(const char *p, const char *end) const;
+
+  private:
+    bool matches(const char *p) const;
+    const char *findskip(const char *p, const char *end) const;
+    const char *findwide(const char *p, const char *end) const;
+
+    std::string literal;       // lower case when folding
+    std::string fold;          // per byte, 0x20 where the byte is a letter to fold
+    bool folded = false;       // some byte is
+    size_t skip[256];
+};
+
+/*************************************************************/
+/* class: textsearch                                         */
+/* purpose: one search in progress over a list of files.     */
+/*          lines of different files may interleave, but     */
+/*          every line names its file.                       */
+/*************************************************************/
+class textsearch {
+  public:
+    textsearch() = default;
+    textsearch(const textsearch &) = delete;
+    textsearch &operator=(const textsearch &) = delete;
+    ~textsearch() { finish(); }
+
+    /*************************************************************/
+    /* function: start                                          */
+    /* purpose: compiles the pattern and starts the threads     */
+    /*          that scan the files.                            */
+    /* parameters:                                              */
+    /*    - root: the directory the files are below (O_PATH).   */
+    /*            owned from now.                               */
+    /*    - files: the regular files to scan, relative to root. */
+    /*    - prefix: put in front of each path that is shown.    */
+    /*    - options: what to look for.                          */
+    /*    - error: receives the reason on failure.              */
+    /* return: false if the pattern is not valid.               */
+    /*************************************************************/
+    bool start(fdhandle root, std::vector<std::string> files, const std::string &prefix,
+               const searchoptions &options, std::string &error);
+
+    /*************************************************************/
+    /* function: next                                           */
+    /* purpose: waits for the next frame of results: lines of   */
+    /*          "path:line", "path:number:line" with numbers,   */
+    /*          "path:count" or "path".                         */
+    /* parameters:                                              */
+    /*    - text: receives the frame; empty for the last call.  */
+    /* return: false once every file has been scanned.          */
+    /*************************************************************/
+    bool next(std::string &text);
+
+    /*************************************************************/
+    /* function: trynext                                        */
+    /* purpose: next without waiting, for an event loop that    */
+    /*          gave notify an eventfd.                         */
+    /* parameters:                                              */
+    /*    - text: receives the frame; empty for the last one.   */
+    /*    - more: set to false with the last frame.             */
+    /* return: false if no frame is ready yet.                  */
+    /*************************************************************/
+    bool trynext(std::string &text, bool &more);
+
+    // Has later searches signal an eventfd when results are ready
+    void notify(int fd) { notify_fd = fd; }
+
+    // Whether start succeeded and next has not returned false yet
+    bool active() const { return results != nullptr; }
+
+    // Stops the scan, waiting for its threads
+    void finish();
+
+  private:
+    // Copies a scanning thread makes of the mapping for regexec
+    struct scratch {
+        std::string line;
+        std::string block;
+        const char *block_start = nullptr; // where block was copied from
+        const char *block_end = nullptr;
+    };
+
+    void work();
+    void scan(const std::string &path, std::string &out, scratch &copies);
+    void scanbuffer(const std::string &path, const char *data, size_t size, std::string &out,
+                    scratch &copies);
+    const char *matchblock(const char *pos, const char *end, scratch &copies) const;
+    bool matchline(const char *line, size_t length, std::string &copy) const;
+    void report(const std::string &path, uint64_t number, const char *line, size_t length,
+                std::string &out) const;
+    bool flush(std::string &out);
+    void gather(std::string &text);
+
+    fdhandle root;
+    std::vector<std::string> files;
+    std::string prefix;
+    searchoptions options;
+    literalfinder literal;
+    bool prefilter = false;        // lines without the literal cannot match
+    bool regex = false;            // lines are tried against compiled
+    regex_t compiled;
+    std::atomic<size_t> next_file{0};
+    std::atomic<unsigned> running{0};
+    std::atomic<bool> stopping{false};
+    std::unique_ptr<workqueue<std::string>> results;
+    std::vector<std::thread> workers;
+    int notify_fd = -1;
+};
+
+#endif
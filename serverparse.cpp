@@ -0,0 +1,72 @@
+/*************************************************************/
+/* author: Arek Gebka                                        */
+/* filename: serverparse.cpp                                 */
+/* purpose: this source file implements the parseservermenu  */
+/*          function that processes command-line arguments   */
+/*          for the server. It parses the `-p` (port), `-d`  */
+/*          (directory), `-m` (mode), `-t` (worker threads), */
+/*          `-b` (listen backlog), `-e` (transfer engine),   */
+/*          `-s` (content store), `-i` (tree index) and `-c` */
+/*          (hot-file cache size) options and stores them in */
+/*          a structure for further use.                     */
+/*************************************************************/
+#include <iostream>
+#include <unistd.h>
+#include <cstdlib>
+#include "serverparse.h"
+
+using namespace std;
+
+struct serveroptions parseservermenu(int argc, char* argv[]){
+	struct serveroptions o;
+	o.port = "";
+	o.directory = "";
+	o.mode = "fork";
+	o.threads = 1;
+	o.backlog = 10;
+	o.engine = "zerocopy";
+	o.store = false;
+	o.index = false;
+	o.cache = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "p:d:m:t:b:e:sic:")) != -1){
+		switch (opt){
+			case 'p':
+				o.port = optarg;
+				break;
+
+			case 'd':
+				o.directory = optarg;
+				break;
+
+			case 'm':
+				o.mode = optarg;
+				break;
+
+			case 't':
+				o.threads = atoi(optarg);
+				break;
+
+			case 'b':
+				o.backlog = atoi(optarg);
+				break;
+
+			case 'e':
+				o.engine = optarg;
+				break;
+
+			case 's':
+				o.store = true;
+				break;
+
+			case 'i':
+				o.index = true;
+				break;
+
+			case 'c':
+				o.cache = atoi(optarg);
+				break;
+		}
+	}
+	return o;
+}
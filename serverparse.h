@@ -0,0 +1,41 @@
+/*************************************************************/
+/* Author: Arek Gebka                                        */
+/* Filename: serverparse.h                                   */
+/* Purpose: This header file declares the parseservermenu    */
+/*          function, responsible for parsing the server's   */
+/*          command-line arguments. It also declares the     */
+/*          struct serveroptions that holds the results.     */
+/*************************************************************/
+#ifndef SERVERPARSE_H
+#define SERVERPARSE_H
+
+#include <string>
+using namespace std;
+
+struct serveroptions {
+    string port;
+    string directory;
+    string mode;      // "fork" (default) or "epoll"
+    int threads;      // reactor worker threads in epoll mode
+    int backlog;      // listen backlog of each listening socket
+    string engine;    // transfer engine: "zerocopy" (default), "uring", "mmap" or "buffered"
+    bool store;       // deduplicate uploads in a content store (-s)
+    bool index;       // keep an in-memory index of the served tree (-i)
+    int cache;        // megabytes of hot-file cache shared by all sessions, 0 for none (-c)
+};
+
+/*************************************************************************/
+/* Function name: parseservermenu                                       */
+/* Description: Parses command-line arguments for the server. Port and  */
+/*              directory are required by the user, while the server    */
+/*              mode defaults to the legacy fork-per-client model, the  */
+/*              worker thread count to 1, the listen backlog to 10, the */
+/*              transfer engine to zerocopy, and the content store, the */
+/*              tree index and the hot-file cache to off.               */
+/* Parameters: int argc - The number of command-line arguments          */
+/*             char* argv[] - Array of command-line arguments           */
+/* Return Value: struct serveroptions                                   */
+/*************************************************************************/
+struct serveroptions parseservermenu(int argc, char* argv[]);
+
+#endif
@@ -17,6 +17,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <iostream>
+#include <cerrno>
 
 mysock::mysock() {
     fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -49,6 +50,7 @@ void mysock::connect(const std::string &hostname, const std::string &port) {
     }
 
     freeaddrinfo(res);
+    tuner.attach(fd);
 }
 
 void mysock::bind(const std::string &port) {
@@ -70,6 +72,13 @@ void mysock::bind(const std::string &port) {
     freeaddrinfo(res);
 }
 
+void mysock::reuseport() {
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        throw std::runtime_error("Failed to enable SO_REUSEPORT");
+    }
+}
 
 void mysock::listen(int backlog) {
     if (::listen(fd, backlog) == -1) {
@@ -82,17 +91,85 @@ mysock mysock::accept() {
     if (client_fd == -1) {
         throw std::runtime_error("Failed to accept connection");
     }
-    return mysock(client_fd);
+    mysock client(client_fd);
+    client.tuner.attach(client_fd);
+    return client;
 }
 
 int mysock::clientsend(const std::string &message) {
-    if (send(fd, message.c_str(), message.size(), 0) == -1) {
+    try {
+        sendall(message.c_str(), message.size());
+    } catch (const std::runtime_error &e) {
         perror("send");
         return -1; // Indicate failure
     }
     return 0; // Indicate success
 }
 
+void mysock::sendall(const char *data, size_t size, int flags) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, flags | MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Failed to send message");
+        }
+        data += sent;
+        size -= sent;
+    }
+}
+
+void mysock::sendallv(struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Failed to send message");
+        }
+
+        // Drop the buffers that went out completely and trim the next one
+        while (iovcnt > 0 && static_cast<size_t>(sent) >= iov->iov_len) {
+            sent -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + sent;
+            iov->iov_len -= sent;
+        }
+    }
+}
+
+size_t mysock::recvall(char *buffer, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t bytes = recv(fd, buffer + total, size - total, 0);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Failed to receive message");
+        }
+        if (bytes == 0) {
+            break; // peer closed the connection
+        }
+        total += bytes;
+    }
+    return total;
+}
+
+int mysock::getfd() const {
+    return fd;
+}
+
 int mysock::clientrecv(char *buffer, size_t size) {
     int bytes = recv(fd, buffer, size, 0);
     if (bytes == -1) {
@@ -102,3 +179,27 @@ int mysock::clientrecv(char *buffer, size_t size) {
 }
 
 
+
+void mysock::sharesends() {
+    if (!frames) {
+        frames = std::make_shared<framelock>();
+    }
+}
+
+std::unique_lock<framelock> mysock::holdframes() {
+    return frames ? std::unique_lock<framelock>(*frames) : std::unique_lock<framelock>();
+}
+
+void framelock::lock() {
+    std::unique_lock<std::mutex> held(guard);
+    uint64_t ticket = next++;
+    turn.wait(held, [this, ticket]() { return serving == ticket; });
+}
+
+void framelock::unlock() {
+    {
+        std::lock_guard<std::mutex> held(guard);
+        ++serving;
+    }
+    turn.notify_all();
+}
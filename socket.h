@@ -11,7 +11,33 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <sys/uio.h>
+#include "tuning.h"
+
+/*************************************************************/
+/* class: framelock                                          */
+/* purpose: the lock frames are sent under once a connection */
+/*          is shared. threads get it in the order they ask, */
+/*          so one sending frame after frame lets the others */
+/*          in between instead of taking it straight back,   */
+/*          and the streams' frames interleave.              */
+/*************************************************************/
+class framelock {
+  public:
+    void lock();
+    void unlock();
+
+  private:
+    std::mutex guard;
+    std::condition_variable turn;
+    uint64_t next = 0;    // ticket of the next thread to ask
+    uint64_t serving = 0; // ticket of the thread allowed to send
+};
 
 /*************************************************************/
 /* class: mysock                                             */
@@ -80,6 +106,46 @@ class mysock {
     /*************************************************************/
     int clientsend(const std::string &message); // ensure this returns int
 
+    /*************************************************************/
+    /* function: sendall                                        */
+    /* purpose: sends exactly size bytes, looping over partial  */
+    /*          sends. throws on a socket error.                */
+    /* parameters:                                              */
+    /*    - data: the bytes to send.                            */
+    /*    - size: the number of bytes to send.                  */
+    /*    - flags: extra send flags such as MSG_MORE.           */
+    /*************************************************************/
+    void sendall(const char *data, size_t size, int flags = 0);
+
+    /*************************************************************/
+    /* function: sendallv                                       */
+    /* purpose: gathers several buffers into as few send calls  */
+    /*          as possible (a frame header and its payload go  */
+    /*          out in a single syscall). throws on error.      */
+    /* parameters:                                              */
+    /*    - iov: the buffers to send. the array is modified.    */
+    /*    - iovcnt: the number of buffers.                      */
+    /*************************************************************/
+    void sendallv(struct iovec *iov, int iovcnt);
+
+    /*************************************************************/
+    /* function: recvall                                        */
+    /* purpose: receives exactly size bytes unless the peer     */
+    /*          closes the connection first.                    */
+    /* parameters:                                              */
+    /*    - buffer: the buffer to store the received data.      */
+    /*    - size: the number of bytes to receive.               */
+    /* return: the number of bytes received; less than size     */
+    /*         only when the peer closed the connection.        */
+    /*************************************************************/
+    size_t recvall(char *buffer, size_t size);
+
+    /*************************************************************/
+    /* function: getfd                                          */
+    /* purpose: returns the underlying socket file descriptor.  */
+    /*************************************************************/
+    int getfd() const;
+
     /*************************************************************/
     /* function: bind                                           */
     /* purpose: binds the socket to a specified port.           */
@@ -88,6 +154,15 @@ class mysock {
     /*************************************************************/
     void bind(const std::string &port);
 
+    /*************************************************************/
+    /* function: reuseport                                      */
+    /* purpose: enables SO_REUSEPORT (and SO_REUSEADDR) so that */
+    /*          several sockets can bind the same port and the  */
+    /*          kernel spreads new connections across them.    */
+    /*          must be called before bind.                     */
+    /*************************************************************/
+    void reuseport();
+
     /*************************************************************/
     /* function: listen                                         */
     /* purpose: listens for incoming connections on the socket. */
@@ -105,8 +180,38 @@ class mysock {
     /*************************************************************/
     mysock accept();
 
+    /*************************************************************/
+    /* function: tuning                                         */
+    /* purpose: returns the sizes transfers on this connection  */
+    /*          use. a connected or accepted socket is tuned    */
+    /*          from the start.                                 */
+    /*************************************************************/
+    linktuner &tuning() { return tuner; }
+
+    /*************************************************************/
+    /* function: sharesends                                     */
+    /* purpose: lets several threads send frames on this        */
+    /*          connection at once. from then on each frame is  */
+    /*          written while holding holdframes, so frames     */
+    /*          from different threads never mix.               */
+    /*************************************************************/
+    void sharesends();
+
+    // Whether sharesends was called
+    bool multiplexed() const { return frames != nullptr; }
+
+    /*************************************************************/
+    /* function: holdframes                                     */
+    /* purpose: keeps other threads from sending until the      */
+    /*          returned lock goes; does nothing on a           */
+    /*          connection that is not shared.                  */
+    /*************************************************************/
+    std::unique_lock<framelock> holdframes();
+
   private:
     int fd; //socket file descriptor representing the socket.
+    linktuner tuner; // sizes of this connection's transfers
+    std::shared_ptr<framelock> frames; // held per frame once sends are shared
 };
 
 #endif
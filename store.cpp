@@ -0,0 +1,278 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: store.cpp                                           */
+/* purpose: this source file implements the content store        */
+/*          declared in store.h. a content lives at              */
+/*          .store/<first 2 hex digits>/<other 62>, and files     */
+/*          are only ever swapped for a clone or link with       */
+/*          rename(2), so a reader never sees a half made file.  */
+/*****************************************************************/
+#include "store.h"
+#include "sandbox.h"
+#include <cerrno>
+#include <filesystem>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Bytes moved per pread/pwrite when the kernel cannot copy a file
+constexpr size_t STORE_COPY_BUFFER = 128 << 10;
+
+// Canonical store directory; empty while the store is off
+static std::string store_root;
+
+// Its identity, for recognizing it in listings
+static dev_t store_dev;
+static ino_t store_ino;
+
+bool openstore(const std::string &base) {
+    struct stat st;
+    try {
+        fs::path root = fs::path(base) / STORE_DIRECTORY;
+        fs::create_directories(root);
+        store_root = fs::canonical(root).string();
+    } catch (const fs::filesystem_error &e) {
+        return false;
+    }
+    if (stat(store_root.c_str(), &st) == -1) {
+        store_root.clear();
+        return false;
+    }
+    store_dev = st.st_dev;
+    store_ino = st.st_ino;
+    return true;
+}
+
+bool storeenabled() {
+    return !store_root.empty();
+}
+
+bool isstore(const struct stat &st) {
+    return !store_root.empty() && S_ISDIR(st.st_mode) && st.st_ino == store_ino && st.st_dev == store_dev;
+}
+
+bool iscontenthash(const std::string &text) {
+    if (text.size() != 64) {
+        return false;
+    }
+    for (char ch : text) {
+        if (!((ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*************************************************************/
+/* function: objectpath                                     */
+/* purpose: where a content is stored.                      */
+/*************************************************************/
+static std::string objectpath(const std::string &hash) {
+    return store_root + "/" + hash.substr(0, 2) + "/" + hash.substr(2);
+}
+
+/*************************************************************/
+/* function: copycontents                                   */
+/* purpose: copies a whole file into an empty one: a clone  */
+/*          if the filesystem shares blocks, else a copy in */
+/*          the kernel, else through a buffer.              */
+/*************************************************************/
+static bool copycontents(int in_fd, int out_fd, uint64_t size) {
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+        return true;
+    }
+    uint64_t done = 0;
+    while (done < size) {
+        loff_t in = done, out = done;
+        ssize_t n = copy_file_range(in_fd, &in, out_fd, &out, size - done, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    std::vector<char> buffer;
+    while (done < size) {
+        buffer.resize(STORE_COPY_BUFFER);
+        ssize_t n = pread(in_fd, buffer.data(), buffer.size(), done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = pwrite(out_fd, buffer.data() + written, n - written, done + written);
+            if (w == -1 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                return false;
+            }
+            written += w;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/*************************************************************/
+/* function: placeobject                                    */
+/* purpose: puts stored content at an entry: a clone where  */
+/*          the filesystem can make one, else a hard link.  */
+/*************************************************************/
+static bool placeobject(const std::string &object, int dirfd, const std::string &name) {
+    std::string temp;
+    int temp_fd = createtemp(dirfd, name, "store", temp);
+    if (temp_fd == -1) {
+        return false;
+    }
+    int object_fd = open(object.c_str(), O_RDONLY | O_CLOEXEC);
+    bool cloned = object_fd != -1 && ioctl(temp_fd, FICLONE, object_fd) == 0;
+    if (cloned) {
+        fchmod(temp_fd, 0644);
+    }
+    if (object_fd != -1) {
+        close(object_fd);
+    }
+    close(temp_fd);
+    if (!cloned) {
+        unlinkat(dirfd, temp.c_str(), 0);
+        if (linkat(AT_FDCWD, object.c_str(), dirfd, temp.c_str(), 0) == -1) {
+            return false;
+        }
+    }
+    // Renaming over another link to the same file does nothing, so the
+    // temporary name is removed either way
+    bool placed = renameat(dirfd, temp.c_str(), dirfd, name.c_str()) == 0;
+    unlinkat(dirfd, temp.c_str(), 0);
+    return placed;
+}
+
+bool storecontent(int dirfd, const std::string &name, const std::string &hash) {
+    struct stat st;
+    if (!storeenabled() || !iscontenthash(hash) || fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+        !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    std::string object = objectpath(hash);
+    mkdir(fs::path(object).parent_path().c_str(), 0755);
+
+    // Two uploads of new content may race to store it; the loser shares
+    // the winner's copy
+    for (int attempt = 0; attempt < 2; attempt++) {
+        struct stat stored;
+        if (stat(object.c_str(), &stored) == 0) {
+            if (stored.st_ino == st.st_ino && stored.st_dev == st.st_dev) {
+                return false;
+            }
+            if (stored.st_size != st.st_size) {
+                return false; // damaged store entry; leave both alone
+            }
+            return placeobject(object, dirfd, name);
+        }
+
+        // New content: a clone keeps the stored copy apart from the file,
+        // otherwise the file itself becomes the stored copy
+        std::string temp;
+        int temp_fd = createtemp(AT_FDCWD, object, "store", temp);
+        int fd = temp_fd == -1 ? -1 : openat(dirfd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        bool cloned = fd != -1 && ioctl(temp_fd, FICLONE, fd) == 0;
+        if (fd != -1) {
+            close(fd);
+        }
+        if (temp_fd != -1) {
+            close(temp_fd);
+        }
+        int linked = cloned ? link(temp.c_str(), object.c_str())
+                            : linkat(dirfd, name.c_str(), AT_FDCWD, object.c_str(), 0);
+        int error = errno;
+        if (temp_fd != -1) {
+            unlink(temp.c_str());
+        }
+        if (linked == 0 || error != EEXIST) {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool linkcontent(const std::string &hash, uint64_t size, int dirfd, const std::string &name) {
+    struct stat stored;
+    if (!storeenabled() || !iscontenthash(hash)) {
+        return false;
+    }
+    std::string object = objectpath(hash);
+    if (stat(object.c_str(), &stored) == -1 || static_cast<uint64_t>(stored.st_size) != size) {
+        return false;
+    }
+    return placeobject(object, dirfd, name);
+}
+
+// Times a shared file is looked at again after another connection
+// swapped it
+constexpr int MAX_UNSHARE_ATTEMPTS = 8;
+
+/*************************************************************/
+/* function: replaceshared                                  */
+/* purpose: swaps a shared file for a private copy of its   */
+/*          contents, or for an empty file.                 */
+/*************************************************************/
+static bool replaceshared(int dirfd, const std::string &name, int fd, const struct stat &st, bool keep) {
+    std::string temp;
+    int temp_fd = createtemp(dirfd, name, "store", temp);
+    if (temp_fd == -1) {
+        return false;
+    }
+    bool copied = !keep || copycontents(fd, temp_fd, st.st_size);
+    fchmod(temp_fd, st.st_mode & 07777);
+    close(temp_fd);
+    if (!copied || renameat(dirfd, temp.c_str(), dirfd, name.c_str()) == -1) {
+        unlinkat(dirfd, temp.c_str(), 0);
+        return false;
+    }
+    return true;
+}
+
+int openunshared(int dirfd, const std::string &name, int flags, bool keep) {
+    bool truncate = flags & O_TRUNC;
+    flags &= ~O_TRUNC;
+    for (int attempt = 0; attempt < MAX_UNSHARE_ATTEMPTS; attempt++) {
+        int fd = openat(dirfd, name.c_str(), flags | O_NOFOLLOW, 0644);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+        if (!S_ISREG(st.st_mode) || st.st_nlink == 1) {
+            if (truncate && ftruncate(fd, 0) == -1) {
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        // Shared (or already swapped away: no links left). Whoever holds
+        // the lock swaps it; the others find a new file at the path
+        flock(fd, LOCK_EX);
+        struct stat now;
+        bool current = fstatat(dirfd, name.c_str(), &now, AT_SYMLINK_NOFOLLOW) == 0 && now.st_ino == st.st_ino &&
+                       now.st_dev == st.st_dev;
+        bool failed = current && st.st_nlink > 1 && !replaceshared(dirfd, name, fd, st, keep && !truncate);
+        close(fd);
+        if (failed) {
+            return -1;
+        }
+    }
+    return -1;
+}
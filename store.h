@@ -0,0 +1,108 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: store.h                                         */
+/* purpose: this header file declares the content store, an  */
+/*          optional directory below the base directory that */
+/*          keeps one copy of every distinct file content,   */
+/*          named by its SHA-256. an uploaded file whose     */
+/*          content is already stored is replaced by a       */
+/*          reflink (where the filesystem can clone) or a    */
+/*          hard link to the stored copy, so identical files */
+/*          take up the space of one. a hard linked file is  */
+/*          shared, so nothing writes into one in place: it  */
+/*          is detached first.                               */
+/*************************************************************/
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <cstdint>
+#include <string>
+#include <sys/stat.h>
+
+// Directory below the base directory that holds the contents
+const std::string STORE_DIRECTORY = ".store";
+
+/*************************************************************/
+/* function: openstore                                      */
+/* purpose: turns the content store on, creating its        */
+/*          directory if needed. call once at startup.      */
+/* parameters:                                              */
+/*    - base: the base directory.                           */
+/* return: false if the directory cannot be created.        */
+/*************************************************************/
+bool openstore(const std::string &base);
+
+/*************************************************************/
+/* function: storeenabled                                   */
+/* purpose: tells whether openstore turned the store on.    */
+/*************************************************************/
+bool storeenabled();
+
+/*************************************************************/
+/* function: isstore                                        */
+/* purpose: tells whether a directory is the store itself,  */
+/*          so listings can leave it out.                   */
+/* parameters:                                              */
+/*    - st: the directory's status (not following links).  */
+/*************************************************************/
+bool isstore(const struct stat &st);
+
+/*************************************************************/
+/* function: iscontenthash                                  */
+/* purpose: checks that text is a SHA-256 in hex, the only  */
+/*          form a client may name stored content by.       */
+/* parameters:                                              */
+/*    - text: the text to check.                            */
+/*************************************************************/
+bool iscontenthash(const std::string &text);
+
+/*************************************************************/
+/* function: storecontent                                   */
+/* purpose: hands a complete file to the store. if the      */
+/*          content is already there the file is replaced   */
+/*          by a clone or link of the stored copy; if not,  */
+/*          the file becomes the stored copy. a failure     */
+/*          leaves the file as it was.                      */
+/* parameters:                                              */
+/*    - dirfd: the directory holding the file.              */
+/*    - name: the file's name in it.                        */
+/*    - hash: the SHA-256 of its contents.                  */
+/* return: true if the file now shares an earlier copy.     */
+/*************************************************************/
+bool storecontent(int dirfd, const std::string &name, const std::string &hash);
+
+/*************************************************************/
+/* function: linkcontent                                    */
+/* purpose: creates or replaces a file with stored content, */
+/*          for a client that announced the hash instead of */
+/*          uploading.                                      */
+/* parameters:                                              */
+/*    - hash: the SHA-256 of the content.                   */
+/*    - size: the size the client expects.                  */
+/*    - dirfd: the directory to create the file in.         */
+/*    - name: the file's name in it.                        */
+/* return: false if the content is not stored.              */
+/*************************************************************/
+bool linkcontent(const std::string &hash, uint64_t size, int dirfd, const std::string &name);
+
+/*************************************************************/
+/* function: openunshared                                   */
+/* purpose: opens a file for writing, making sure it is not */
+/*          shared through a hard link first. a shared file */
+/*          is swapped for an empty one, or for a private   */
+/*          copy when its contents are kept. connections    */
+/*          writing ranges of the same file take turns with */
+/*          flock(2), so it is swapped only once.           */
+/* parameters:                                              */
+/*    - dirfd: the directory holding the file.              */
+/*    - name: the file's name in it; never followed if it   */
+/*            is a symlink.                                 */
+/*    - flags: open(2) flags; O_CREAT and O_TRUNC are       */
+/*             honoured without touching shared contents.   */
+/*    - keep: whether the current contents must survive.    */
+/* return: an open descriptor, or -1.                       */
+/*************************************************************/
+int openunshared(int dirfd, const std::string &name, int flags, bool keep);
+
+#endif
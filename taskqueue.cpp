@@ -0,0 +1,63 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: taskqueue.cpp                                       */
+/* purpose: this source file implements the task queue declared  */
+/*          in taskqueue.h.                                      */
+/*****************************************************************/
+#include "taskqueue.h"
+
+taskqueue::taskqueue(size_t threads, size_t waiting) : most_threads(threads), most_waiting(waiting) {}
+
+taskqueue::~taskqueue() {
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [this]() { return unfinished == 0; });
+        stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+void taskqueue::submit(std::function<void()> task) {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [this]() { return queued.size() < most_waiting; });
+    queued.push_back(std::move(task));
+    ++unfinished;
+    if (idle < queued.size() && workers.size() < most_threads) {
+        workers.emplace_back(&taskqueue::work, this);
+    }
+    changed.notify_all();
+}
+
+void taskqueue::drain() {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [this]() { return unfinished == 0; });
+}
+
+/*************************************************************/
+/* function: work                                           */
+/* purpose: the body of each thread: runs queued tasks      */
+/*          until the queue is destroyed.                   */
+/*************************************************************/
+void taskqueue::work() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        ++idle;
+        changed.wait(guard, [this]() { return stopping || !queued.empty(); });
+        --idle;
+        if (queued.empty()) {
+            return;
+        }
+        std::function<void()> task = std::move(queued.front());
+        queued.pop_front();
+        changed.notify_all(); // room for submit
+        guard.unlock();
+        task();
+        guard.lock();
+        if (--unfinished == 0) {
+            changed.notify_all();
+        }
+    }
+}
@@ -0,0 +1,73 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: taskqueue.h                                     */
+/* purpose: this header file declares the task queue a       */
+/*          session runs its concurrent commands on. threads */
+/*          are started as tasks arrive, up to a limit, and  */
+/*          kept for the rest of the session. submit waits   */
+/*          while too many tasks are queued, so a client     */
+/*          that pipelines faster than the commands run is   */
+/*          held back rather than buffered without bound.    */
+/*************************************************************/
+
+#ifndef TASKQUEUE_H
+#define TASKQUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*************************************************************/
+/* class: taskqueue                                          */
+/* purpose: runs tasks on a small pool of threads. tasks     */
+/*          must not throw.                                  */
+/*************************************************************/
+class taskqueue {
+  public:
+    /*************************************************************/
+    /* function: taskqueue                                      */
+    /* purpose: creates a queue with no threads yet.            */
+    /* parameters:                                              */
+    /*    - threads: the most tasks run at once.                */
+    /*    - waiting: the most tasks queued behind them.         */
+    /*************************************************************/
+    taskqueue(size_t threads, size_t waiting);
+    taskqueue(const taskqueue &) = delete;
+    taskqueue &operator=(const taskqueue &) = delete;
+
+    // Finishes the tasks submitted and stops the threads
+    ~taskqueue();
+
+    /*************************************************************/
+    /* function: submit                                         */
+    /* purpose: queues a task, starting a thread for it if all  */
+    /*          are busy and the limit allows.                  */
+    /*************************************************************/
+    void submit(std::function<void()> task);
+
+    /*************************************************************/
+    /* function: drain                                          */
+    /* purpose: waits until every task submitted so far has     */
+    /*          finished.                                       */
+    /*************************************************************/
+    void drain();
+
+  private:
+    void work();
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<std::function<void()>> queued;
+    std::vector<std::thread> workers;
+    size_t most_threads;
+    size_t most_waiting;
+    size_t unfinished = 0; // tasks queued or running
+    size_t idle = 0;       // threads waiting for a task
+    bool stopping = false;
+};
+
+#endif
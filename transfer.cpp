@@ -0,0 +1,772 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: transfer.cpp                                        */
+/* purpose: this source file implements the file transfer        */
+/*          engine declared in transfer.h.                       */
+/*****************************************************************/
+#include "transfer.h"
+#include "protocol.h"
+#include "uring.h"
+#include "compress.h"
+#include "checksum.h"
+#include "workqueue.h"
+#include "mapguard.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <sstream>
+#include <memory>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Largest count handed to one sendfile() call
+constexpr size_t SENDFILE_CHUNK = 1 << 24;
+
+// How long sendfile waits for room on a socket without a send timeout
+constexpr int SEND_STALL_MS = 60000;
+
+// Requested capacity of the splice pipe (the kernel may grant less)
+constexpr int SPLICE_PIPE_SIZE = 1 << 20;
+
+// DATA frames at least this large get their range preallocated
+constexpr uint64_t PREALLOCATE_THRESHOLD = 1 << 20;
+
+// Read size used when summing bytes back from the page cache
+constexpr size_t INTEGRITY_READ = 256 << 10;
+
+// Blocks a blocksummer may fall behind before the transfer waits for it
+constexpr size_t SUMMER_QUEUE_DEPTH = 4;
+
+// Damaged ranges listed one by one in a checksum mismatch error
+constexpr size_t MAX_REPORTED_RANGES = 32;
+
+// Most of a file the mmap engine maps at once
+constexpr uint64_t MAP_CHUNK = 64 << 20;
+
+// Bounds on the mmap engine's send window, whatever SO_SNDBUF says
+constexpr uint64_t MIN_MAP_WINDOW = 256 << 10;
+constexpr uint64_t MAX_MAP_WINDOW = 8 << 20;
+
+// Leading text of a checksum mismatch error
+static const std::string MISMATCH_PREFIX = "Error: Checksum mismatch at";
+
+// Engine used by sendfiledata and recvfiledata
+static transferengine current_engine = transferengine::ZEROCOPY;
+
+transferengine settransferengine(transferengine engine) {
+    if (engine == transferengine::URING && !uring::supported()) {
+        engine = transferengine::ZEROCOPY;
+    }
+    current_engine = engine;
+    return engine;
+}
+
+bool parsetransferengine(const std::string &name, transferengine &engine) {
+    if (name == "buffered") {
+        engine = transferengine::BUFFERED;
+    } else if (name == "zerocopy") {
+        engine = transferengine::ZEROCOPY;
+    } else if (name == "uring") {
+        engine = transferengine::URING;
+    } else if (name == "mmap") {
+        engine = transferengine::MAPPED;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void integritysums::update(const char *data, size_t size) {
+    while (size > 0) {
+        uint64_t used = (position - start) % INTEGRITY_BLOCK;
+        size_t n = size < INTEGRITY_BLOCK - used ? size : INTEGRITY_BLOCK - used;
+        crc = crc32c(crc, data, n);
+        if (content) {
+            content->update(data, n);
+        }
+        data += n;
+        size -= n;
+        position += n;
+        if ((position - start) % INTEGRITY_BLOCK == 0) {
+            uint32_t packed = htobe32(crc);
+            sums.append(reinterpret_cast<const char *>(&packed), sizeof(packed));
+            crc = 0;
+        }
+    }
+}
+
+bool integritysums::readfile(int fd, uint64_t end) {
+    static thread_local std::vector<char> buffer(INTEGRITY_READ);
+    while (position < end) {
+        size_t want = end - position < buffer.size() ? end - position : buffer.size();
+        ssize_t got = pread(fd, buffer.data(), want, position);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        update(buffer.data(), got);
+    }
+    return true;
+}
+
+std::string integritysums::digest() const {
+    std::string out = sums;
+    if ((position - start) % INTEGRITY_BLOCK != 0) {
+        uint32_t packed = htobe32(crc);
+        out.append(reinterpret_cast<const char *>(&packed), sizeof(packed));
+    }
+    return out;
+}
+
+bool integritysums::verify(const std::string &expected, std::vector<byterange> &damaged) const {
+    damaged.clear();
+    if (expected.empty()) {
+        return true;
+    }
+    std::string actual = digest();
+    if (actual.size() != expected.size()) {
+        damaged.push_back({start, position - start});
+        return false;
+    }
+    for (size_t i = 0; i < actual.size(); i += 4) {
+        if (std::memcmp(&actual[i], &expected[i], 4) == 0) {
+            continue;
+        }
+        uint64_t offset = start + i / 4 * INTEGRITY_BLOCK;
+        uint64_t length = position - offset < INTEGRITY_BLOCK ? position - offset : INTEGRITY_BLOCK;
+        if (!damaged.empty() && damaged.back().offset + damaged.back().length == offset) {
+            damaged.back().length += length;
+        } else {
+            damaged.push_back({offset, length});
+        }
+    }
+    return damaged.empty();
+}
+
+std::string formatdamaged(const std::vector<byterange> &damaged) {
+    std::string text = MISMATCH_PREFIX;
+    for (size_t i = 0; i < damaged.size(); i++) {
+        uint64_t length = damaged[i].length;
+        if (i == MAX_REPORTED_RANGES - 1) {
+            // One range from here to the end of the last one
+            length = damaged.back().offset + damaged.back().length - damaged[i].offset;
+        }
+        text += " " + std::to_string(damaged[i].offset) + "+" + std::to_string(length);
+        if (i == MAX_REPORTED_RANGES - 1) {
+            break;
+        }
+    }
+    return text;
+}
+
+bool parsedamaged(const std::string &text, std::vector<byterange> &damaged) {
+    damaged.clear();
+    if (text.compare(0, MISMATCH_PREFIX.size(), MISMATCH_PREFIX) != 0) {
+        return false;
+    }
+    std::istringstream in(text.substr(MISMATCH_PREFIX.size()));
+    byterange r;
+    char plus;
+    while (in >> r.offset >> plus >> r.length && plus == '+') {
+        damaged.push_back(r);
+    }
+    return !damaged.empty();
+}
+
+/*************************************************************/
+/* class: blocksummer                                        */
+/* purpose: feeds integritysums from a file on a helper      */
+/*          thread, so summing a block that was just sent or */
+/*          written overlaps with moving the next one.       */
+/*************************************************************/
+class blocksummer {
+  public:
+    blocksummer(integritysums &sums, int fd)
+        : ends(SUMMER_QUEUE_DEPTH), worker([this, &sums, fd]() {
+              uint64_t end;
+              while (ends.pop(end)) {
+                  if (ok && !sums.readfile(fd, end)) {
+                      ok = false;
+                  }
+              }
+          }) {}
+
+    ~blocksummer() {
+        finish();
+    }
+
+    // Queues the file up to end for summing
+    void feed(uint64_t end) {
+        ends.push(end);
+    }
+
+    // Waits for the queued blocks; false if the file could not be read
+    bool finish() {
+        if (worker.joinable()) {
+            ends.close();
+            worker.join();
+        }
+        return ok;
+    }
+
+  private:
+    workqueue<uint64_t> ends;
+    bool ok = true; // written by the worker, read after it is joined
+    std::thread worker;
+};
+
+/*************************************************************/
+/* function: sendbuffered                                   */
+/* purpose: fallback for descriptors sendfile() rejects:    */
+/*          copies the range through a userspace buffer of  */
+/*          the connection's chunk size.                    */
+/* parameters:                                              */
+/*    - s: the connection to send on.                       */
+/*    - fd: the file to read.                               */
+/*    - offset: where to start reading.                     */
+/*    - length: how many bytes to send.                     */
+/*************************************************************/
+static void sendbuffered(mysock &s, int fd, uint64_t offset, uint64_t length) {
+    std::vector<char> buffer(length < s.tuning().chunk() ? length : s.tuning().chunk());
+    while (length > 0) {
+        size_t want = length < buffer.size() ? length : buffer.size();
+        ssize_t got = pread(fd, buffer.data(), want, offset);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            throw std::runtime_error("File ended before the announced length");
+        }
+        s.sendall(buffer.data(), got);
+        offset += got;
+        length -= got;
+    }
+}
+
+/*************************************************************/
+/* function: sendwindow                                     */
+/* purpose: how far ahead of the socket the mmap engine     */
+/*          reads: the send buffer the kernel has grown for */
+/*          this connection, in whole pages.                */
+/*************************************************************/
+static uint64_t sendwindow(mysock &s) {
+    int buffer = 0;
+    socklen_t size = sizeof(buffer);
+    uint64_t window = MIN_MAP_WINDOW;
+    if (getsockopt(s.getfd(), SOL_SOCKET, SO_SNDBUF, &buffer, &size) == 0 && buffer > 0) {
+        window = buffer;
+    }
+    window = window < MIN_MAP_WINDOW ? MIN_MAP_WINDOW : window > MAX_MAP_WINDOW ? MAX_MAP_WINDOW : window;
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    return window / page * page;
+}
+
+/*************************************************************/
+/* function: summapped                                      */
+/* purpose: adds mapped bytes to the sums. a file cut short */
+/*          under the mapping raises SIGBUS here, which is  */
+/*          turned into a false return.                     */
+/*************************************************************/
+static bool summapped(integritysums &sums, const char *data, size_t size) {
+    sigjmp_buf shrank;
+    bool ok = false;
+    if (sigsetjmp(shrank, 1) == 0) {
+        mapped_read = &shrank;
+        sums.update(data, size);
+        ok = true;
+    }
+    mapped_read = nullptr;
+    return ok;
+}
+
+/*************************************************************/
+/* function: sendmapped                                     */
+/* purpose: the mmap engine: maps the range a chunk at a    */
+/*          time and sends it straight from the mapping, a  */
+/*          send window at a time. the next window is asked */
+/*          for with MADV_WILLNEED while the current one is */
+/*          summed and sent, so the disk reads ahead of the */
+/*          socket by what the socket can hold. a file that */
+/*          cannot be mapped is sent through a buffer.      */
+/* parameters:                                              */
+/*    - s: the connection to send on.                       */
+/*    - fd: the file to read.                               */
+/*    - offset: where to start reading.                     */
+/*    - length: how many bytes to send.                     */
+/*    - sums: receives the bytes sent, or nullptr.          */
+/*************************************************************/
+static void sendmapped(mysock &s, int fd, uint64_t offset, uint64_t length, integritysums *sums) {
+    guardmappings();
+    uint64_t window = sendwindow(s);
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    while (length > 0) {
+        uint64_t base = offset / page * page;
+        uint64_t skew = offset - base;
+        uint64_t span = length < MAP_CHUNK - skew ? length : MAP_CHUNK - skew;
+        void *mapped = mmap(nullptr, skew + span, PROT_READ, MAP_SHARED, fd, base);
+        if (mapped == MAP_FAILED) {
+            sendbuffered(s, fd, offset, length);
+            if (sums && !sums->readfile(fd, offset + length)) {
+                throw std::runtime_error("File ended before the announced length");
+            }
+            return;
+        }
+        madvise(mapped, skew + span, MADV_SEQUENTIAL);
+
+        // Windows are counted from the start of the mapping, so each
+        // one after the first begins on a page
+        char *start = static_cast<char *>(mapped);
+        uint64_t end = skew + span;
+        uint64_t at = skew;
+        try {
+            madvise(mapped, window < end ? window : end, MADV_WILLNEED);
+            while (at < end) {
+                uint64_t stop = (at / window + 1) * window;
+                stop = stop < end ? stop : end;
+                if (stop < end) {
+                    madvise(start + stop, end - stop < window ? end - stop : window, MADV_WILLNEED);
+                }
+                if (sums && !summapped(*sums, start + at, stop - at)) {
+                    throw std::runtime_error("File ended before the announced length");
+                }
+                bool more = stop < end || length > span;
+                s.sendall(start + at, stop - at, more ? MSG_MORE : 0);
+                at = stop;
+            }
+        } catch (...) {
+            munmap(mapped, end);
+            throw;
+        }
+        munmap(mapped, end);
+        offset += span;
+        length -= span;
+    }
+}
+
+void sendfiledata(mysock &s, uint32_t reqid, int fd, uint64_t offset, uint64_t length) {
+    integritysums sums(offset);
+    auto started = std::chrono::steady_clock::now();
+    sendfileframe(s, reqid, fd, offset, length, &sums);
+    s.tuning().observe(length, std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+    std::string digest = sums.digest();
+    sendframe(s, FRAME_END, reqid, digest.data(), digest.size());
+}
+
+/*************************************************************/
+/* function: waitwritable                                   */
+/* purpose: waits for room in a socket that would block,    */
+/*          for its SO_SNDTIMEO or else SEND_STALL_MS.      */
+/*          throws if no room comes, as recv does when its  */
+/*          timeout expires.                                */
+/* parameters:                                              */
+/*    - socket_fd: the socket.                              */
+/*************************************************************/
+static void waitwritable(int socket_fd) {
+    struct timeval limit = {0, 0};
+    socklen_t size = sizeof(limit);
+    getsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &limit, &size);
+    int ms = limit.tv_sec || limit.tv_usec ? limit.tv_sec * 1000 + limit.tv_usec / 1000 : SEND_STALL_MS;
+    struct pollfd p = {socket_fd, POLLOUT, 0};
+    int ready;
+    do {
+        ready = poll(&p, 1, ms > 0 ? ms : 1);
+    } while (ready == -1 && errno == EINTR);
+    if (ready == 0) {
+        throw std::runtime_error("Timed out sending file data");
+    }
+    if (ready == -1) {
+        throw std::runtime_error("sendfile failed");
+    }
+}
+
+/*************************************************************/
+/* function: sendpayload                                    */
+/* purpose: sends file bytes with the selected engine.      */
+/* parameters:                                              */
+/*    - s: the connection to send on.                       */
+/*    - fd: the file to read.                               */
+/*    - offset: where to start reading.                     */
+/*    - length: how many bytes to send.                     */
+/*************************************************************/
+static void sendpayload(mysock &s, int fd, uint64_t offset, uint64_t length) {
+    if (current_engine == transferengine::BUFFERED) {
+        sendbuffered(s, fd, offset, length);
+        return;
+    }
+    if (current_engine == transferengine::URING) {
+        uringsend(s.getfd(), fd, offset, length);
+        return;
+    }
+
+    off_t position = offset;
+    uint64_t remaining = length;
+    while (remaining > 0) {
+        size_t want = remaining < SENDFILE_CHUNK ? remaining : SENDFILE_CHUNK;
+        ssize_t sent = sendfile(s.getfd(), fd, &position, want);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                waitwritable(s.getfd());
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                // The descriptor does not support sendfile; finish the frame by hand
+                sendbuffered(s, fd, position, remaining);
+                break;
+            }
+            throw std::runtime_error("sendfile failed");
+        }
+        if (sent == 0) {
+            throw std::runtime_error("File ended before the announced length");
+        }
+        remaining -= sent;
+    }
+}
+
+/*************************************************************/
+/* function: senddataheader                                 */
+/* purpose: starts a DATA frame. MSG_MORE lets the header   */
+/*          share a segment with the first payload bytes.   */
+/*************************************************************/
+static void senddataheader(mysock &s, uint32_t reqid, uint64_t length) {
+    frameheader h;
+    h.type = FRAME_DATA;
+    h.reqid = reqid;
+    h.length = length;
+    char header[FRAME_HEADER_SIZE];
+    encodeheader(h, header);
+    s.sendall(header, sizeof(header), length > 0 ? MSG_MORE : 0);
+}
+
+void sendfileframe(mysock &s, uint32_t reqid, int fd, uint64_t offset, uint64_t length, integritysums *sums) {
+    // On a multiplexed connection each block is a frame of its own, so
+    // replies to the session's other commands can go out between them
+    uint64_t most = s.multiplexed() && length > INTEGRITY_BLOCK ? INTEGRITY_BLOCK : length;
+
+    if (current_engine == transferengine::MAPPED) {
+        do {
+            uint64_t frame = length < most ? length : most;
+            auto held = s.holdframes();
+            senddataheader(s, reqid, frame);
+            sendmapped(s, fd, offset, frame, sums);
+            offset += frame;
+            length -= frame;
+        } while (length > 0);
+        return;
+    }
+    posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    if (!sums || length <= INTEGRITY_BLOCK) {
+        // Not worth a thread: sum it once it is out
+        do {
+            uint64_t frame = length < most ? length : most;
+            auto held = s.holdframes();
+            senddataheader(s, reqid, frame);
+            sendpayload(s, fd, offset, frame);
+            if (held) {
+                held.unlock();
+            }
+            offset += frame;
+            length -= frame;
+            if (sums && !sums->readfile(fd, offset)) {
+                throw std::runtime_error("File ended before the announced length");
+            }
+        } while (length > 0);
+        return;
+    }
+
+    // Each block is summed from the page cache on the helper thread
+    // while the next one is sent
+    blocksummer summer(*sums, fd);
+    std::unique_lock<framelock> held;
+    uint64_t unframed = 0; // bytes the open frame still needs
+    while (length > 0) {
+        if (unframed == 0) {
+            unframed = length < most ? length : most;
+            held = s.holdframes();
+            senddataheader(s, reqid, unframed);
+        }
+        uint64_t block = length < INTEGRITY_BLOCK ? length : INTEGRITY_BLOCK;
+        sendpayload(s, fd, offset, block);
+        offset += block;
+        length -= block;
+        unframed -= block;
+        if (unframed == 0 && held) {
+            held.unlock();
+        }
+        summer.feed(offset);
+    }
+    if (!summer.finish()) {
+        throw std::runtime_error("File ended before the announced length");
+    }
+}
+
+/*************************************************************/
+/* function: writeall                                       */
+/* purpose: pwrites a whole buffer at an offset.            */
+/* parameters:                                              */
+/*    - fd: the destination file.                           */
+/*    - data: the bytes to write.                           */
+/*    - size: how many bytes to write.                      */
+/*    - offset: where to write them. advanced on success.   */
+/* return: false if the write failed.                       */
+/*************************************************************/
+static bool writeall(int fd, const char *data, size_t size, uint64_t &offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+/*************************************************************/
+/* function: recvcopy                                       */
+/* purpose: receives payload bytes through a userspace      */
+/*          buffer of the connection's chunk size and       */
+/*          pwrites them (or discards them).                */
+/* parameters:                                              */
+/*    - s: the connection to read from.                     */
+/*    - fd: the destination file, or -1 to discard.         */
+/*    - offset: the file offset. advanced as bytes land.    */
+/*    - length: how many payload bytes to consume.          */
+/*    - write_failed: set once a write fails.               */
+/*************************************************************/
+static void recvcopy(mysock &s, int fd, uint64_t &offset, uint64_t length, bool &write_failed) {
+    std::vector<char> buffer(length < s.tuning().chunk() ? length : s.tuning().chunk());
+    while (length > 0) {
+        size_t want = length < buffer.size() ? length : buffer.size();
+        if (s.recvall(buffer.data(), want) < want) {
+            throw std::runtime_error("Connection closed in the middle of a frame");
+        }
+        if (fd != -1 && !write_failed && !writeall(fd, buffer.data(), want, offset)) {
+            write_failed = true;
+        }
+        length -= want;
+    }
+}
+
+/*************************************************************/
+/* function: recvsplice                                     */
+/* purpose: moves payload bytes socket -> pipe -> file.     */
+/*          stops early if the kernel refuses to splice, in */
+/*          which case whatever already sits in the pipe is */
+/*          written by hand and the caller finishes the     */
+/*          frame with recvcopy.                            */
+/* parameters:                                              */
+/*    - s: the connection to read from.                     */
+/*    - pipefd: the splice pipe.                            */
+/*    - fd: the destination file.                           */
+/*    - offset: the file offset. advanced as bytes land.    */
+/*    - length: how many payload bytes to consume.          */
+/*    - write_failed: set once a write fails.               */
+/*    - usable: cleared when splice is not supported.       */
+/* return: the number of payload bytes consumed.            */
+/*************************************************************/
+static uint64_t recvsplice(mysock &s, const int pipefd[2], int fd, uint64_t &offset, uint64_t length,
+                           bool &write_failed, bool &usable) {
+    uint64_t consumed = 0;
+    while (consumed < length) {
+        size_t want = length - consumed < SPLICE_PIPE_SIZE ? length - consumed : SPLICE_PIPE_SIZE;
+        ssize_t in = splice(s.getfd(), nullptr, pipefd[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                usable = false;
+                return consumed;
+            }
+            throw std::runtime_error("Failed to receive message");
+        }
+        if (in == 0) {
+            throw std::runtime_error("Connection closed in the middle of a frame");
+        }
+        consumed += in;
+
+        size_t pending = in;
+        while (pending > 0) {
+            loff_t position = offset;
+            ssize_t out = splice(pipefd[0], nullptr, fd, &position, pending, SPLICE_F_MOVE);
+            if (out == -1 && errno == EINTR) {
+                continue;
+            }
+            if (out > 0) {
+                offset = position;
+                pending -= out;
+                continue;
+            }
+
+            // The file side refused: empty the pipe through a buffer
+            bool unsupported = out == -1 && (errno == EINVAL || errno == ENOSYS);
+            std::vector<char> buffer(pending);
+            size_t drained = 0;
+            while (drained < pending) {
+                ssize_t got = read(pipefd[0], buffer.data() + drained, pending - drained);
+                if (got == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (got <= 0) {
+                    throw std::runtime_error("Failed to drain splice pipe");
+                }
+                drained += got;
+            }
+            if (!unsupported || !writeall(fd, buffer.data(), pending, offset)) {
+                write_failed = true;
+            }
+            usable = false;
+            return consumed;
+        }
+    }
+    return consumed;
+}
+
+datareceiver::datareceiver(int fd, uint64_t offset, sha256 *content)
+    : fd(fd), offset(offset), sums(offset, content), started(std::chrono::steady_clock::now()) {
+    bool splicing = current_engine == transferengine::ZEROCOPY || current_engine == transferengine::MAPPED;
+    use_splice = fd != -1 && splicing && pipe2(pipefd, O_CLOEXEC) == 0;
+    if (use_splice) {
+        fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    }
+}
+
+datareceiver::~datareceiver() {
+    closepipe();
+}
+
+void datareceiver::closepipe() {
+    if (pipefd[0] != -1) {
+        ::close(pipefd[0]);
+        ::close(pipefd[1]);
+        pipefd[0] = pipefd[1] = -1;
+    }
+}
+
+/*************************************************************/
+/* function: landed                                         */
+/* purpose: sums the bytes written up to offset, on the     */
+/*          helper thread if there is one.                  */
+/*************************************************************/
+void datareceiver::landed() {
+    if (fd == -1 || write_failed) {
+        return;
+    }
+    if (summer) {
+        summer->feed(offset);
+    } else if (!sums.readfile(fd, offset)) {
+        write_failed = true;
+    }
+}
+
+bool datareceiver::frame(mysock &s, const frameheader &h) {
+    if (h.type == FRAME_END) {
+        std::string expected = recvtext(s, h);
+        closepipe();
+        s.tuning().observe(received, std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+        if (summer && !summer->finish()) {
+            write_failed = true;
+        }
+        if (write_failed) {
+            failure = "Error: Writing to file failed.";
+        } else if (fd != -1 && !sums.verify(expected, bad)) {
+            failure = formatdamaged(bad);
+        } else {
+            verified = true;
+        }
+        return true;
+    }
+    if (h.type == FRAME_ERROR) {
+        failure = recvtext(s, h);
+        closepipe();
+        return true;
+    }
+    if (h.type != FRAME_DATA) {
+        throw std::runtime_error("Unexpected frame in data stream");
+    }
+
+    received += h.length;
+    if (h.flags & FLAG_COMPRESSED) {
+        if (h.length > MAX_COMPRESSED_FRAME) {
+            throw std::runtime_error("Compressed frame exceeds the maximum size");
+        }
+        std::string packed(h.length, '\0'), chunk;
+        if (s.recvall(&packed[0], packed.size()) < packed.size()) {
+            throw std::runtime_error("Connection closed in the middle of a frame");
+        }
+        inflatechunk(packed.data(), packed.size(), chunk);
+        if (fd != -1 && !write_failed && !writeall(fd, chunk.data(), chunk.size(), offset)) {
+            write_failed = true;
+        }
+        if (summer) {
+            landed(); // keep the sums in order behind the helper
+        } else {
+            sums.update(chunk.data(), chunk.size());
+        }
+        return false;
+    }
+
+    if (fd != -1 && !write_failed && h.length >= PREALLOCATE_THRESHOLD) {
+        // Reserve the blocks but keep the size, so a partial file
+        // shows how much actually arrived (resume relies on it)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, h.length); // best effort
+    }
+
+    // Block by block, so each block is read back for its sum while
+    // it is still in the page cache
+    if (fd != -1 && !summer && h.length > INTEGRITY_BLOCK) {
+        summer.reset(new blocksummer(sums, fd));
+    }
+    uint64_t remaining = h.length;
+    while (remaining > 0) {
+        uint64_t block = remaining < INTEGRITY_BLOCK ? remaining : INTEGRITY_BLOCK;
+        remaining -= block;
+        if (current_engine == transferengine::URING) {
+            uringrecv(s.getfd(), fd, offset, block, write_failed);
+        } else {
+            if (use_splice && !write_failed) {
+                block -= recvsplice(s, pipefd, fd, offset, block, write_failed, use_splice);
+            }
+            recvcopy(s, fd, offset, block, write_failed);
+        }
+        landed();
+    }
+    return false;
+}
+
+bool recvfiledata(mysock &s, int fd, uint64_t offset, std::string &error, const frameheader *first,
+                  std::vector<byterange> *damaged, sha256 *content) {
+    datareceiver stream(fd, offset, content);
+    frameheader h;
+    if (first) {
+        h = *first;
+    }
+    while (first || recvheader(s, h)) {
+        first = nullptr;
+        if (stream.frame(s, h)) {
+            error = stream.error();
+            if (damaged && !stream.damaged().empty()) {
+                *damaged = stream.damaged();
+            }
+            return stream.complete();
+        }
+    }
+    throw std::runtime_error("Connection closed in the middle of a transfer");
+}
@@ -0,0 +1,315 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: transfer.h                                      */
+/* purpose: this header file declares the file transfer      */
+/*          engine that moves file contents between a file   */
+/*          descriptor and a mysock connection using the     */
+/*          framed protocol. downloads go from the page      */
+/*          cache to the socket with sendfile(2) and only    */
+/*          fall back to a read/send loop when the kernel    */
+/*          cannot sendfile from the descriptor. uploads are */
+/*          spliced from the socket through a pipe into the  */
+/*          destination file, again without userspace copies.*/
+/*          an io_uring engine can be selected instead; it   */
+/*          batches file and socket I/O through registered   */
+/*          buffers and is only used where io_uring works.   */
+/*          every transfer is checked end to end: the sender */
+/*          computes a CRC32C of each INTEGRITY_BLOCK of the */
+/*          range as it goes and puts them in the END frame, */
+/*          and the receiver compares them with the bytes    */
+/*          that landed, reporting the blocks that differ so */
+/*          only those are sent again.                       */
+/*************************************************************/
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "socket.h"
+#include "protocol.h"
+
+class sha256;
+
+// Bytes covered by each CRC32C in an END frame
+constexpr uint64_t INTEGRITY_BLOCK = 4 << 20;
+
+// Rounds of resending damaged ranges before a transfer is given up
+constexpr int MAX_INTEGRITY_RETRIES = 3;
+
+/*************************************************************/
+/* struct: byterange                                         */
+/* purpose: a range of file bytes.                           */
+/*************************************************************/
+struct byterange {
+    uint64_t offset;
+    uint64_t length;
+};
+
+/*************************************************************/
+/* class: integritysums                                      */
+/* purpose: the CRC32C of every INTEGRITY_BLOCK of a byte    */
+/*          range, fed in order while the range streams by,  */
+/*          either with bytes in hand or by reading back     */
+/*          what the kernel moved without a userspace copy.  */
+/*          the blocks are counted from the start of the     */
+/*          range; the last one may be partial. the same     */
+/*          bytes can also be fed to a SHA-256, so an upload  */
+/*          is named for the content store as it lands.      */
+/*************************************************************/
+class integritysums {
+  public:
+    /*************************************************************/
+    /* function: integritysums                                  */
+    /* purpose: starts the sums of a range.                     */
+    /* parameters:                                              */
+    /*    - offset: the file offset of the range.               */
+    /*    - content: also fed every byte of the range, or null. */
+    /*************************************************************/
+    integritysums(uint64_t offset = 0, sha256 *content = nullptr)
+        : start(offset), position(offset), content(content) {}
+
+    /*************************************************************/
+    /* function: update                                         */
+    /* purpose: feeds the next bytes of the range.              */
+    /* parameters:                                              */
+    /*    - data: the bytes.                                    */
+    /*    - size: how many bytes.                               */
+    /*************************************************************/
+    void update(const char *data, size_t size);
+
+    /*************************************************************/
+    /* function: readfile                                       */
+    /* purpose: feeds the range from the file up to an offset,  */
+    /*          for bytes that were sent or received zero-copy. */
+    /*          they are normally still in the page cache.      */
+    /* parameters:                                              */
+    /*    - fd: the file.                                       */
+    /*    - end: the file offset to feed up to.                 */
+    /* return: false if the file could not be read.             */
+    /*************************************************************/
+    bool readfile(int fd, uint64_t end);
+
+    /*************************************************************/
+    /* function: digest                                         */
+    /* purpose: the END payload: one CRC32C per block so far,   */
+    /*          4 bytes each in network byte order.             */
+    /*************************************************************/
+    std::string digest() const;
+
+    /*************************************************************/
+    /* function: verify                                         */
+    /* purpose: compares these sums with the sender's END       */
+    /*          payload. an empty payload is from a sender that */
+    /*          does not checksum and is accepted.              */
+    /* parameters:                                              */
+    /*    - expected: the END payload.                          */
+    /*    - damaged: receives the ranges whose blocks differ,   */
+    /*               adjacent blocks merged.                    */
+    /* return: true if every block matches.                     */
+    /*************************************************************/
+    bool verify(const std::string &expected, std::vector<byterange> &damaged) const;
+
+  private:
+    uint64_t start;
+    uint64_t position;   // file offset of the next byte
+    uint32_t crc = 0;    // CRC of the current block so far
+    std::string sums;    // packed CRCs of the finished blocks
+    sha256 *content;     // content hash fed alongside, or null
+};
+
+/*************************************************************/
+/* function: formatdamaged                                  */
+/* purpose: builds the error text for a transfer that did   */
+/*          not verify: "Error: Checksum mismatch at" and   */
+/*          the damaged ranges as offset+length. past a     */
+/*          few dozen ranges the rest is merged into one.   */
+/* parameters:                                              */
+/*    - damaged: the ranges from integritysums::verify.     */
+/*************************************************************/
+std::string formatdamaged(const std::vector<byterange> &damaged);
+
+/*************************************************************/
+/* function: parsedamaged                                   */
+/* purpose: reads the ranges back from such an error.       */
+/* parameters:                                              */
+/*    - text: the error text.                               */
+/*    - damaged: receives the ranges.                       */
+/* return: false if the text is not a checksum mismatch.    */
+/*************************************************************/
+bool parsedamaged(const std::string &text, std::vector<byterange> &damaged);
+
+/*************************************************************/
+/* enum: transferengine                                      */
+/* purpose: how file payloads are moved.                     */
+/*************************************************************/
+enum class transferengine {
+    BUFFERED, // read/send and recv/pwrite through a userspace buffer
+    ZEROCOPY, // sendfile and splice (default)
+    URING,    // batched io_uring operations on registered buffers
+    MAPPED    // send straight from an mmap of the file; receives like ZEROCOPY
+};
+
+/*************************************************************/
+/* function: settransferengine                              */
+/* purpose: selects the engine for this process. io_uring   */
+/*          falls back to the zero-copy engine if the       */
+/*          kernel does not allow it.                       */
+/* parameters:                                              */
+/*    - engine: the requested engine.                       */
+/* return: the engine actually in use.                      */
+/*************************************************************/
+transferengine settransferengine(transferengine engine);
+
+/*************************************************************/
+/* function: parsetransferengine                            */
+/* purpose: maps "buffered", "zerocopy", "uring" or "mmap" */
+/*          to an engine.                                   */
+/* parameters:                                              */
+/*    - name: the engine name.                              */
+/*    - engine: receives the engine.                        */
+/* return: false if the name is unknown.                    */
+/*************************************************************/
+bool parsetransferengine(const std::string &name, transferengine &engine);
+
+/*************************************************************/
+/* function: sendfiledata                                   */
+/* purpose: sends a byte range of a file as a single DATA   */
+/*          frame followed by an END frame that carries the */
+/*          range's integritysums. the header is            */
+/*          corked onto the first payload segment. with the */
+/*          zero-copy engine the payload never enters       */
+/*          userspace unless sendfile rejects the file, in  */
+/*          which case it falls back to buffered. throws if */
+/*          the file cannot supply the announced length,    */
+/*          since the frame can then no longer be completed.*/
+/* parameters:                                              */
+/*    - s: the connection to send on.                       */
+/*    - reqid: the request id the data belongs to.          */
+/*    - fd: an open, readable file descriptor.              */
+/*    - offset: where in the file to start.                 */
+/*    - length: how many bytes to send.                     */
+/*************************************************************/
+void sendfiledata(mysock &s, uint32_t reqid, int fd, uint64_t offset, uint64_t length);
+
+/*************************************************************/
+/* function: sendfileframe                                  */
+/* purpose: sends a byte range of a file as one DATA frame  */
+/*          the way sendfiledata does, without the END, so  */
+/*          a stream can be built from several frames. with */
+/*          sums the range goes out in INTEGRITY_BLOCK      */
+/*          pieces and each is summed from the page cache   */
+/*          while the socket drains the one before. on a    */
+/*          multiplexed connection each INTEGRITY_BLOCK is  */
+/*          a frame of its own instead.                     */
+/* parameters:                                              */
+/*    - s: the connection to send on.                       */
+/*    - reqid: the request id the data belongs to.          */
+/*    - fd: an open, readable file descriptor.              */
+/*    - offset: where in the file to start.                 */
+/*    - length: how many bytes to send.                     */
+/*    - sums: fed with the range, or null.                  */
+/*************************************************************/
+void sendfileframe(mysock &s, uint32_t reqid, int fd, uint64_t offset, uint64_t length,
+                   integritysums *sums = nullptr);
+
+class blocksummer;
+
+/*************************************************************/
+/* class: datareceiver                                       */
+/* purpose: one incoming DATA stream, taken a frame at a     */
+/*          time, so streams whose frames are interleaved on */
+/*          one connection can each land in their own file.  */
+/*          recvfiledata below is a loop over it and says    */
+/*          how the payload is written and checked.          */
+/*************************************************************/
+class datareceiver {
+  public:
+    /*************************************************************/
+    /* function: datareceiver                                   */
+    /* purpose: starts a stream.                                */
+    /* parameters:                                              */
+    /*    - fd: the destination file, or -1 to discard.         */
+    /*    - offset: file offset of the first payload byte.      */
+    /*    - content: fed the written bytes in order, or null.   */
+    /*************************************************************/
+    datareceiver(int fd, uint64_t offset, sha256 *content = nullptr);
+    datareceiver(const datareceiver &) = delete;
+    datareceiver &operator=(const datareceiver &) = delete;
+    ~datareceiver();
+
+    /*************************************************************/
+    /* function: frame                                          */
+    /* purpose: consumes a frame of this stream whose header    */
+    /*          was just read: a DATA payload is written, an    */
+    /*          END is checked and an ERROR is kept. throws if  */
+    /*          the frame cannot be read or is not part of a    */
+    /*          data stream.                                    */
+    /* parameters:                                              */
+    /*    - s: the connection to read the payload from.         */
+    /*    - h: the frame's header.                              */
+    /* return: true once the stream has ended.                  */
+    /*************************************************************/
+    bool frame(mysock &s, const frameheader &h);
+
+    // Once ended: true if every byte was written and verified
+    bool complete() const { return verified; }
+
+    // Once ended incomplete: the reason
+    const std::string &error() const { return failure; }
+
+    // The ranges that failed the check, if that was the reason
+    const std::vector<byterange> &damaged() const { return bad; }
+
+  private:
+    void landed();
+    void closepipe();
+
+    int fd;
+    uint64_t offset;           // file offset of the next payload byte
+    int pipefd[2] = {-1, -1};  // splice pipe, while the stream runs
+    bool use_splice;
+    bool write_failed = false;
+    integritysums sums;
+    std::chrono::steady_clock::time_point started;
+    uint64_t received = 0;                // payload bytes, for the tuner
+    std::unique_ptr<blocksummer> summer;  // started by the first large DATA frame
+    bool verified = false;
+    std::string failure;
+    std::vector<byterange> bad;
+};
+
+/*************************************************************/
+/* function: recvfiledata                                   */
+/* purpose: receives DATA frames until END or ERROR and     */
+/*          writes the payloads to a file starting at an    */
+/*          offset. each DATA header's length is used to    */
+/*          preallocate the range with fallocate, then the  */
+/*          payload is moved socket -> pipe -> file with    */
+/*          splice(2). filesystems without splice support   */
+/*          fall back to recv/pwrite. compressed DATA       */
+/*          frames are inflated and written as they arrive. */
+/*          after a write error the rest of the stream is   */
+/*          drained so the connection stays usable. the     */
+/*          written bytes are read back block by block and  */
+/*          checked against the sums in the END frame.      */
+/* parameters:                                              */
+/*    - s: the connection to read from.                     */
+/*    - fd: the destination file, or -1 to discard.         */
+/*    - offset: file offset of the first payload byte.      */
+/*    - error: receives the reason when false is returned.  */
+/*    - first: the stream's first header if the caller has  */
+/*             already read it, or null.                    */
+/*    - damaged: receives the ranges that failed the check, */
+/*               or null.                                   */
+/*    - content: fed the written bytes in order, or null.   */
+/* return: true if the stream ended with END and every byte */
+/*         was written and verified.                        */
+/*************************************************************/
+bool recvfiledata(mysock &s, int fd, uint64_t offset, std::string &error, const frameheader *first = nullptr,
+                  std::vector<byterange> *damaged = nullptr, sha256 *content = nullptr);
+
+#endif
@@ -0,0 +1,616 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: treeindex.cpp                                       */
+/* purpose: this source file implements the tree index declared  */
+/*          in treeindex.h. a directory is watched before it is  */
+/*          read, so nothing created meanwhile is missed, and an */
+/*          event only ever makes the index look at the disk     */
+/*          again, so an event applied twice or late is          */
+/*          harmless. a reader first applies the events already  */
+/*          queued, which covers every change that finished      */
+/*          before it asked. a forked child shares the watch     */
+/*          descriptor with the parent and must not read it:     */
+/*          it answers from its copy while the descriptor has    */
+/*          nothing queued and the parent's generation counter,  */
+/*          kept in shared memory, is what it was at the fork.   */
+/*          the parent counts up before reading any event.       */
+/*****************************************************************/
+#include "treeindex.h"
+#include "sandbox.h"
+#include "store.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <poll.h>
+#include <pthread.h>
+#include <shared_mutex>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// What a watched directory reports: any entry appearing, going away or
+// changing, and the directory itself going away
+constexpr uint32_t INDEX_EVENTS = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB |
+                                  IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+// Bytes read per getdents64 call while scanning a directory
+constexpr size_t INDEX_READ = 64 << 10;
+
+/*************************************************************/
+/* struct: indexdirectory                                    */
+/* purpose: one directory of the index.                      */
+/*************************************************************/
+struct indexdirectory {
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    int watch = -1;
+    std::map<std::string, indexentry> entries; // by name, so pages come out sorted
+};
+
+/*************************************************************/
+/* struct: indexstate                                        */
+/* purpose: the index of one process.                        */
+/*************************************************************/
+struct indexstate {
+    fdhandle base_fd;    // the base directory (O_PATH)
+    fdhandle notify_fd;  // the inotify instance holding the watches
+    bool valid = false;  // built and not overflowed
+    std::unordered_map<std::string, indexdirectory> directories; // by path below the base
+    std::unordered_map<int, std::string> watches;                // watch -> directory path
+};
+
+/*************************************************************/
+/* struct: indexsumentry                                     */
+/* purpose: a remembered checksum and the file it is for.    */
+/*************************************************************/
+struct indexsumentry {
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t digest;
+};
+
+static std::string index_base;
+static std::shared_mutex index_lock;
+static indexstate index_state;
+static bool index_on = false;
+
+// Counted up by the parent around every change; shared with children
+static std::atomic<uint64_t> *index_generation = nullptr;
+static bool index_child = false;       // this process is a forked child
+static uint64_t index_forked_at = 0;   // the generation its copy is of
+
+static std::mutex sum_lock;
+static std::unordered_map<std::string, indexsumentry> index_sums; // by device:inode
+
+indexentry makeentry(const struct stat &st) {
+    indexentry e;
+    e.kind = S_ISDIR(st.st_mode) ? 'D' : S_ISREG(st.st_mode) ? 'F' : S_ISLNK(st.st_mode) ? 'L' : 'O';
+    e.size = S_ISREG(st.st_mode) ? st.st_size : 0;
+    e.mtime = st.st_mtime;
+    e.inode = st.st_ino;
+    return e;
+}
+
+/*************************************************************/
+/* function: joinpath                                       */
+/* purpose: appends a name to a path below the base.        */
+/*************************************************************/
+static std::string joinpath(const std::string &directory, const std::string &name) {
+    return directory.empty() ? name : directory + "/" + name;
+}
+
+/*************************************************************/
+/* function: scandirectory                                  */
+/* purpose: watches and reads one directory.                */
+/* parameters:                                              */
+/*    - state: the index the directory is for.              */
+/*    - path: the directory below the base.                 */
+/*    - inode: what its parent listed it as; 0 for the base.*/
+/*    - dir: receives the directory.                        */
+/*    - subdirectories: receives the directories in it.     */
+/* return: false if it could not be watched. a directory    */
+/*         that is gone or unreadable is left out (dir's    */
+/*         watch stays -1) but is not a failure.            */
+/*************************************************************/
+static bool scandirectory(const indexstate &state, const std::string &path, uint64_t inode, indexdirectory &dir,
+                          std::vector<std::pair<std::string, uint64_t>> &subdirectories) {
+    fdhandle fd(openbeneath(state.base_fd.get(), path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW));
+    struct stat st;
+    if (fd.get() == -1 || fstat(fd.get(), &st) == -1 || (inode != 0 && st.st_ino != inode)) {
+        return true; // replaced since the parent was read; its event will say how
+    }
+
+    // Watched through the descriptor, so it is the directory just opened
+    // whatever happens to the path meanwhile
+    std::string self = "/proc/self/fd/" + std::to_string(fd.get());
+    dir.watch = inotify_add_watch(state.notify_fd.get(), self.c_str(), INDEX_EVENTS);
+    if (dir.watch == -1) {
+        return false;
+    }
+    dir.device = st.st_dev;
+    dir.inode = st.st_ino;
+
+    std::vector<char> buffer(INDEX_READ);
+    while (true) {
+        ssize_t n = getdents64(fd.get(), buffer.data(), buffer.size());
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        for (ssize_t at = 0; at < n;) {
+            const struct dirent64 *d = reinterpret_cast<const struct dirent64 *>(buffer.data() + at);
+            at += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            struct stat entry;
+            if (fstatat(fd.get(), name, &entry, AT_SYMLINK_NOFOLLOW) == -1 || isstore(entry)) {
+                continue;
+            }
+            dir.entries[name] = makeentry(entry);
+            if (S_ISDIR(entry.st_mode)) {
+                subdirectories.emplace_back(joinpath(path, name), entry.st_ino);
+            }
+        }
+    }
+    return true;
+}
+
+/*************************************************************/
+/* function: addtree                                        */
+/* purpose: scans a directory and everything below it into  */
+/*          an index, several directories at a time.        */
+/* parameters:                                              */
+/*    - state: the index to add to.                         */
+/*    - path: the directory below the base.                 */
+/*    - inode: what its parent listed it as; 0 for the base.*/
+/*    - threads: how many threads scan.                     */
+/* return: false if a directory could not be watched.       */
+/*************************************************************/
+static bool addtree(indexstate &state, const std::string &path, uint64_t inode, unsigned threads) {
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<std::pair<std::string, uint64_t>> pending = {{path, inode}};
+    size_t busy = 0;
+    bool failed = false;
+
+    auto work = [&]() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&]() { return failed || !pending.empty() || busy == 0; });
+            if (failed || pending.empty()) {
+                return; // nothing queued and nobody left to queue more
+            }
+            std::pair<std::string, uint64_t> next = std::move(pending.back());
+            pending.pop_back();
+            busy++;
+            guard.unlock();
+
+            indexdirectory dir;
+            std::vector<std::pair<std::string, uint64_t>> subdirectories;
+            bool ok = scandirectory(state, next.first, next.second, dir, subdirectories);
+
+            guard.lock();
+            busy--;
+            if (!ok) {
+                failed = true;
+            } else if (dir.watch != -1) {
+                state.watches[dir.watch] = next.first;
+                state.directories[next.first] = std::move(dir);
+                pending.insert(pending.end(), subdirectories.begin(), subdirectories.end());
+            }
+            wake.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    return !failed;
+}
+
+/*************************************************************/
+/* function: buildindex                                     */
+/* purpose: builds a whole new index of the base.           */
+/* return: false if the tree cannot be watched.             */
+/*************************************************************/
+static bool buildindex(indexstate &state) {
+    state.base_fd.reset(open(index_base.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    state.notify_fd.reset(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    if (state.base_fd.get() == -1 || state.notify_fd.get() == -1) {
+        return false;
+    }
+    unsigned threads = std::min(std::max(std::thread::hardware_concurrency(), 1u), MAX_INDEX_THREADS);
+    state.valid = addtree(state, "", 0, threads) && state.directories.count("") != 0;
+    return state.valid;
+}
+
+/*************************************************************/
+/* function: removetree                                     */
+/* purpose: forgets a directory and everything below it,    */
+/*          dropping their watches.                         */
+/*************************************************************/
+static void removetree(indexstate &state, const std::string &path) {
+    auto found = state.directories.find(path);
+    if (found == state.directories.end()) {
+        return;
+    }
+    for (const auto &entry : found->second.entries) {
+        if (entry.second.kind == 'D') {
+            removetree(state, joinpath(path, entry.first));
+        }
+    }
+    // The same directory may have been scanned again under its new name
+    // and got the same watch back; that one stays
+    found = state.directories.find(path);
+    auto watch = state.watches.find(found->second.watch);
+    if (watch != state.watches.end() && watch->second == path) {
+        inotify_rm_watch(state.notify_fd.get(), watch->first);
+        state.watches.erase(watch);
+    }
+    state.directories.erase(found);
+}
+
+/*************************************************************/
+/* function: removeentry                                    */
+/* purpose: forgets one entry (and its tree if it is a      */
+/*          directory).                                     */
+/*************************************************************/
+static void removeentry(indexstate &state, const std::string &directory, const std::string &name) {
+    auto dir = state.directories.find(directory);
+    if (dir == state.directories.end()) {
+        return;
+    }
+    auto entry = dir->second.entries.find(name);
+    if (entry == dir->second.entries.end()) {
+        return;
+    }
+    bool subdirectory = entry->second.kind == 'D';
+    dir->second.entries.erase(entry);
+    if (subdirectory) {
+        removetree(state, joinpath(directory, name));
+    }
+}
+
+/*************************************************************/
+/* function: refreshentry                                   */
+/* purpose: looks at one entry on the disk again and makes  */
+/*          the index agree, scanning a new directory.      */
+/* return: false if a new directory could not be watched.   */
+/*************************************************************/
+static bool refreshentry(indexstate &state, const std::string &directory, const std::string &name) {
+    auto dir = state.directories.find(directory);
+    if (dir == state.directories.end()) {
+        return true;
+    }
+    fdhandle parent(openbeneath(state.base_fd.get(), directory, O_PATH | O_DIRECTORY | O_NOFOLLOW));
+    struct stat st;
+    if (parent.get() == -1 || fstat(parent.get(), &st) == -1 || st.st_ino != dir->second.inode ||
+        fstatat(parent.get(), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1 || isstore(st)) {
+        removeentry(state, directory, name);
+        return true;
+    }
+
+    indexentry e = makeentry(st);
+    std::string path = joinpath(directory, name);
+    auto old = dir->second.entries.find(name);
+    if (old != dir->second.entries.end() && old->second.kind == 'D' && old->second.inode != e.inode) {
+        removetree(state, path);
+    }
+    dir->second.entries[name] = e;
+    if (e.kind == 'D' && state.directories.count(path) == 0) {
+        return addtree(state, path, e.inode, 1);
+    }
+    return true;
+}
+
+/*************************************************************/
+/* function: applyevents                                    */
+/* purpose: reads every queued event and applies it. the    */
+/*          caller holds the index exclusively.             */
+/*************************************************************/
+static void applyevents(indexstate &state) {
+    alignas(struct inotify_event) char buffer[16384];
+    while (state.valid) {
+        ssize_t n = read(state.notify_fd.get(), buffer, sizeof(buffer));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        for (ssize_t at = 0; at < n && state.valid;) {
+            const struct inotify_event *e = reinterpret_cast<const struct inotify_event *>(buffer + at);
+            at += sizeof(struct inotify_event) + e->len;
+            if (e->mask & IN_Q_OVERFLOW) {
+                state.valid = false; // events were lost; only a rebuild can tell what changed
+                break;
+            }
+            auto watch = state.watches.find(e->wd);
+            if (watch == state.watches.end()) {
+                continue;
+            }
+            std::string directory = watch->second;
+            if (e->mask & IN_IGNORED) {
+                state.watches.erase(watch);
+                continue;
+            }
+            if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // Only the base matters here; any other directory is also
+                // reported by its parent
+                state.valid = state.valid && !directory.empty();
+                continue;
+            }
+            if (e->len == 0) {
+                continue;
+            }
+            std::string name = e->name;
+            if (e->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                removeentry(state, directory, name);
+            } else if (!refreshentry(state, directory, name)) {
+                state.valid = false; // out of watches
+            }
+        }
+    }
+}
+
+/*************************************************************/
+/* function: pending                                        */
+/* purpose: tells whether events are waiting to be read.    */
+/*************************************************************/
+static bool pending(int notify_fd) {
+    int queued = 0;
+    return ioctl(notify_fd, FIONREAD, &queued) == -1 || queued > 0;
+}
+
+/*************************************************************/
+/* function: catchup                                        */
+/* purpose: applies the queued events. parent only.         */
+/*************************************************************/
+static void catchup() {
+    std::unique_lock<std::shared_mutex> guard(index_lock);
+    index_generation->fetch_add(1);
+    applyevents(index_state);
+    index_generation->fetch_add(1);
+}
+
+/*************************************************************/
+/* function: keepcurrent                                    */
+/* purpose: the thread that applies events as they arrive,  */
+/*          so the kernel's queue does not overflow between */
+/*          requests, and rebuilds the index when it must.  */
+/*************************************************************/
+static void keepcurrent() {
+    while (true) {
+        int notify_fd;
+        bool valid;
+        {
+            std::shared_lock<std::shared_mutex> guard(index_lock);
+            notify_fd = index_state.notify_fd.get();
+            valid = index_state.valid;
+        }
+
+        if (!valid) {
+            indexstate rebuilt;
+            bool ok = buildindex(rebuilt);
+            {
+                std::unique_lock<std::shared_mutex> guard(index_lock);
+                index_generation->fetch_add(1);
+                std::swap(index_state, rebuilt);
+                index_generation->fetch_add(1);
+            }
+            if (!ok) {
+                std::cerr << "Warning: the tree index could not be rebuilt; reading the disk from now on."
+                          << std::endl;
+                return;
+            }
+            continue;
+        }
+
+        struct pollfd p = {notify_fd, POLLIN, 0};
+        if (poll(&p, 1, -1) == -1 && errno != EINTR) {
+            return;
+        }
+        catchup();
+    }
+}
+
+/*************************************************************/
+/* function: beforefork                                     */
+/* purpose: keeps a fork from copying the index halfway     */
+/*          through a change.                               */
+/*************************************************************/
+static void beforefork() {
+    index_lock.lock();
+}
+
+static void afterforkparent() {
+    index_lock.unlock();
+}
+
+/*************************************************************/
+/* function: afterforkchild                                 */
+/* purpose: turns the child's copy into a read-only         */
+/*          snapshot. the lock stays taken, so the child    */
+/*          never touches it.                               */
+/*************************************************************/
+static void afterforkchild() {
+    index_child = true;
+    index_forked_at = index_generation->load();
+}
+
+/*************************************************************/
+/* class: indexreader                                       */
+/* purpose: holds the index for reading, once it reflects   */
+/*          every change made before it was taken.          */
+/*************************************************************/
+class indexreader {
+  public:
+    indexreader() {
+        if (index_child) {
+            // The counter is read after the queue: the parent counts up
+            // before it takes events off the queue
+            current = index_state.valid && !pending(index_state.notify_fd.get()) &&
+                      index_generation->load() == index_forked_at;
+            return;
+        }
+        guard = std::shared_lock<std::shared_mutex>(index_lock);
+        if (index_state.valid && pending(index_state.notify_fd.get())) {
+            guard.unlock();
+            catchup();
+            guard.lock();
+        }
+        current = index_state.valid;
+    }
+
+    bool current = false;
+
+  private:
+    std::shared_lock<std::shared_mutex> guard;
+};
+
+/*************************************************************/
+/* function: finddirectory                                  */
+/* purpose: the indexed directory a caller opened, if the   */
+/*          index has it under that path.                   */
+/*************************************************************/
+static const indexdirectory *finddirectory(const std::string &directory, const struct stat &st) {
+    auto found = index_state.directories.find(directory);
+    if (found == index_state.directories.end() || found->second.inode != st.st_ino ||
+        found->second.device != st.st_dev) {
+        return nullptr;
+    }
+    return &found->second;
+}
+
+bool openindex(const std::string &base, size_t &entries) {
+    index_base = base;
+    void *shared = mmap(nullptr, sizeof(std::atomic<uint64_t>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    if (shared == MAP_FAILED) {
+        return false;
+    }
+    index_generation = new (shared) std::atomic<uint64_t>(0);
+    if (!buildindex(index_state)) {
+        return false;
+    }
+    entries = 0;
+    for (const auto &dir : index_state.directories) {
+        entries += dir.second.entries.size();
+    }
+    pthread_atfork(beforefork, afterforkparent, afterforkchild);
+
+    // Signals are for the threads that serve clients
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    std::thread(keepcurrent).detach();
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    index_on = true;
+    return true;
+}
+
+bool indexenabled() {
+    return index_on;
+}
+
+bool indexlist(const std::string &directory, const struct stat &st, const std::string &after,
+               const std::function<bool(const std::string &, const indexentry &)> &visit) {
+    if (!index_on) {
+        return false;
+    }
+    indexreader reader;
+    const indexdirectory *dir = reader.current ? finddirectory(directory, st) : nullptr;
+    if (!dir) {
+        return false;
+    }
+    auto entry = after.empty() ? dir->entries.begin() : dir->entries.upper_bound(after);
+    for (; entry != dir->entries.end(); ++entry) {
+        if (!visit(entry->first, entry->second)) {
+            break;
+        }
+    }
+    return true;
+}
+
+bool indexentries(const std::string &directory, const struct stat *st,
+                  std::vector<std::pair<std::string, indexentry>> &entries) {
+    entries.clear();
+    if (!index_on) {
+        return false;
+    }
+    indexreader reader;
+    if (!reader.current) {
+        return false;
+    }
+    if (st) {
+        const indexdirectory *dir = finddirectory(directory, *st);
+        if (!dir) {
+            return false;
+        }
+        entries.assign(dir->entries.begin(), dir->entries.end());
+        return true;
+    }
+    auto dir = index_state.directories.find(directory);
+    if (dir != index_state.directories.end()) { // unreadable directories have no entries
+        entries.assign(dir->second.entries.begin(), dir->second.entries.end());
+    }
+    return true;
+}
+
+/*************************************************************/
+/* function: sumkey                                         */
+/* purpose: names a file for the checksum table.            */
+/*************************************************************/
+static std::string sumkey(const struct stat &st) {
+    return std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino);
+}
+
+bool indexsum(const struct stat &st, uint64_t &digest) {
+    if (!index_on) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(sum_lock);
+    auto found = index_sums.find(sumkey(st));
+    if (found == index_sums.end() || found->second.size != static_cast<uint64_t>(st.st_size) ||
+        found->second.mtime_ns != st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec ||
+        found->second.ctime_ns != st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec) {
+        return false;
+    }
+    digest = found->second.digest;
+    return true;
+}
+
+void indexremember(const struct stat &st, uint64_t digest) {
+    if (!index_on) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(sum_lock);
+    if (index_sums.size() >= MAX_INDEX_SUMS) {
+        index_sums.clear();
+    }
+    index_sums[sumkey(st)] = {static_cast<uint64_t>(st.st_size),
+                              st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec,
+                              st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec, digest};
+}
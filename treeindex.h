@@ -0,0 +1,130 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: treeindex.h                                     */
+/* purpose: this header file declares the tree index, an     */
+/*          optional in-memory copy of the served tree: every*/
+/*          directory's entries with their type, size, mtime */
+/*          and inode. it is built at startup by several     */
+/*          threads and kept current with inotify watches on */
+/*          every directory, so listings, recursive get      */
+/*          manifests and find answer without reading the    */
+/*          disk. whole-file checksums are remembered per    */
+/*          inode as well. the index only answers when it    */
+/*          holds every change made so far; otherwise the    */
+/*          caller reads the disk as it would without it.    */
+/*************************************************************/
+
+#ifndef TREEINDEX_H
+#define TREEINDEX_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+// Most threads that build the index
+constexpr unsigned MAX_INDEX_THREADS = 8;
+
+// Checksums remembered before the index forgets them all
+constexpr size_t MAX_INDEX_SUMS = 1 << 20;
+
+/*************************************************************/
+/* struct: indexentry                                        */
+/* purpose: one directory entry as the index keeps it.       */
+/*************************************************************/
+struct indexentry {
+    char kind = 'O';   // 'D', 'F', 'L' (symlink, not followed) or 'O' (other)
+    uint64_t size = 0; // regular files only
+    int64_t mtime = 0;
+    uint64_t inode = 0;
+};
+
+/*************************************************************/
+/* function: makeentry                                      */
+/* purpose: describes a file the way the index does.        */
+/* parameters:                                              */
+/*    - st: its status, not following symlinks.             */
+/*************************************************************/
+indexentry makeentry(const struct stat &st);
+
+/*************************************************************/
+/* function: openindex                                      */
+/* purpose: builds the index of a directory and starts the  */
+/*          thread that keeps it current. call once at      */
+/*          startup, after the content store is opened (the */
+/*          store is left out). a forked child keeps a copy */
+/*          that answers until the parent sees a change.    */
+/* parameters:                                              */
+/*    - base: the base directory.                           */
+/*    - entries: receives the number of entries indexed.    */
+/* return: false if the tree cannot be watched (no inotify, */
+/*         too many directories for the watch limit).       */
+/*************************************************************/
+bool openindex(const std::string &base, size_t &entries);
+
+/*************************************************************/
+/* function: indexenabled                                   */
+/* purpose: tells whether openindex built an index.         */
+/*************************************************************/
+bool indexenabled();
+
+/*************************************************************/
+/* function: indexlist                                      */
+/* purpose: visits the entries of one directory in name     */
+/*          order. visit must not call back into the index. */
+/* parameters:                                              */
+/*    - directory: its path below the base ("" for the base)*/
+/*    - st: its status, from the descriptor the caller      */
+/*          opened, so a path that no longer names the same */
+/*          directory is not answered.                      */
+/*    - after: visit only names after this one; "" for all. */
+/*    - visit: called with each name and entry; returns     */
+/*             false to stop.                               */
+/* return: false if the index cannot answer.                */
+/*************************************************************/
+bool indexlist(const std::string &directory, const struct stat &st, const std::string &after,
+               const std::function<bool(const std::string &, const indexentry &)> &visit);
+
+/*************************************************************/
+/* function: indexentries                                   */
+/* purpose: copies the entries of one directory in name     */
+/*          order, so a caller can walk a tree a directory  */
+/*          at a time without holding the index while it    */
+/*          deals with each one.                            */
+/* parameters:                                              */
+/*    - directory: its path below the base ("" for the base)*/
+/*    - st: its status, as for indexlist, for the directory */
+/*          the caller opened; null for one found below it  */
+/*          through the index, which is empty if it was     */
+/*          unreadable.                                     */
+/*    - entries: receives the names and entries.            */
+/* return: false if the index cannot answer.                */
+/*************************************************************/
+bool indexentries(const std::string &directory, const struct stat *st,
+                  std::vector<std::pair<std::string, indexentry>> &entries);
+
+/*************************************************************/
+/* function: indexsum                                       */
+/* purpose: looks up the remembered XXH64 of a whole file.  */
+/*          it is only returned while the file's inode,     */
+/*          size, mtime and ctime are what they were when   */
+/*          it was remembered, so any write discards it.    */
+/* parameters:                                              */
+/*    - st: the file's current status.                      */
+/*    - digest: receives the checksum.                      */
+/* return: false if none is remembered.                     */
+/*************************************************************/
+bool indexsum(const struct stat &st, uint64_t &digest);
+
+/*************************************************************/
+/* function: indexremember                                  */
+/* purpose: remembers the XXH64 of a whole file.            */
+/* parameters:                                              */
+/*    - st: the file's status before it was read.           */
+/*    - digest: its checksum.                               */
+/*************************************************************/
+void indexremember(const struct stat &st, uint64_t digest);
+
+#endif
@@ -0,0 +1,327 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: tuning.cpp                                          */
+/* purpose: this source file implements the link tuner declared  */
+/*          in tuning.h.                                         */
+/*****************************************************************/
+#include "tuning.h"
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Smallest size "tune" accepts
+constexpr uint64_t MIN_FIXED_SIZE = 4 << 10;
+
+// Weight of the newest transfer in the averaged throughput
+constexpr double RATE_WEIGHT = 0.25;
+
+/*************************************************************/
+/* struct: kernellimits                                      */
+/* purpose: how far the kernel lets socket buffers grow.     */
+/*************************************************************/
+struct kernellimits {
+    uint64_t send_auto = 4 << 20;    // tcp_wmem ceiling for autotuning
+    uint64_t receive_auto = 6 << 20; // tcp_rmem ceiling
+    uint64_t send_max = 212992;      // wmem_max, the most SO_SNDBUF grants
+    uint64_t receive_max = 212992;   // rmem_max
+};
+
+/*************************************************************/
+/* function: readlimit                                      */
+/* purpose: reads field `field` (from 0) of a sysctl file,  */
+/*          keeping value if it cannot be read.             */
+/*************************************************************/
+static void readlimit(const char *path, int field, uint64_t &value) {
+    std::ifstream in(path);
+    uint64_t number = 0;
+    for (int i = 0; i <= field; ++i) {
+        if (!(in >> number)) {
+            return;
+        }
+    }
+    value = number;
+}
+
+/*************************************************************/
+/* function: limits                                         */
+/* purpose: the kernel's limits, read once per process.     */
+/*************************************************************/
+static const kernellimits &limits() {
+    static const kernellimits read = []() {
+        kernellimits l;
+        readlimit("/proc/sys/net/ipv4/tcp_wmem", 2, l.send_auto);
+        readlimit("/proc/sys/net/ipv4/tcp_rmem", 2, l.receive_auto);
+        readlimit("/proc/sys/net/core/wmem_max", 0, l.send_max);
+        readlimit("/proc/sys/net/core/rmem_max", 0, l.receive_max);
+        return l;
+    }();
+    return read;
+}
+
+/*************************************************************/
+/* function: formatsize                                     */
+/* purpose: a size as "4M", "256K" or a count of bytes.     */
+/*************************************************************/
+static std::string formatsize(uint64_t bytes) {
+    if (bytes >= (1 << 20) && bytes % (1 << 20) == 0) {
+        return std::to_string(bytes >> 20) + "M";
+    }
+    if (bytes >= (1 << 10) && bytes % (1 << 10) == 0) {
+        return std::to_string(bytes >> 10) + "K";
+    }
+    return std::to_string(bytes);
+}
+
+/*************************************************************/
+/* function: parsesize                                      */
+/* purpose: reads "auto" (0) or a size with an optional K   */
+/*          or M suffix.                                    */
+/*************************************************************/
+static bool parsesize(const std::string &text, uint64_t &bytes) {
+    if (text == "auto") {
+        bytes = 0;
+        return true;
+    }
+    size_t digits = 0;
+    uint64_t value = 0;
+    while (digits < text.size() && text[digits] >= '0' && text[digits] <= '9' && value < MAX_SOCKET_BUFFER) {
+        value = value * 10 + (text[digits++] - '0');
+    }
+    std::string suffix = text.substr(digits);
+    if (digits == 0 || (suffix != "" && suffix != "K" && suffix != "k" && suffix != "M" && suffix != "m")) {
+        return false;
+    }
+    bytes = suffix == "" ? value : suffix == "K" || suffix == "k" ? value << 10 : value << 20;
+    return bytes >= MIN_FIXED_SIZE && bytes <= MAX_SOCKET_BUFFER;
+}
+
+bool parselinksettings(const std::vector<std::string> &words, linksettings &settings, std::string &error) {
+    if (words.size() == 1 && words[0] == "auto") {
+        settings = linksettings();
+        return true;
+    }
+    if (words.empty() || words.size() % 2 != 0) {
+        error = "Usage: tune auto | tune <chunk|sndbuf|rcvbuf|lowat> <size|auto> ...";
+        return false;
+    }
+    linksettings parsed = settings;
+    for (size_t i = 0; i < words.size(); i += 2) {
+        uint64_t *field = words[i] == "chunk"    ? &parsed.chunk
+                          : words[i] == "sndbuf" ? &parsed.sndbuf
+                          : words[i] == "rcvbuf" ? &parsed.rcvbuf
+                          : words[i] == "lowat"  ? &parsed.lowat
+                                                 : nullptr;
+        if (!field) {
+            error = "Unknown setting: " + words[i];
+            return false;
+        }
+        if (!parsesize(words[i + 1], *field)) {
+            error = "Invalid size for " + words[i] + ": " + words[i + 1] + " (" + formatsize(MIN_FIXED_SIZE) +
+                    " to " + formatsize(MAX_SOCKET_BUFFER) + ", or auto)";
+            return false;
+        }
+    }
+    settings = parsed;
+    return true;
+}
+
+std::string formatlinksettings(const linksettings &settings) {
+    auto show = [](uint64_t bytes) { return bytes ? formatsize(bytes) : std::string("auto"); };
+    return "chunk " + show(settings.chunk) + " sndbuf " + show(settings.sndbuf) + " rcvbuf " +
+           show(settings.rcvbuf) + " lowat " + show(settings.lowat);
+}
+
+/*************************************************************/
+/* function: setbuffer                                      */
+/* purpose: sets a socket buffer, past the administrator's  */
+/*          maximum if the process may.                     */
+/* parameters:                                              */
+/*    - fd: the socket.                                     */
+/*    - option: SO_SNDBUF or SO_RCVBUF.                     */
+/*    - forced: SO_SNDBUFFORCE or SO_RCVBUFFORCE.           */
+/*    - bytes: the size wanted.                             */
+/*************************************************************/
+static void setbuffer(int fd, int option, int forced, uint64_t bytes) {
+    int value = static_cast<int>(bytes);
+    if (setsockopt(fd, SOL_SOCKET, forced, &value, sizeof(value)) == -1) {
+        setsockopt(fd, SOL_SOCKET, option, &value, sizeof(value));
+    }
+}
+
+/*************************************************************/
+/* function: canforce                                       */
+/* purpose: tells whether SO_*BUFFORCE works for us, which  */
+/*          takes CAP_NET_ADMIN. found once by trying it on */
+/*          a throwaway socket.                             */
+/*************************************************************/
+static bool canforce() {
+    static const bool allowed = []() {
+        int probe = socket(AF_INET, SOCK_STREAM, 0);
+        int value = MIN_FIXED_SIZE;
+        bool ok = probe != -1 && setsockopt(probe, SOL_SOCKET, SO_SNDBUFFORCE, &value, sizeof(value)) == 0;
+        if (probe != -1) {
+            close(probe);
+        }
+        return ok;
+    }();
+    return allowed;
+}
+
+/*************************************************************/
+/* function: buffertarget                                   */
+/* purpose: the size to set a socket buffer to, or 0 to     */
+/*          leave it to autotuning.                         */
+/* parameters:                                              */
+/*    - fixed: the size fixed with "tune", or 0.            */
+/*    - current: the size already set, or 0.                */
+/*    - wanted: what the measurements call for.             */
+/*    - ceiling: how far autotuning grows the buffer.       */
+/*    - most: the most an unprivileged process may set.     */
+/*************************************************************/
+static uint64_t buffertarget(uint64_t fixed, uint64_t current, uint64_t wanted, uint64_t ceiling, uint64_t most) {
+    if (fixed) {
+        return fixed;
+    }
+    if (current) {
+        // Autotuning cannot be turned back on, so keep tuning by hand
+        return wanted > MIN_TRANSFER_CHUNK ? wanted : MIN_TRANSFER_CHUNK;
+    }
+    // The kernel doubles what it is given, for its own overhead
+    uint64_t granted = canforce() || wanted < most ? wanted : most;
+    return 2 * granted > ceiling ? wanted : 0;
+}
+
+linktuner::linktuner(const linktuner &other) {
+    *this = other;
+}
+
+linktuner &linktuner::operator=(const linktuner &other) {
+    if (this != &other) {
+        std::scoped_lock both(lock, other.lock);
+        fd = other.fd;
+        overrides = other.overrides;
+        applied = other.applied;
+        rate = other.rate;
+        rtt = other.rtt;
+        chunk_size = other.chunk_size;
+    }
+    return *this;
+}
+
+void linktuner::attach(int socket_fd) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        fd = socket_fd;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    observe(0, 0); // the handshake already gave an RTT
+}
+
+void linktuner::observe(uint64_t bytes, double seconds) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (fd == -1) {
+        return;
+    }
+    struct tcp_info info;
+    socklen_t size = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &size) == 0) {
+        // A receiver that sends little has only the receive-side estimate
+        uint32_t micros = info.tcpi_rtt ? info.tcpi_rtt : info.tcpi_rcv_rtt;
+        if (micros) {
+            rtt = micros / 1e6;
+        }
+    }
+    if (bytes >= MIN_TUNING_SAMPLE && seconds > 0) {
+        double sample = bytes / seconds;
+        rate = rate == 0 ? sample : rate + RATE_WEIGHT * (sample - rate);
+    }
+    apply();
+}
+
+void linktuner::force(const linksettings &settings) {
+    std::lock_guard<std::mutex> guard(lock);
+    overrides = settings;
+    apply();
+}
+
+linksettings linktuner::forced() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return overrides;
+}
+
+uint64_t linktuner::chunk() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return chunk_size;
+}
+
+/*************************************************************/
+/* function: apply                                          */
+/* purpose: works the sizes out again and sets those that   */
+/*          changed on the socket. called holding lock.     */
+/*************************************************************/
+void linktuner::apply() {
+    uint64_t product = static_cast<uint64_t>(rate * rtt);
+
+    uint64_t chunk = MIN_TRANSFER_CHUNK;
+    while (chunk < product && chunk < MAX_TRANSFER_CHUNK) {
+        chunk <<= 1;
+    }
+    chunk_size = overrides.chunk ? overrides.chunk : chunk;
+    if (fd == -1) {
+        return;
+    }
+
+    // Room for a window in flight and one more being queued behind it
+    uint64_t wanted = 2 * product < MAX_SOCKET_BUFFER ? 2 * product : MAX_SOCKET_BUFFER;
+    const kernellimits &l = limits();
+    uint64_t sndbuf = buffertarget(overrides.sndbuf, applied.sndbuf, wanted, l.send_auto, l.send_max);
+    if (sndbuf && sndbuf != applied.sndbuf) {
+        setbuffer(fd, SO_SNDBUF, SO_SNDBUFFORCE, sndbuf);
+        applied.sndbuf = sndbuf;
+    }
+    uint64_t rcvbuf = buffertarget(overrides.rcvbuf, applied.rcvbuf, wanted, l.receive_auto, l.receive_max);
+    if (rcvbuf && rcvbuf != applied.rcvbuf) {
+        setbuffer(fd, SO_RCVBUF, SO_RCVBUFFORCE, rcvbuf);
+        applied.rcvbuf = rcvbuf;
+    }
+
+    // Unsent bytes the socket holds: two chunks, so one is queued
+    // while the next is being read
+    uint64_t lowat = overrides.lowat ? overrides.lowat : 2 * chunk_size;
+    lowat = overrides.lowat || lowat > MIN_NOTSENT_LOWAT ? lowat : MIN_NOTSENT_LOWAT;
+    if (lowat != applied.lowat) {
+        int value = static_cast<int>(lowat);
+        setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value, sizeof(value));
+        applied.lowat = lowat;
+    }
+}
+
+std::string linktuner::describe() const {
+    std::lock_guard<std::mutex> guard(lock);
+    auto origin = [](uint64_t fixed) { return fixed ? " (set)" : " (auto)"; };
+    auto buffer = [this](int option, uint64_t fixed, uint64_t applied_size) {
+        int value = 0;
+        socklen_t size = sizeof(value);
+        getsockopt(fd, SOL_SOCKET, option, &value, &size);
+        return formatsize(value) + (fixed ? " (set)" : applied_size ? " (auto)" : " (kernel)");
+    };
+
+    std::ostringstream out;
+    out << "chunk " << formatsize(chunk_size) << origin(overrides.chunk) << ", sndbuf "
+        << buffer(SO_SNDBUF, overrides.sndbuf, applied.sndbuf) << ", rcvbuf "
+        << buffer(SO_RCVBUF, overrides.rcvbuf, applied.rcvbuf) << ", lowat " << formatsize(applied.lowat)
+        << origin(overrides.lowat) << "; ";
+    char measured[64];
+    if (rate > 0) {
+        snprintf(measured, sizeof(measured), "rtt %.3f ms, %.0f MB/s", rtt * 1e3, rate / 1e6);
+    } else {
+        snprintf(measured, sizeof(measured), "rtt %.3f ms, throughput not measured yet", rtt * 1e3);
+    }
+    return out.str() + measured;
+}
@@ -0,0 +1,137 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: tuning.h                                        */
+/* purpose: this header file declares the link tuner, which  */
+/*          sizes each connection's transfers from what it   */
+/*          measures: the RTT the kernel keeps for the       */
+/*          socket and the throughput of the transfers that  */
+/*          have finished. their product, the bandwidth-delay*/
+/*          product, sets the chunk moved per read, write or */
+/*          recv, the socket buffers and TCP_NOTSENT_LOWAT.  */
+/*          a session may fix any of them with "tune".       */
+/*************************************************************/
+
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Bounds on the chunk a transfer moves per call
+constexpr uint64_t MIN_TRANSFER_CHUNK = 64 << 10;
+constexpr uint64_t MAX_TRANSFER_CHUNK = 4 << 20;
+
+// Most a socket buffer may be set to, adaptively or by hand
+constexpr uint64_t MAX_SOCKET_BUFFER = 64 << 20;
+
+// Smallest TCP_NOTSENT_LOWAT the tuner picks by itself
+constexpr uint64_t MIN_NOTSENT_LOWAT = 1 << 20;
+
+// Transfers shorter than this say more about latency than throughput
+constexpr uint64_t MIN_TUNING_SAMPLE = 1 << 20;
+
+/*************************************************************/
+/* struct: linksettings                                      */
+/* purpose: sizes for one connection, in bytes. 0 leaves a   */
+/*          size to the tuner.                               */
+/*************************************************************/
+struct linksettings {
+    uint64_t chunk = 0;  // bytes moved per read, write or recv
+    uint64_t sndbuf = 0; // SO_SNDBUF
+    uint64_t rcvbuf = 0; // SO_RCVBUF
+    uint64_t lowat = 0;  // TCP_NOTSENT_LOWAT
+
+    // Whether any size is fixed
+    bool any() const { return chunk || sndbuf || rcvbuf || lowat; }
+};
+
+/*************************************************************/
+/* function: parselinksettings                              */
+/* purpose: reads the arguments of "tune": "auto", or pairs */
+/*          of a setting and a size such as "chunk 1M" or   */
+/*          "lowat auto". sizes take a K or M suffix.       */
+/* parameters:                                              */
+/*    - words: the arguments.                               */
+/*    - settings: updated with them.                        */
+/*    - error: receives the reason on failure.              */
+/* return: false if an argument is not valid; settings are  */
+/*         then unchanged.                                  */
+/*************************************************************/
+bool parselinksettings(const std::vector<std::string> &words, linksettings &settings, std::string &error);
+
+/*************************************************************/
+/* function: formatlinksettings                             */
+/* purpose: the arguments of "tune" that set settings, e.g. */
+/*          "chunk 1M sndbuf auto rcvbuf auto lowat auto".  */
+/*************************************************************/
+std::string formatlinksettings(const linksettings &settings);
+
+/*************************************************************/
+/* class: linktuner                                          */
+/* purpose: the sizes of one connected TCP socket. socket    */
+/*          buffers are left to the kernel's autotuning      */
+/*          unless the tuner wants more than autotuning may  */
+/*          reach, or a size is fixed, as setting one turns  */
+/*          autotuning off for good. the threads of a        */
+/*          multiplexed session may share one tuner.         */
+/*************************************************************/
+class linktuner {
+  public:
+    linktuner() = default;
+    linktuner(const linktuner &other);
+    linktuner &operator=(const linktuner &other);
+
+    /*************************************************************/
+    /* function: attach                                         */
+    /* purpose: starts tuning a connected socket. frames are    */
+    /*          corked with MSG_MORE where it matters, so Nagle */
+    /*          is turned off with TCP_NODELAY.                 */
+    /*************************************************************/
+    void attach(int fd);
+
+    /*************************************************************/
+    /* function: observe                                        */
+    /* purpose: records a finished transfer and resizes the     */
+    /*          connection if the measurements call for it.     */
+    /* parameters:                                              */
+    /*    - bytes: the payload moved.                           */
+    /*    - seconds: how long it took.                          */
+    /*************************************************************/
+    void observe(uint64_t bytes, double seconds);
+
+    /*************************************************************/
+    /* function: force                                          */
+    /* purpose: fixes the sizes that are not 0 and returns the  */
+    /*          others to the tuner.                            */
+    /*************************************************************/
+    void force(const linksettings &settings);
+
+    // The sizes fixed by force
+    linksettings forced() const;
+
+    // Bytes to move per read, write or recv
+    uint64_t chunk() const;
+
+    /*************************************************************/
+    /* function: describe                                       */
+    /* purpose: the sizes in use, whether each is fixed, chosen */
+    /*          by the tuner or left to the kernel, and the     */
+    /*          measurements behind them, as one line.          */
+    /*************************************************************/
+    std::string describe() const;
+
+  private:
+    void apply();
+
+    mutable std::mutex lock; // guards everything below
+    int fd = -1;
+    linksettings overrides;
+    linksettings applied;    // what is set on the socket; 0 where nothing is
+    double rate = 0;         // bytes per second, averaged over transfers
+    double rtt = 0;          // seconds, as the kernel last smoothed it
+    uint64_t chunk_size = MIN_TRANSFER_CHUNK;
+};
+
+#endif
@@ -0,0 +1,417 @@
+/*****************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                      */
+/* filename: uring.cpp                                           */
+/* purpose: this source file implements the io_uring wrapper     */
+/*          and transfer pipelines declared in uring.h. each     */
+/*          thread lazily builds one ring with a small set of    */
+/*          registered buffers and reuses it for every transfer. */
+/*****************************************************************/
+#include "uring.h"
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Registered buffers per ring and their size
+constexpr unsigned RING_BUFFERS = 4;
+constexpr size_t RING_BUFFER_SIZE = 256 * 1024;
+
+// Submission queue entries per ring
+constexpr unsigned RING_ENTRIES = 16;
+
+// Operation tags kept in the top bits of user_data
+constexpr uint64_t TAG_READ = 1ULL << 32;
+constexpr uint64_t TAG_WRITE = 2ULL << 32;
+constexpr uint64_t SLOT_MASK = 0xffffffffULL;
+
+uring::uring(unsigned entries) {
+    std::memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1) {
+        throw std::runtime_error("io_uring_setup failed");
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("Failed to map io_uring submission queue");
+    }
+    if (single_mmap) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            munmap(sq_ptr, sq_size);
+            ::close(fd);
+            throw std::runtime_error("Failed to map io_uring completion queue");
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqe_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqe_ptr == MAP_FAILED) {
+        if (!single_mmap) {
+            munmap(cq_ptr, cq_size);
+        }
+        munmap(sq_ptr, sq_size);
+        ::close(fd);
+        throw std::runtime_error("Failed to map io_uring entries");
+    }
+    sqes = static_cast<struct io_uring_sqe *>(sqe_ptr);
+
+    char *sq = static_cast<char *>(sq_ptr);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_entries = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_entries);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+    char *cq = static_cast<char *>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    sqe_tail = *sq_tail;
+}
+
+uring::~uring() {
+    munmap(sqes, sqes_size);
+    if (cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_size);
+    }
+    munmap(sq_ptr, sq_size);
+    ::close(fd);
+}
+
+bool uring::supported() {
+    static const bool available = []() {
+        try {
+            uring probe(2);
+            return true;
+        } catch (const std::runtime_error &) {
+            return false;
+        }
+    }();
+    return available;
+}
+
+void uring::registerbuffers(const std::vector<struct iovec> &buffers) {
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) == -1) {
+        throw std::runtime_error("Failed to register io_uring buffers");
+    }
+}
+
+struct io_uring_sqe *uring::getsqe() {
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sqe_tail - head >= *sq_entries) {
+        return nullptr;
+    }
+    unsigned index = sqe_tail & *sq_mask;
+    sq_array[index] = index;
+    struct io_uring_sqe *sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe_tail++;
+    pending++;
+    return sqe;
+}
+
+void uring::submit(unsigned wait_nr) {
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (true) {
+        long submitted = syscall(__NR_io_uring_enter, fd, pending, wait_nr, flags, nullptr, 0);
+        if (submitted == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("io_uring_enter failed");
+        }
+        pending -= submitted;
+        return;
+    }
+}
+
+bool uring::popcqe(uint64_t &user_data, int32_t &res) {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    user_data = cqe->user_data;
+    res = cqe->res;
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*************************************************************/
+/* struct: ringbuffers                                       */
+/* purpose: a thread's ring plus its registered buffers.     */
+/*************************************************************/
+struct ringbuffers {
+    uring ring{RING_ENTRIES};
+    char *memory;
+    std::vector<struct iovec> buffers;
+
+    ringbuffers() {
+        void *p = mmap(nullptr, RING_BUFFERS * RING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Failed to allocate io_uring buffers");
+        }
+        memory = static_cast<char *>(p);
+        for (unsigned i = 0; i < RING_BUFFERS; ++i) {
+            buffers.push_back({memory + i * RING_BUFFER_SIZE, RING_BUFFER_SIZE});
+        }
+        try {
+            ring.registerbuffers(buffers);
+        } catch (...) {
+            munmap(memory, RING_BUFFERS * RING_BUFFER_SIZE);
+            throw;
+        }
+    }
+
+    ~ringbuffers() {
+        munmap(memory, RING_BUFFERS * RING_BUFFER_SIZE);
+    }
+};
+
+// This thread's ring, created on its first io_uring transfer
+static thread_local std::unique_ptr<ringbuffers> thread_ring;
+
+/*************************************************************/
+/* function: threadring                                     */
+/* purpose: returns this thread's ring, creating it on the  */
+/*          first transfer.                                 */
+/*************************************************************/
+static ringbuffers &threadring() {
+    if (!thread_ring) {
+        thread_ring = std::make_unique<ringbuffers>();
+    }
+    return *thread_ring;
+}
+
+/*************************************************************/
+/* function: queuefixed                                     */
+/* purpose: queues a READ_FIXED or WRITE_FIXED operation.   */
+/* parameters:                                              */
+/*    - rb: the thread's ring.                              */
+/*    - opcode: IORING_OP_READ_FIXED or WRITE_FIXED.        */
+/*    - fd: the file or socket.                             */
+/*    - slot: the registered buffer index.                  */
+/*    - start: first byte within the buffer.                */
+/*    - len: number of bytes.                               */
+/*    - offset: file offset (ignored by sockets).           */
+/*    - tag: TAG_READ or TAG_WRITE.                         */
+/*************************************************************/
+static void queuefixed(ringbuffers &rb, uint8_t opcode, int fd, unsigned slot, size_t start, size_t len,
+                       uint64_t offset, uint64_t tag) {
+    struct io_uring_sqe *sqe = rb.ring.getsqe();
+    if (!sqe) {
+        throw std::runtime_error("io_uring submission queue full");
+    }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(rb.memory + slot * RING_BUFFER_SIZE + start);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = slot;
+    sqe->user_data = tag | slot;
+}
+
+/*************************************************************/
+/* function: sendpipeline                                   */
+/* purpose: the body of uringsend (see uring.h).            */
+/*************************************************************/
+static void sendpipeline(ringbuffers &rb, int sock, int fd, uint64_t offset, uint64_t length) {
+    // Buffers are used round-robin in file order: slot = sequence % RING_BUFFERS
+    struct slotstate {
+        uint64_t offset = 0;
+        size_t len = 0;
+        size_t filled = 0;
+        size_t sent = 0;
+        bool reading = false;
+    } slots[RING_BUFFERS];
+
+    uint64_t end = offset + length;
+    uint64_t next_read = offset;
+    uint64_t read_seq = 0;
+    uint64_t write_seq = 0;
+    uint64_t total_seq = (length + RING_BUFFER_SIZE - 1) / RING_BUFFER_SIZE;
+    bool write_inflight = false;
+
+    while (write_seq < total_seq) {
+        // Read ahead into every free buffer
+        while (read_seq - write_seq < RING_BUFFERS && next_read < end) {
+            unsigned slot = read_seq % RING_BUFFERS;
+            slotstate &st = slots[slot];
+            st.offset = next_read;
+            st.len = end - next_read < RING_BUFFER_SIZE ? end - next_read : RING_BUFFER_SIZE;
+            st.filled = st.sent = 0;
+            st.reading = true;
+            queuefixed(rb, IORING_OP_READ_FIXED, fd, slot, 0, st.len, st.offset, TAG_READ);
+            next_read += st.len;
+            read_seq++;
+        }
+
+        // Only one socket write at a time keeps the stream in order
+        unsigned head = write_seq % RING_BUFFERS;
+        if (!write_inflight && !slots[head].reading && slots[head].filled > slots[head].sent) {
+            slotstate &st = slots[head];
+            queuefixed(rb, IORING_OP_WRITE_FIXED, sock, head, st.sent, st.filled - st.sent, 0, TAG_WRITE);
+            write_inflight = true;
+        }
+
+        rb.ring.submit(1);
+
+        uint64_t user_data;
+        int32_t res;
+        while (rb.ring.popcqe(user_data, res)) {
+            unsigned slot = user_data & SLOT_MASK;
+            slotstate &st = slots[slot];
+            if ((user_data & ~SLOT_MASK) == TAG_READ) {
+                if (res == -EINTR || res == -EAGAIN) {
+                    res = 0;
+                } else if (res < 0) {
+                    throw std::runtime_error("io_uring file read failed");
+                } else if (res == 0) {
+                    throw std::runtime_error("File ended before the announced length");
+                }
+                st.filled += res;
+                if (st.filled < st.len) {
+                    // Short read: fetch the rest into the same buffer
+                    queuefixed(rb, IORING_OP_READ_FIXED, fd, slot, st.filled, st.len - st.filled,
+                               st.offset + st.filled, TAG_READ);
+                } else {
+                    st.reading = false;
+                }
+            } else {
+                write_inflight = false;
+                if (res == -EINTR || res == -EAGAIN) {
+                    continue;
+                }
+                if (res < 0) {
+                    throw std::runtime_error("io_uring socket send failed");
+                }
+                st.sent += res;
+                if (st.sent == st.len) {
+                    write_seq++;
+                }
+            }
+        }
+    }
+}
+
+/*************************************************************/
+/* function: recvpipeline                                   */
+/* purpose: the body of uringrecv (see uring.h).            */
+/*************************************************************/
+static void recvpipeline(ringbuffers &rb, int sock, int fd, uint64_t &offset, uint64_t length,
+                         bool &write_failed) {
+    struct slotstate {
+        uint64_t offset = 0;
+        size_t len = 0;
+        size_t written = 0;
+        bool busy = false;
+    } slots[RING_BUFFERS];
+
+    uint64_t to_receive = length;
+    bool recv_inflight = false;
+    unsigned writes_inflight = 0;
+
+    while (to_receive > 0 || recv_inflight || writes_inflight > 0) {
+        // Only one socket read at a time keeps the stream in order
+        if (!recv_inflight && to_receive > 0) {
+            for (unsigned slot = 0; slot < RING_BUFFERS; ++slot) {
+                if (!slots[slot].busy) {
+                    size_t want = to_receive < RING_BUFFER_SIZE ? to_receive : RING_BUFFER_SIZE;
+                    slots[slot].busy = true;
+                    queuefixed(rb, IORING_OP_READ_FIXED, sock, slot, 0, want, 0, TAG_READ);
+                    recv_inflight = true;
+                    break;
+                }
+            }
+        }
+
+        rb.ring.submit(1);
+
+        uint64_t user_data;
+        int32_t res;
+        while (rb.ring.popcqe(user_data, res)) {
+            unsigned slot = user_data & SLOT_MASK;
+            slotstate &st = slots[slot];
+            if ((user_data & ~SLOT_MASK) == TAG_READ) {
+                recv_inflight = false;
+                if (res == -EINTR || res == -EAGAIN) {
+                    st.busy = false;
+                    continue;
+                }
+                if (res < 0) {
+                    throw std::runtime_error("io_uring socket receive failed");
+                }
+                if (res == 0) {
+                    throw std::runtime_error("Connection closed in the middle of a frame");
+                }
+                to_receive -= res;
+                if (fd == -1 || write_failed) {
+                    st.busy = false;
+                    continue;
+                }
+                // Hand the buffer to a positional file write
+                st.offset = offset;
+                st.len = res;
+                st.written = 0;
+                offset += res;
+                queuefixed(rb, IORING_OP_WRITE_FIXED, fd, slot, 0, st.len, st.offset, TAG_WRITE);
+                writes_inflight++;
+            } else {
+                writes_inflight--;
+                if (res == -EINTR || res == -EAGAIN) {
+                    res = 0;
+                } else if (res <= 0) {
+                    write_failed = true;
+                    st.busy = false;
+                    continue;
+                }
+                st.written += res;
+                if (st.written < st.len) {
+                    queuefixed(rb, IORING_OP_WRITE_FIXED, fd, slot, st.written, st.len - st.written,
+                               st.offset + st.written, TAG_WRITE);
+                    writes_inflight++;
+                } else {
+                    st.busy = false;
+                }
+            }
+        }
+    }
+}
+
+void uringsend(int sock, int fd, uint64_t offset, uint64_t length) {
+    try {
+        sendpipeline(threadring(), sock, fd, offset, length);
+    } catch (...) {
+        // Operations may still be in flight; closing the ring cancels them
+        thread_ring.reset();
+        throw;
+    }
+}
+
+void uringrecv(int sock, int fd, uint64_t &offset, uint64_t length, bool &write_failed) {
+    try {
+        recvpipeline(threadring(), sock, fd, offset, length, write_failed);
+    } catch (...) {
+        thread_ring.reset();
+        throw;
+    }
+}
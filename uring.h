@@ -0,0 +1,142 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: uring.h                                         */
+/* purpose: this header file declares a small io_uring       */
+/*          wrapper (raw syscalls, no liburing) and the      */
+/*          io_uring transfer pipelines built on it. a       */
+/*          transfer keeps several file reads/writes in      */
+/*          flight in registered buffers while the socket    */
+/*          side is kept strictly ordered, and everything    */
+/*          queued in one pass is submitted with a single    */
+/*          io_uring_enter call.                             */
+/*************************************************************/
+
+#ifndef URING_H
+#define URING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <linux/io_uring.h>
+
+/*************************************************************/
+/* class: uring                                              */
+/* purpose: owns one io_uring instance and its mapped rings. */
+/*************************************************************/
+class uring {
+  public:
+    /*************************************************************/
+    /* function: uring                                          */
+    /* purpose: creates the ring and maps the queues. throws if */
+    /*          the kernel does not provide io_uring.           */
+    /* parameters:                                              */
+    /*    - entries: the submission queue size.                 */
+    /*************************************************************/
+    uring(unsigned entries);
+
+    /*************************************************************/
+    /* function: ~uring                                         */
+    /* purpose: unmaps the queues and closes the ring.          */
+    /*************************************************************/
+    ~uring();
+
+    uring(const uring &) = delete;
+    uring &operator=(const uring &) = delete;
+
+    /*************************************************************/
+    /* function: supported                                      */
+    /* purpose: probes once whether io_uring can be used here   */
+    /*          (old kernels, seccomp and the io_uring_disabled */
+    /*          sysctl all make setup fail).                    */
+    /*************************************************************/
+    static bool supported();
+
+    /*************************************************************/
+    /* function: registerbuffers                                */
+    /* purpose: registers fixed buffers for READ/WRITE_FIXED.   */
+    /* parameters:                                              */
+    /*    - buffers: the buffers; buf_index refers to the       */
+    /*               position in this list.                     */
+    /*************************************************************/
+    void registerbuffers(const std::vector<struct iovec> &buffers);
+
+    /*************************************************************/
+    /* function: getsqe                                         */
+    /* purpose: returns a zeroed submission entry to fill in,   */
+    /*          or null if the submission queue is full.        */
+    /*************************************************************/
+    struct io_uring_sqe *getsqe();
+
+    /*************************************************************/
+    /* function: submit                                         */
+    /* purpose: submits every queued entry and optionally waits */
+    /*          for completions in the same syscall.            */
+    /* parameters:                                              */
+    /*    - wait_nr: completions to wait for (0 = don't wait).  */
+    /*************************************************************/
+    void submit(unsigned wait_nr);
+
+    /*************************************************************/
+    /* function: popcqe                                         */
+    /* purpose: takes one completion off the completion queue.  */
+    /* parameters:                                              */
+    /*    - user_data: receives the entry's user_data.          */
+    /*    - res: receives the result (bytes or -errno).         */
+    /* return: false if the completion queue is empty.          */
+    /*************************************************************/
+    bool popcqe(uint64_t &user_data, int32_t &res);
+
+  private:
+    int fd;
+    struct io_uring_params params;
+    void *sq_ptr = nullptr;
+    void *cq_ptr = nullptr;
+    size_t sq_size = 0;
+    size_t cq_size = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_entries;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    unsigned sqe_tail = 0;  // local tail, published by submit()
+    unsigned pending = 0;   // entries queued but not yet submitted
+};
+
+/*************************************************************/
+/* function: uringsend                                      */
+/* purpose: sends a file range to a socket. reads of the    */
+/*          next buffers run ahead while the current one is */
+/*          being written. throws on I/O errors or if the   */
+/*          file ends early.                                */
+/* parameters:                                              */
+/*    - sock: the connected socket.                         */
+/*    - fd: the file to read.                               */
+/*    - offset: where in the file to start.                 */
+/*    - length: how many bytes to send.                     */
+/*************************************************************/
+void uringsend(int sock, int fd, uint64_t offset, uint64_t length);
+
+/*************************************************************/
+/* function: uringrecv                                      */
+/* purpose: receives exactly length bytes from a socket and */
+/*          writes them to a file at offset. socket reads   */
+/*          are kept in order; file writes overlap them.    */
+/*          throws if the connection closes early.          */
+/* parameters:                                              */
+/*    - sock: the connected socket.                         */
+/*    - fd: the destination file, or -1 to discard.         */
+/*    - offset: file offset of the first byte. advanced.    */
+/*    - length: how many bytes to receive.                  */
+/*    - write_failed: set if a file write fails.            */
+/*************************************************************/
+void uringrecv(int sock, int fd, uint64_t &offset, uint64_t length, bool &write_failed);
+
+#endif
@@ -0,0 +1,153 @@
+/*************************************************************/
+/* authors: Arek Gebka and Lizmary Delarosa                  */
+/* filename: workqueue.h                                     */
+/* purpose: this header file defines a bounded blocking      */
+/*          queue for handing work between the threads of a  */
+/*          pipeline. push waits while the queue is full, so */
+/*          a fast stage cannot run arbitrarily far ahead of */
+/*          a slow one, and pop waits while it is empty.     */
+/*          close lets the consumers drain what is left and  */
+/*          then stop. a consumer on an event loop must not  */
+/*          wait: it has an eventfd signalled instead and    */
+/*          takes items with trypop.                         */
+/*************************************************************/
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <unistd.h>
+
+/*************************************************************/
+/* class: workqueue                                          */
+/* purpose: bounded multi-producer multi-consumer queue.     */
+/*************************************************************/
+template <typename T>
+class workqueue {
+  public:
+    /*************************************************************/
+    /* function: workqueue                                      */
+    /* purpose: creates an empty queue.                         */
+    /* parameters:                                              */
+    /*    - capacity: how many items may wait at once.          */
+    /*************************************************************/
+    explicit workqueue(size_t capacity) : capacity(capacity) {}
+
+    /*************************************************************/
+    /* function: push                                           */
+    /* purpose: adds an item, waiting for room if needed.       */
+    /* parameters:                                              */
+    /*    - item: the item to add.                              */
+    /* return: false if the queue was closed.                   */
+    /*************************************************************/
+    bool push(T item) {
+        std::unique_lock<std::mutex> guard(lock);
+        not_full.wait(guard, [this]() { return closed || items.size() < capacity; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        signal();
+        return true;
+    }
+
+    /*************************************************************/
+    /* function: pop                                            */
+    /* purpose: takes the oldest item, waiting for one if the   */
+    /*          queue is empty.                                 */
+    /* parameters:                                              */
+    /*    - item: receives the item.                            */
+    /* return: false once the queue is closed and empty.        */
+    /*************************************************************/
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> guard(lock);
+        not_empty.wait(guard, [this]() { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    /*************************************************************/
+    /* function: trypop                                         */
+    /* purpose: takes the oldest item if one is waiting.        */
+    /* parameters:                                              */
+    /*    - item: receives the item.                            */
+    /* return: false if the queue is empty.                     */
+    /*************************************************************/
+    bool trypop(T &item) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    /*************************************************************/
+    /* function: close                                          */
+    /* purpose: stops further pushes and wakes every waiting    */
+    /*          thread. items already queued can still be       */
+    /*          popped.                                         */
+    /*************************************************************/
+    void close() {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+        signal();
+    }
+
+    /*************************************************************/
+    /* function: finished                                       */
+    /* purpose: tells whether the queue is closed and empty,    */
+    /*          so nothing more will come out of it.            */
+    /*************************************************************/
+    bool finished() {
+        std::lock_guard<std::mutex> guard(lock);
+        return closed && items.empty();
+    }
+
+    /*************************************************************/
+    /* function: notify                                         */
+    /* purpose: has every later push, and the close, signal an  */
+    /*          eventfd, so an event loop can wait for items    */
+    /*          with epoll. the eventfd must stay open until    */
+    /*          the producers have stopped.                     */
+    /* parameters:                                              */
+    /*    - fd: the eventfd, or -1 for none.                    */
+    /*************************************************************/
+    void notify(int fd) {
+        std::lock_guard<std::mutex> guard(lock);
+        notify_fd = fd;
+    }
+
+  private:
+    // Wakes the event loop waiting on notify_fd; called with lock held
+    void signal() {
+        uint64_t one = 1;
+        if (notify_fd != -1 && write(notify_fd, &one, sizeof(one)) == -1) {
+            // The counter is already non-zero, so the loop is awake anyway
+        }
+    }
+
+    std::mutex lock;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+    int notify_fd = -1;
+};
+
+#endif